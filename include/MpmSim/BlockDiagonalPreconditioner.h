@@ -0,0 +1,49 @@
+#ifndef MPMSIM_BLOCKDIAGONALPRECONDITIONER_H
+#define MPMSIM_BLOCKDIAGONALPRECONDITIONER_H
+
+#include "ProceduralMatrix.h"
+#include "Grid.h"
+
+#include <vector>
+
+namespace MpmSim
+{
+
+// Preconditioner made from the 3x3 blocks on the diagonal of a grid's implicit update matrix, so it takes
+// account of how moving a node along one axis pushes it along the others, which the plain diagonal
+// misses when the snow's been squashed or sheared. The blocks are projected through the collisions
+// in the same way as Grid::ImplicitUpdateMatrix::subspaceProject(), and inverted on the subspace left:
+class BlockDiagonalPreconditioner : public ProceduralMatrix
+{
+public:
+
+	// dfdxi holds the force derivative blocks, as computed by Grid::dForceidXiBlocks(). The grid's
+	// nodes need to have been collided already:
+	BlockDiagonalPreconditioner( const Grid& g,
+								 const Eigen::VectorXf& dfdxi,
+								 const CollisionObject::CollisionObjectSet& collisionObjects,
+								 float timeStep );
+
+	virtual void multVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void subspaceProject( Eigen::VectorXf& x ) const;
+
+	// inverse of node idx's projected block:
+	const Eigen::Matrix3f& inverseBlock( int idx ) const;
+
+private:
+
+	const Grid& m_g;
+	const CollisionObject::CollisionObjectSet& m_collisionObjects;
+
+	// projected blocks for each node, and their inverses on the projected subspace:
+	std::vector<Eigen::Matrix3f> m_blocks;
+	std::vector<Eigen::Matrix3f> m_inverseBlocks;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_BLOCKDIAGONALPRECONDITIONER_H
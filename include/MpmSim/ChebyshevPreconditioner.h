@@ -0,0 +1,52 @@
+#ifndef MPMSIM_CHEBYSHEVPRECONDITIONER_H
+#define MPMSIM_CHEBYSHEVPRECONDITIONER_H
+
+#include "ProceduralMatrix.h"
+
+namespace MpmSim
+{
+
+// Preconditioner which runs a fixed number of Chebyshev accelerated iterations on mat, using inner
+// (usually a block jacobi preconditioner) to precondition those. It needs bounds on the eigenvalues
+// of inner^-1 * mat, which it estimates by running a few steps of a preconditioned Lanczos process
+// on the first vector it's asked to apply itself to. After that it's a fixed polynomial in mat, so
+// unlike the solver it doesn't do any dot products, and it's symmetric positive definite as long as
+// inner is. Each application costs degree - 1 multiplications by mat and degree applications of inner:
+class ChebyshevPreconditioner : public ProceduralMatrix
+{
+public:
+
+	ChebyshevPreconditioner( const ProceduralMatrix& mat, const ProceduralMatrix& inner, int degree, int lanczosSteps = 10 );
+
+	// this would mean inverting the polynomial, so it throws:
+	virtual void multVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void subspaceProject( Eigen::VectorXf& x ) const;
+
+	// the interval the polynomial's been fitted to, which is only worked out once the preconditioner's
+	// been used:
+	float minEigenvalue() const;
+	float maxEigenvalue() const;
+
+private:
+
+	// works out m_minEigenvalue and m_maxEigenvalue, starting the Lanczos process off with b. This
+	// leaves m_estimated false if b's zero:
+	void estimateEigenvalues( const Eigen::VectorXf& b ) const;
+
+	const ProceduralMatrix& m_mat;
+	const ProceduralMatrix& m_inner;
+	int m_degree;
+	int m_lanczosSteps;
+
+	mutable bool m_estimated;
+	mutable float m_minEigenvalue;
+	mutable float m_maxEigenvalue;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_CHEBYSHEVPRECONDITIONER_H
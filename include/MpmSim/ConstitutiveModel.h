@@ -21,6 +21,20 @@ public:
 	// history dependant material properties:
 	virtual void updateParticleData() = 0;
 	
+	// same as above, but only for the specified particles, for when only some of the deformation
+	// gradients have changed. Sim calls this for each body as it finishes with it, and the bodies
+	// get advanced concurrently, so this mustn't touch any of the other particles, or write to the
+	// model itself. Call prepareParticleData() first if the variables might have been reallocated:
+	virtual void updateParticleData( const std::vector<int>& particleInds ) = 0;
+	
+	// Picks up any particle variables that have been reallocated, by resizing or changing their
+	// layout, since the model last looked at them. Sim calls this on its own thread at the start of
+	// each step, before it starts on the bodies:
+	void prepareParticleData()
+	{
+		refreshHandles();
+	}
+	
 	// energy density for particle p:
 	virtual float energyDensity( size_t p ) const = 0;
 	
@@ -29,6 +43,33 @@ public:
 	
 	// computes the change in dEnergyDensitydF when you change F by dFp:
 	virtual Eigen::Matrix3f dEdFDifferential( const Eigen::Matrix3f& dFp, size_t p ) const = 0;
+	
+	// batch versions of the above for the particles in [ begin, end ), which write one matrix per particle
+	// into result. dFp has one matrix per particle too. The grid calls these on chunks of particles so it
+	// doesn't pay for a virtual call per particle, so models should override them with something that
+	// avoids calling the single particle versions:
+	virtual void dEnergyDensitydF( std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const
+	{
+		for( std::vector<int>::const_iterator it = begin; it != end; ++it, ++result )
+		{
+			*result = dEnergyDensitydF( *it );
+		}
+	}
+	
+	virtual void dEdFDifferential( const Eigen::Matrix3f* dFp, std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const
+	{
+		for( std::vector<int>::const_iterator it = begin; it != end; ++it, ++dFp, ++result )
+		{
+			*result = dEdFDifferential( *dFp, *it );
+		}
+	}
+
+protected:
+
+	// resolves any particle data handles the model holds on to again, for prepareParticleData():
+	virtual void refreshHandles()
+	{
+	}
 
 };
 
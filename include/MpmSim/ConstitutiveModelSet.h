@@ -0,0 +1,70 @@
+#ifndef MPMSIM_CONSTITUTIVEMODELSET_H
+#define MPMSIM_CONSTITUTIVEMODELSET_H
+
+#include "ConstitutiveModel.h"
+
+namespace MpmSim
+{
+
+// Constitutive model which lets different particles be made of different materials. It owns a list
+// of models, and each particle uses the one indexed by its "material" variable, or the first one if
+// there isn't a "material" variable. The batch functions hand each run of particles with the same
+// material over to that material's model in one go, so it's worth keeping particles grouped by
+// material, which the grid does. updateParticleData() throws if any particle's material id doesn't
+// index a model, however many models there are, so the other functions can rely on them.
+class ConstitutiveModelSet : public ConstitutiveModel
+{
+public:
+
+	ConstitutiveModelSet();
+	virtual ~ConstitutiveModelSet();
+
+	// add a model to the list, taking ownership of it. Returns its material id:
+	int add( ConstitutiveModel* model );
+
+	const ConstitutiveModel* model( size_t i ) const;
+	size_t numModels() const;
+
+	// sets up all the models, then gets each one to update its own particles, as models sharing
+	// particle variables might have initialized them all with their own parameters:
+	virtual void setParticles( MaterialPointData& p );
+
+	// these split the particles up by material and update each lot with its own model:
+	virtual void updateParticleData();
+	virtual void updateParticleData( const std::vector<int>& particleInds );
+
+	virtual float energyDensity( size_t p ) const;
+	virtual Eigen::Matrix3f dEnergyDensitydF( size_t p ) const;
+	virtual Eigen::Matrix3f dEdFDifferential( const Eigen::Matrix3f& dFp, size_t p ) const;
+
+	virtual void dEnergyDensitydF( std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const;
+	virtual void dEdFDifferential( const Eigen::Matrix3f* dFp, std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const;
+
+private:
+
+	// no copying, as we own the models:
+	ConstitutiveModelSet( const ConstitutiveModelSet& );
+	ConstitutiveModelSet& operator=( const ConstitutiveModelSet& );
+
+	// model for particle p:
+	const ConstitutiveModel& particleModel( size_t p ) const;
+
+	// sorts the specified particles into a list for each material, throwing if any of them
+	// have invalid material ids:
+	void splitByMaterial( const std::vector<int>& particleInds, std::vector< std::vector<int> >& materialParticles ) const;
+
+	std::vector<ConstitutiveModel*> m_models;
+
+	MaterialPointData* m_p;
+
+	// refreshes the material ids, and each model's handles:
+	virtual void refreshHandles();
+
+	// particle material ids. Invalid if the particles haven't got any:
+	MaterialPointData::Handle<int> m_particleMaterials;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_CONSTITUTIVEMODELSET_H
@@ -18,9 +18,31 @@ public:
 	
 	// dw/dx:
 	virtual float dw( float x ) const;
+	
+	// Evaluate the weights and derivatives for the four nodes at normalized coordinates
+	// -1-t, -t, 1-t and 2-t in one go, for 0 <= t < 1. This isn't virtual, so grids can
+	// inline it when they know they're using this shape function:
+	static void stencilWeights( float t, float* w, float* dw );
 
 };
 
+inline void CubicBsplineShapeFunction::stencilWeights( float t, float* w, float* dw )
+{
+	float t2 = t * t;
+	float t3 = t2 * t;
+	float oneMinusT = 1 - t;
+	
+	w[0] = oneMinusT * oneMinusT * oneMinusT / 6;
+	w[1] = 0.5f * t3 - t2 + 2.0f/3;
+	w[2] = ( -3 * t3 + 3 * t2 + 3 * t + 1 ) / 6;
+	w[3] = t3 / 6;
+	
+	dw[0] = 0.5f * oneMinusT * oneMinusT;
+	dw[1] = t * ( 2 - 1.5f * t );
+	dw[2] = 1.5f * t2 - t - 0.5f;
+	dw[3] = -0.5f * t2;
+}
+
 } //namespace MpmSim
 
 #endif
@@ -8,6 +8,7 @@
 #include "CollisionObject.h"
 #include "ConstitutiveModel.h"
 #include "Sim.h"
+#include "StencilKernels.h"
 
 #include <Eigen/Dense>
 
@@ -31,9 +32,21 @@ public:
 		float gridSize,
 		const ShapeFunction& shapeFunction,
 		Eigen::Vector3f frameVelocity = Eigen::Vector3f::Zero(),
-		int dimension = 3
+		int dimension = 3,
+		bool sparse = false
 	);
 	
+	~Grid();
+	
+	// re-splat the grid after the particles have moved. This reuses the grid's buffers,
+	// which only get reallocated if the extents change, and starts from the previous
+	// particle ordering, which is usually almost sorted already:
+	void update( const Eigen::Vector3f& frameVelocity = Eigen::Vector3f::Zero() );
+	
+	// switch the grid over to a different set of particles. This takes effect on the next
+	// call to update():
+	void setParticles( const Sim::IndexList& particleInds );
+	
 	// work out particle volumes:
 	void computeParticleVolumes() const;
 
@@ -53,9 +66,77 @@ public:
 	// transfer grid velocities to particles:
 	void updateParticleVelocities();
 	
-private:
+	// When this is on, updateGridVelocities() starts by working out a 9x9 stiffness matrix for each
+	// particle, which maps the velocity gradient at the particle straight to the force matrix it splats.
+	// The solver iterations then do a small matrix multiply per particle instead of going back to the
+	// constitutive model. It costs 81 floats per particle and nine evaluations of the model's stress
+	// differentials per solve, so it pays off when the solve takes more than a few iterations. Off
+	// by default:
+	void setStiffnessCaching( bool cache );
+	bool getStiffnessCaching() const;
+	
+	// Number of grid levels in the multigrid preconditioner for the implicit solve, including this one.
+	// Each extra level is a dense grid over the same particles with cells twice the size of the level
+	// above, which get kept between time steps like this one. Setting this to 1 uses the block diagonal
+	// preconditioner instead, which is the default:
+	void setMultigridLevels( int levels );
+	int getMultigridLevels() const;
+	
+	// Working out the block diagonal preconditioner means going over all the particles' stiffnesses,
+	// which can cost as much as a solver iteration. With this above zero the grid holds on to the
+	// stiffness part of it across time steps, only updating the masses and collisions, until a solve
+	// takes more than ( 1 + maxIterationGrowth ) times as many iterations as the first one that used it.
+	// It starts again from scratch if the grid's nodes get moved around. Zero, the default, works it
+	// out every time. This does nothing when the multigrid preconditioner's on:
+	void setPreconditionerReuse( float maxIterationGrowth );
+	float getPreconditionerReuse() const;
+	
+	// With this above zero, the block diagonal preconditioner is swapped for an additive Schwarz one,
+	// which chops the grid into cubes this many processing voxels wide, and approximately solves the
+	// implicit update on each cube's nodes independently, using only its own particles, before adding
+	// the solutions together. The cubes overlap by the particles' stencils. It saves a few iterations, but
+	// each application costs about three matrix multiplies, plus six per subdomain up front to choose the
+	// damping, so it's only worth it on big bodies on machines with lots of cores, where the subdomains
+	// get solved at the same time without having to talk to each other until the end. Zero, the default,
+	// turns it off. This does nothing when the multigrid preconditioner's on:
+	void setSchwarzSubdomainSize( int voxels );
+	int getSchwarzSubdomainSize() const;
+	
+	// With this above one, the block diagonal or Schwarz preconditioner gets wrapped in a
+	// ChebyshevPreconditioner doing this many iterations, with eigenvalue bounds from a few Lanczos steps
+	// at the start of each solve. The solver then takes fewer iterations, each costing degree - 1 more
+	// matrix multiplies, and the extra work doesn't need any dot products, which are what stop the solve
+	// scaling on machines with lots of cores. It defaults to 0, and anything one or less turns it off. This
+	// does nothing when the multigrid preconditioner's on:
+	void setChebyshevDegree( int degree );
+	int getChebyshevDegree() const;
+	
+	// Solves with PipelinedConjugateResiduals instead of ConjugateResiduals, which waits for its dot
+	// products once per iteration instead of three times, and does them at the same time as the matrix
+	// multiply. It takes a few more multiplies per solve though, so it's off by default:
+	void setPipelinedSolve( bool pipelined );
+	bool getPipelinedSolve() const;
 	
-	// classes used by updateGridVelocities() in the implicit velocity solve:
+	// How updateGridVelocities() guesses the velocities it starts the solver off from. With
+	// Sim::PreviousVelocityGuess or Sim::ExtrapolatedVelocityGuess the grid hangs on to the velocities
+	// from its last one or two solves, and looks them up by position, so they still line up after the
+	// extents change. Nodes they don't cover get the centre of mass guess, and if the result's further
+	// from solving the implicit update than the centre of mass guess is, the whole body uses that
+	// instead, which costs two extra multiplies per solve. Defaults to Sim::CentreOfMassGuess:
+	void setInitialGuess( Sim::InitialGuess guess );
+	Sim::InitialGuess getInitialGuess() const;
+	
+	// With this above zero, the solver deflates each solve with this many approximate eigenvectors
+	// for the slowest converging modes of the last one, using RecycledConjugateResiduals. Consecutive
+	// solves have nearly the same matrix, so those modes barely change from one time step to the next.
+	// They're looked up by position if the grid's changed shape in between. It costs this many extra
+	// multiplies per solve, and about twelve times this many vectors. Zero, the default, turns it off.
+	// This does nothing with pipelined solves:
+	void setRecycleSize( int size );
+	int getRecycleSize() const;
+	
+	// The matrix updateGridVelocities() solves with, which the preconditioners build on. It takes grid
+	// velocities relative to the collision objects to the momenta they need at the start of the step:
 	class ImplicitUpdateMatrix : public ProceduralMatrix
 	{
 	public:
@@ -72,6 +153,9 @@ private:
 
 		void subspaceProject( Eigen::VectorXf& toProject ) const;
 
+		// number of times multVector() has been called, which is roughly the number of solver iterations:
+		int multiplies() const;
+
 	private:
 
 		const MaterialPointData& m_d;
@@ -81,15 +165,13 @@ private:
 		const ForceField::ForceFieldSet& m_fields;
 		float m_timeStep;
 
+		mutable int m_multiplies;
+
 		typedef std::vector< const CollisionObject* >::const_iterator CollisionIterator;
 		typedef std::vector< const CollisionObject* >::const_reverse_iterator ReverseCollisionIterator;
-
-
-
-
 	};
 
-	// =====================================================================
+	// Applies the diagonal of the implicit update matrix, for smoothing in the multigrid preconditioner:
 	class DiagonalPreconditioner : public ProceduralMatrix
 	{
 	public:
@@ -107,9 +189,171 @@ private:
 
 	};
 
-	// map grid coordinates to cell index:
+	// grid data for the preconditioners:
+	
+	// node masses:
+	const Eigen::VectorXf& masses() const;
+	
+	// world space position of a grid node:
+	Eigen::Vector3f nodePosition( int idx ) const;
+	
+	// true if the node hit a collision object in the last call to updateGridVelocities():
+	bool nodeCollided( int idx ) const;
+	
+	// matrix projecting a node's velocity onto the subspace its collision leaves it free to move in:
+	Eigen::Matrix3f collisionProjection( int idx, const CollisionObject::CollisionObjectSet& collisionObjects ) const;
+	
+	// appends the nodes whose shape functions are nonzero at p, along with their weights there. In a
+	// sparse grid this leaves out nodes that haven't been allocated:
+	void nodeWeights( const Eigen::Vector3f& p, std::vector<int>& nodes, std::vector<float>& weights ) const;
+	
+	// the particle data the grid was built from:
+	const MaterialPointData& particleData() const;
+	
+	// coarse grids for the multigrid preconditioner, each with cells twice the size of the last:
+	size_t numCoarseGrids() const;
+	const Grid& coarseGrid( size_t i ) const;
+	
+	// The grid splats its particles a voxel at a time, in the eight partitions described with
+	// m_processingPartitions below. Each entry in a partition is the range of m_particleInds in one voxel:
+	typedef std::vector< std::pair<Sim::ConstIndexIterator, Sim::ConstIndexIterator> > ParticlesInVoxelList;
+	const ParticlesInVoxelList& processingPartition( int i, int j, int k ) const;
+	
+	// coordinates of the processing voxel containing particle p:
+	Eigen::Vector3i processingVoxel( int p ) const;
+	
+	// appends the nodes in the stencil of one of the grid's particles:
+	void particleNodes( Sim::ConstIndexIterator particle, std::vector<int>& nodes ) const;
+	
+	// Adds the force differentials from the particles in voxels onto df, like calculateForceDifferentials()
+	// does for the whole grid. This uses the stiffness cache if it's there, and runs on the calling thread,
+	// so it can be called for different voxels and different vectors at the same time:
+	void addForceDifferentials(
+		Eigen::VectorXf& df,
+		const Eigen::VectorXf& dx,
+		const ConstitutiveModel& constitutiveModel,
+		const ParticlesInVoxelList& voxels ) const;
+	
+private:
+	
+	// no copying, as we own the coarse multigrid levels:
+	Grid( const Grid& );
+	Grid& operator=( const Grid& );
+	
+	// makes sure m_coarseGrids is the right length, and updates the grids for the current particles
+	// and frame velocity:
+	void updateCoarseGrids();
+	
+	// works out m_nodeCollided from the grid's current velocities. The coarse grids use this, as they
+	// don't have explicit momenta:
+	void collideNodes( const CollisionObject::CollisionObjectSet& collisionObjects );
+	
+	// map grid coordinates to cell index. Returns -1 if the cell isn't allocated in a sparse grid:
 	int coordsToIndex( int i, int j, int k ) const;
 	
+	// map cell index back to grid coordinates:
+	void indexToCoords( int idx, Eigen::Vector3i& coords ) const;
+	
+	// Sparse grids only store nodes in the fixed size blocks that particles actually splat onto.
+	// Blocks are 4 cells wide along each simulated axis, and are identified by a 64 bit key
+	// packing their block coordinates. m_blockKeys is kept sorted so we can find a block's
+	// slot with a binary search, and the nodes in slot b occupy indices
+	// b * m_blockNodes to ( b + 1 ) * m_blockNodes - 1:
+	typedef long long BlockKey;
+	BlockKey blockKey( int bi, int bj, int bk ) const;
+	int blockSlot( BlockKey key ) const;
+	
+	// work out which blocks the particles touch:
+	void allocateBlocks();
+	
+	// work out which blocks a shape function stencil starting at the specified grid
+	// coordinates overlaps:
+	void stencilBlocks( const Eigen::Vector3i& base, Eigen::Vector3i& blockBase, Eigen::Vector3i& blockCount ) const;
+	
+	// work out a node's index in a sparse grid, given the blocks its stencil overlaps:
+	int sparseIndex( const Eigen::Vector3i& blockBase, const Eigen::Vector3i& blockCount, const int* blockSlots, int i, int j, int k ) const;
+	
+	// work out the grid extents from the particle bounding box. If the grid has been used
+	// before the old extents are kept if they still fit, and padded out a bit if they don't:
+	void computeExtents();
+	
+	// Enough of the grid's node layout at some point to find where a node was from its position,
+	// after the grid's changed:
+	class NodeLayout
+	{
+	public:
+		
+		NodeLayout();
+		
+		// copies the grid's current layout:
+		void store( const Grid& g );
+		
+		void clear();
+		
+		// true if the grid's nodes are still laid out like this:
+		bool matches( const Grid& g ) const;
+		
+		// Finds the index the node at the specified grid coordinates relative to the origin had in
+		// this layout. Returns -1 if it wasn't in the grid:
+		int index( const Grid& g, const Eigen::Vector3i& coords ) const;
+		
+		void swap( NodeLayout& other );
+		
+	private:
+		
+		// coordinates of the first node relative to the origin, and the grid dimensions:
+		Eigen::Vector3i m_origin;
+		Eigen::Vector3i m_n;
+		std::vector<BlockKey> m_blockKeys;
+		
+	};
+	
+	// Velocities the grid solved for on an earlier time step, along with the layout they were solved
+	// on, so a node's velocity can be found from its position after the grid's changed:
+	class SolvedVelocities
+	{
+	public:
+		
+		SolvedVelocities();
+		
+		// copies the grid's current velocities and layout, remembering they were solved over timeStep:
+		void store( const Grid& g, float timeStep );
+		
+		void clear();
+		bool empty() const;
+		
+		// time step the velocities were solved over:
+		float timeStep() const;
+		
+		// Finds the velocity, relative to a static frame, of the node at the specified grid coordinates
+		// relative to the origin. Returns false if there wasn't a node with mass there:
+		bool velocity( const Grid& g, const Eigen::Vector3i& coords, Eigen::Vector3f& v ) const;
+		
+		void swap( SolvedVelocities& other );
+		
+	private:
+		
+		Eigen::VectorXf m_velocities;
+		std::vector<char> m_occupied;
+		Eigen::Vector3f m_frameVelocity;
+		float m_timeStep;
+		NodeLayout m_layout;
+		
+		friend class MpmSimTest::TestGrid;
+		
+	};
+	
+	// fills in m_velocities with the initial guess from m_solvedVelocities, relative to the collision
+	// velocities vc, at the nodes it covers. Returns false if it didn't cover any:
+	bool warmStartVelocities( const Eigen::VectorXf& vc, float timeStep );
+	
+	// coordinates of the first node relative to the origin:
+	Eigen::Vector3i gridOrigin() const;
+	
+	// moves the recycled vectors onto the current layout by node position, if it's changed since
+	// they were harvested. Nodes that weren't in the old layout get zeros:
+	void remapRecycleSpace();
+	
 	// the ShapeFunctionIterator is a class for iterating over all grid nodes
 	// which have a specified point in their support, and evaluating the corresponding
 	// shape functions and their derivatives at that point.
@@ -121,6 +365,9 @@ private:
 		
 		// initialize for a specified point:
 		void initialize( const Eigen::Vector3f& p, bool computeDerivatives = false );
+		
+		// initialize for one of the grid's particles, using the cached shape function values:
+		void initialize( Sim::ConstIndexIterator particle, bool computeDerivatives = false );
 
 		// move to next point - returns false when it's done:
 		bool next();
@@ -128,6 +375,9 @@ private:
 		// what grid point are we on?
 		void gridPos( Eigen::Vector3i& pos ) const;
 		
+		// index of the grid point we're on:
+		int index() const;
+		
 		// compute shape function weight
 		float w() const;
 		
@@ -135,27 +385,133 @@ private:
 		void dw( Eigen::Vector3f& g ) const;
 		
 	private:
+		
+		// point the iterator at a set of weights and block slots laid out as described
+		// in Grid::evaluateShapeFunctions(), and rewind it:
+		void setStencil( const float* weights, const int* blockSlots );
 
 		const Grid& m_grid;
 
 		int m_diameter;
 		
-		std::vector<float> m_w[3];
-		std::vector<float> m_dw[3];
+		// storage for weights and block slots when we initialize with an arbitrary point:
+		std::vector<float> m_weights;
+		std::vector<int> m_blockSlotStorage;
+		
+		const float* m_w[3];
+		const float* m_dw[3];
 		Eigen::Vector3i m_pos;
 		Eigen::Vector3i m_base;
 		bool m_gradients;
 		
+		// sparse grid slots for the blocks overlapped by the stencil, so we
+		// only have to look them up once per particle:
+		Eigen::Vector3i m_blockBase;
+		Eigen::Vector3i m_blockCount;
+		const int* m_blockSlots;
+		
 	};
 	
+	// Work out the shape function weights for a point along each axis, and their derivatives if
+	// requested. base receives the grid coordinates of the first node in the stencil. weights needs
+	// room for 6 * diameter floats: the weights along x, y and z, followed by the derivatives along
+	// x, y and z. For sparse grids, blockSlots receives the slots of the blocks the stencil overlaps,
+	// and needs room for m_maxStencilBlocks ints:
+	void evaluateShapeFunctions(
+		const Eigen::Vector3f& p,
+		bool computeDerivatives,
+		Eigen::Vector3i& base,
+		float* weights,
+		int* blockSlots ) const;
+	
+
+	// fill in the shape function cache, m_stencilBases, m_stencilWeights and m_stencilBlockSlots:
+	class ShapeFunctionCacher;
+	void cacheShapeFunctions();
+	
+	// fill in m_stiffness:
+	class StiffnessCacher;
+	void cacheStiffness( const ConstitutiveModel& constitutiveModel );
+	
+	// works out the stiffness matrices for a run of up to StiffnessBatchSize particles, laid out one
+	// after the other like m_stiffness, whether or not they're cached:
+	enum
+	{
+		StiffnessBatchSize = 64
+	};
+	void computeStiffness( Sim::ConstIndexIterator begin, Sim::ConstIndexIterator end, const ConstitutiveModel& constitutiveModel, float* stiffness ) const;
+	
 	// thread specific storage for shape function iterators
 	mutable tbb::enumerable_thread_specific< std::auto_ptr< ShapeFunctionIterator > > m_shapeFunctionIterators;
 
 	// grabs a shape function iterator for this thread
 	ShapeFunctionIterator& shapeFunctionIterator() const;
 	
+	// Stencil shapes we've got compile time specialised code for. This gets chosen once when the
+	// grid's constructed, and the splatters and particle loops are instantiated for each one, so
+	// their inner loops have fixed trip counts and don't have to branch on the dimension:
+	enum StencilType
+	{
+		GenericStencil,
+		Stencil4x4,
+		Stencil4x4x4
+	};
+	// Does the same job as ShapeFunctionIterator for a stencil D nodes wide in Dim dimensions.
+	// This only works for the grid's own particles, as it reads from the shape function cache:
+	template< int D, int Dim >
+	class FixedShapeFunctionIterator
+	{
+	public:
+		
+		FixedShapeFunctionIterator( const Grid& g );
+		
+		void initialize( Sim::ConstIndexIterator particle, bool computeDerivatives = false );
+		
+		bool next();
+		
+		void gridPos( Eigen::Vector3i& pos ) const;
+		
+		int index() const;
+		
+		float w() const;
+		
+		void dw( Eigen::Vector3f& g ) const;
+	
+	private:
+		
+		const Grid& m_grid;
+		const float* m_weights;
+		Eigen::Vector3i m_base;
+		int m_pos[3];
+		
+		// index of the current node in a dense grid, which we keep up to date in next():
+		int m_index;
+		
+		// sparse grid blocks overlapped by the stencil:
+		Eigen::Vector3i m_blockBase;
+		Eigen::Vector3i m_blockCount;
+		const int* m_blockSlots;
+	};
+	
+	// calls op( shIt ) with the most specialised shape function iterator we've got for this grid:
+	template< class Op >
+	void dispatchStencil( Op& op ) const;
+	
+	// describes the cached stencil of one of the grid's particles for the SIMD kernels:
+	StencilKernels::Stencil stencil( Sim::ConstIndexIterator particle ) const;
+	
+	// particle loops for computeParticleVolumes(), updateDeformationGradients() and updateParticleVelocities():
+	class ParticleVolumeGatherer;
+	class DeformationGradientGatherer;
+	class ParticleVelocityGatherer;
+	
 	// class for splatting quantities like mass onto the grid in paralell, using the shape function iterator:
 	class GridSplatter;
+	
+	// base class for splatters which implement their particle loop as a template on the shape function iterator,
+	// so it can be specialised for the grid's stencil type:
+	template< class Derived >
+	class StencilSplatter;
 
 	// splat a quantity onto the grid in paralell using the supplied splatter object
 	template< class Splatter >
@@ -179,17 +535,26 @@ private:
 		const std::vector<Eigen::Vector3f>& particleX,
 		int dim=0 );
 
+	// put m_particleInds back into voxel order after the particles have moved:
+	void resortParticles();
+	
+	// If the particles have material ids, this groups the particles in each voxel by material, so the
+	// constitutive model gets runs of particles with the same material when we ask it for stresses.
+	// The insertion sort in resortParticles() keeps the order within voxels, so after the first time
+	// round this is usually just a pass checking everything's still grouped:
+	void groupParticlesByMaterial();
+
 	// This variable consists of eight lists of voxels corresponding to the eight partitions described above
-	typedef std::vector< std::pair<Sim::ConstIndexIterator, Sim::ConstIndexIterator> > ParticlesInVoxelList;
 	ParticlesInVoxelList m_processingPartitions[2][2][2];
 	
 	
 	// compute m_processingPartitions:
 	void computeProcessingPartitions();
 		
-	// splatters for transferring mass and velocity onto the grid:
-	class MassSplatter;
-	class VelocitySplatter;
+	// splatter for transferring mass and momentum onto the grid in a single pass, and
+	// a class for dividing the momenta by the masses afterwards:
+	class MassMomentumSplatter;
+	class VelocityNormaliser;
 
 	
 	// grid physics:
@@ -231,25 +596,86 @@ private:
 	) const;
 	
 	// calculate how much the force changes for each node/axis per unit displacement
-	// for that node on that axis. I'm currently trying to use this to make the implicit
-	// solve converge faster:
+	// for that node on that axis. This costs three stress differentials per stencil node,
+	// so the preconditioners take the diagonals of dForceidXiBlocks() instead:
 	class dFidXiSplatter;
 	void dForceidXi(
 		Eigen::VectorXf& dfdxi, 
 		const ConstitutiveModel& constitutiveModel ) const;
 	
+	// same again, but works out the whole 3x3 block of force derivatives for each node. Each block is
+	// stored as a column major matrix, at offset 9 * idx in blocks. The blocks are contracted straight
+	// out of the particle stiffness matrices, so this uses the stiffness cache if it's there, and
+	// otherwise costs nine stress differentials per particle rather than three per stencil node:
+	class dFidXiBlockSplatter;
+	void dForceidXiBlocks(
+		Eigen::VectorXf& blocks, 
+		const ConstitutiveModel& constitutiveModel ) const;
+	
 	// particle info:
 	MaterialPointData& m_d;	
 	Sim::IndexList m_particleInds;
 	
+	// the particle variables we use, resolved once when the grid's constructed and
+	// refreshed in update():
+	MaterialPointData::Handle<Eigen::Vector3f> m_particleX;
+	MaterialPointData::Handle<Eigen::Vector3f> m_particleV;
+	MaterialPointData::Handle<float> m_particleM;
+	MaterialPointData::Handle<float> m_particleVolumes;
+	MaterialPointData::Handle<Eigen::Matrix3f> m_particleF;
+	
+	// particle material ids, which aren't valid unless the particle data has a "material" variable:
+	MaterialPointData::Handle<int> m_particleMaterials;
+	
+	// true once m_particleInds has been voxel sorted:
+	bool m_sorted;
+	
+	// scratch space for resortParticles():
+	std::vector< std::pair< Eigen::Vector3i, int > > m_sortKeys;
+	
+	// The particles don't move while the grid is in use, so update() evaluates the shape functions
+	// for all of them up front and stores the results here, indexed by position in m_particleInds.
+	// All the splatting and gathering passes then read from this instead of recomputing the weights:
+	std::vector<Eigen::Vector3i> m_stencilBases;
+	std::vector<float> m_stencilWeights;
+	std::vector<int> m_stencilBlockSlots;
+	
+	// Per particle stiffness matrices for the implicit solve when stiffness caching's on, indexed by
+	// position in m_particleInds like the shape function cache. Each one's a column major 9x9 matrix
+	// taking the (column major) gradient of the grid displacements at the particle to its force matrix,
+	// with the particle volume and F^T already multiplied in. They depend on the constitutive model's
+	// state, so they're only valid during updateGridVelocities():
+	std::vector<float> m_stiffness;
+	bool m_stiffnessCaching;
+	bool m_stiffnessCached;
+	
 	// grid variables:
 	Eigen::VectorXf m_masses;
 	Eigen::VectorXf m_velocities;
 	Eigen::VectorXf m_prevVelocities;
 	std::vector<char> m_nodeCollided;
 	
+	// velocities from the last two solves, most recent first, if we're using them for initial guesses:
+	SolvedVelocities m_solvedVelocities[2];
+	Sim::InitialGuess m_initialGuess;
+	
+	// vectors the last solve handed back for deflating the next one, and the layout they were
+	// harvested on:
+	int m_recycleSize;
+	std::vector<Eigen::VectorXf> m_recycleSpace;
+	NodeLayout m_recycleLayout;
+	
 	// shape function we're using for this grid:
 	const ShapeFunction& m_shapeFunction;
+	StencilType m_stencilType;
+	
+	// true if we can evaluate cubic b-spline weights directly instead of through the virtual
+	// ShapeFunction interface:
+	bool m_cubicBspline;
+	
+	// SIMD kernels for 4 node wide stencils on dense grids, or zero if we can't use them on this
+	// grid, in which case everything goes through the shape function iterators instead:
+	const StencilKernels* m_kernels;
 	
 	// grid geometry:
 	float m_gridSize;
@@ -258,6 +684,36 @@ private:
 	Eigen::Vector3i m_n;
 	int m_dimension;
 	
+	// sparse block storage, and the maximum number of blocks a stencil can overlap:
+	bool m_sparse;
+	std::vector<BlockKey> m_blockKeys;
+	Eigen::Vector3i m_blockShift;
+	int m_blockNodes;
+	int m_maxStencilBlocks;
+	
+	// implicit solve settings, starting with the multVector() calls made by the last solve on this
+	// grid, or zero if it hasn't done one yet:
+	int m_lastSolveMultiplies;
+	
+	// chebyshev iterations in the preconditioner, or one or less if it's off:
+	int m_chebyshevDegree;
+	
+	// use PipelinedConjugateResiduals for the implicit solve:
+	bool m_pipelinedSolve;
+	
+	// force derivative blocks we're reusing for the block diagonal preconditioner, or empty if we
+	// haven't got any, and the multiplies taken by the first solve that used them:
+	Eigen::VectorXf m_reusedPreconditionerBlocks;
+	int m_reusedPreconditionerMultiplies;
+	float m_preconditionerReuse;
+	
+	// coarse grids for the multigrid preconditioner, each with cells twice the size of the last:
+	std::vector<Grid*> m_coarseGrids;
+	int m_multigridLevels;
+	
+	// processing voxels along each side of the Schwarz preconditioner's subdomains, or zero if it's off:
+	int m_schwarzSubdomainSize;
+	
 	// grid motion:
 	Eigen::Vector3f m_frameVelocity;
 
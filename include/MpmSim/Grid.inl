@@ -17,6 +17,126 @@ void Grid::splat( Splatter& s ) const
 	}
 }
 
+inline int Grid::sparseIndex( const Eigen::Vector3i& blockBase, const Eigen::Vector3i& blockCount, const int* blockSlots, int i, int j, int k ) const
+{
+	int b = ( i >> m_blockShift[0] ) - blockBase[0] + blockCount[0] * ( ( j >> m_blockShift[1] ) - blockBase[1] + blockCount[1] * ( ( k >> m_blockShift[2] ) - blockBase[2] ) );
+	int li = i & ( ( 1 << m_blockShift[0] ) - 1 );
+	int lj = j & ( ( 1 << m_blockShift[1] ) - 1 );
+	int lk = k & ( ( 1 << m_blockShift[2] ) - 1 );
+	return blockSlots[b] * m_blockNodes + li + ( ( lj + ( lk << m_blockShift[1] ) ) << m_blockShift[0] );
+}
+
+template< class Op >
+void Grid::dispatchStencil( Op& op ) const
+{
+	switch( m_stencilType )
+	{
+		case Stencil4x4x4:
+		{
+			FixedShapeFunctionIterator<4, 3> shIt( *this );
+			op( shIt );
+			break;
+		}
+		case Stencil4x4:
+		{
+			FixedShapeFunctionIterator<4, 2> shIt( *this );
+			op( shIt );
+			break;
+		}
+		default:
+			op( shapeFunctionIterator() );
+	}
+}
+
+template< int D, int Dim >
+inline Grid::FixedShapeFunctionIterator<D, Dim>::FixedShapeFunctionIterator( const Grid& g )
+	: m_grid( g ), m_weights( 0 ), m_index( 0 ), m_blockSlots( 0 )
+{
+	m_base.setZero();
+	m_pos[0] = m_pos[1] = m_pos[2] = 0;
+}
+
+template< int D, int Dim >
+inline void Grid::FixedShapeFunctionIterator<D, Dim>::initialize( Sim::ConstIndexIterator particle, bool )
+{
+	int slot = int( particle - m_grid.m_particleInds.begin() );
+	m_base = m_grid.m_stencilBases[slot];
+	m_weights = &m_grid.m_stencilWeights[ slot * 6 * D ];
+	m_pos[0] = m_pos[1] = m_pos[2] = 0;
+	if( m_grid.m_sparse )
+	{
+		m_blockSlots = &m_grid.m_stencilBlockSlots[ slot * m_grid.m_maxStencilBlocks ];
+		m_grid.stencilBlocks( m_base, m_blockBase, m_blockCount );
+	}
+	else
+	{
+		m_index = m_base[0] + m_grid.m_n[0] * ( m_base[1] + m_grid.m_n[1] * m_base[2] );
+	}
+}
+
+template< int D, int Dim >
+inline bool Grid::FixedShapeFunctionIterator<D, Dim>::next()
+{
+	++m_index;
+	if( ++m_pos[0] < D )
+	{
+		return true;
+	}
+	if( Dim == 1 )
+	{
+		return false;
+	}
+	
+	m_pos[0] = 0;
+	m_index += m_grid.m_n[0] - D;
+	if( ++m_pos[1] < D )
+	{
+		return true;
+	}
+	if( Dim == 2 )
+	{
+		return false;
+	}
+	
+	m_pos[1] = 0;
+	m_index += m_grid.m_n[0] * ( m_grid.m_n[1] - D );
+	return ++m_pos[2] < D;
+}
+
+template< int D, int Dim >
+inline void Grid::FixedShapeFunctionIterator<D, Dim>::gridPos( Eigen::Vector3i& pos ) const
+{
+	pos[0] = m_pos[0] + m_base[0];
+	pos[1] = m_pos[1] + m_base[1];
+	pos[2] = m_pos[2] + m_base[2];
+}
+
+template< int D, int Dim >
+inline int Grid::FixedShapeFunctionIterator<D, Dim>::index() const
+{
+	if( !m_grid.m_sparse )
+	{
+		return m_index;
+	}
+	return m_grid.sparseIndex( m_blockBase, m_blockCount, m_blockSlots, m_pos[0] + m_base[0], m_pos[1] + m_base[1], m_pos[2] + m_base[2] );
+}
+
+template< int D, int Dim >
+inline float Grid::FixedShapeFunctionIterator<D, Dim>::w() const
+{
+	return m_weights[ m_pos[0] ] * m_weights[ D + m_pos[1] ] * m_weights[ 2 * D + m_pos[2] ];
+}
+
+template< int D, int Dim >
+inline void Grid::FixedShapeFunctionIterator<D, Dim>::dw( Eigen::Vector3f& g ) const
+{
+	const float* w = m_weights;
+	const float* dw = m_weights + 3 * D;
+	g[0] = -dw[ m_pos[0] ] *  w[ D + m_pos[1] ] *  w[ 2 * D + m_pos[2] ];
+	g[1] = - w[ m_pos[0] ] * dw[ D + m_pos[1] ] *  w[ 2 * D + m_pos[2] ];
+	g[2] = - w[ m_pos[0] ] *  w[ D + m_pos[1] ] * dw[ 2 * D + m_pos[2] ];
+}
+
 } //namespace MpmSim
 
 #endif // MPMSIM_GRID_INL
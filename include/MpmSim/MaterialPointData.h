@@ -5,6 +5,8 @@
 #include <map>
 #include <Eigen/Dense>
 
+#include "PackedArray.h"
+
 namespace MpmSim
 {
 
@@ -16,17 +18,94 @@ public:
 	MaterialPointData();
 	~MaterialPointData();
 	
+	// How a variable's stored. AoS variables are a std::vector<T>, which is what most of the code
+	// expects. AoSoA variables are a PackedArray<T>, which stores vectors and matrices component-wise
+	// in aligned blocks for SIMD code:
+	enum Layout
+	{
+		AoS,
+		AoSoA
+	};
+	
 	// create a variable of the specified name with the specified type:
 	template<typename T>
-	void createVariable( const std::string& name );
+	void createVariable( const std::string& name, Layout layout = AoS );
 	
-	// retrieve a variable of the specified name with the specified type:
+	// retrieve an AoS variable of the specified name with the specified type:
 	template<typename T>
 	std::vector<T>& variable( const std::string& name );
 	
 	template<typename T>
 	const std::vector<T>& variable( const std::string& name ) const;
 	
+	// retrieve an AoSoA variable of the specified name with the specified type:
+	template<typename T>
+	PackedArray<T>& packedVariable( const std::string& name );
+	
+	template<typename T>
+	const PackedArray<T>& packedVariable( const std::string& name ) const;
+	
+	// A variable resolved by name once up front, for code that accesses it a lot or hangs on to
+	// it for a long time. Handles can point at variables with either layout. Code that only deals
+	// with AoS variables can use the std::vector directly, which costs the same as going through a
+	// pointer to it. get() and set() work with both layouts, for the same price plus a branch.
+	// Handles survive the variable being resized, but not it being reallocated by setLayout().
+	// Holders can check stale() to find out if that's happened, and refresh() to resolve the handle
+	// again:
+	template<typename T>
+	class Handle
+	{
+	public:
+		
+		Handle();
+		
+		// AoS access, which is only valid when packed() is zero:
+		std::vector<T>& operator*() const;
+		std::vector<T>* operator->() const;
+		T& operator[]( size_t i ) const;
+		
+		// the variable's storage if it's AoSoA, or zero if it's AoS:
+		PackedArray<T>* packed() const;
+		
+		// element access for either layout:
+		size_t size() const;
+		T get( size_t i ) const;
+		void set( size_t i, const T& value ) const;
+		
+		// false for default constructed handles:
+		bool valid() const;
+		
+		// true if the variable's been reallocated since the handle was resolved:
+		bool stale() const;
+		
+		// resolve the handle again if it's stale:
+		void refresh();
+		
+	private:
+		
+		friend class MaterialPointData;
+		
+		std::vector<T>* m_data;
+		PackedArray<T>* m_packed;
+		MaterialPointData* m_owner;
+		std::string m_name;
+		unsigned m_generation;
+	};
+	
+	// resolve a handle to a variable of the specified name with the specified type:
+	template<typename T>
+	Handle<T> handle( const std::string& name );
+	
+	// layout of the named variable:
+	Layout layout( const std::string& name ) const;
+	
+	// switch a variable to a different layout, keeping its contents:
+	template<typename T>
+	void setLayout( const std::string& name, Layout layout );
+	
+	// true if there's a variable of the specified name:
+	bool hasVariable( const std::string& name ) const;
+	
 	// number of variables:
 	size_t numVariables() const;
 	
@@ -38,7 +117,9 @@ private:
 	class MaterialPointVariableBase
 	{
 	public:
+		virtual ~MaterialPointVariableBase() {}
 		virtual size_t dataSize() = 0;
+		virtual Layout layout() const = 0;
 	};
 
 	template <typename T> 
@@ -49,12 +130,29 @@ private:
 		MaterialPointVariable( size_t n ) : m_data(n) {}
 		MaterialPointVariable( size_t n, const T& value ) : m_data(n,value) {}
 		virtual size_t dataSize() { return m_data.size(); };
+		virtual Layout layout() const { return AoS; }
 		typedef std::vector<T> Data;
 		Data m_data;
 	};
 	
+	template <typename T> 
+	class PackedMaterialPointVariable : public MaterialPointVariableBase
+	{
+	public:
+		virtual size_t dataSize() { return m_data.size(); };
+		virtual Layout layout() const { return AoSoA; }
+		typedef PackedArray<T> Data;
+		Data m_data;
+	};
+	
+	// finds the named variable, throwing if there isn't one:
+	MaterialPointVariableBase* findVariable( const std::string& name ) const;
+	
 	typedef std::map< std::string, MaterialPointVariableBase* > VariableMap;
 	VariableMap m_variables;
+	
+	// incremented whenever a variable gets reallocated, so handles can tell they're stale:
+	unsigned m_generation;
 };
 
 }
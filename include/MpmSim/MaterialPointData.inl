@@ -7,27 +7,33 @@ namespace MpmSim
 {
 
 template<typename T>
-void MaterialPointData::createVariable( const std::string& name )
+void MaterialPointData::createVariable( const std::string& name, Layout layout )
 {
 	if( m_variables.find( name ) != m_variables.end() )
 	{
 		throw std::runtime_error( "Material point data already has a variable named '" + name + "'" );
 	}
-	m_variables[name] = new MaterialPointVariable<T>;
+	if( layout == AoSoA )
+	{
+		m_variables[name] = new PackedMaterialPointVariable<T>;
+	}
+	else
+	{
+		m_variables[name] = new MaterialPointVariable<T>;
+	}
 }
 
 template<typename T>
 std::vector<T>& MaterialPointData::variable( const std::string& name )
 {
-	VariableMap::iterator it = m_variables.find( name );
-	if( it == m_variables.end() )
-	{
-		throw std::runtime_error( "Material point data has no variable named '" + name + "'" );
-	}
-	
-	MaterialPointVariable<T>* variable = dynamic_cast< MaterialPointVariable<T>* >( it->second );
+	MaterialPointVariableBase* base = findVariable( name );
+	MaterialPointVariable<T>* variable = dynamic_cast< MaterialPointVariable<T>* >( base );
 	if( !variable )
 	{
+		if( base->layout() != AoS )
+		{
+			throw std::runtime_error( "Material point variable '" + name + "' is packed - use packedVariable() to access it" );
+		}
 		throw std::runtime_error( "Material point data has no variable named '" + name + "' of the specified type" );
 	}
 	return variable->m_data;
@@ -39,5 +45,157 @@ const std::vector<T>& MaterialPointData::variable( const std::string& name ) con
 	return const_cast<MaterialPointData*>( this )->variable<T>( name );
 }
 
+template<typename T>
+PackedArray<T>& MaterialPointData::packedVariable( const std::string& name )
+{
+	MaterialPointVariableBase* base = findVariable( name );
+	PackedMaterialPointVariable<T>* variable = dynamic_cast< PackedMaterialPointVariable<T>* >( base );
+	if( !variable )
+	{
+		if( base->layout() != AoSoA )
+		{
+			throw std::runtime_error( "Material point variable '" + name + "' isn't packed - use variable() to access it" );
+		}
+		throw std::runtime_error( "Material point data has no variable named '" + name + "' of the specified type" );
+	}
+	return variable->m_data;
+}
+
+template<typename T>
+const PackedArray<T>& MaterialPointData::packedVariable( const std::string& name ) const
+{
+	return const_cast<MaterialPointData*>( this )->packedVariable<T>( name );
+}
+
+template<typename T>
+MaterialPointData::Handle<T> MaterialPointData::handle( const std::string& name )
+{
+	Handle<T> h;
+	if( findVariable( name )->layout() == AoSoA )
+	{
+		h.m_packed = &packedVariable<T>( name );
+	}
+	else
+	{
+		h.m_data = &variable<T>( name );
+	}
+	h.m_owner = this;
+	h.m_name = name;
+	h.m_generation = m_generation;
+	return h;
+}
+
+template<typename T>
+MaterialPointData::Handle<T>::Handle() : m_data( 0 ), m_packed( 0 ), m_owner( 0 ), m_generation( 0 )
+{
+}
+
+template<typename T>
+inline std::vector<T>& MaterialPointData::Handle<T>::operator*() const
+{
+	return *m_data;
+}
+
+template<typename T>
+inline std::vector<T>* MaterialPointData::Handle<T>::operator->() const
+{
+	return m_data;
+}
+
+template<typename T>
+inline T& MaterialPointData::Handle<T>::operator[]( size_t i ) const
+{
+	return (*m_data)[i];
+}
+
+template<typename T>
+inline PackedArray<T>* MaterialPointData::Handle<T>::packed() const
+{
+	return m_packed;
+}
+
+template<typename T>
+inline size_t MaterialPointData::Handle<T>::size() const
+{
+	return m_packed ? m_packed->size() : m_data->size();
+}
+
+template<typename T>
+inline T MaterialPointData::Handle<T>::get( size_t i ) const
+{
+	return m_packed ? m_packed->get( i ) : (*m_data)[i];
+}
+
+template<typename T>
+inline void MaterialPointData::Handle<T>::set( size_t i, const T& value ) const
+{
+	if( m_packed )
+	{
+		m_packed->set( i, value );
+	}
+	else
+	{
+		(*m_data)[i] = value;
+	}
+}
+
+template<typename T>
+inline bool MaterialPointData::Handle<T>::valid() const
+{
+	return m_data != 0 || m_packed != 0;
+}
+
+template<typename T>
+inline bool MaterialPointData::Handle<T>::stale() const
+{
+	return m_owner && m_generation != m_owner->m_generation;
+}
+
+template<typename T>
+void MaterialPointData::Handle<T>::refresh()
+{
+	if( stale() )
+	{
+		*this = m_owner->handle<T>( m_name );
+	}
+}
+
+template<typename T>
+void MaterialPointData::setLayout( const std::string& name, Layout layout )
+{
+	MaterialPointVariableBase* base = findVariable( name );
+	if( base->layout() == layout )
+	{
+		return;
+	}
+	
+	MaterialPointVariableBase* converted = 0;
+	if( layout == AoSoA )
+	{
+		const std::vector<T>& data = variable<T>( name );
+		PackedMaterialPointVariable<T>* packed = new PackedMaterialPointVariable<T>;
+		packed->m_data.resize( data.size() );
+		for( size_t i=0; i < data.size(); ++i )
+		{
+			packed->m_data.set( i, data[i] );
+		}
+		converted = packed;
+	}
+	else
+	{
+		const PackedArray<T>& data = packedVariable<T>( name );
+		MaterialPointVariable<T>* unpacked = new MaterialPointVariable<T>( data.size() );
+		for( size_t i=0; i < data.size(); ++i )
+		{
+			unpacked->m_data[i] = data.get( i );
+		}
+		converted = unpacked;
+	}
+	
+	delete base;
+	m_variables[name] = converted;
+	++m_generation;
+}
+
 }
 #endif
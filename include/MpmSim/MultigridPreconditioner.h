@@ -0,0 +1,67 @@
+#ifndef MPMSIM_MULTIGRIDPRECONDITIONER_H
+#define MPMSIM_MULTIGRIDPRECONDITIONER_H
+
+#include "ProceduralMatrix.h"
+#include "Grid.h"
+
+#include <memory>
+#include <vector>
+
+namespace MpmSim
+{
+
+// Preconditioner which applies a multigrid V cycle. Each level smooths with damped Jacobi iterations
+// using the diagonal preconditioner, and works out a correction from the next coarsest level, whose
+// matrix is built on the fine grid's next coarse grid in the same way as the fine one. The residuals are
+// restricted and the corrections prolongated by evaluating the coarse grid's shape functions at the
+// finer grid's nodes, and the collision projections get applied at every level. The pre and post
+// smoothing are the same, so the cycle's a symmetric operator like the conjugate residuals solver needs:
+class MultigridPreconditioner : public ProceduralMatrix
+{
+public:
+
+	// the coarse grids need their nodes collided, and their stiffness cached if the fine grid's has been,
+	// before this gets constructed:
+	MultigridPreconditioner( const Grid& g,
+							 const Grid::ImplicitUpdateMatrix& implicitMatrix,
+							 const ConstitutiveModel& constitutiveModel,
+							 const CollisionObject::CollisionObjectSet& collisionObjects,
+							 const ForceField::ForceFieldSet& fields,
+							 float timeStep );
+
+	virtual ~MultigridPreconditioner();
+
+	// the V cycle only gives us the inverse, so this throws:
+	virtual void multVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void subspaceProject( Eigen::VectorXf& x ) const;
+
+private:
+
+	// grid, matrix, smoother and transfer operators for each level:
+	class Level;
+
+	// sparse matrix for moving vectors between levels, with a paralell product:
+	class Transfer;
+	class TransferMultiplier;
+
+	// approximately solves level l's system for b:
+	void vCycle( size_t l, const Eigen::VectorXf& b, Eigen::VectorXf& x ) const;
+
+	// estimates the largest eigenvalue of the level's matrix with the diagonal divided out, so
+	// we can choose a damping factor for the smoothing that doesn't blow up:
+	float maxEigenvalue( const Level& level ) const;
+
+	// one damped jacobi iteration for level's system. zeroGuess says x is zero, so we don't
+	// need to multiply by the matrix to get the residual:
+	void smooth( const Level& level, const Eigen::VectorXf& b, Eigen::VectorXf& x, bool zeroGuess ) const;
+
+	std::vector< std::unique_ptr<Level> > m_levels;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_MULTIGRIDPRECONDITIONER_H
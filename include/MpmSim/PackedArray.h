@@ -0,0 +1,78 @@
+#ifndef MPMSIM_PACKEDARRAY_H
+#define MPMSIM_PACKEDARRAY_H
+
+#include <vector>
+#include <cstddef>
+
+namespace MpmSim
+{
+
+// Array of floats, Eigen vectors or Eigen matrices stored component-wise in blocks of BlockSize
+// elements (AoSoA), so element i's component c lives at component( i / BlockSize, c )[ i % BlockSize ].
+// Blocks start on 32 byte boundaries, so SIMD code can load the same component for 8 elements with
+// a single aligned AVX load. The last block is padded out with zeros.
+template< typename T >
+class PackedArray
+{
+public:
+
+	enum
+	{
+		BlockSize = 8,
+		Components = sizeof( T ) / sizeof( float ),
+		Alignment = 32
+	};
+
+	PackedArray();
+	PackedArray( size_t n );
+	PackedArray( const PackedArray& other );
+	PackedArray& operator=( const PackedArray& other );
+
+	size_t size() const;
+	
+	// number of blocks the elements occupy:
+	size_t numBlocks() const;
+
+	void resize( size_t n );
+	void clear();
+	void push_back( const T& value );
+
+	// element access. These copy the components in and out, so there's no non-const reference version:
+	T get( size_t i ) const;
+	void set( size_t i, const T& value );
+
+	// aligned pointer to BlockSize values of component c for the elements in the specified block:
+	float* component( size_t block, int c );
+	const float* component( size_t block, int c ) const;
+
+	// copy elements src[*begin], src[*(begin+1)] ... into elements 0, 1... of this array, resizing it to fit.
+	// This lets batch kernels pack up a list of particles from an AoS variable:
+	template< class IndexIterator >
+	void gather( const std::vector<T>& src, IndexIterator begin, IndexIterator end );
+
+	// the reverse of gather(), which copies elements 0, 1... back to dst[*begin], dst[*(begin+1)]...:
+	template< class IndexIterator >
+	void scatter( std::vector<T>& dst, IndexIterator begin, IndexIterator end ) const;
+
+private:
+
+	// make room for the specified number of blocks, keeping the existing elements:
+	void reserveBlocks( size_t numBlocks );
+
+	void updateDataPointer();
+
+	// m_data is m_storage's first 32 byte aligned float:
+	std::vector<float> m_storage;
+	float* m_data;
+	size_t m_size;
+	
+	// number of blocks we've got room for:
+	size_t m_blockCapacity;
+
+};
+
+} // namespace MpmSim
+
+#include "PackedArray.inl"
+
+#endif // MPMSIM_PACKEDARRAY_H
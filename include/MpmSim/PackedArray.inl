@@ -0,0 +1,197 @@
+#ifndef MPMSIM_PACKEDARRAY_INL
+#define MPMSIM_PACKEDARRAY_INL
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace MpmSim
+{
+
+template< typename T >
+PackedArray<T>::PackedArray() : m_data( 0 ), m_size( 0 ), m_blockCapacity( 0 )
+{
+}
+
+template< typename T >
+PackedArray<T>::PackedArray( size_t n ) : m_data( 0 ), m_size( 0 ), m_blockCapacity( 0 )
+{
+	resize( n );
+}
+
+template< typename T >
+PackedArray<T>::PackedArray( const PackedArray& other )
+	: m_storage( other.m_storage ), m_data( 0 ), m_size( other.m_size ), m_blockCapacity( other.m_blockCapacity )
+{
+	updateDataPointer();
+
+	// the copy's alignment offset into the storage can differ from the original's:
+	if( m_blockCapacity )
+	{
+		std::copy( other.m_data, other.m_data + m_blockCapacity * BlockSize * Components, m_data );
+	}
+}
+
+template< typename T >
+PackedArray<T>& PackedArray<T>::operator=( const PackedArray& other )
+{
+	if( this != &other )
+	{
+		PackedArray copy( other );
+		m_storage.swap( copy.m_storage );
+		m_size = copy.m_size;
+		m_blockCapacity = copy.m_blockCapacity;
+		updateDataPointer();
+	}
+	return *this;
+}
+
+template< typename T >
+inline size_t PackedArray<T>::size() const
+{
+	return m_size;
+}
+
+template< typename T >
+inline size_t PackedArray<T>::numBlocks() const
+{
+	return ( m_size + BlockSize - 1 ) / BlockSize;
+}
+
+template< typename T >
+void PackedArray<T>::resize( size_t n )
+{
+	reserveBlocks( ( n + BlockSize - 1 ) / BlockSize );
+
+	// zero any elements we've dropped off the end of the last block, so the padding stays zero:
+	for( size_t i = n; i < m_size && i < m_blockCapacity * BlockSize; ++i )
+	{
+		for( int c=0; c < Components; ++c )
+		{
+			component( i / BlockSize, c )[ i % BlockSize ] = 0;
+		}
+	}
+	m_size = n;
+}
+
+template< typename T >
+void PackedArray<T>::clear()
+{
+	resize( 0 );
+}
+
+template< typename T >
+void PackedArray<T>::push_back( const T& value )
+{
+	size_t i = m_size;
+	if( i == m_blockCapacity * BlockSize )
+	{
+		// grow geometrically so pushing back particles one by one doesn't keep copying:
+		reserveBlocks( std::max( m_blockCapacity + 1, 2 * m_blockCapacity ) );
+	}
+	m_size = i + 1;
+	set( i, value );
+}
+
+template< typename T >
+inline T PackedArray<T>::get( size_t i ) const
+{
+	T value;
+	float* v = reinterpret_cast<float*>( &value );
+	const float* block = m_data + ( i / BlockSize ) * BlockSize * Components + ( i % BlockSize );
+	for( int c=0; c < Components; ++c )
+	{
+		v[c] = block[ c * BlockSize ];
+	}
+	return value;
+}
+
+template< typename T >
+inline void PackedArray<T>::set( size_t i, const T& value )
+{
+	const float* v = reinterpret_cast<const float*>( &value );
+	float* block = m_data + ( i / BlockSize ) * BlockSize * Components + ( i % BlockSize );
+	for( int c=0; c < Components; ++c )
+	{
+		block[ c * BlockSize ] = v[c];
+	}
+}
+
+template< typename T >
+inline float* PackedArray<T>::component( size_t block, int c )
+{
+	return m_data + ( block * Components + c ) * BlockSize;
+}
+
+template< typename T >
+inline const float* PackedArray<T>::component( size_t block, int c ) const
+{
+	return m_data + ( block * Components + c ) * BlockSize;
+}
+
+template< typename T >
+template< class IndexIterator >
+void PackedArray<T>::gather( const std::vector<T>& src, IndexIterator begin, IndexIterator end )
+{
+	resize( 0 );
+	resize( end - begin );
+	size_t i = 0;
+	for( IndexIterator it = begin; it != end; ++it, ++i )
+	{
+		set( i, src[ *it ] );
+	}
+}
+
+template< typename T >
+template< class IndexIterator >
+void PackedArray<T>::scatter( std::vector<T>& dst, IndexIterator begin, IndexIterator end ) const
+{
+	if( size_t( end - begin ) > m_size )
+	{
+		throw std::runtime_error( "PackedArray::scatter(): index range is longer than the array" );
+	}
+	size_t i = 0;
+	for( IndexIterator it = begin; it != end; ++it, ++i )
+	{
+		dst[ *it ] = get( i );
+	}
+}
+
+template< typename T >
+void PackedArray<T>::reserveBlocks( size_t numBlocks )
+{
+	if( numBlocks <= m_blockCapacity && m_data )
+	{
+		return;
+	}
+
+	// allocate with enough slack to line the data up on an aligned address:
+	std::vector<float> storage( numBlocks * BlockSize * Components + Alignment / sizeof( float ), 0.0f );
+	std::vector<float> oldStorage;
+	oldStorage.swap( m_storage );
+	float* oldData = m_data;
+
+	m_storage.swap( storage );
+	updateDataPointer();
+	if( oldData )
+	{
+		std::copy( oldData, oldData + m_blockCapacity * BlockSize * Components, m_data );
+	}
+	m_blockCapacity = numBlocks;
+}
+
+template< typename T >
+void PackedArray<T>::updateDataPointer()
+{
+	if( m_storage.empty() )
+	{
+		m_data = 0;
+		return;
+	}
+	size_t address = reinterpret_cast<size_t>( &m_storage[0] );
+	size_t offset = ( Alignment - address % Alignment ) % Alignment;
+	m_data = &m_storage[0] + offset / sizeof( float );
+}
+
+} // namespace MpmSim
+
+#endif // MPMSIM_PACKEDARRAY_INL
@@ -0,0 +1,48 @@
+#ifndef MPMSIM_PIPELINEDCONJUGATERESIDUALS_H
+#define MPMSIM_PIPELINEDCONJUGATERESIDUALS_H
+
+#include "LinearSolver.h"
+#include "TerminationCriterion.h"
+
+namespace MpmSim
+{
+
+// Does the same preconditioned conjugate residuals iterations as ConjugateResiduals, but rearranged
+// along the lines of Ghysels and Vanroose's pipelined conjugate gradients, so each iteration has a
+// single synchronisation point instead of one after every dot product. It keeps a few more vectors
+// up to date with recurrences, so the dot products it needs can all be worked out in one parallel
+// pass over the vectors while the matrix multiply for the next iteration is running. The termination
+// criterion gets called once both have finished. The recurrences drift further from the true residual
+// than the plain solver's in single precision, so it recomputes them from scratch every now and then,
+// and before stopping, which costs a few extra matrix multiplies per solve. That means it's only
+// worth it when the reductions are what's holding the solve up:
+class PipelinedConjugateResiduals : public LinearSolver
+{
+public:
+
+	PipelinedConjugateResiduals( TerminationCriterion& terminationCriterion, const ProceduralMatrix* preconditioner = 0 );
+
+	virtual void operator()(
+		const ProceduralMatrix& mat,
+		const Eigen::VectorXf& rhs,
+		Eigen::VectorXf& x,
+		Debug* d=0 ) const;
+
+private:
+
+	// tbb functors for the fused dot products and the multiply running alongside them:
+	class Reductions;
+	class Reducer;
+	class Multiplier;
+
+	// applies the preconditioner if we've got one, or copies x into result otherwise:
+	void precondition( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	TerminationCriterion& m_terminationCriterion;
+	const ProceduralMatrix* m_preconditioner;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_PIPELINEDCONJUGATERESIDUALS_H
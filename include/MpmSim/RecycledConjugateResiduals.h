@@ -0,0 +1,63 @@
+#ifndef MPMSIM_RECYCLEDCONJUGATERESIDUALS_H
+#define MPMSIM_RECYCLEDCONJUGATERESIDUALS_H
+
+#include "LinearSolver.h"
+#include "TerminationCriterion.h"
+
+#include <vector>
+
+namespace MpmSim
+{
+
+// Preconditioned conjugate residuals, deflated by a handful of vectors recycled from an earlier solve
+// with a similar matrix, along the lines of de Sturler's GCRO-DR and Wang, de Sturler and Paulino's
+// recycling MINRES. The residual's kept orthogonal to A times the recycled vectors in the
+// preconditioner's inner product, so the modes they span get solved for up front, and the iterations
+// only have to deal with the rest. While it's iterating it collects harmonic Ritz vectors for the
+// smallest eigenvalues of the preconditioned matrix from the recycled vectors and its search
+// directions, and it hands those back in recycleSpace for the next solve. Those are the slow modes
+// plain conjugate residuals spends most of its time on.
+//
+// Each solve costs an extra matrix multiply and preconditioner application per recycled vector, and
+// it keeps about twelve times recycleSize vectors around:
+class RecycledConjugateResiduals : public LinearSolver
+{
+public:
+
+	// recycleSpace holds the vectors to deflate with going in, which don't need to be orthogonal or
+	// anything, and the ones harvested from this solve coming out:
+	RecycledConjugateResiduals(
+		TerminationCriterion& terminationCriterion,
+		std::vector<Eigen::VectorXf>& recycleSpace,
+		int recycleSize,
+		const ProceduralMatrix* preconditioner = 0
+	);
+
+	virtual void operator()(
+		const ProceduralMatrix& mat,
+		const Eigen::VectorXf& rhs,
+		Eigen::VectorXf& x,
+		Debug* d=0 ) const;
+
+private:
+
+	// A set of vectors, w, along with Aw and P^-1 Aw:
+	class Space;
+
+	// applies the preconditioner if we've got one, or copies x into result otherwise:
+	void precondition( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	// replaces the vectors in space with the recycleSize harmonic Ritz vectors it spans with the
+	// smallest harmonic Ritz values:
+	void compress( Space& space ) const;
+
+	TerminationCriterion& m_terminationCriterion;
+	std::vector<Eigen::VectorXf>& m_recycleSpace;
+	int m_recycleSize;
+	const ProceduralMatrix* m_preconditioner;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_RECYCLEDCONJUGATERESIDUALS_H
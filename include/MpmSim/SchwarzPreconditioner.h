@@ -0,0 +1,87 @@
+#ifndef MPMSIM_SCHWARZPRECONDITIONER_H
+#define MPMSIM_SCHWARZPRECONDITIONER_H
+
+#include "tbb/enumerable_thread_specific.h"
+
+#include "ProceduralMatrix.h"
+#include "BlockDiagonalPreconditioner.h"
+#include "Grid.h"
+
+#include <memory>
+#include <vector>
+
+namespace MpmSim
+{
+
+// Additive Schwarz preconditioner, which sums approximate solutions on overlapping subdomains of the
+// grid. Each subdomain is a cube of the grid's processing voxels, and gets the nodes its particles'
+// stencils touch. The local matrices are the implicit update matrix restricted to those nodes, but
+// with only the subdomain's own particles contributing stiffness, so each subdomain can multiply by
+// its matrix without touching anybody else's particles. They're solved with a fixed number of damped
+// block jacobi iterations from zero, and the overlapping nodes are weighted so they don't get counted
+// more than once, so the whole thing is a fixed symmetric operator, like the conjugate residuals
+// solver needs:
+class SchwarzPreconditioner : public ProceduralMatrix
+{
+public:
+
+	// subdomainSize is the number of processing voxels along each side of a subdomain. The grid's nodes
+	// need to have been collided already, and blockDiagonal has to outlive the preconditioner:
+	SchwarzPreconditioner( const Grid& g,
+						   const BlockDiagonalPreconditioner& blockDiagonal,
+						   const ConstitutiveModel& constitutiveModel,
+						   const CollisionObject::CollisionObjectSet& collisionObjects,
+						   float timeStep,
+						   int subdomainSize );
+
+	virtual ~SchwarzPreconditioner();
+
+	// the subdomain solves only give us the inverse, so this throws:
+	virtual void multVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	virtual void subspaceProject( Eigen::VectorXf& x ) const;
+
+private:
+
+	// particles, nodes and solution storage for one subdomain:
+	class Subdomain;
+
+	// tbb loops for working out the subdomains' nodes and damping, and doing their solves:
+	class SubdomainInitialiser;
+	class SubdomainSolver;
+
+	// multiplies x by subdomain s's local matrix. Both vectors have three entries per subdomain node:
+	void localMultiply( const Subdomain& s, const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+
+	// approximately solves subdomain s's system for the restriction of b, leaving the result in
+	// the subdomain's solution storage:
+	void localSolve( Subdomain& s, const Eigen::VectorXf& b ) const;
+
+	// applies the block diagonal preconditioner's inverse blocks to a subdomain vector:
+	void localJacobi( const Subdomain& s, const Eigen::VectorXf& r, Eigen::VectorXf& result ) const;
+
+	// largest eigenvalue of the subdomain's matrix with the diagonal blocks divided out:
+	float maxEigenvalue( const Subdomain& s ) const;
+
+	const Grid& m_g;
+	const BlockDiagonalPreconditioner& m_blockDiagonal;
+	const ConstitutiveModel& m_constitutiveModel;
+	float m_timeStep;
+
+	// collision projections for every node, which are the identity for nodes that haven't collided:
+	std::vector<Eigen::Matrix3f> m_projections;
+
+	std::vector< std::unique_ptr<Subdomain> > m_subdomains;
+
+	// grid sized scratch vectors for the local multiplies to put the input and force differentials in,
+	// one pair per thread:
+	typedef std::pair<Eigen::VectorXf, Eigen::VectorXf> Workspace;
+	mutable tbb::enumerable_thread_specific<Workspace> m_workspaces;
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_SCHWARZPRECONDITIONER_H
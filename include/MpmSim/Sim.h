@@ -23,6 +23,8 @@ class TestSimClass;
 namespace MpmSim
 {
 
+class Grid;
+
 class Sim
 {
 
@@ -37,15 +39,83 @@ public:
 		ConstitutiveModel& model,
 		const CollisionObject::CollisionObjectSet& collisionObjects,
 		const ForceField::ForceFieldSet& forceFields,
-		int dimension=3
+		int dimension=3,
+		bool sparseGrids=false
 	);
 	
+	// construct a sim with particles made of different materials. materials holds a material id for
+	// each particle, which gets stored in the "material" variable, and model is usually a
+	// ConstitutiveModelSet with a model for each material:
+	Sim(
+		const std::vector<Eigen::Vector3f>& x,
+		const std::vector<float>& masses,
+		const std::vector<int>& materials,
+		float gridSize,
+		const ShapeFunction& shapeFunction,
+		ConstitutiveModel& model,
+		const CollisionObject::CollisionObjectSet& collisionObjects,
+		const ForceField::ForceFieldSet& forceFields,
+		int dimension=3,
+		bool sparseGrids=false
+	);
+	
+	~Sim();
+	
 	// accessor for particle data:
 	MaterialPointData& particleData();
 
 	// complete a full simulation time step:
 	void advance( float timeStep, TerminationCriterion& terminationCriterion, LinearSolver::Debug* d = 0 );
 	
+	// caches per particle stiffness matrices for the implicit solves, trading memory for faster
+	// solver iterations. See Grid::setStiffnessCaching(). Off by default:
+	void setStiffnessCaching( bool cache );
+	bool getStiffnessCaching() const;
+	
+	// number of levels in the grids' multigrid preconditioners. See Grid::setMultigridLevels(). Defaults
+	// to 1, which means they use a block diagonal preconditioner instead:
+	void setMultigridLevels( int levels );
+	int getMultigridLevels() const;
+	
+	// lets the grids hang on to their preconditioners across time steps until the solves get this
+	// much slower. See Grid::setPreconditionerReuse(). Defaults to 0, which works them out every step:
+	void setPreconditionerReuse( float maxIterationGrowth );
+	float getPreconditionerReuse() const;
+	
+	// size of the subdomains in the grids' additive Schwarz preconditioners, in processing voxels. See
+	// Grid::setSchwarzSubdomainSize(). Defaults to 0, which uses the block diagonal preconditioner:
+	void setSchwarzSubdomainSize( int voxels );
+	int getSchwarzSubdomainSize() const;
+	
+	// number of Chebyshev iterations in the grids' preconditioners. See Grid::setChebyshevDegree().
+	// Defaults to 0, and anything one or less turns them off:
+	void setChebyshevDegree( int degree );
+	int getChebyshevDegree() const;
+	
+	// makes the grids use the pipelined conjugate residuals solver. See Grid::setPipelinedSolve(). Off
+	// by default:
+	void setPipelinedSolve( bool pipelined );
+	bool getPipelinedSolve() const;
+	
+	// how the grids guess the velocities they start their implicit solves from. CentreOfMassGuess
+	// sets every node to the body's centre of mass velocity, or the velocity of whatever it's hit,
+	// PreviousVelocityGuess starts from the velocities the grid solved for on the previous time step,
+	// and ExtrapolatedVelocityGuess extrapolates linearly from the previous two. See
+	// Grid::setInitialGuess():
+	enum InitialGuess
+	{
+		CentreOfMassGuess,
+		PreviousVelocityGuess,
+		ExtrapolatedVelocityGuess
+	};
+	void setInitialGuess( InitialGuess guess );
+	InitialGuess getInitialGuess() const;
+	
+	// number of approximate eigenvectors the grids carry over from one solve to the next to deflate
+	// it with. See Grid::setRecycleSize():
+	void setRecycleSize( int size );
+	int getRecycleSize() const;
+	
 	typedef std::vector<int> IndexList;
 	typedef IndexList::iterator IndexIterator;
 	typedef IndexList::const_iterator ConstIndexIterator;
@@ -56,12 +126,37 @@ public:
 	
 private:
 	
+	// the sim owns its grids, so no copying:
+	Sim( const Sim& );
+	Sim& operator=( const Sim& );
+	
+	// sets up the particle variables and the grids. Called by the constructors:
+	void initialize( const std::vector<Eigen::Vector3f>& x, const std::vector<float>& masses );
+	
 	// partition the sim into contiguous bodies:
 	void calculateBodies();
 	
+	// hand the grids from the last time step over to the bodies that have just been calculated:
+	void assignGrids( const std::vector<size_t>& oldBodySizes );
+	
+	// update the grid for body b and transfer its new velocities and deformation gradients back
+	// onto the particles. Returns false if the solve was cancelled:
+	bool advanceBody( size_t b, float timeStep, TerminationCriterion& termination, LinearSolver::Debug* d );
+	
+	// runs advanceBody() on lots of bodies at once:
+	class BodyAdvancer;
+	
+	// orders bodies by decreasing size:
+	class BodySizeComparator;
+	
 	// material point data for all the particles
 	MaterialPointData m_particleData;
 	
+	// handles to the particle variables advance() uses:
+	MaterialPointData::Handle<Eigen::Vector3f> m_particleX;
+	MaterialPointData::Handle<Eigen::Vector3f> m_particleV;
+	MaterialPointData::Handle<float> m_particleM;
+	
 	// a list of particles with no neighbours, which are treated in isolation:
 	IndexList m_ballisticParticles;
 
@@ -70,6 +165,15 @@ private:
 	// are spatially sorted so contiguous particles are in the same voxel:
 	std::vector< IndexList > m_bodies;
 	
+	// background grids for each body. These stick around between time steps so we can update
+	// them rather than building them from scratch. Entries are null for bodies that haven't
+	// got a grid yet:
+	std::vector< Grid* > m_grids;
+	
+	// which body each particle was in after the last call to calculateBodies(), or -1 for
+	// ballistic particles. Used to work out which grid goes with which body:
+	std::vector<int> m_particleBodies;
+	
 	// computational grid cell size
 	float m_gridSize;
 	
@@ -88,6 +192,33 @@ private:
 	// dimension:
 	int m_dimension;
 	
+	// use sparse block grids instead of dense bounding box grids:
+	bool m_sparseGrids;
+	
+	// cache stiffness matrices in the grids' implicit solves:
+	bool m_stiffnessCaching;
+	
+	// multigrid levels for the implicit solves:
+	int m_multigridLevels;
+	
+	// how much slower the solves can get before the grids work their preconditioners out again:
+	float m_preconditionerReuse;
+	
+	// subdomain size for the grids' Schwarz preconditioners:
+	int m_schwarzSubdomainSize;
+	
+	// chebyshev iterations for the grids' preconditioners:
+	int m_chebyshevDegree;
+	
+	// pipelined solves for the grids:
+	bool m_pipelinedSolve;
+	
+	// initial guess for the grids' solves:
+	InitialGuess m_initialGuess;
+	
+	// size of the grids' recycled deflation spaces:
+	int m_recycleSize;
+	
 	// testing:
 	friend class MpmSimTest::TestSimClass;
 
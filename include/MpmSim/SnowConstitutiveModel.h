@@ -19,8 +19,17 @@ public:
 	
 	virtual void setParticles( MaterialPointData& p );
 	
+	// When this is on, particles which are inside the yield limits get their polar decomposition
+	// by iterating from the previous step's rotation, which usually converges in one or two iterations
+	// and is a lot cheaper than an SVD. Particles that need clamping still get the SVD. Off by default:
+	void setWarmStartPolarDecomposition( bool warmStart );
+	bool getWarmStartPolarDecomposition() const;
+	
 	// update deformation at particle p:
 	virtual void updateParticleData();
+	
+	// update deformation for a subset of the particles:
+	virtual void updateParticleData( const std::vector<int>& particleInds );
 
 	// energy density for particle p:
 	virtual float energyDensity( size_t p ) const;
@@ -30,9 +39,39 @@ public:
 	
 	// computes the change in dEnergyDensitydF when you change F by dFp:
 	virtual Eigen::Matrix3f dEdFDifferential( const Eigen::Matrix3f& dFp, size_t p ) const;
+	
+	// batch versions, which only check for nans once per batch:
+	virtual void dEnergyDensitydF( std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const;
+	virtual void dEdFDifferential( const Eigen::Matrix3f* dFp, std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const;
 
 private:
 
+	// applies plasticity and hardening to a single particle, given the singular value decomposition
+	// F = U * diag( singularValues ) * V^T of its deformation gradient:
+	void updateParticle( size_t p, const Eigen::Matrix3f& U, Eigen::Vector3f singularValues, const Eigen::Matrix3f& V );
+	
+	// tries updating particle p using a polar decomposition warm started from its stored rotation.
+	// Returns false without changing anything if the particle needs clamping or the iteration
+	// doesn't converge:
+	bool updateParticleWarmStart( size_t p );
+	
+	// stores the rotation R and stretch S from the polar decomposition of particle p's (clamped)
+	// deformation gradient, along with its determinant J, then updates Ginv and the hardening:
+	void setPolarDecomposition( size_t p, const Eigen::Matrix3f& R, const Eigen::Matrix3f& S, float J );
+	
+	// decomposes the deformation gradients for up to SvdKernels::BlockSize particles at once using
+	// SIMD, then calls updateParticle() on them. If warm starting's on, it only does this for the
+	// particles updateParticleWarmStart() fails on. If F's packed and the particles make up one of
+	// its blocks, the SIMD code reads them straight out of it:
+	void updateParticleBlock( const size_t* particles, int n );
+	
+	// classes for running updateParticleBlock() in paralell on all the particles or a list of them:
+	class ParticleUpdater;
+	class IndexedParticleUpdater;
+	
+	// dEnergyDensitydF() without the nan check:
+	Eigen::Matrix3f stress( size_t p ) const;
+	
 	static float matrixDoubleDot( const Eigen::Matrix3f& a, const Eigen::Matrix3f& b );
 	static Eigen::Matrix3f computeRdifferential( const Eigen::Matrix3f& dF, const Eigen::Matrix3f& R, const Eigen::Matrix3f& Ginv );
 	
@@ -45,16 +84,22 @@ private:
 	float m_mu;
 	float m_lambda;
 	
+	bool m_warmStartPolar;
+	
 	MaterialPointData* m_p;
 
-	std::vector<Eigen::Matrix3f>* m_particleF;
-	std::vector<Eigen::Matrix3f>* m_particleR;
-	std::vector<Eigen::Matrix3f>* m_particleFinvTrans;
-	std::vector<Eigen::Matrix3f>* m_particleGinv;
+	// resolves the handles below again if any of the variables have been reallocated:
+	virtual void refreshHandles();
+	
+	MaterialPointData::Handle<Eigen::Matrix3f> m_particleF;
+	MaterialPointData::Handle<Eigen::Matrix3f> m_particleFplastic;
+	MaterialPointData::Handle<Eigen::Matrix3f> m_particleR;
+	MaterialPointData::Handle<Eigen::Matrix3f> m_particleFinvTrans;
+	MaterialPointData::Handle<Eigen::Matrix3f> m_particleGinv;
 	
-	std::vector<float>* m_particleJ;
-	std::vector<float>* m_particleMu;
-	std::vector<float>* m_particleLambda;
+	MaterialPointData::Handle<float> m_particleJ;
+	MaterialPointData::Handle<float> m_particleMu;
+	MaterialPointData::Handle<float> m_particleLambda;
 	
 };
 
@@ -12,6 +12,7 @@ class SquareMagnitudeTermination : public TerminationCriterion
 public:
 
 	SquareMagnitudeTermination( int maxIters, float tolError );
+	virtual TerminationCriterion* clone() const;
 	virtual void init( const ProceduralMatrix& A, const Eigen::VectorXf& b );
 	virtual bool operator()( Eigen::VectorXf& r, int iterationNumber ) const;
 	virtual bool cancelled() const;
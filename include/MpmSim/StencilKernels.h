@@ -0,0 +1,61 @@
+#ifndef MPMSIM_STENCILKERNELS_H
+#define MPMSIM_STENCILKERNELS_H
+
+#include <Eigen/Dense>
+
+namespace MpmSim
+{
+
+// Kernels for transferring quantities between particles and a dense grid through a 4 node wide
+// shape function stencil. Each row of a stencil is 4 contiguous grid nodes, so the SSE and AVX2
+// versions process whole rows at a time. Use best() to get the fastest version the cpu supports.
+class StencilKernels
+{
+public:
+
+	virtual ~StencilKernels() {}
+
+	// A 4x4 or 4x4x4 stencil on a dense grid. weights points at 24 floats laid out like the grid's
+	// shape function cache: four weights along x, y and z, then four derivatives along x, y and z.
+	// The stencil's nodes have indices base + i + j * rowStride + k * sliceStride, with k going up
+	// to numSlices - 1:
+	struct Stencil
+	{
+		const float* weights;
+		int base;
+		int rowStride;
+		int sliceStride;
+		int numSlices;
+	};
+
+	// masses[n] += mass * w_n and momenta[3n...3n+2] += w_n * momentum for all the stencil nodes:
+	virtual void splatMassMomentum( const Stencil& s, float mass, const Eigen::Vector3f& momentum, float* masses, float* momenta ) const = 0;
+
+	// forces[3n...3n+2] -= forceMatrix * dw_n for all the stencil nodes, where dw_n is the weight
+	// gradient as returned by Grid::ShapeFunctionIterator::dw():
+	virtual void splatForce( const Stencil& s, const Eigen::Matrix3f& forceMatrix, float* forces ) const = 0;
+
+	// returns the sum of x[3n...3n+2] * dw_n^T over all the stencil nodes:
+	virtual Eigen::Matrix3f gatherGradient( const Stencil& s, const float* x ) const = 0;
+
+	// returns the sum of w_n * x[3n...3n+2] over all the stencil nodes:
+	virtual Eigen::Vector3f gatherValue( const Stencil& s, const float* x ) const = 0;
+
+	enum Type
+	{
+		Scalar,
+		SSE,
+		AVX2
+	};
+
+	// returns the kernels of the specified type, or zero if this cpu can't run them:
+	static const StencilKernels* kernels( Type type );
+
+	// returns the fastest kernels this cpu can run:
+	static const StencilKernels& best();
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_STENCILKERNELS_H
@@ -0,0 +1,86 @@
+#ifndef MPMSIM_SVD3_H
+#define MPMSIM_SVD3_H
+
+#include <Eigen/Dense>
+
+#include <cmath>
+
+namespace MpmSim
+{
+
+// Closed form 3x3 singular value decomposition, after McAdams et al. 2011, "Computing the Singular
+// Value Decomposition of 3x3 matrices with minimal branching and elementary floating point operations".
+// It does a fixed number of Jacobi sweeps on A^T A with approximate Givens rotations accumulated
+// in a quaternion, sorts the singular values, then does a Givens QR decomposition of A V to get U.
+//
+// Unlike Eigen::JacobiSVD, U and V are always proper rotations. If det( A ) < 0 the smallest singular
+// value comes out negative instead, so U V^T is the rotation from the polar decomposition of A.
+// Singular values are sorted by decreasing magnitude.
+//
+// The algorithm has no data dependent branches, so it's written as a template on the scalar type and
+// can be run on SIMD vectors of matrices as well as on single floats. Real needs the arithmetic operators,
+// comparison operators returning a mask type, construction from a float and the svdSelect(), svdRsqrt(),
+// svdSqrt(), svdAbs() and svdMax() functions below. Matrices are stored row major.
+template< typename Real >
+class Svd3
+{
+public:
+
+	static void decompose( const Real* a, Real* u, Real* sigma, Real* v );
+
+private:
+
+	// applies one Jacobi rotation to the symmetric matrix s, in the plane of its first two rows and columns,
+	// then cycles the rows and columns round for the next one. x, y and z index the quaternion components
+	// corresponding to the current first, second and third rows. They're template parameters so q can
+	// live in registers:
+	template< int x, int y, int z >
+	static void jacobiConjugation( Real& s11, Real& s21, Real& s22, Real& s31, Real& s32, Real& s33, Real* q );
+
+	// computes an approximate Givens rotation quaternion ( ch, sh ) for zeroing a12 in [ a11 a12 ; a12 a22 ]:
+	static void approximateGivensQuaternion( const Real& a11, const Real& a12, const Real& a22, Real& ch, Real& sh );
+
+	// computes a Givens rotation quaternion for zeroing a2 in [ a1 ; a2 ], leaving a non negative a1:
+	static void qrGivensQuaternion( const Real& a1, const Real& a2, Real& ch, Real& sh );
+
+	// swaps x and y if c is set:
+	static void condSwap( const typename Real::Mask& c, Real& x, Real& y );
+
+	// swaps x and -y if c is set:
+	static void condNegSwap( const typename Real::Mask& c, Real& x, Real& y );
+
+	static void quaternionToMatrix( const Real* q, Real* m );
+
+	static void multiply( const Real* a, const Real* b, Real* result );
+
+};
+
+// Adapts float to the interface Svd3 needs:
+struct SvdFloat
+{
+	typedef bool Mask;
+	SvdFloat() {}
+	SvdFloat( float x ) : v( x ) {}
+	float v;
+};
+
+inline SvdFloat operator+( const SvdFloat& a, const SvdFloat& b ) { return a.v + b.v; }
+inline SvdFloat operator-( const SvdFloat& a, const SvdFloat& b ) { return a.v - b.v; }
+inline SvdFloat operator*( const SvdFloat& a, const SvdFloat& b ) { return a.v * b.v; }
+inline SvdFloat operator-( const SvdFloat& a ) { return -a.v; }
+inline bool operator<( const SvdFloat& a, const SvdFloat& b ) { return a.v < b.v; }
+inline bool operator>( const SvdFloat& a, const SvdFloat& b ) { return a.v > b.v; }
+inline SvdFloat svdSelect( bool c, const SvdFloat& a, const SvdFloat& b ) { return c ? a : b; }
+inline SvdFloat svdRsqrt( const SvdFloat& x ) { return 1.0f / sqrtf( x.v ); }
+inline SvdFloat svdSqrt( const SvdFloat& x ) { return sqrtf( x.v ); }
+inline SvdFloat svdAbs( const SvdFloat& x ) { return fabsf( x.v ); }
+inline SvdFloat svdMax( const SvdFloat& a, const SvdFloat& b ) { return a.v > b.v ? a : b; }
+
+// Decomposes a = u * diag( sigma ) * v^T using Svd3:
+void svd3( const Eigen::Matrix3f& a, Eigen::Matrix3f& u, Eigen::Vector3f& sigma, Eigen::Matrix3f& v );
+
+} // namespace MpmSim
+
+#include "Svd3.inl"
+
+#endif // MPMSIM_SVD3_H
@@ -0,0 +1,262 @@
+#ifndef MPMSIM_SVD3_INL
+#define MPMSIM_SVD3_INL
+
+namespace MpmSim
+{
+
+template< typename Real >
+void Svd3<Real>::decompose( const Real* a, Real* u, Real* sigma, Real* v )
+{
+	// symmetric matrix A^T A. We only need the lower triangle:
+	Real s11 = a[0] * a[0] + a[3] * a[3] + a[6] * a[6];
+	Real s21 = a[1] * a[0] + a[4] * a[3] + a[7] * a[6];
+	Real s22 = a[1] * a[1] + a[4] * a[4] + a[7] * a[7];
+	Real s31 = a[2] * a[0] + a[5] * a[3] + a[8] * a[6];
+	Real s32 = a[2] * a[1] + a[5] * a[4] + a[8] * a[7];
+	Real s33 = a[2] * a[2] + a[5] * a[5] + a[8] * a[8];
+
+	// diagonalize it with Jacobi sweeps, accumulating the rotations in the quaternion q = ( x, y, z, w ).
+	// Four sweeps leaves the odd random matrix with errors around 1.e-2 when the smaller singular values
+	// are close, but five gets everything down to single precision:
+	Real q[4] = { Real( 0.0f ), Real( 0.0f ), Real( 0.0f ), Real( 1.0f ) };
+	for( int i=0; i < 5; ++i )
+	{
+		jacobiConjugation<0, 1, 2>( s11, s21, s22, s31, s32, s33, q );
+		jacobiConjugation<1, 2, 0>( s11, s21, s22, s31, s32, s33, q );
+		jacobiConjugation<2, 0, 1>( s11, s21, s22, s31, s32, s33, q );
+	}
+
+	// the approximate rotations drift slightly off unit length:
+	Real qNorm = svdRsqrt( q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3] );
+	for( int i=0; i < 4; ++i )
+	{
+		q[i] = q[i] * qNorm;
+	}
+	quaternionToMatrix( q, v );
+
+	// B = A V has orthogonal columns with lengths equal to the singular values:
+	Real b[9];
+	multiply( a, v, b );
+
+	// sort the columns by decreasing length, negating one of them on each swap to keep V a rotation:
+	Real rho1 = b[0] * b[0] + b[3] * b[3] + b[6] * b[6];
+	Real rho2 = b[1] * b[1] + b[4] * b[4] + b[7] * b[7];
+	Real rho3 = b[2] * b[2] + b[5] * b[5] + b[8] * b[8];
+
+	typename Real::Mask c = rho1 < rho2;
+	for( int i=0; i < 3; ++i )
+	{
+		condNegSwap( c, b[3 * i], b[3 * i + 1] );
+		condNegSwap( c, v[3 * i], v[3 * i + 1] );
+	}
+	condSwap( c, rho1, rho2 );
+
+	c = rho1 < rho3;
+	for( int i=0; i < 3; ++i )
+	{
+		condNegSwap( c, b[3 * i], b[3 * i + 2] );
+		condNegSwap( c, v[3 * i], v[3 * i + 2] );
+	}
+	condSwap( c, rho1, rho3 );
+
+	c = rho2 < rho3;
+	for( int i=0; i < 3; ++i )
+	{
+		condNegSwap( c, b[3 * i + 1], b[3 * i + 2] );
+		condNegSwap( c, v[3 * i + 1], v[3 * i + 2] );
+	}
+
+	// QR decompose B with three Givens rotations, so B = G1 G2 G3 R and U = G1 G2 G3. First one zeros b21:
+	Real ch, sh;
+	qrGivensQuaternion( b[0], b[3], ch, sh );
+	Real ca = Real( 1.0f ) - Real( 2.0f ) * sh * sh;
+	Real sa = Real( 2.0f ) * ch * sh;
+	Real r[9];
+	for( int j=0; j < 3; ++j )
+	{
+		r[j] = ca * b[j] + sa * b[3 + j];
+		r[3 + j] = -sa * b[j] + ca * b[3 + j];
+		r[6 + j] = b[6 + j];
+	}
+	Real g1[9] = {
+		ca, -sa, Real( 0.0f ),
+		sa, ca, Real( 0.0f ),
+		Real( 0.0f ), Real( 0.0f ), Real( 1.0f )
+	};
+
+	// second one zeros b31:
+	qrGivensQuaternion( r[0], r[6], ch, sh );
+	ca = Real( 1.0f ) - Real( 2.0f ) * sh * sh;
+	sa = Real( 2.0f ) * ch * sh;
+	for( int j=0; j < 3; ++j )
+	{
+		b[j] = ca * r[j] + sa * r[6 + j];
+		b[3 + j] = r[3 + j];
+		b[6 + j] = -sa * r[j] + ca * r[6 + j];
+	}
+	Real g2[9] = {
+		ca, Real( 0.0f ), -sa,
+		Real( 0.0f ), Real( 1.0f ), Real( 0.0f ),
+		sa, Real( 0.0f ), ca
+	};
+
+	// third one zeros b32:
+	qrGivensQuaternion( b[4], b[7], ch, sh );
+	ca = Real( 1.0f ) - Real( 2.0f ) * sh * sh;
+	sa = Real( 2.0f ) * ch * sh;
+	for( int j=0; j < 3; ++j )
+	{
+		r[j] = b[j];
+		r[3 + j] = ca * b[3 + j] + sa * b[6 + j];
+		r[6 + j] = -sa * b[3 + j] + ca * b[6 + j];
+	}
+	Real g3[9] = {
+		Real( 1.0f ), Real( 0.0f ), Real( 0.0f ),
+		Real( 0.0f ), ca, -sa,
+		Real( 0.0f ), sa, ca
+	};
+
+	Real g12[9];
+	multiply( g1, g2, g12 );
+	multiply( g12, g3, u );
+
+	sigma[0] = r[0];
+	sigma[1] = r[4];
+	sigma[2] = r[8];
+}
+
+template< typename Real >
+template< int x, int y, int z >
+inline void Svd3<Real>::jacobiConjugation( Real& s11, Real& s21, Real& s22, Real& s31, Real& s32, Real& s33, Real* q )
+{
+	Real ch, sh;
+	approximateGivensQuaternion( s11, s21, s22, ch, sh );
+
+	// ( ch, sh ) is already unit length, so this is a rotation through twice the half angle:
+	Real a = ch * ch - sh * sh;
+	Real b = Real( 2.0f ) * sh * ch;
+
+	// S = Q^T S Q:
+	Real t11 = s11, t21 = s21, t22 = s22, t31 = s31, t32 = s32;
+	s11 = a * ( a * t11 + b * t21 ) + b * ( a * t21 + b * t22 );
+	s21 = a * ( -b * t11 + a * t21 ) + b * ( -b * t21 + a * t22 );
+	s22 = -b * ( -b * t11 + a * t21 ) + a * ( -b * t21 + a * t22 );
+	s31 = a * t31 + b * t32;
+	s32 = -b * t31 + a * t32;
+
+	// accumulate the rotation:
+	Real tmp[3] = { q[0] * sh, q[1] * sh, q[2] * sh };
+	sh = sh * q[3];
+	q[0] = q[0] * ch;
+	q[1] = q[1] * ch;
+	q[2] = q[2] * ch;
+	q[3] = q[3] * ch;
+	q[z] = q[z] + sh;
+	q[3] = q[3] - tmp[z];
+	q[x] = q[x] + tmp[y];
+	q[y] = q[y] - tmp[x];
+
+	// cycle the rows and columns round for the next rotation:
+	t11 = s11; t21 = s21; t22 = s22; t31 = s31; t32 = s32;
+	Real t33 = s33;
+	s11 = t22;
+	s21 = t32;
+	s22 = t33;
+	s31 = t21;
+	s32 = t31;
+	s33 = t11;
+}
+
+template< typename Real >
+inline void Svd3<Real>::approximateGivensQuaternion( const Real& a11, const Real& a12, const Real& a22, Real& ch, Real& sh )
+{
+	// 3 + 2 sqrt( 2 ), cos( pi / 8 ) and sin( pi / 8 ):
+	const float gamma = 5.828427124f;
+	const float cStar = 0.923879532f;
+	const float sStar = 0.3826834323f;
+
+	ch = Real( 2.0f ) * ( a11 - a22 );
+	sh = a12;
+
+	// fall back on a rotation of pi / 4 when the half angle estimate is too big:
+	typename Real::Mask b = Real( gamma ) * sh * sh < ch * ch;
+	Real w = svdRsqrt( ch * ch + sh * sh );
+	ch = svdSelect( b, w * ch, Real( cStar ) );
+	sh = svdSelect( b, w * sh, Real( sStar ) );
+	
+	// don't rotate at all if a12 is already zero, so diagonal matrices come through exactly:
+	typename Real::Mask offDiagonal = Real( 0.0f ) < a12 * a12;
+	ch = svdSelect( offDiagonal, ch, Real( 1.0f ) );
+	sh = svdSelect( offDiagonal, sh, Real( 0.0f ) );
+}
+
+template< typename Real >
+inline void Svd3<Real>::qrGivensQuaternion( const Real& a1, const Real& a2, Real& ch, Real& sh )
+{
+	const float epsilon = 1.e-6f;
+	Real rho = svdSqrt( a1 * a1 + a2 * a2 );
+
+	sh = svdSelect( rho > Real( epsilon ), a2, Real( 0.0f ) );
+	ch = svdAbs( a1 ) + svdMax( rho, Real( epsilon ) );
+	condSwap( a1 < Real( 0.0f ), sh, ch );
+
+	Real w = svdRsqrt( ch * ch + sh * sh );
+	ch = ch * w;
+	sh = sh * w;
+}
+
+template< typename Real >
+inline void Svd3<Real>::condSwap( const typename Real::Mask& c, Real& x, Real& y )
+{
+	Real z = x;
+	x = svdSelect( c, y, x );
+	y = svdSelect( c, z, y );
+}
+
+template< typename Real >
+inline void Svd3<Real>::condNegSwap( const typename Real::Mask& c, Real& x, Real& y )
+{
+	Real z = -x;
+	x = svdSelect( c, y, x );
+	y = svdSelect( c, z, y );
+}
+
+template< typename Real >
+inline void Svd3<Real>::quaternionToMatrix( const Real* q, Real* m )
+{
+	Real qxx = q[0] * q[0];
+	Real qyy = q[1] * q[1];
+	Real qzz = q[2] * q[2];
+	Real qxz = q[0] * q[2];
+	Real qxy = q[0] * q[1];
+	Real qyz = q[1] * q[2];
+	Real qwx = q[3] * q[0];
+	Real qwy = q[3] * q[1];
+	Real qwz = q[3] * q[2];
+
+	m[0] = Real( 1.0f ) - Real( 2.0f ) * ( qyy + qzz );
+	m[1] = Real( 2.0f ) * ( qxy - qwz );
+	m[2] = Real( 2.0f ) * ( qxz + qwy );
+	m[3] = Real( 2.0f ) * ( qxy + qwz );
+	m[4] = Real( 1.0f ) - Real( 2.0f ) * ( qxx + qzz );
+	m[5] = Real( 2.0f ) * ( qyz - qwx );
+	m[6] = Real( 2.0f ) * ( qxz - qwy );
+	m[7] = Real( 2.0f ) * ( qyz + qwx );
+	m[8] = Real( 1.0f ) - Real( 2.0f ) * ( qxx + qyy );
+}
+
+template< typename Real >
+inline void Svd3<Real>::multiply( const Real* a, const Real* b, Real* result )
+{
+	for( int i=0; i < 3; ++i )
+	{
+		for( int j=0; j < 3; ++j )
+		{
+			result[3 * i + j] = a[3 * i] * b[j] + a[3 * i + 1] * b[3 + j] + a[3 * i + 2] * b[6 + j];
+		}
+	}
+}
+
+} // namespace MpmSim
+
+#endif // MPMSIM_SVD3_INL
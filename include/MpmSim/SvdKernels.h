@@ -0,0 +1,50 @@
+#ifndef MPMSIM_SVDKERNELS_H
+#define MPMSIM_SVDKERNELS_H
+
+namespace MpmSim
+{
+
+// Kernels for decomposing BlockSize 3x3 matrices at once with Svd3, one matrix per SIMD lane.
+// Matrices are stored like a block of a PackedArray<Eigen::Matrix3f>: component c of all the
+// matrices sits in a run of BlockSize floats starting at c * BlockSize, with the components in
+// Eigen's column major order. The kernels all do the same arithmetic, so every lane's result matches
+// what svd3() gives for that matrix. Use best() to get the fastest version the cpu supports.
+class SvdKernels
+{
+public:
+
+	enum
+	{
+		BlockSize = 8
+	};
+
+	virtual ~SvdKernels() {}
+
+	// a points at 9 * BlockSize floats, u and v at 9 * BlockSize and sigma at 3 * BlockSize. These
+	// don't need to be aligned:
+	virtual void decompose( const float* a, float* u, float* sigma, float* v ) const = 0;
+
+	enum Type
+	{
+		Scalar,
+		SSE,
+		AVX2
+	};
+
+	// returns the kernels of the specified type, or zero if this cpu can't run them:
+	static const SvdKernels* kernels( Type type );
+
+	// returns the fastest kernels this cpu can run:
+	static const SvdKernels& best();
+
+private:
+
+	// the AVX2 kernels live in SvdKernelsAvx2.cpp, which gets compiled for AVX2. This returns zero
+	// if we're not building for x86:
+	static const SvdKernels* avx2Kernels();
+
+};
+
+} // namespace MpmSim
+
+#endif // MPMSIM_SVDKERNELS_H
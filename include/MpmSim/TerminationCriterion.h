@@ -10,6 +10,15 @@ namespace MpmSim
 class TerminationCriterion
 {
 	public:
+		virtual ~TerminationCriterion() {}
+		
+		// makes a copy with its own solve state, so several solves can run at once. Criteria that
+		// can't be copied can leave this returning zero, in which case Sim does one solve at a time:
+		virtual TerminationCriterion* clone() const
+		{
+			return 0;
+		}
+		
 		virtual void init( const ProceduralMatrix& A, const Eigen::VectorXf& b ) = 0;
 		virtual bool operator()( Eigen::VectorXf& r, int iterationNumber ) const = 0;
 		virtual bool cancelled() const = 0;
@@ -13,6 +13,7 @@ class HoudiniSolveTermination : public SquareMagnitudeTermination
 public:
 
 	HoudiniSolveTermination( int maxIters, float tolError, UT_Interrupt* utInterrupt );
+	virtual TerminationCriterion* clone() const;
 	virtual bool operator()( Eigen::VectorXf& r, int iterationNumber ) const;
 	virtual bool cancelled() const;
 
@@ -43,6 +43,16 @@ private:
 	float hardening(fpreal t)		{ return evalFloat("hardening", 0, t); }
 	float compressiveStrength(fpreal t)	{ return evalFloat("compressiveStrength", 0, t); }
 	float tensileStrength(fpreal t)		{ return evalFloat("tensileStrength", 0, t); }
+	bool sparseGrid(fpreal t)		{ return evalInt("sparseGrid", 0, t) != 0; }
+	bool warmStartPolar(fpreal t)		{ return evalInt("warmStartPolar", 0, t) != 0; }
+	bool cacheStiffness(fpreal t)		{ return evalInt("cacheStiffness", 0, t) != 0; }
+	int multigridLevels(fpreal t)		{ return evalInt("multigridLevels", 0, t); }
+	float preconditionerReuse(fpreal t)	{ return evalFloat("preconditionerReuse", 0, t); }
+	int schwarzSubdomainSize(fpreal t)	{ return evalInt("schwarzSubdomainSize", 0, t); }
+	int chebyshevDegree(fpreal t)		{ return evalInt("chebyshevDegree", 0, t); }
+	bool pipelinedSolve(fpreal t)		{ return evalInt("pipelinedSolve", 0, t) != 0; }
+	int initialGuess(fpreal t)		{ return evalInt("initialGuess", 0, t); }
+	int recycleSize(fpreal t)		{ return evalInt("recycleSize", 0, t); }
 	
 	void findVDBs( 	const GU_Detail *detail, const GEO_PrimVDB *&pVdb, const GEO_PrimVDB *&vVdb );
 	
@@ -11,6 +11,9 @@ public:
 private:
 	static void testSolve();
 	static void testPreconditioner();
+	static void testChebyshevPreconditioner();
+	static void testPipelinedSolve();
+	static void testRecycledSolve();
 };
 
 }
@@ -1,6 +1,8 @@
 #ifndef MPMSIMTEST_TESTGRID_H
 #define MPMSIMTEST_TESTGRID_H
 
+#include "MpmSim/Grid.h"
+
 namespace MpmSimTest
 {
 
@@ -13,6 +15,7 @@ public:
 private:
 
 	class ImplicitUpdateRecord;
+	class SnowFixture;
 
 	static void testProcessingPartitions();
 	static void testSplatting();
@@ -21,6 +24,20 @@ private:
 	static void testImplicitUpdate();
 	static void testMovingGrid();
 	static void testDfiDxi();
+	static void testSparseGrid();
+	static void testGridUpdate();
+	static void testShapeFunctionCache();
+	static void testStencilKernels();
+	static void testStiffnessCache();
+	static void testMultigrid();
+	static void testBlockDiagonalPreconditioner();
+	static void testPreconditionerReuse();
+	static void testSchwarzPreconditioner();
+	static void testInitialGuess();
+	static void testRecycleSpace();
+	
+	// checks an updated grid matches one built from scratch:
+	static void checkUpdatedGrid( const MpmSim::Grid& g, MpmSim::MaterialPointData& d, const MpmSim::ShapeFunction& shapeFunction, bool sparse );
 };
 
 }
@@ -0,0 +1,18 @@
+#ifndef MPMSIMTEST_TESTMATERIALPOINTDATA_H
+#define MPMSIMTEST_TESTMATERIALPOINTDATA_H
+
+namespace MpmSimTest
+{
+
+class TestMaterialPointData
+{
+public:
+	static void test();
+private:
+	static void testPackedVariables();
+	static void testHandles();
+};
+
+}
+
+#endif
@@ -10,6 +10,9 @@ public:
 private:
 	static void testInitialization();
 	static void testTimestepAdvance();
+	static void testConcurrentBodies();
+	static void testMultipleMaterials();
+	static void testPackedDeformationGradients();
 };
 }
 
@@ -8,6 +8,13 @@ class TestSnowConstitutiveModel
 {
 public:
 	static void test();
+private:
+	static void testParticleSubset();
+	static void testPackedDeformationGradients();
+	static void testWarmStartPolar();
+	static void testBatchEvaluation();
+	static void testSvd3();
+	static void testSvdKernels();
 };
 
 }
@@ -0,0 +1,79 @@
+#include "MpmSim/BlockDiagonalPreconditioner.h"
+
+using namespace Eigen;
+using namespace MpmSim;
+
+BlockDiagonalPreconditioner::BlockDiagonalPreconditioner(const Grid& g,
+														 const Eigen::VectorXf& dfdxi,
+														 const CollisionObject::CollisionObjectSet& collisionObjects,
+														 float timeStep)
+	: m_g( g ), m_collisionObjects( collisionObjects )
+{
+	const VectorXf& masses = g.masses();
+	int numNodes = (int)masses.size();
+	m_blocks.resize( numNodes );
+	m_inverseBlocks.resize( numNodes );
+	for( int i=0; i < numNodes; ++i )
+	{
+		if( masses[i] == 0 )
+		{
+			// nothing here, so just leave the vector alone like the diagonal preconditioner:
+			m_blocks[i].setIdentity();
+			m_inverseBlocks[i].setIdentity();
+			continue;
+		}
+		
+		Matrix3f block = masses[i] * Matrix3f::Identity() - timeStep * timeStep * Eigen::Map<const Matrix3f>( &dfdxi[ 9 * i ] );
+		
+		// the force differentials are symmetric, but only up to rounding:
+		block = 0.5f * ( block + block.transpose() );
+		
+		if( !g.nodeCollided( i ) )
+		{
+			m_blocks[i] = block;
+			m_inverseBlocks[i] = block.inverse();
+			continue;
+		}
+		
+		// P * block * P is singular along the directions the collision removes, so fill those in with
+		// the mass to get something we can invert, then project the inverse back onto the subspace:
+		Matrix3f projection = g.collisionProjection( i, collisionObjects );
+		m_blocks[i] = projection * block * projection;
+		Matrix3f filled = m_blocks[i] + masses[i] * ( Matrix3f::Identity() - projection );
+		m_inverseBlocks[i] = projection * filled.inverse() * projection;
+	}
+}
+
+void BlockDiagonalPreconditioner::multVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	result.resize( x.size() );
+	for( size_t i=0; i < m_blocks.size(); ++i )
+	{
+		result.segment<3>( 3 * i ) = m_blocks[i] * x.segment<3>( 3 * i );
+	}
+}
+
+void BlockDiagonalPreconditioner::multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	result.resize( x.size() );
+	for( size_t i=0; i < m_inverseBlocks.size(); ++i )
+	{
+		result.segment<3>( 3 * i ) = m_inverseBlocks[i] * x.segment<3>( 3 * i );
+	}
+}
+
+void BlockDiagonalPreconditioner::subspaceProject( Eigen::VectorXf& x ) const
+{
+	for( int idx=0; idx < m_g.masses().size(); ++idx )
+	{
+		if( m_g.nodeCollided( idx ) )
+		{
+			x.segment<3>( 3 * idx ) = m_g.collisionProjection( idx, m_collisionObjects ) * x.segment<3>( 3 * idx );
+		}
+	}
+}
+
+const Eigen::Matrix3f& BlockDiagonalPreconditioner::inverseBlock( int idx ) const
+{
+	return m_inverseBlocks[idx];
+}
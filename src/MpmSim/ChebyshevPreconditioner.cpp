@@ -0,0 +1,141 @@
+#include "MpmSim/ChebyshevPreconditioner.h"
+
+#include <Eigen/Eigenvalues>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+using namespace Eigen;
+using namespace MpmSim;
+
+ChebyshevPreconditioner::ChebyshevPreconditioner( const ProceduralMatrix& mat, const ProceduralMatrix& inner, int degree, int lanczosSteps ) :
+	m_mat( mat ),
+	m_inner( inner ),
+	m_degree( std::max( degree, 1 ) ),
+	m_lanczosSteps( std::max( lanczosSteps, 1 ) ),
+	m_estimated( false ),
+	m_minEigenvalue( 1 ),
+	m_maxEigenvalue( 1 )
+{
+}
+
+void ChebyshevPreconditioner::multVector( const Eigen::VectorXf&, Eigen::VectorXf& ) const
+{
+	// that'd mean inverting the polynomial, and the solvers only ever need multInverseVector():
+	throw std::runtime_error( "ChebyshevPreconditioner::multVector() isn't supported" );
+}
+
+void ChebyshevPreconditioner::multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	VectorXf r = x;
+	m_mat.subspaceProject( r );
+	if( !m_estimated )
+	{
+		estimateEigenvalues( r );
+		if( !m_estimated )
+		{
+			// x didn't tell us anything, so just use the inner preconditioner until we get a better one:
+			m_inner.multInverseVector( r, result );
+			return;
+		}
+	}
+
+	// Chebyshev iteration for mat * result = x starting from zero, as in Saad's "Iterative Methods for
+	// Sparse Linear Systems", algorithm 12.1. The coefficients only depend on the eigenvalue bounds,
+	// so they're the same every time:
+	float theta = 0.5f * ( m_maxEigenvalue + m_minEigenvalue );
+	float delta = 0.5f * ( m_maxEigenvalue - m_minEigenvalue );
+	float sigma = theta / delta;
+	float rho = 1 / sigma;
+
+	VectorXf z;
+	m_inner.multInverseVector( r, z );
+	VectorXf d = z / theta;
+	result = d;
+
+	VectorXf ad;
+	for( int i=1; i < m_degree; ++i )
+	{
+		m_mat.multVector( d, ad );
+		r -= ad;
+		m_inner.multInverseVector( r, z );
+		float rhoNext = 1 / ( 2 * sigma - rho );
+		d = ( rhoNext * rho ) * d + ( 2 * rhoNext / delta ) * z;
+		rho = rhoNext;
+		result += d;
+	}
+}
+
+void ChebyshevPreconditioner::subspaceProject( Eigen::VectorXf& x ) const
+{
+	m_mat.subspaceProject( x );
+}
+
+float ChebyshevPreconditioner::minEigenvalue() const
+{
+	return m_minEigenvalue;
+}
+
+float ChebyshevPreconditioner::maxEigenvalue() const
+{
+	return m_maxEigenvalue;
+}
+
+void ChebyshevPreconditioner::estimateEigenvalues( const Eigen::VectorXf& b ) const
+{
+	// Run a few steps of preconditioned conjugate gradients on mat * x = b, and build the Lanczos
+	// tridiagonal matrix out of the step lengths as we go (see Saad, section 6.7.3). Its eigenvalues
+	// approach the extreme eigenvalues of inner^-1 * mat from the inside:
+	std::vector<float> alphas;
+	std::vector<float> betas;
+	VectorXf r = b;
+	VectorXf z;
+	m_inner.multInverseVector( r, z );
+	VectorXf p = z;
+	VectorXf ap;
+	float rz = r.dot( z );
+	for( int i=0; i < m_lanczosSteps && rz > 0; ++i )
+	{
+		m_mat.multVector( p, ap );
+		float pap = p.dot( ap );
+		if( pap <= 0 )
+		{
+			break;
+		}
+		alphas.push_back( rz / pap );
+		r -= alphas.back() * ap;
+		m_inner.multInverseVector( r, z );
+		float rzNext = r.dot( z );
+		betas.push_back( rzNext / rz );
+		p = z + betas.back() * p;
+		rz = rzNext;
+	}
+
+	if( alphas.empty() )
+	{
+		return;
+	}
+	m_estimated = true;
+
+	int n = (int)alphas.size();
+	MatrixXf t = MatrixXf::Zero( n, n );
+	for( int i=0; i < n; ++i )
+	{
+		t( i, i ) = 1 / alphas[i];
+		if( i > 0 )
+		{
+			t( i, i ) += betas[i-1] / alphas[i-1];
+			t( i, i-1 ) = t( i-1, i ) = sqrt( betas[i-1] ) / alphas[i-1];
+		}
+	}
+	SelfAdjointEigenSolver<MatrixXf> eigenSolver( t, EigenvaluesOnly );
+
+	// The largest estimate is from below, and underestimating it can make the iterations diverge, so
+	// pad it out a bit. Overestimating the smallest one just means the lowest modes converge a bit more
+	// slowly, but we keep it a decent way under the largest, as the process can stop early if b only
+	// has a few modes in it:
+	m_maxEigenvalue = 1.1f * eigenSolver.eigenvalues()[n-1];
+	m_minEigenvalue = std::min( eigenSolver.eigenvalues()[0], 0.5f * m_maxEigenvalue );
+	m_minEigenvalue = std::max( m_minEigenvalue, 1.e-4f * m_maxEigenvalue );
+}
@@ -113,14 +113,10 @@ void ConjugateResiduals::operator()
 		
 		// r_precond <- r_precond - alpha * P^-1 Ap
 		r_precond = r_precond - alpha * precond_Ap;
-		if( m_preconditioner )
-		{
-			m_preconditioner->multVector( r_precond, r );
-		}
-		else
-		{
-			r = r_precond;
-		}
+		
+		// r <- r - alpha * Ap. We update this directly rather than multiplying r_precond by P, so
+		// preconditioners that only know how to apply P^-1 (like a multigrid cycle) work too:
+		r = r - alpha * Ap;
 		
 		if( m_terminationCriterion( r, i ) )
 		{
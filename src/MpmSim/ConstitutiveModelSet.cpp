@@ -0,0 +1,184 @@
+#include "MpmSim/ConstitutiveModelSet.h"
+
+#include <stdexcept>
+
+using namespace MpmSim;
+using namespace Eigen;
+
+ConstitutiveModelSet::ConstitutiveModelSet() : m_p( 0 )
+{
+}
+
+ConstitutiveModelSet::~ConstitutiveModelSet()
+{
+	for( size_t i=0; i < m_models.size(); ++i )
+	{
+		delete m_models[i];
+	}
+}
+
+int ConstitutiveModelSet::add( ConstitutiveModel* model )
+{
+	m_models.push_back( model );
+	return int( m_models.size() - 1 );
+}
+
+const ConstitutiveModel* ConstitutiveModelSet::model( size_t i ) const
+{
+	return m_models[i];
+}
+
+size_t ConstitutiveModelSet::numModels() const
+{
+	return m_models.size();
+}
+
+void ConstitutiveModelSet::setParticles( MaterialPointData& p )
+{
+	if( m_models.empty() )
+	{
+		throw std::runtime_error( "ConstitutiveModelSet::setParticles(): no models have been added" );
+	}
+
+	m_p = &p;
+	m_particleMaterials = MaterialPointData::Handle<int>();
+	if( p.hasVariable( "material" ) )
+	{
+		m_particleMaterials = p.handle<int>( "material" );
+	}
+
+	for( size_t i=0; i < m_models.size(); ++i )
+	{
+		m_models[i]->setParticles( p );
+	}
+
+	// updateParticleData() checks the material ids, and sets up each model's particles:
+	updateParticleData();
+}
+
+void ConstitutiveModelSet::updateParticleData()
+{
+	refreshHandles();
+	std::vector<int> particleInds( m_p->variable<float>( "m" ).size() );
+	for( size_t p=0; p < particleInds.size(); ++p )
+	{
+		particleInds[p] = int( p );
+	}
+	updateParticleData( particleInds );
+}
+
+void ConstitutiveModelSet::updateParticleData( const std::vector<int>& particleInds )
+{
+	// The sim calls this concurrently on different bodies, so the lists have to be local:
+	std::vector< std::vector<int> > materialParticles;
+	splitByMaterial( particleInds, materialParticles );
+	for( size_t i=0; i < m_models.size(); ++i )
+	{
+		if( materialParticles[i].size() )
+		{
+			m_models[i]->updateParticleData( materialParticles[i] );
+		}
+	}
+}
+
+void ConstitutiveModelSet::refreshHandles()
+{
+	m_particleMaterials.refresh();
+	for( size_t i=0; i < m_models.size(); ++i )
+	{
+		m_models[i]->prepareParticleData();
+	}
+}
+
+void ConstitutiveModelSet::splitByMaterial( const std::vector<int>& particleInds, std::vector< std::vector<int> >& materialParticles ) const
+{
+	materialParticles.resize( m_models.size() );
+	if( !m_particleMaterials.valid() )
+	{
+		materialParticles[0] = particleInds;
+		return;
+	}
+
+	const std::vector<int>& particleMaterials = *m_particleMaterials;
+	for( std::vector<int>::const_iterator it = particleInds.begin(); it != particleInds.end(); ++it )
+	{
+		int material = particleMaterials[*it];
+		if( material < 0 || material >= (int)m_models.size() )
+		{
+			throw std::runtime_error( "ConstitutiveModelSet: particle has an invalid material id" );
+		}
+		materialParticles[material].push_back( *it );
+	}
+}
+
+inline const ConstitutiveModel& ConstitutiveModelSet::particleModel( size_t p ) const
+{
+	if( !m_particleMaterials.valid() )
+	{
+		return *m_models[0];
+	}
+	return *m_models[ m_particleMaterials[p] ];
+}
+
+float ConstitutiveModelSet::energyDensity( size_t p ) const
+{
+	return particleModel( p ).energyDensity( p );
+}
+
+Eigen::Matrix3f ConstitutiveModelSet::dEnergyDensitydF( size_t p ) const
+{
+	return particleModel( p ).dEnergyDensitydF( p );
+}
+
+Eigen::Matrix3f ConstitutiveModelSet::dEdFDifferential( const Eigen::Matrix3f& dFp, size_t p ) const
+{
+	return particleModel( p ).dEdFDifferential( dFp, p );
+}
+
+void ConstitutiveModelSet::dEnergyDensitydF( std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const
+{
+	if( !m_particleMaterials.valid() )
+	{
+		m_models[0]->dEnergyDensitydF( begin, end, result );
+		return;
+	}
+
+	// hand each run of particles with the same material over to its model:
+	const std::vector<int>& particleMaterials = *m_particleMaterials;
+	while( begin != end )
+	{
+		int material = particleMaterials[*begin];
+		std::vector<int>::const_iterator runEnd = begin + 1;
+		while( runEnd != end && particleMaterials[*runEnd] == material )
+		{
+			++runEnd;
+		}
+		m_models[material]->dEnergyDensitydF( begin, runEnd, result );
+		result += runEnd - begin;
+		begin = runEnd;
+	}
+}
+
+void ConstitutiveModelSet::dEdFDifferential( const Eigen::Matrix3f* dFp, std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const
+{
+	if( !m_particleMaterials.valid() )
+	{
+		m_models[0]->dEdFDifferential( dFp, begin, end, result );
+		return;
+	}
+
+	const std::vector<int>& particleMaterials = *m_particleMaterials;
+	while( begin != end )
+	{
+		int material = particleMaterials[*begin];
+		std::vector<int>::const_iterator runEnd = begin + 1;
+		while( runEnd != end && particleMaterials[*runEnd] == material )
+		{
+			++runEnd;
+		}
+		m_models[material]->dEdFDifferential( dFp, begin, runEnd, result );
+		dFp += runEnd - begin;
+		result += runEnd - begin;
+		begin = runEnd;
+	}
+}
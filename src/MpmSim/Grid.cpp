@@ -2,10 +2,19 @@
 #include "tbb/parallel_for.h"
 
 #include "MpmSim/Grid.h"
+#include "MpmSim/BlockDiagonalPreconditioner.h"
+#include "MpmSim/ChebyshevPreconditioner.h"
 #include "MpmSim/ConjugateResiduals.h"
+#include "MpmSim/CubicBsplineShapeFunction.h"
 #include "MpmSim/ForceField.h"
+#include "MpmSim/MultigridPreconditioner.h"
+#include "MpmSim/SchwarzPreconditioner.h"
+#include "MpmSim/PipelinedConjugateResiduals.h"
+#include "MpmSim/RecycledConjugateResiduals.h"
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 
 using namespace MpmSim;
@@ -28,6 +37,13 @@ class Grid::GridSplatter
 		
 		virtual ~GridSplatter() {}
 		
+		// splats a run of particles from a single voxel straight into result, for callers that
+		// do their own partitioning:
+		void splatVoxel( Sim::ConstIndexIterator begin, Sim::ConstIndexIterator end, Eigen::VectorXf& result ) const
+		{
+			splat( begin, end, result );
+		}
+		
 		void setPartition( int i, int j, int k )
 		{
 			m_partition = &m_g.m_processingPartitions[i][j][k];
@@ -45,6 +61,13 @@ class Grid::GridSplatter
 
 	protected:
 
+		// splatters that need stresses from the constitutive model ask for them this many particles
+		// at a time, so they only make one virtual call per batch:
+		enum
+		{
+			StressBatchSize = 64
+		};
+
 		virtual void splat(
 			Sim::ConstIndexIterator begin,
 			Sim::ConstIndexIterator end,
@@ -60,99 +83,190 @@ class Grid::GridSplatter
 
 };
 
-class Grid::MassSplatter : public Grid::GridSplatter
+template< class Derived >
+class Grid::StencilSplatter : public Grid::GridSplatter
+{
+	public:
+		StencilSplatter(
+			const Grid& g,
+			Eigen::VectorXf& result
+		) : GridSplatter( g, result )
+		{
+		}
+		
+	protected:
+		
+		virtual void splat(
+			Sim::ConstIndexIterator begin,
+			Sim::ConstIndexIterator end,
+			Eigen::VectorXf& result ) const
+		{
+			const Derived& d = static_cast<const Derived&>( *this );
+			if( m_g.m_kernels && d.splatParticlesVectorised( *m_g.m_kernels, begin, end, result ) )
+			{
+				return;
+			}
+			ParticleRange r( d, begin, end, result );
+			m_g.dispatchStencil( r );
+		}
+		
+		// Derived classes can hide this with a version that splats the particles using the grid's SIMD
+		// kernels and returns true. Otherwise we fall back on splatParticles():
+		bool splatParticlesVectorised(
+			const StencilKernels&,
+			Sim::ConstIndexIterator,
+			Sim::ConstIndexIterator,
+			Eigen::VectorXf& ) const
+		{
+			return false;
+		}
+		
+	private:
+		
+		// forwards a range of particles to Derived::splatParticles() with whatever shape function iterator
+		// dispatchStencil() gives us:
+		class ParticleRange
+		{
+		public:
+			ParticleRange( const Derived& s, Sim::ConstIndexIterator begin, Sim::ConstIndexIterator end, Eigen::VectorXf& result )
+				: m_s( s ), m_begin( begin ), m_end( end ), m_result( result )
+			{
+			}
+			
+			template< class ShapeFunctionIteratorT >
+			void operator()( ShapeFunctionIteratorT& shIt )
+			{
+				m_s.splatParticles( shIt, m_begin, m_end, m_result );
+			}
+			
+		private:
+			const Derived& m_s;
+			Sim::ConstIndexIterator m_begin;
+			Sim::ConstIndexIterator m_end;
+			Eigen::VectorXf& m_result;
+		};
+		
+};
+
+class Grid::MassMomentumSplatter : public Grid::StencilSplatter< Grid::MassMomentumSplatter >
 {
 public:
-	MassSplatter( const Grid& g, Eigen::VectorXf& result )
+	MassMomentumSplatter( const Grid& g, Eigen::VectorXf& masses, Eigen::VectorXf& momenta )
 		:
-		Grid::GridSplatter( g, result ),
-		m_particleX( g.m_d.variable<Eigen::Vector3f>("p") ),
-		m_particleM( g.m_d.variable<float>("m") )
+		Grid::StencilSplatter< Grid::MassMomentumSplatter >( g, masses ),
+		m_momenta( momenta ),
+		m_particleM( *g.m_particleM ),
+		m_particleV( *g.m_particleV )
 	{
 	}
 	
-	virtual void splat(
+	template< class ShapeFunctionIteratorT >
+	void splatParticles(
+		ShapeFunctionIteratorT& shIt,
 		Sim::ConstIndexIterator begin,
 		Sim::ConstIndexIterator end,
 		Eigen::VectorXf& gridMasses
 	) const
 	{
-		Grid::ShapeFunctionIterator& shIt = m_g.shapeFunctionIterator();
-		Vector3i particleCell;
 		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
 		{
 			int p = *it;
-			shIt.initialize( m_particleX[p] );
+			Eigen::Vector3f momentum = m_particleM[p] * ( m_particleV[p] - m_g.m_frameVelocity );
+			shIt.initialize( it );
 			do
 			{
-				shIt.gridPos( particleCell );
-				int idx = m_g.coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-				gridMasses[ idx ] += m_particleM[p] * shIt.w();
+				int idx = shIt.index();
+				float w = shIt.w();
+				gridMasses[ idx ] += m_particleM[p] * w;
+				m_momenta.segment<3>( 3 * idx ) += w * momentum;
 			} while( shIt.next() );
 		}
 	}
+	
+	bool splatParticlesVectorised(
+		const StencilKernels& kernels,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& gridMasses
+	) const
+	{
+		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+		{
+			int p = *it;
+			Eigen::Vector3f momentum = m_particleM[p] * ( m_particleV[p] - m_g.m_frameVelocity );
+			kernels.splatMassMomentum( m_g.stencil( it ), m_particleM[p], momentum, gridMasses.data(), m_momenta.data() );
+		}
+		return true;
+	}
 
 private:
 
-	const std::vector<Eigen::Vector3f>& m_particleX;
+	Eigen::VectorXf& m_momenta;
 	const std::vector<float>& m_particleM;
+	const std::vector<Eigen::Vector3f>& m_particleV;
 
 };
 
-
-class Grid::VelocitySplatter : public Grid::GridSplatter
+// turns splatted momenta into velocities in paralell:
+class Grid::VelocityNormaliser
 {
-
 public:
-
-	VelocitySplatter( const Grid& g, Eigen::VectorXf& result )
-		:
-		Grid::GridSplatter( g, result ),
-		m_particleM( g.m_d.variable<float>("m") ),
-		m_particleX( g.m_d.variable<Eigen::Vector3f>("p") ),
-		m_particleV( g.m_d.variable<Eigen::Vector3f>("v") )
-	{	
+	
+	VelocityNormaliser( Eigen::VectorXf& masses, Eigen::VectorXf& velocities )
+		: m_masses( masses ), m_velocities( velocities )
+	{
 	}
 	
-	virtual void splat(
-		Sim::ConstIndexIterator begin,
-		Sim::ConstIndexIterator end,
-		Eigen::VectorXf& gridVelocities
-	) const
+	void operator()( const tbb::blocked_range<int>& r ) const
 	{
-		Grid::ShapeFunctionIterator& shIt = m_g.shapeFunctionIterator();
-		Vector3i particleCell;
-		const Eigen::VectorXf& m_masses = m_g.m_masses;
-		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+		for( int i = r.begin(); i != r.end(); ++i )
 		{
-			int p = *it;
-			shIt.initialize( m_particleX[p] );
+			// grid masses can end up less than zero due to numerical issues in the shape functions, so clamp 'em:
+			if( m_masses[i] < 0 )
+			{
+				m_masses[i] = 0;
+			}
 			
-			// splat the velocities:
-			do
+			#ifdef WIN32
+			if( !_finite(m_masses[i]) )
+			#else
+			if( isinff(m_masses[i]) || isnanf(m_masses[i]) )
+			#endif
+			{
+				throw std::runtime_error( "nans in splatted masses!" );
+			}
+			
+			if( m_masses[i] > 0 )
+			{
+				m_velocities.segment<3>( 3 * i ) /= m_masses[i];
+			}
+			else
+			{
+				m_velocities.segment<3>( 3 * i ).setZero();
+			}
+			
+			for( int j=3 * i; j < 3 * i + 3; ++j )
 			{
-				shIt.gridPos( particleCell );
-				int idx = m_g.coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-				float gridCellMass = m_masses[idx];
-				if( gridCellMass > 0 )
+				#ifdef WIN32
+				if( !_finite(m_velocities[j]) )
+				#else
+				if( isinff(m_velocities[j]) || isnanf(m_velocities[j]) )
+				#endif
 				{
-					gridVelocities.segment<3>( 3 * idx ) += shIt.w() * ( m_particleM[p] / gridCellMass ) * ( m_particleV[p] - m_g.m_frameVelocity );
+					throw std::runtime_error( "nans in splatted velocities!" );
 				}
-			} while( shIt.next() );
+			}
 		}
 	}
 	
 private:
-
-	const std::vector<float>& m_particleM;
-	const std::vector<Eigen::Vector3f>& m_particleX;
-	const std::vector<Eigen::Vector3f>& m_particleV;
-
+	
+	Eigen::VectorXf& m_masses;
+	Eigen::VectorXf& m_velocities;
+	
 };
 
 
-
-
 // Grid implementation
 Grid::Grid(
 		MaterialPointData& d,
@@ -160,569 +274,1466 @@ Grid::Grid(
 		float gridSize,
 		const ShapeFunction& shapeFunction,
 		Eigen::Vector3f frameVelocity,
-		int dimension
+		int dimension,
+		bool sparse
 ) :
 	m_d( d ),
-	m_frameVelocity( frameVelocity ),
 	m_particleInds( particleInds ),
-	m_gridSize( gridSize ),
+	m_particleX( d.handle<Eigen::Vector3f>( "p" ) ),
+	m_particleV( d.handle<Eigen::Vector3f>( "v" ) ),
+	m_particleM( d.handle<float>( "m" ) ),
+	m_particleVolumes( d.handle<float>( "volume" ) ),
+	m_particleF( d.handle<Eigen::Matrix3f>( "F" ) ),
+	m_sorted( false ),
+	m_stiffnessCaching( false ),
+	m_stiffnessCached( false ),
+	m_initialGuess( Sim::CentreOfMassGuess ),
+	m_recycleSize( 0 ),
 	m_shapeFunction( shapeFunction ),
-	m_dimension( dimension )
+	m_stencilType( GenericStencil ),
+	m_cubicBspline( dynamic_cast<const CubicBsplineShapeFunction*>( &shapeFunction ) != 0 ),
+	m_kernels( 0 ),
+	m_gridSize( gridSize ),
+	m_dimension( dimension ),
+	m_sparse( sparse ),
+	m_blockNodes( 1 ),
+	m_maxStencilBlocks( 0 ),
+	m_lastSolveMultiplies( 0 ),
+	m_chebyshevDegree( 0 ),
+	m_pipelinedSolve( false ),
+	m_reusedPreconditionerMultiplies( 0 ),
+	m_preconditionerReuse( 0 ),
+	m_multigridLevels( 1 ),
+	m_schwarzSubdomainSize( 0 ),
+	m_frameVelocity( frameVelocity )
 {
-	// work out the physical size of the grid:
-	m_min.setConstant( 1.e10 );
-	m_max.setConstant( -1.e10 );
-
-	const std::vector<Vector3f>& particleX = d.variable<Vector3f>("p");
-
-	for( Sim::ConstIndexIterator it = particleInds.begin(); it != particleInds.end(); ++it )
+	if( d.hasVariable( "material" ) )
 	{
-		int p = *it;
-		for( int j=0; j < m_dimension; ++j )
-		{
-			if( particleX[p][j] < m_min[j] )
-			{
-				m_min[j] = particleX[p][j];
-			}
-			if( particleX[p][j] > m_max[j] )
-			{
-				m_max[j] = particleX[p][j];
-			}
-		}
+		m_particleMaterials = d.handle<int>( "material" );
 	}
 	
-	// calculate grid dimensions and quantize bounding box:
-	for( int j=0; j < m_dimension; ++j )
-	{
-		int cellMin = int( floor( m_min[j] / m_gridSize ) ) - m_shapeFunction.supportRadius() - 1;
-		int cellMax = int( ceil( m_max[j] / m_gridSize ) ) + m_shapeFunction.supportRadius() + 1;
-		m_min[j] = cellMin * m_gridSize;
-		m_max[j] = cellMax * m_gridSize;
-		m_n[j] = cellMax - cellMin;
-		
-	}
-	for( int j=m_dimension; j < 3; ++j )
+	// use fixed size stencil code if we've got it for this shape function support and dimension:
+	if( m_shapeFunction.supportRadius() == 2 )
 	{
-		m_min[j] = m_max[j] = 0;
-		m_n[j] = 1;
+		if( m_dimension == 3 )
+		{
+			m_stencilType = Stencil4x4x4;
+		}
+		else if( m_dimension == 2 )
+		{
+			m_stencilType = Stencil4x4;
+		}
 	}
 	
-	long long ncells = (long long)m_n[0] * (long long)m_n[1] * (long long)m_n[2];
-	if( ncells > 4000000000 || ncells <= 0 )
+	// the SIMD kernels need each row of the stencil to be contiguous in memory, which it isn't
+	// in a sparse grid:
+	if( !m_sparse && m_stencilType != GenericStencil )
 	{
-		throw std::runtime_error( "grid is too big" );
+		m_kernels = &StencilKernels::best();
 	}
 	
-	// partition the particle inds for paralell processing:
-	computeProcessingPartitions();
-
-	// calculate masses:
-	m_masses.resize( ncells );
-	m_masses.setZero();
-	
-	MassSplatter sM( *this, m_masses );
-	splat( sM );
-	
-	// grid masses can end up less than zero due to numerical issues in the shape functions, so clamp 'em:
-	for( int i=0; i < m_masses.size(); ++i )
+	if( m_sparse )
 	{
-		if( m_masses[i] < 0 )
+		// blocks are 4 cells wide along the simulated axes and one cell wide along the others:
+		int diameter = 2 * m_shapeFunction.supportRadius();
+		m_maxStencilBlocks = 1;
+		for( int j=0; j < 3; ++j )
 		{
-			m_masses[i] = 0;
-		}
-		
-		#ifdef WIN32
-		if( !_finite(m_masses[i]) )
-		#else
-		if( isinff(m_masses[i]) || isnanf(m_masses[i]) )
-		#endif
-		{
-			throw std::runtime_error( "nans in splatted masses!" );
+			m_blockShift[j] = j < m_dimension ? 2 : 0;
+			m_blockNodes <<= m_blockShift[j];
+			if( j < m_dimension )
+			{
+				int blockSize = 1 << m_blockShift[j];
+				m_maxStencilBlocks *= ( diameter + blockSize - 2 ) / blockSize + 1;
+			}
 		}
 	}
+	update( frameVelocity );
+}
 
-	// calculate velocities:
-	m_velocities.resize( ncells * 3 );
-	m_velocities.setZero();
-	
-	VelocitySplatter sV( *this, m_velocities );
-	splat( sV );
-	
-	for( int i=0; i < m_velocities.size(); ++i )
+Grid::~Grid()
+{
+	for( size_t i=0; i < m_coarseGrids.size(); ++i )
 	{
-		#ifdef WIN32
-		if( !_finite(m_velocities[i]) )
-		#else
-		if( isinff(m_velocities[i]) || isnanf(m_velocities[i]) )
-		#endif
-		{
-			throw std::runtime_error( "nans in splatted velocities!" );
-		}
+		delete m_coarseGrids[i];
 	}
-	
-	m_prevVelocities = m_velocities;
 }
 
-void Grid::computeParticleVolumes() const
+void Grid::setStiffnessCaching( bool cache )
 {
-	const std::vector<Vector3f>& particleX = m_d.variable<Vector3f>("p");
-	const std::vector<float>& particleM = m_d.variable<float>("m");
-	std::vector<float>& particleVolumes = m_d.variable<float>("volume");
-	
-	ShapeFunctionIterator& shIt = shapeFunctionIterator();
-	Vector3i particleCell;
-	
-	float cellVolume = m_gridSize * m_gridSize * m_gridSize;
-	for( Sim::ConstIndexIterator it = m_particleInds.begin(); it != m_particleInds.end(); ++it )
+	m_stiffnessCaching = cache;
+	if( !cache )
 	{
-		float density(0);
-		int p = *it;
-		shIt.initialize( particleX[p] );
-		do
-		{
-			shIt.gridPos( particleCell );
-			int idx = coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-			
-			// accumulate the particle's density:
-			density += shIt.w() * m_masses[ idx ] / cellVolume;
-					
-		} while( shIt.next() );
-		
-		particleVolumes[p] = particleM[p] / density;
+		std::vector<float>().swap( m_stiffness );
+		m_stiffnessCached = false;
 	}
 }
 
+bool Grid::getStiffnessCaching() const
+{
+	return m_stiffnessCaching;
+}
 
-// used for sorting a list of points by their positions on the "dim" axis
-namespace
+void Grid::setMultigridLevels( int levels )
 {
-class SpatialComparator
+	m_multigridLevels = std::max( levels, 1 );
+}
+
+int Grid::getMultigridLevels() const
 {
-public:
-	
-	SpatialComparator( int dim, const std::vector< Eigen::Vector3f >& x ) :
-		m_dim( dim ), m_x( x )
+	return m_multigridLevels;
+}
+
+void Grid::setPreconditionerReuse( float maxIterationGrowth )
+{
+	m_preconditionerReuse = maxIterationGrowth;
+	if( m_preconditionerReuse <= 0 )
 	{
+		m_reusedPreconditionerBlocks.resize( 0 );
 	}
-	
-	bool operator()( int a, int b )
+}
+
+float Grid::getPreconditionerReuse() const
+{
+	return m_preconditionerReuse;
+}
+
+void Grid::setSchwarzSubdomainSize( int voxels )
+{
+	m_schwarzSubdomainSize = std::max( voxels, 0 );
+}
+
+int Grid::getSchwarzSubdomainSize() const
+{
+	return m_schwarzSubdomainSize;
+}
+
+void Grid::setChebyshevDegree( int degree )
+{
+	m_chebyshevDegree = degree;
+}
+
+int Grid::getChebyshevDegree() const
+{
+	return m_chebyshevDegree;
+}
+
+void Grid::setPipelinedSolve( bool pipelined )
+{
+	m_pipelinedSolve = pipelined;
+}
+
+bool Grid::getPipelinedSolve() const
+{
+	return m_pipelinedSolve;
+}
+
+void Grid::setInitialGuess( Sim::InitialGuess guess )
+{
+	m_initialGuess = guess;
+	if( m_initialGuess == Sim::CentreOfMassGuess )
 	{
-		return m_x[a][m_dim] < m_x[b][m_dim];
+		m_solvedVelocities[0].clear();
+		m_solvedVelocities[1].clear();
 	}
-
-private:
-	int m_dim;
-	const std::vector< Eigen::Vector3f >& m_x;
-};
 }
 
-void Grid::voxelSort(
-	Sim::IndexIterator begin,
-	Sim::IndexIterator end,
-	float voxelSize,
-	const std::vector<Eigen::Vector3f>& particleX,
-	int dim )
+Sim::InitialGuess Grid::getInitialGuess() const
 {
-	// sort along dim:
-	std::sort( begin, end, SpatialComparator( dim, particleX ) );
+	return m_initialGuess;
+}
 
-	if( dim == 2 )
+void Grid::setRecycleSize( int size )
+{
+	m_recycleSize = size;
+	if( m_recycleSize <= 0 )
 	{
-		// got to z coord - done!
-		return;
+		m_recycleSpace.clear();
+		m_recycleLayout.clear();
 	}
-	
-	// now chop into slices along dim, and sort each slice along dim + 1:
-	int currentSlice = int( floor( particleX[*begin][dim] / voxelSize ) );
-	std::vector<int>::iterator sliceBegin = begin;
-	std::vector<int>::iterator sliceEnd = begin + 1;
-	for( ;;++sliceEnd )
+	else if( (int)m_recycleSpace.size() > m_recycleSize )
 	{
-		int particleSlice = sliceEnd == end ? currentSlice + 1 : int( floor( particleX[*sliceEnd][dim] / voxelSize ) );
-		if( particleSlice != currentSlice )
-		{
-			voxelSort( sliceBegin, sliceEnd, voxelSize, particleX, dim + 1 );
-			if( sliceEnd == end )
-			{
-				break;
-			}
-			sliceBegin = sliceEnd;
-			currentSlice = particleSlice;
-		}
+		m_recycleSpace.resize( m_recycleSize );
 	}
 }
 
-void Grid::computeProcessingPartitions()
+int Grid::getRecycleSize() const
 {
-	if (m_particleInds.empty())
-		return;
-
-	const std::vector<Eigen::Vector3f>& particleX = m_d.variable<Vector3f>("p");
-	
-	// sort the spatial index so particles in the same voxel are adjacent:
-	voxelSort(m_particleInds.begin(), m_particleInds.end(), 2 * m_shapeFunction.supportRadius() * m_gridSize, particleX );
+	return m_recycleSize;
+}
 
-	// now imagine chopping space up into little 2x2x2 voxel blocks. All
-	// the voxels in the (0,0,0) corners go in processingPartitions[0][0][0],
-	// all the voxels in the (1,0,0) corners go in processingPartitions[1][0][0],
-	// etc etc.
-	Eigen::Vector3i currentVoxel = Eigen::Vector3i::Zero();
-	Sim::ConstIndexIterator begin = m_particleInds.begin();
-	Sim::ConstIndexIterator end = m_particleInds.end();
-	Sim::ConstIndexIterator* partitionEnd = 0;
+void Grid::updateCoarseGrids()
+{
+	size_t numCoarseGrids = m_multigridLevels - 1;
+	while( m_coarseGrids.size() > numCoarseGrids )
+	{
+		delete m_coarseGrids.back();
+		m_coarseGrids.pop_back();
+	}
 	
-	float voxelSize = 2 * m_shapeFunction.supportRadius() * m_gridSize;
-	for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+	float gridSize = m_gridSize;
+	for( size_t i=0; i < numCoarseGrids; ++i )
 	{
-		Eigen::Vector3f x = particleX[ *it ] / voxelSize;
-		Eigen::Vector3i voxel( (int)floor( x[0] ), (int)floor( x[1] ), (int)floor( x[2] ) );
-		if( voxel != currentVoxel || it == begin )
+		gridSize *= 2;
+		if( i < m_coarseGrids.size() )
 		{
-			currentVoxel = voxel;
-			ParticlesInVoxelList& partition = m_processingPartitions[ voxel[0]&1 ][ voxel[1]&1 ][ voxel[2]&1 ];
-			partition.push_back( std::make_pair( it, it ) );
-			partitionEnd = &partition.back().second;
+			m_coarseGrids[i]->update( m_frameVelocity );
+		}
+		else
+		{
+			// A sparse coarse grid doesn't have every node the fine nodes' stencils reach, but the ones it
+			// leaves out have no particles near them, so they've got no mass and the multigrid transfers
+			// would skip them anyway:
+			m_coarseGrids.push_back( new Grid( m_d, m_particleInds, gridSize, m_shapeFunction, m_frameVelocity, m_dimension, m_sparse ) );
 		}
-		++*partitionEnd;
 	}
 }
 
+void Grid::collideNodes( const CollisionObject::CollisionObjectSet& collisionObjects )
+{
+	m_nodeCollided.resize( m_masses.size() );
+	for( int idx=0; idx < m_masses.size(); ++idx )
+	{
+		Vector3f v = m_velocities.segment<3>( 3 * idx );
+		m_nodeCollided[idx] = collisionObjects.collide( v, nodePosition( idx ), m_frameVelocity );
+	}
+}
 
-class Grid::ForceSplatter : public Grid::GridSplatter
+Eigen::Matrix3f Grid::collisionProjection( int idx, const CollisionObject::CollisionObjectSet& collisionObjects ) const
 {
-public:
-	
-	ForceSplatter(
-		const Grid& g,
-		Eigen::VectorXf& result,
-		const ConstitutiveModel& constitutiveModel
-	)
-		:
-		Grid::GridSplatter( g, result ),
-		m_particleVolumes( g.m_d.variable<float>("volume") ),
-		m_particleX( g.m_d.variable<Eigen::Vector3f>("p") ),
-		m_particleF( g.m_d.variable<Eigen::Matrix3f>("F") ),
-		m_constitutiveModel( constitutiveModel )
+	int objIdx = m_nodeCollided[idx];
+	if( objIdx == -1 )
+	{
+		// no collision
+		return Matrix3f::Identity();
+	}
+	else if( objIdx == -2 )
 	{
+		// more than one collision: set to zero
+		return Matrix3f::Zero();
 	}
+	
+	// find object normal:
+	const CollisionObject* obj = collisionObjects.object( objIdx );
+	Vector3f n;
+	obj->grad( nodePosition( idx ), n );
+	n.normalize();
+	
+	// project out component perpendicular to the object
+	return Matrix3f::Identity() - n * n.transpose();
+}
 
-	virtual void splat(
-		Sim::ConstIndexIterator begin,
-		Sim::ConstIndexIterator end,
-		Eigen::VectorXf& forces
-	) const
+void Grid::setParticles( const Sim::IndexList& particleInds )
+{
+	m_particleInds = particleInds;
+	m_sorted = false;
+	m_reusedPreconditionerBlocks.resize( 0 );
+	for( size_t i=0; i < m_coarseGrids.size(); ++i )
 	{
-		Grid::ShapeFunctionIterator& shIt = m_g.shapeFunctionIterator();
-		Vector3i particleCell;
-		Vector3f weightGrad;
+		m_coarseGrids[i]->setParticles( particleInds );
+	}
+}
 
-		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
-		{
-			int p = *it;
-			Eigen::Matrix3f forceMatrix = m_particleVolumes[p] * m_constitutiveModel.dEnergyDensitydF( p ) * m_particleF[p].transpose();
-			shIt.initialize( m_particleX[p], true );
-			do
-			{
-				shIt.gridPos( particleCell );
-				shIt.dw( weightGrad );
-				int idx = m_g.coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-				forces.segment<3>( 3 * idx ) -= forceMatrix * weightGrad;
-			} while( shIt.next() );
-		}
-	}	
-private:
+void Grid::update( const Eigen::Vector3f& frameVelocity )
+{
+	m_frameVelocity = frameVelocity;
+	m_stiffnessCached = false;
+	
+	m_particleX.refresh();
+	m_particleV.refresh();
+	m_particleM.refresh();
+	m_particleVolumes.refresh();
+	m_particleF.refresh();
+	m_particleMaterials.refresh();
+	
+	// the preconditioner blocks we're reusing are stored per node, so they're no good if the
+	// nodes get moved around:
+	Vector3f oldMin = m_min;
+	Vector3i oldN = m_n;
+	std::vector<BlockKey> oldBlockKeys;
+	if( m_sparse && m_reusedPreconditionerBlocks.size() )
+	{
+		oldBlockKeys = m_blockKeys;
+	}
+	
+	// work out the physical size of the grid:
+	computeExtents();
+	
+	// sort the particles so ones in the same voxel are adjacent. If we've done this
+	// before the previous order should be pretty close:
+	const std::vector<Vector3f>& particleX = *m_particleX;
+	if( m_sorted )
+	{
+		resortParticles();
+	}
+	else if( !m_particleInds.empty() )
+	{
+		voxelSort( m_particleInds.begin(), m_particleInds.end(), 2 * m_shapeFunction.supportRadius() * m_gridSize, particleX );
+		m_sorted = true;
+	}
+	groupParticlesByMaterial();
+	
+	// partition the particle inds for paralell processing:
+	computeProcessingPartitions();
 
-	const std::vector<float>& m_particleVolumes;
-	const std::vector<Eigen::Vector3f>& m_particleX;
-	const std::vector<Eigen::Matrix3f>& m_particleF;
-	const ConstitutiveModel& m_constitutiveModel;
-};
+	long long ncells;
+	if( m_sparse )
+	{
+		allocateBlocks();
+		ncells = (long long)m_blockKeys.size() * m_blockNodes;
+	}
+	else
+	{
+		ncells = (long long)m_n[0] * (long long)m_n[1] * (long long)m_n[2];
+	}
+	
+	if( ncells > 4000000000 || ncells <= 0 )
+	{
+		throw std::runtime_error( "grid is too big" );
+	}
+	
+	if( m_reusedPreconditionerBlocks.size() && ( m_min != oldMin || m_n != oldN || ( m_sparse && m_blockKeys != oldBlockKeys ) ) )
+	{
+		m_reusedPreconditionerBlocks.resize( 0 );
+	}
+	
+	// evaluate shape functions for all the particles:
+	cacheShapeFunctions();
 
+	// splat masses and momenta in one go. The resizes don't reallocate if the grid extents haven't changed:
+	m_masses.resize( ncells );
+	m_masses.setZero();
+	m_velocities.resize( ncells * 3 );
+	m_velocities.setZero();
+	
+	MassMomentumSplatter s( *this, m_masses, m_velocities );
+	splat( s );
+	
+	// divide through by the masses to get velocities:
+	VelocityNormaliser n( m_masses, m_velocities );
+	tbb::parallel_for( tbb::blocked_range<int>( 0, (int)m_masses.size() ), n );
+	
+	m_prevVelocities = m_velocities;
+}
 
-void Grid::calculateForces(
-	VectorXf& forces,
-	const ConstitutiveModel& constitutiveModel,
-	const ForceField::ForceFieldSet& fields ) const
+void Grid::computeExtents()
 {
-	forces.setZero();
+	Vector3f particleMin = Vector3f::Constant( 1.e10 );
+	Vector3f particleMax = Vector3f::Constant( -1.e10 );
 
-	// force fields:
-	for( int i=0; i < m_n[0]; ++i )
+	const std::vector<Vector3f>& particleX = *m_particleX;
+
+	for( Sim::ConstIndexIterator it = m_particleInds.begin(); it != m_particleInds.end(); ++it )
 	{
-		for( int j=0; j < m_n[1]; ++j )
+		int p = *it;
+		for( int j=0; j < m_dimension; ++j )
 		{
-			for( int k=0; k < m_n[2]; ++k )
+			if( particleX[p][j] < particleMin[j] )
 			{
-				int idx = coordsToIndex( i, j, k );
-				Eigen::Vector3f f = forces.segment<3>(3 * idx);
-				fields.force( f, Eigen::Vector3f( float(i), float(j), float(k) ) * m_gridSize + m_min, m_masses[idx] );
-				forces.segment<3>(3 * idx) = f;
+				particleMin[j] = particleX[p][j];
+			}
+			if( particleX[p][j] > particleMax[j] )
+			{
+				particleMax[j] = particleX[p][j];
 			}
 		}
 	}
 	
-	// add on internal forces:
-	ForceSplatter s( *this, forces, constitutiveModel );
-	splat( s );
-}
-
-
-class Grid::dFidXiSplatter : public Grid::GridSplatter
-{
-public:
-	
-	dFidXiSplatter(
-		const Grid& g,
-		Eigen::VectorXf& result,
-		const ConstitutiveModel& constitutiveModel
-	)
-		:
-		Grid::GridSplatter( g, result ),
-		m_particleVolumes( g.m_d.variable<float>("volume") ),
-		m_particleX( g.m_d.variable<Vector3f>("p") ),
-		m_particleF( g.m_d.variable<Matrix3f>("F") ),
-		m_constitutiveModel( constitutiveModel )
+	// quantize bounding box:
+	Vector3i cellMin, cellMax;
+	for( int j=0; j < m_dimension; ++j )
 	{
+		cellMin[j] = int( floor( particleMin[j] / m_gridSize ) ) - m_shapeFunction.supportRadius() - 1;
+		cellMax[j] = int( ceil( particleMax[j] / m_gridSize ) ) + m_shapeFunction.supportRadius() + 1;
 	}
 	
-	virtual void splat(
-		Sim::ConstIndexIterator begin,
-		Sim::ConstIndexIterator end,
-		Eigen::VectorXf& dfidxi
-	) const
+	if( m_masses.size() )
 	{
-		Grid::ShapeFunctionIterator& shIt = m_g.shapeFunctionIterator();
-		Vector3i particleCell;
-		Vector3f weightGrad;
-		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+		// this grid's been used before, so we can keep the old extents as long as the
+		// particles are still inside them and they haven't got too baggy:
+		bool fits = true;
+		Vector3i slack;
+		for( int j=0; j < m_dimension; ++j )
 		{
-			int p = *it;
-
-			// work out deformation gradient differential for this particle when grid nodes are
-			// all moved one unit in the x, y and z directions:
-			Matrix3f dFpX = Matrix3f::Zero();
-			Matrix3f dFpY = Matrix3f::Zero();
-			Matrix3f dFpZ = Matrix3f::Zero();
-			Eigen::Vector3f df;
-			shIt.initialize( m_particleX[p], true );
-			do
+			int oldMin = int( floor( m_min[j] / m_gridSize + 0.5f ) );
+			int oldMax = oldMin + m_n[j];
+			slack[j] = 2 + ( cellMax[j] - cellMin[j] ) / 16;
+			if( cellMin[j] < oldMin || cellMax[j] > oldMax || m_n[j] > cellMax[j] - cellMin[j] + 4 * slack[j] )
 			{
-				shIt.gridPos( particleCell );
-				shIt.dw( weightGrad );
-				int idx = m_g.coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-				dFpX = Eigen::Vector3f(1,0,0) * weightGrad.transpose() * m_particleF[p];
-				dFpY = Eigen::Vector3f(0,1,0) * weightGrad.transpose() * m_particleF[p];
-				dFpZ = Eigen::Vector3f(0,0,1) * weightGrad.transpose() * m_particleF[p];
-				
-				Matrix3f forceMatrixX =
-					m_particleVolumes[p] *
-					m_constitutiveModel.dEdFDifferential( dFpX, p ) *
-					m_particleF[p].transpose();
-				Matrix3f forceMatrixY =
-					m_particleVolumes[p] *
-					m_constitutiveModel.dEdFDifferential( dFpY, p ) *
-					m_particleF[p].transpose();
-				Matrix3f forceMatrixZ =
-					m_particleVolumes[p] *
-					m_constitutiveModel.dEdFDifferential( dFpZ, p ) *
-					m_particleF[p].transpose();
-
-				dfidxi[ 3 * idx   ] += (-forceMatrixX * weightGrad)[0];
-				dfidxi[ 3 * idx+1 ] += (-forceMatrixY * weightGrad)[1];
-				dfidxi[ 3 * idx+2 ] += (-forceMatrixZ * weightGrad)[2];		
-			} while( shIt.next() );
+				fits = false;
+			}
+		}
+		if( fits )
+		{
+			return;
+		}
+		
+		// pad the new extents out a bit so the grid doesn't need resizing every time step:
+		for( int j=0; j < m_dimension; ++j )
+		{
+			cellMin[j] -= slack[j];
+			cellMax[j] += slack[j];
 		}
 	}
 	
-	const std::vector<float>& m_particleVolumes;
-	const std::vector<Eigen::Vector3f>& m_particleX;
-	const std::vector<Eigen::Matrix3f>& m_particleF;
-	const ConstitutiveModel& m_constitutiveModel;
-};
-
-void Grid::dForceidXi(
-	Eigen::VectorXf& dfdxi, 
-	const ConstitutiveModel& constitutiveModel ) const
-{
-	dfdxi = Eigen::VectorXf::Constant( m_velocities.size(), 0.0f );
-	dFidXiSplatter s( *this, dfdxi, constitutiveModel );
-	splat( s );
+	// calculate grid dimensions:
+	for( int j=0; j < m_dimension; ++j )
+	{
+		m_min[j] = cellMin[j] * m_gridSize;
+		m_max[j] = cellMax[j] * m_gridSize;
+		m_n[j] = cellMax[j] - cellMin[j];
+	}
+	for( int j=m_dimension; j < 3; ++j )
+	{
+		m_min[j] = m_max[j] = 0;
+		m_n[j] = 1;
+	}
 }
 
-
-class Grid::ForceDifferentialSplatter : public Grid::GridSplatter
+class Grid::ParticleVolumeGatherer
 {
 public:
 	
-	ForceDifferentialSplatter(
-		const Grid& g,
-		Eigen::VectorXf& result,
-		const ConstitutiveModel& constitutiveModel,
-		const Eigen::VectorXf& dx
-	)
+	ParticleVolumeGatherer( const Grid& g )
 		:
-		Grid::GridSplatter( g, result ),
-		m_particleVolumes( g.m_d.variable<float>("volume") ),
-		m_particleX( g.m_d.variable<Eigen::Vector3f>("p") ),
-		m_particleF( g.m_d.variable<Eigen::Matrix3f>("F") ),
-		m_dx( dx ),
-		m_constitutiveModel( constitutiveModel )
+		m_g( g ),
+		m_particleM( *g.m_particleM ),
+		m_particleVolumes( *g.m_particleVolumes )
 	{
 	}
 	
-	virtual void splat(
-		Sim::ConstIndexIterator begin,
-		Sim::ConstIndexIterator end,
-		Eigen::VectorXf& df
-	) const
+	template< class ShapeFunctionIteratorT >
+	void operator()( ShapeFunctionIteratorT& shIt )
 	{
-		Grid::ShapeFunctionIterator& shIt = m_g.shapeFunctionIterator();
-		Vector3i particleCell;
-		Vector3f weightGrad;
-		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+		float cellVolume = m_g.m_gridSize * m_g.m_gridSize * m_g.m_gridSize;
+		for( Sim::ConstIndexIterator it = m_g.m_particleInds.begin(); it != m_g.m_particleInds.end(); ++it )
 		{
+			float density(0);
 			int p = *it;
-
-			// work out deformation gradient differential for this particle when grid nodes are
-			// all moved by their respective dx
-			Matrix3f dFp = Matrix3f::Zero();
-			shIt.initialize( m_particleX[p], true );
-			do
-			{
-				shIt.gridPos( particleCell );
-				shIt.dw( weightGrad );
-				int idx = m_g.coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-				dFp += m_dx.segment<3>( 3 * idx ) * weightGrad.transpose() * m_particleF[p];
-			} while( shIt.next() );
-			
-			Matrix3f forceMatrix =
-				m_particleVolumes[p] *
-				m_constitutiveModel.dEdFDifferential( dFp, p ) *
-				m_particleF[p].transpose();
-			
-			shIt.initialize( m_particleX[p], true );
+			shIt.initialize( it );
 			do
 			{
-				shIt.gridPos( particleCell );
-				shIt.dw( weightGrad );
-				int idx = m_g.coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
+				int idx = shIt.index();
 				
-				// add on difference in velocity due to this force:
-				df.segment<3>( 3 * idx ) -= forceMatrix * weightGrad;
+				// accumulate the particle's density:
+				density += shIt.w() * m_g.m_masses[ idx ] / cellVolume;
 						
 			} while( shIt.next() );
+			
+			m_particleVolumes[p] = m_particleM[p] / density;
 		}
 	}
 	
-	const std::vector<float>& m_particleVolumes;
-	const std::vector<Eigen::Vector3f>& m_particleX;
-	const std::vector<Eigen::Matrix3f>& m_particleF;
-	const Eigen::VectorXf& m_dx;
-	const ConstitutiveModel& m_constitutiveModel;
+private:
+	
+	const Grid& m_g;
+	const std::vector<float>& m_particleM;
+	std::vector<float>& m_particleVolumes;
+	
 };
 
-void Grid::calculateForceDifferentials(
-		VectorXf& df,
-		const VectorXf& dx,
-		const ConstitutiveModel& constitutiveModel,
-		const ForceField::ForceFieldSet& fields
-) const
+void Grid::computeParticleVolumes() const
 {
-	// TODO: this doesn't deal with force fields which vary in space
-	df.resize( m_velocities.size() );
-	df.setZero();
-	ForceDifferentialSplatter s( *this, df, constitutiveModel, dx );
-	splat( s );
+	ParticleVolumeGatherer g( *this );
+	dispatchStencil( g );
 }
 
-void Grid::calculateExplicitMomenta(
-	VectorXf& explicitMomenta,
-	std::vector<char>& nodeCollided,
-	float timeStep,
-	const ConstitutiveModel& constitutiveModel,
-	const CollisionObject::CollisionObjectSet& collisionObjects,
-	const ForceField::ForceFieldSet& fields
-)
+
+void Grid::allocateBlocks()
 {
-	// work out forces on grid points:
-	VectorXf forces( m_velocities.size() );
-	calculateForces( forces, constitutiveModel, fields );
+	for( int j=0; j < 3; ++j )
+	{
+		// block coordinates get packed into 21 bits each:
+		if( ( m_n[j] >> m_blockShift[j] ) >= ( 1 << 21 ) )
+		{
+			throw std::runtime_error( "grid is too big" );
+		}
+	}
 	
-	// work out explicit velocity update, and convert it to momenta:
-	explicitMomenta.resize( m_velocities.size() );
-	nodeCollided.resize( m_masses.size() );
-	for( int i=0; i < m_n[0]; ++i )
+	// find the blocks overlapped by every particle's shape function support:
+	const std::vector<Vector3f>& particleX = *m_particleX;
+	int r = m_shapeFunction.supportRadius();
+	m_blockKeys.clear();
+	for( Sim::ConstIndexIterator it = m_particleInds.begin(); it != m_particleInds.end(); ++it )
 	{
-		for( int j=0; j < m_n[1]; ++j )
+		Vector3i blockMin = Vector3i::Zero();
+		Vector3i blockMax = Vector3i::Zero();
+		for( int dim=0; dim < m_dimension; ++dim )
 		{
-			for( int k=0; k < m_n[2]; ++k )
+			int base = (int)floor( ( particleX[*it][dim] - m_min[dim] ) / m_gridSize ) + 1 - r;
+			blockMin[dim] = base >> m_blockShift[dim];
+			blockMax[dim] = ( base + 2 * r - 1 ) >> m_blockShift[dim];
+		}
+		for( int bk = blockMin[2]; bk <= blockMax[2]; ++bk )
+		{
+			for( int bj = blockMin[1]; bj <= blockMax[1]; ++bj )
 			{
-				int idx = coordsToIndex( i, j, k );
-
-				Vector3f force = forces.segment<3>( 3 * idx );
-				Vector3f velocity = m_velocities.segment<3>( 3 * idx );
-				Vector3f explicitVelocity = velocity;
-				if( m_masses[idx] > 0 )
-				{
-					explicitVelocity += timeStep * force / m_masses[idx];
-				}
-
-				// which collision objects affect this node? -1 means none, -2 means more than one, >= 0
-				// is the object index:
-				Vector3f x( m_gridSize * i + m_min[0], m_gridSize * j + m_min[1], m_gridSize * k + m_min[2] );
-				nodeCollided[idx] = collisionObjects.collide( explicitVelocity, x, m_frameVelocity );
-				explicitMomenta.segment<3>( 3 * idx ) = explicitVelocity * m_masses[idx];
-				float prod = explicitMomenta[ 3 * idx ] * explicitMomenta[ 3 * idx + 1 ] * explicitMomenta[ 3 * idx + 2 ];
-				#ifdef WIN32
-				if( !_finite(prod) )
-				#else
-				if( isinff(prod) || isnanf(prod) )
-				#endif
+				for( int bi = blockMin[0]; bi <= blockMax[0]; ++bi )
 				{
-					std::cerr << "x: " << x.transpose() << std::endl;
-					std::cerr << "force: " << force.transpose() << std::endl;
-					std::cerr << "velocity: " << velocity.transpose() << std::endl;
-					std::cerr << "explicitVelocity: " << explicitVelocity.transpose() << std::endl;
-					std::cerr << "mass: " << m_masses[idx] << std::endl;
-					throw std::runtime_error( "nan in explicit momenta!" );
+					BlockKey key = blockKey( bi, bj, bk );
+					// particles are voxel sorted, so this catches most of the duplicates:
+					if( m_blockKeys.empty() || m_blockKeys.back() != key )
+					{
+						m_blockKeys.push_back( key );
+					}
 				}
-				
 			}
 		}
 	}
-	
+	std::sort( m_blockKeys.begin(), m_blockKeys.end() );
+	m_blockKeys.erase( std::unique( m_blockKeys.begin(), m_blockKeys.end() ), m_blockKeys.end() );
 }
 
-void Grid::collisionVelocities(
-	Eigen::VectorXf& vc,
-	const CollisionObject::CollisionObjectSet& collisionObjects,
-	const std::vector<char>& nodeCollided
-) const
+void Grid::stencilBlocks( const Eigen::Vector3i& base, Eigen::Vector3i& blockBase, Eigen::Vector3i& blockCount ) const
 {
-	vc.resize( 3 * m_n[0] * m_n[1] * m_n[2] );
-	for( int i=0; i < m_n[0]; ++i )
+	int diameter = 2 * m_shapeFunction.supportRadius();
+	for( int dim=0; dim < 3; ++dim )
 	{
-		for( int j=0; j < m_n[1]; ++j )
-		{
-			for( int k=0; k < m_n[2]; ++k )
-			{
-				int idx = coordsToIndex( i, j, k );
-				if( nodeCollided[idx] < 0 )
-				{
-					vc.segment<3>( 3 * idx ).setZero();
-				}
-				else
-				{
-					Vector3f x( m_gridSize * i + m_min[0], m_gridSize * j + m_min[1], m_gridSize * k + m_min[2] );
-					const CollisionObject* obj = collisionObjects.object( nodeCollided[idx] );
-					
-					Vector3f vObj;
-					obj->velocity( x, vObj );
-					// express collision velocity relative to moving frame:
-					vc.segment<3>( 3 * idx ) = vObj - m_frameVelocity;
-				}
-			}
-		}
+		blockBase[dim] = base[dim] >> m_blockShift[dim];
+		int blockMax = dim < m_dimension ? ( base[dim] + diameter - 1 ) >> m_blockShift[dim] : blockBase[dim];
+		blockCount[dim] = blockMax - blockBase[dim] + 1;
+	}
+}
+
+Grid::BlockKey Grid::blockKey( int bi, int bj, int bk ) const
+{
+	return (BlockKey)bi | ( (BlockKey)bj << 21 ) | ( (BlockKey)bk << 42 );
+}
+
+int Grid::blockSlot( BlockKey key ) const
+{
+	std::vector<BlockKey>::const_iterator it = std::lower_bound( m_blockKeys.begin(), m_blockKeys.end(), key );
+	if( it == m_blockKeys.end() || *it != key )
+	{
+		return -1;
+	}
+	return int( it - m_blockKeys.begin() );
+}
+
+// used for sorting a list of points by their positions on the "dim" axis
+namespace
+{
+class SpatialComparator
+{
+public:
+	
+	SpatialComparator( int dim, const std::vector< Eigen::Vector3f >& x ) :
+		m_dim( dim ), m_x( x )
+	{
+	}
+	
+	bool operator()( int a, int b )
+	{
+		return m_x[a][m_dim] < m_x[b][m_dim];
+	}
+
+private:
+	int m_dim;
+	const std::vector< Eigen::Vector3f >& m_x;
+};
+}
+
+// orders particles by material id:
+namespace
+{
+class MaterialComparator
+{
+public:
+	
+	MaterialComparator( const std::vector<int>& materials ) : m_materials( materials )
+	{
+	}
+	
+	bool operator()( int a, int b ) const
+	{
+		return m_materials[a] < m_materials[b];
+	}
+
+private:
+	const std::vector<int>& m_materials;
+};
+}
+
+// lexicographical ordering on voxel coordinates, used when re-sorting the particles:
+namespace
+{
+class VoxelKeyComparator
+{
+public:
+	
+	bool operator()( const std::pair< Eigen::Vector3i, int >& a, const std::pair< Eigen::Vector3i, int >& b ) const
+	{
+		for( int i=0; i < 3; ++i )
+		{
+			if( a.first[i] != b.first[i] )
+			{
+				return a.first[i] < b.first[i];
+			}
+		}
+		return false;
+	}
+};
+}
+
+void Grid::voxelSort(
+	Sim::IndexIterator begin,
+	Sim::IndexIterator end,
+	float voxelSize,
+	const std::vector<Eigen::Vector3f>& particleX,
+	int dim )
+{
+	// sort along dim:
+	std::sort( begin, end, SpatialComparator( dim, particleX ) );
+
+	if( dim == 2 )
+	{
+		// got to z coord - done!
+		return;
+	}
+	
+	// now chop into slices along dim, and sort each slice along dim + 1:
+	int currentSlice = int( floor( particleX[*begin][dim] / voxelSize ) );
+	std::vector<int>::iterator sliceBegin = begin;
+	std::vector<int>::iterator sliceEnd = begin + 1;
+	for( ;;++sliceEnd )
+	{
+		int particleSlice = sliceEnd == end ? currentSlice + 1 : int( floor( particleX[*sliceEnd][dim] / voxelSize ) );
+		if( particleSlice != currentSlice )
+		{
+			voxelSort( sliceBegin, sliceEnd, voxelSize, particleX, dim + 1 );
+			if( sliceEnd == end )
+			{
+				break;
+			}
+			sliceBegin = sliceEnd;
+			currentSlice = particleSlice;
+		}
+	}
+}
+
+void Grid::resortParticles()
+{
+	const std::vector<Eigen::Vector3f>& particleX = *m_particleX;
+	float voxelSize = 2 * m_shapeFunction.supportRadius() * m_gridSize;
+	
+	m_sortKeys.resize( m_particleInds.size() );
+	for( size_t i=0; i < m_particleInds.size(); ++i )
+	{
+		Eigen::Vector3f x = particleX[ m_particleInds[i] ] / voxelSize;
+		m_sortKeys[i].first = Eigen::Vector3i( (int)floor( x[0] ), (int)floor( x[1] ), (int)floor( x[2] ) );
+		m_sortKeys[i].second = m_particleInds[i];
+	}
+	
+	// insertion sort on the voxel coordinates, which is linear time if hardly anything's moved
+	// voxel. If it looks like a lot of particles have moved we bail out and do a full sort:
+	VoxelKeyComparator less;
+	size_t moves = 0;
+	size_t maxMoves = 8 * m_sortKeys.size();
+	for( size_t i=1; i < m_sortKeys.size(); ++i )
+	{
+		if( !less( m_sortKeys[i], m_sortKeys[i-1] ) )
+		{
+			continue;
+		}
+		std::pair< Eigen::Vector3i, int > key = m_sortKeys[i];
+		size_t j = i;
+		for( ; j > 0 && less( key, m_sortKeys[j-1] ); --j )
+		{
+			m_sortKeys[j] = m_sortKeys[j-1];
+		}
+		m_sortKeys[j] = key;
+		moves += i - j;
+		if( moves > maxMoves )
+		{
+			std::sort( m_sortKeys.begin(), m_sortKeys.end(), less );
+			break;
+		}
+	}
+	
+	for( size_t i=0; i < m_particleInds.size(); ++i )
+	{
+		m_particleInds[i] = m_sortKeys[i].second;
+	}
+}
+
+void Grid::groupParticlesByMaterial()
+{
+	if( !m_particleMaterials.valid() || m_particleInds.empty() )
+	{
+		return;
+	}
+	
+	const std::vector<Eigen::Vector3f>& particleX = *m_particleX;
+	const std::vector<int>& particleMaterials = *m_particleMaterials;
+	float voxelSize = 2 * m_shapeFunction.supportRadius() * m_gridSize;
+	
+	// find each voxel's run of particles, and sort it by material if it isn't grouped already. The
+	// runs are sorted, so that just means checking the materials don't go down anywhere:
+	Sim::IndexIterator voxelBegin = m_particleInds.begin();
+	Eigen::Vector3i currentVoxel = Eigen::Vector3i::Zero();
+	bool grouped = true;
+	for( Sim::IndexIterator it = m_particleInds.begin(); ; ++it )
+	{
+		Eigen::Vector3i voxel;
+		if( it != m_particleInds.end() )
+		{
+			Eigen::Vector3f x = particleX[ *it ] / voxelSize;
+			voxel = Eigen::Vector3i( (int)floor( x[0] ), (int)floor( x[1] ), (int)floor( x[2] ) );
+			if( it == voxelBegin )
+			{
+				currentVoxel = voxel;
+				continue;
+			}
+		}
+		
+		if( it == m_particleInds.end() || voxel != currentVoxel )
+		{
+			if( !grouped )
+			{
+				std::stable_sort( voxelBegin, it, MaterialComparator( particleMaterials ) );
+			}
+			if( it == m_particleInds.end() )
+			{
+				break;
+			}
+			voxelBegin = it;
+			currentVoxel = voxel;
+			grouped = true;
+		}
+		else if( particleMaterials[ *it ] < particleMaterials[ *( it - 1 ) ] )
+		{
+			grouped = false;
+		}
+	}
+}
+
+void Grid::computeProcessingPartitions()
+{
+	for( int i=0; i < 8; ++i )
+	{
+		m_processingPartitions[i&1][(i&2) / 2][(i&4) / 4].clear();
+	}
+	
+	if (m_particleInds.empty())
+		return;
+
+	const std::vector<Eigen::Vector3f>& particleX = *m_particleX;
+	
+	// now imagine chopping space up into little 2x2x2 voxel blocks. All
+	// the voxels in the (0,0,0) corners go in processingPartitions[0][0][0],
+	// all the voxels in the (1,0,0) corners go in processingPartitions[1][0][0],
+	// etc etc.
+	Eigen::Vector3i currentVoxel = Eigen::Vector3i::Zero();
+	Sim::ConstIndexIterator begin = m_particleInds.begin();
+	Sim::ConstIndexIterator end = m_particleInds.end();
+	Sim::ConstIndexIterator* partitionEnd = 0;
+	
+	float voxelSize = 2 * m_shapeFunction.supportRadius() * m_gridSize;
+	for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+	{
+		Eigen::Vector3f x = particleX[ *it ] / voxelSize;
+		Eigen::Vector3i voxel( (int)floor( x[0] ), (int)floor( x[1] ), (int)floor( x[2] ) );
+		if( voxel != currentVoxel || it == begin )
+		{
+			currentVoxel = voxel;
+			ParticlesInVoxelList& partition = m_processingPartitions[ voxel[0]&1 ][ voxel[1]&1 ][ voxel[2]&1 ];
+			partition.push_back( std::make_pair( it, it ) );
+			partitionEnd = &partition.back().second;
+		}
+		++*partitionEnd;
+	}
+}
+
+const Grid::ParticlesInVoxelList& Grid::processingPartition( int i, int j, int k ) const
+{
+	return m_processingPartitions[i][j][k];
+}
+
+Eigen::Vector3i Grid::processingVoxel( int p ) const
+{
+	// this has to match computeProcessingPartitions():
+	float voxelSize = 2 * m_shapeFunction.supportRadius() * m_gridSize;
+	Eigen::Vector3f x = m_particleX.get( p ) / voxelSize;
+	return Eigen::Vector3i( (int)floor( x[0] ), (int)floor( x[1] ), (int)floor( x[2] ) );
+}
+
+void Grid::particleNodes( Sim::ConstIndexIterator particle, std::vector<int>& nodes ) const
+{
+	ShapeFunctionIterator& shIt = shapeFunctionIterator();
+	shIt.initialize( particle );
+	do
+	{
+		nodes.push_back( shIt.index() );
+	} while( shIt.next() );
+}
+
+
+class Grid::ForceSplatter : public Grid::StencilSplatter< Grid::ForceSplatter >
+{
+public:
+	
+	ForceSplatter(
+		const Grid& g,
+		Eigen::VectorXf& result,
+		const ConstitutiveModel& constitutiveModel
+	)
+		:
+		Grid::StencilSplatter< Grid::ForceSplatter >( g, result ),
+		m_particleVolumes( *g.m_particleVolumes ),
+		m_particleF( g.m_particleF ),
+		m_constitutiveModel( constitutiveModel )
+	{
+	}
+
+	template< class ShapeFunctionIteratorT >
+	void splatParticles(
+		ShapeFunctionIteratorT& shIt,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& forces
+	) const
+	{
+		Vector3f weightGrad;
+		Eigen::Matrix3f stresses[ StressBatchSize ];
+
+		while( begin != end )
+		{
+			Sim::ConstIndexIterator batchEnd = begin + std::min<std::ptrdiff_t>( end - begin, StressBatchSize );
+			m_constitutiveModel.dEnergyDensitydF( begin, batchEnd, stresses );
+			
+			const Eigen::Matrix3f* stress = stresses;
+			for( Sim::ConstIndexIterator it = begin; it != batchEnd; ++it, ++stress )
+			{
+				int p = *it;
+				Eigen::Matrix3f forceMatrix = m_particleVolumes[p] * *stress * m_particleF.get( p ).transpose();
+				shIt.initialize( it, true );
+				do
+				{
+					shIt.dw( weightGrad );
+					int idx = shIt.index();
+					forces.segment<3>( 3 * idx ) -= forceMatrix * weightGrad;
+				} while( shIt.next() );
+			}
+			begin = batchEnd;
+		}
+	}
+	
+	bool splatParticlesVectorised(
+		const StencilKernels& kernels,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& forces
+	) const
+	{
+		Eigen::Matrix3f stresses[ StressBatchSize ];
+		
+		while( begin != end )
+		{
+			Sim::ConstIndexIterator batchEnd = begin + std::min<std::ptrdiff_t>( end - begin, StressBatchSize );
+			m_constitutiveModel.dEnergyDensitydF( begin, batchEnd, stresses );
+			
+			const Eigen::Matrix3f* stress = stresses;
+			for( Sim::ConstIndexIterator it = begin; it != batchEnd; ++it, ++stress )
+			{
+				int p = *it;
+				Eigen::Matrix3f forceMatrix = m_particleVolumes[p] * *stress * m_particleF.get( p ).transpose();
+				kernels.splatForce( m_g.stencil( it ), forceMatrix, forces.data() );
+			}
+			begin = batchEnd;
+		}
+		return true;
+	}
+	
+private:
+
+	const std::vector<float>& m_particleVolumes;
+	const MaterialPointData::Handle<Eigen::Matrix3f>& m_particleF;
+	const ConstitutiveModel& m_constitutiveModel;
+};
+
+
+void Grid::calculateForces(
+	VectorXf& forces,
+	const ConstitutiveModel& constitutiveModel,
+	const ForceField::ForceFieldSet& fields ) const
+{
+	forces.setZero();
+
+	// force fields:
+	for( int idx=0; idx < m_masses.size(); ++idx )
+	{
+		Eigen::Vector3f f = forces.segment<3>(3 * idx);
+		fields.force( f, nodePosition( idx ), m_masses[idx] );
+		forces.segment<3>(3 * idx) = f;
+	}
+	
+	// add on internal forces:
+	ForceSplatter s( *this, forces, constitutiveModel );
+	splat( s );
+}
+
+
+class Grid::dFidXiSplatter : public Grid::StencilSplatter< Grid::dFidXiSplatter >
+{
+public:
+	
+	dFidXiSplatter(
+		const Grid& g,
+		Eigen::VectorXf& result,
+		const ConstitutiveModel& constitutiveModel
+	)
+		:
+		Grid::StencilSplatter< Grid::dFidXiSplatter >( g, result ),
+		m_particleVolumes( *g.m_particleVolumes ),
+		m_particleF( g.m_particleF ),
+		m_constitutiveModel( constitutiveModel )
+	{
+	}
+	
+	template< class ShapeFunctionIteratorT >
+	void splatParticles(
+		ShapeFunctionIteratorT& shIt,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& dfidxi
+	) const
+	{
+		Vector3f weightGrad;
+		for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+		{
+			int p = *it;
+			const Matrix3f F = m_particleF.get( p );
+
+			// work out deformation gradient differential for this particle when grid nodes are
+			// all moved one unit in the x, y and z directions:
+			Matrix3f dFpX = Matrix3f::Zero();
+			Matrix3f dFpY = Matrix3f::Zero();
+			Matrix3f dFpZ = Matrix3f::Zero();
+			shIt.initialize( it, true );
+			do
+			{
+				shIt.dw( weightGrad );
+				int idx = shIt.index();
+				dFpX = Eigen::Vector3f(1,0,0) * weightGrad.transpose() * F;
+				dFpY = Eigen::Vector3f(0,1,0) * weightGrad.transpose() * F;
+				dFpZ = Eigen::Vector3f(0,0,1) * weightGrad.transpose() * F;
+				
+				Matrix3f forceMatrixX =
+					m_particleVolumes[p] *
+					m_constitutiveModel.dEdFDifferential( dFpX, p ) *
+					F.transpose();
+				Matrix3f forceMatrixY =
+					m_particleVolumes[p] *
+					m_constitutiveModel.dEdFDifferential( dFpY, p ) *
+					F.transpose();
+				Matrix3f forceMatrixZ =
+					m_particleVolumes[p] *
+					m_constitutiveModel.dEdFDifferential( dFpZ, p ) *
+					F.transpose();
+
+				dfidxi[ 3 * idx   ] += (-forceMatrixX * weightGrad)[0];
+				dfidxi[ 3 * idx+1 ] += (-forceMatrixY * weightGrad)[1];
+				dfidxi[ 3 * idx+2 ] += (-forceMatrixZ * weightGrad)[2];
+			} while( shIt.next() );
+		}
+	}
+	
+	const std::vector<float>& m_particleVolumes;
+	const MaterialPointData::Handle<Eigen::Matrix3f>& m_particleF;
+	const ConstitutiveModel& m_constitutiveModel;
+};
+
+void Grid::dForceidXi(
+	Eigen::VectorXf& dfdxi, 
+	const ConstitutiveModel& constitutiveModel ) const
+{
+	dfdxi = Eigen::VectorXf::Constant( m_velocities.size(), 0.0f );
+	dFidXiSplatter s( *this, dfdxi, constitutiveModel );
+	splat( s );
+}
+
+
+class Grid::dFidXiBlockSplatter : public Grid::StencilSplatter< Grid::dFidXiBlockSplatter >
+{
+public:
+	
+	dFidXiBlockSplatter(
+		const Grid& g,
+		Eigen::VectorXf& result,
+		const ConstitutiveModel& constitutiveModel,
+		const float* stiffness
+	)
+		:
+		Grid::StencilSplatter< Grid::dFidXiBlockSplatter >( g, result ),
+		m_constitutiveModel( constitutiveModel ),
+		m_stiffness( stiffness )
+	{
+	}
+	
+	template< class ShapeFunctionIteratorT >
+	void splatParticles(
+		ShapeFunctionIteratorT& shIt,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& blocks
+	) const
+	{
+		float batchStiffness[ 81 * StiffnessBatchSize ];
+		Matrix<float, 9, 6> q;
+		Vector3f g;
+		while( begin != end )
+		{
+			Sim::ConstIndexIterator batchEnd = begin + std::min<std::ptrdiff_t>( end - begin, StiffnessBatchSize );
+			for( const float* k = stiffness( begin, batchEnd, batchStiffness ); begin != batchEnd; ++begin, k += 81 )
+			{
+				symmetricBlocks( k, q );
+				shIt.initialize( begin, true );
+				do
+				{
+					shIt.dw( g );
+					Matrix<float, 6, 1> gg;
+					gg << g[0] * g[0], g[1] * g[1], g[2] * g[2], g[0] * g[1], g[0] * g[2], g[1] * g[2];
+					Map< Matrix<float, 9, 1> >( &blocks[ 9 * shIt.index() ] ) -= q * gg;
+				} while( shIt.next() );
+			}
+		}
+	}
+	
+	// The weight gradient's separable, so along a row of the stencil the products of its components
+	// are the x weights and derivatives times a few numbers that are fixed for the row. That lets us
+	// update the four blocks in a row with three outer products:
+	bool splatParticlesVectorised(
+		const StencilKernels&,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& blocks
+	) const
+	{
+		float batchStiffness[ 81 * StiffnessBatchSize ];
+		Matrix<float, 9, 6> q;
+		while( begin != end )
+		{
+			Sim::ConstIndexIterator batchEnd = begin + std::min<std::ptrdiff_t>( end - begin, StiffnessBatchSize );
+			for( const float* k = stiffness( begin, batchEnd, batchStiffness ); begin != batchEnd; ++begin, k += 81 )
+			{
+				symmetricBlocks( k, q );
+				StencilKernels::Stencil s = m_g.stencil( begin );
+				Map< const Array4f > wx( s.weights );
+				Map< const Array4f > dwx( s.weights + 12 );
+				const float* wy = s.weights + 4;
+				const float* wz = s.weights + 8;
+				const float* dwy = s.weights + 16;
+				const float* dwz = s.weights + 20;
+				Matrix<float, 1, 4> dwx2 = ( dwx * dwx ).matrix().transpose();
+				Matrix<float, 1, 4> wx2 = ( wx * wx ).matrix().transpose();
+				Matrix<float, 1, 4> wxdwx = ( wx * dwx ).matrix().transpose();
+				for( int z=0; z < s.numSlices; ++z )
+				{
+					for( int y=0; y < 4; ++y )
+					{
+						float a = wy[y] * wz[z];
+						float b = dwy[y] * wz[z];
+						float c = wy[y] * dwz[z];
+						Map< Matrix<float, 9, 4> > row( &blocks[ 9 * ( s.base + y * s.rowStride + z * s.sliceStride ) ] );
+						row.noalias() -= ( q.col( 0 ) * ( a * a ) ) * dwx2;
+						row.noalias() -= ( q.col( 1 ) * ( b * b ) + q.col( 2 ) * ( c * c ) + q.col( 5 ) * ( b * c ) ) * wx2;
+						row.noalias() -= ( q.col( 3 ) * ( a * b ) + q.col( 4 ) * ( a * c ) ) * wxdwx;
+					}
+				}
+			}
+		}
+		return true;
+	}
+	
+private:
+	
+	// stiffness matrices for the particles from begin to end, which can't be more than StiffnessBatchSize.
+	// We use the cached ones if we've got them, otherwise it's nine stress differentials per particle,
+	// worked out into scratch:
+	const float* stiffness( Sim::ConstIndexIterator begin, Sim::ConstIndexIterator end, float* scratch ) const
+	{
+		if( m_stiffness )
+		{
+			return m_stiffness + 81 * ( begin - m_g.m_particleInds.begin() );
+		}
+		m_g.computeStiffness( begin, end, m_constitutiveModel, scratch );
+		return scratch;
+	}
+	
+	// Moving a node by one unit along axis a gives a displacement gradient of e_a * g^T, where g is
+	// the node's weight gradient, and the force on the node is then -forceMatrix * g. The force matrix
+	// is linear in the gradient, so the node's block comes out as -sum( g_b * g_c * K_bc ), where K_bc
+	// is the 3x3 block of the stiffness matrix taking column c of the gradient to column b of the force
+	// matrix. g_b * g_c is symmetric in b and c, so we add K_bc and K_cb together, and put the six sums
+	// in the columns of q in the order xx, yy, zz, xy, xz, yz:
+	static void symmetricBlocks( const float* k, Matrix<float, 9, 6>& q )
+	{
+		Map< const Matrix<float, 9, 9> > stiffness( k );
+		Map<Matrix3f>( q.col( 0 ).data() ) = stiffness.block<3, 3>( 0, 0 );
+		Map<Matrix3f>( q.col( 1 ).data() ) = stiffness.block<3, 3>( 3, 3 );
+		Map<Matrix3f>( q.col( 2 ).data() ) = stiffness.block<3, 3>( 6, 6 );
+		Map<Matrix3f>( q.col( 3 ).data() ) = stiffness.block<3, 3>( 0, 3 ) + stiffness.block<3, 3>( 3, 0 );
+		Map<Matrix3f>( q.col( 4 ).data() ) = stiffness.block<3, 3>( 0, 6 ) + stiffness.block<3, 3>( 6, 0 );
+		Map<Matrix3f>( q.col( 5 ).data() ) = stiffness.block<3, 3>( 3, 6 ) + stiffness.block<3, 3>( 6, 3 );
+	}
+	
+	const ConstitutiveModel& m_constitutiveModel;
+	const float* m_stiffness;
+};
+
+void Grid::dForceidXiBlocks(
+	Eigen::VectorXf& blocks, 
+	const ConstitutiveModel& constitutiveModel ) const
+{
+	blocks = Eigen::VectorXf::Constant( 3 * m_velocities.size(), 0.0f );
+	dFidXiBlockSplatter s( *this, blocks, constitutiveModel, m_stiffnessCached ? &m_stiffness[0] : 0 );
+	splat( s );
+}
+
+
+class Grid::ForceDifferentialSplatter : public Grid::StencilSplatter< Grid::ForceDifferentialSplatter >
+{
+public:
+	
+	ForceDifferentialSplatter(
+		const Grid& g,
+		Eigen::VectorXf& result,
+		const ConstitutiveModel& constitutiveModel,
+		const Eigen::VectorXf& dx,
+		const float* stiffness
+	)
+		:
+		Grid::StencilSplatter< Grid::ForceDifferentialSplatter >( g, result ),
+		m_particleVolumes( *g.m_particleVolumes ),
+		m_particleF( g.m_particleF ),
+		m_dx( dx ),
+		m_constitutiveModel( constitutiveModel ),
+		m_stiffness( stiffness )
+	{
+	}
+	
+	template< class ShapeFunctionIteratorT >
+	void splatParticles(
+		ShapeFunctionIteratorT& shIt,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& df
+	) const
+	{
+		Vector3f weightGrad;
+		if( m_stiffness )
+		{
+			// gather the displacement gradient at each particle and multiply it by its stiffness matrix:
+			for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+			{
+				Matrix3f gradient = Matrix3f::Zero();
+				shIt.initialize( it, true );
+				do
+				{
+					shIt.dw( weightGrad );
+					int idx = shIt.index();
+					gradient += m_dx.segment<3>( 3 * idx ) * weightGrad.transpose();
+				} while( shIt.next() );
+				
+				Matrix3f forceMatrix = stiffnessMultiply( it, gradient );
+				
+				shIt.initialize( it, true );
+				do
+				{
+					shIt.dw( weightGrad );
+					int idx = shIt.index();
+					df.segment<3>( 3 * idx ) -= forceMatrix * weightGrad;
+				} while( shIt.next() );
+			}
+			return;
+		}
+		
+		Matrix3f dFps[ StressBatchSize ];
+		Matrix3f stressDifferentials[ StressBatchSize ];
+		
+		while( begin != end )
+		{
+			Sim::ConstIndexIterator batchEnd = begin + std::min<std::ptrdiff_t>( end - begin, StressBatchSize );
+			
+			// work out deformation gradient differentials for this batch of particles when grid nodes are
+			// all moved by their respective dx
+			Matrix3f* dFp = dFps;
+			for( Sim::ConstIndexIterator it = begin; it != batchEnd; ++it, ++dFp )
+			{
+				const Matrix3f F = m_particleF.get( *it );
+				dFp->setZero();
+				shIt.initialize( it, true );
+				do
+				{
+					shIt.dw( weightGrad );
+					int idx = shIt.index();
+					*dFp += m_dx.segment<3>( 3 * idx ) * weightGrad.transpose() * F;
+				} while( shIt.next() );
+			}
+			
+			m_constitutiveModel.dEdFDifferential( dFps, begin, batchEnd, stressDifferentials );
+			
+			const Matrix3f* dStress = stressDifferentials;
+			for( Sim::ConstIndexIterator it = begin; it != batchEnd; ++it, ++dStress )
+			{
+				int p = *it;
+				Matrix3f forceMatrix =
+					m_particleVolumes[p] *
+					*dStress *
+					m_particleF.get( p ).transpose();
+				
+				shIt.initialize( it, true );
+				do
+				{
+					shIt.dw( weightGrad );
+					int idx = shIt.index();
+					
+					// add on difference in velocity due to this force:
+					df.segment<3>( 3 * idx ) -= forceMatrix * weightGrad;
+							
+				} while( shIt.next() );
+			}
+			begin = batchEnd;
+		}
+	}
+	
+	bool splatParticlesVectorised(
+		const StencilKernels& kernels,
+		Sim::ConstIndexIterator begin,
+		Sim::ConstIndexIterator end,
+		Eigen::VectorXf& df
+	) const
+	{
+		if( m_stiffness )
+		{
+			for( Sim::ConstIndexIterator it = begin; it != end; ++it )
+			{
+				StencilKernels::Stencil s = m_g.stencil( it );
+				Matrix3f forceMatrix = stiffnessMultiply( it, kernels.gatherGradient( s, m_dx.data() ) );
+				kernels.splatForce( s, forceMatrix, df.data() );
+			}
+			return true;
+		}
+		
+		Matrix3f dFps[ StressBatchSize ];
+		Matrix3f stressDifferentials[ StressBatchSize ];
+		
+		while( begin != end )
+		{
+			Sim::ConstIndexIterator batchEnd = begin + std::min<std::ptrdiff_t>( end - begin, StressBatchSize );
+			
+			Matrix3f* dFp = dFps;
+			for( Sim::ConstIndexIterator it = begin; it != batchEnd; ++it, ++dFp )
+			{
+				*dFp = kernels.gatherGradient( m_g.stencil( it ), m_dx.data() ) * m_particleF.get( *it );
+			}
+			
+			m_constitutiveModel.dEdFDifferential( dFps, begin, batchEnd, stressDifferentials );
+			
+			const Matrix3f* dStress = stressDifferentials;
+			for( Sim::ConstIndexIterator it = begin; it != batchEnd; ++it, ++dStress )
+			{
+				int p = *it;
+				Matrix3f forceMatrix =
+					m_particleVolumes[p] *
+					*dStress *
+					m_particleF.get( p ).transpose();
+				kernels.splatForce( m_g.stencil( it ), forceMatrix, df.data() );
+			}
+			begin = batchEnd;
+		}
+		return true;
+	}
+	
+	// applies a particle's cached stiffness matrix to the displacement gradient at the particle:
+	Matrix3f stiffnessMultiply( Sim::ConstIndexIterator particle, const Matrix3f& gradient ) const
+	{
+		const float* k = m_stiffness + 81 * ( particle - m_g.m_particleInds.begin() );
+		Matrix3f forceMatrix;
+		Map< Matrix<float, 9, 1> >( forceMatrix.data() ) =
+			Map< const Matrix<float, 9, 9> >( k ) * Map< const Matrix<float, 9, 1> >( gradient.data() );
+		return forceMatrix;
+	}
+	
+	const std::vector<float>& m_particleVolumes;
+	const MaterialPointData::Handle<Eigen::Matrix3f>& m_particleF;
+	const Eigen::VectorXf& m_dx;
+	const ConstitutiveModel& m_constitutiveModel;
+	const float* m_stiffness;
+};
+
+class Grid::StiffnessCacher
+{
+public:
+	
+	StiffnessCacher( Grid& g, const ConstitutiveModel& constitutiveModel )
+		: m_g( g ), m_constitutiveModel( constitutiveModel )
+	{
+	}
+	
+	void operator()( const tbb::blocked_range<size_t>& r ) const
+	{
+		for( size_t batchBegin = r.begin(); batchBegin < r.end(); batchBegin += StiffnessBatchSize )
+		{
+			size_t batchEnd = std::min( r.end(), batchBegin + StiffnessBatchSize );
+			m_g.computeStiffness(
+				m_g.m_particleInds.begin() + batchBegin,
+				m_g.m_particleInds.begin() + batchEnd,
+				m_constitutiveModel,
+				&m_g.m_stiffness[ 81 * batchBegin ]
+			);
+		}
+	}
+	
+private:
+	
+	Grid& m_g;
+	const ConstitutiveModel& m_constitutiveModel;
+	
+};
+
+void Grid::computeStiffness( Sim::ConstIndexIterator begin, Sim::ConstIndexIterator end, const ConstitutiveModel& constitutiveModel, float* stiffness ) const
+{
+	const std::vector<float>& particleVolumes = *m_particleVolumes;
+	const MaterialPointData::Handle<Eigen::Matrix3f>& particleF = m_particleF;
+	Matrix3f dFps[ StiffnessBatchSize ];
+	Matrix3f stressDifferentials[ StiffnessBatchSize ];
+	
+	// the force matrix is linear in the displacement gradient, so we can get the stiffness matrix
+	// a column at a time by feeding in a gradient with a single non zero component. That gives
+	// a deformation gradient differential of dFp = gradient * F, which only has one non zero row:
+	for( int c=0; c < 9; ++c )
+	{
+		int row = c % 3;
+		int col = c / 3;
+		Matrix3f* dFp = dFps;
+		for( Sim::ConstIndexIterator it = begin; it != end; ++it, ++dFp )
+		{
+			dFp->setZero();
+			dFp->row( row ) = particleF.get( *it ).row( col );
+		}
+		
+		constitutiveModel.dEdFDifferential( dFps, begin, end, stressDifferentials );
+		
+		const Matrix3f* dStress = stressDifferentials;
+		float* k = stiffness + 9 * c;
+		for( Sim::ConstIndexIterator it = begin; it != end; ++it, ++dStress, k += 81 )
+		{
+			int p = *it;
+			Matrix3f forceMatrix = particleVolumes[p] * *dStress * particleF.get( p ).transpose();
+			Map< Matrix<float, 9, 1> > column( k );
+			column = Map< const Matrix<float, 9, 1> >( forceMatrix.data() );
+		}
+	}
+}
+
+void Grid::cacheStiffness( const ConstitutiveModel& constitutiveModel )
+{
+	m_stiffness.resize( 81 * m_particleInds.size() );
+	tbb::parallel_for( tbb::blocked_range<size_t>( 0, m_particleInds.size() ), StiffnessCacher( *this, constitutiveModel ) );
+	m_stiffnessCached = !m_particleInds.empty();
+}
+
+void Grid::calculateForceDifferentials(
+		VectorXf& df,
+		const VectorXf& dx,
+		const ConstitutiveModel& constitutiveModel,
+		const ForceField::ForceFieldSet& fields
+) const
+{
+	// TODO: this doesn't deal with force fields which vary in space
+	df.resize( m_velocities.size() );
+	df.setZero();
+	ForceDifferentialSplatter s( *this, df, constitutiveModel, dx, m_stiffnessCached ? &m_stiffness[0] : 0 );
+	splat( s );
+}
+
+void Grid::addForceDifferentials(
+		VectorXf& df,
+		const VectorXf& dx,
+		const ConstitutiveModel& constitutiveModel,
+		const ParticlesInVoxelList& voxels
+) const
+{
+	ForceDifferentialSplatter s( *this, df, constitutiveModel, dx, m_stiffnessCached ? &m_stiffness[0] : 0 );
+	for( ParticlesInVoxelList::const_iterator v = voxels.begin(); v != voxels.end(); ++v )
+	{
+		s.splatVoxel( v->first, v->second, df );
+	}
+}
+
+void Grid::calculateExplicitMomenta(
+	VectorXf& explicitMomenta,
+	std::vector<char>& nodeCollided,
+	float timeStep,
+	const ConstitutiveModel& constitutiveModel,
+	const CollisionObject::CollisionObjectSet& collisionObjects,
+	const ForceField::ForceFieldSet& fields
+)
+{
+	// work out forces on grid points:
+	VectorXf forces( m_velocities.size() );
+	calculateForces( forces, constitutiveModel, fields );
+	
+	// work out explicit velocity update, and convert it to momenta:
+	explicitMomenta.resize( m_velocities.size() );
+	nodeCollided.resize( m_masses.size() );
+	for( int idx=0; idx < m_masses.size(); ++idx )
+	{
+		Vector3f force = forces.segment<3>( 3 * idx );
+		Vector3f velocity = m_velocities.segment<3>( 3 * idx );
+		Vector3f explicitVelocity = velocity;
+		if( m_masses[idx] > 0 )
+		{
+			explicitVelocity += timeStep * force / m_masses[idx];
+		}
+
+		// which collision objects affect this node? -1 means none, -2 means more than one, >= 0
+		// is the object index:
+		Vector3f x = nodePosition( idx );
+		nodeCollided[idx] = collisionObjects.collide( explicitVelocity, x, m_frameVelocity );
+		explicitMomenta.segment<3>( 3 * idx ) = explicitVelocity * m_masses[idx];
+		float prod = explicitMomenta[ 3 * idx ] * explicitMomenta[ 3 * idx + 1 ] * explicitMomenta[ 3 * idx + 2 ];
+		#ifdef WIN32
+		if( !_finite(prod) )
+		#else
+		if( isinff(prod) || isnanf(prod) )
+		#endif
+		{
+			std::cerr << "x: " << x.transpose() << std::endl;
+			std::cerr << "force: " << force.transpose() << std::endl;
+			std::cerr << "velocity: " << velocity.transpose() << std::endl;
+			std::cerr << "explicitVelocity: " << explicitVelocity.transpose() << std::endl;
+			std::cerr << "mass: " << m_masses[idx] << std::endl;
+			throw std::runtime_error( "nan in explicit momenta!" );
+		}
+	}
+	
+}
+
+void Grid::collisionVelocities(
+	Eigen::VectorXf& vc,
+	const CollisionObject::CollisionObjectSet& collisionObjects,
+	const std::vector<char>& nodeCollided
+) const
+{
+	vc.resize( m_velocities.size() );
+	for( int idx=0; idx < m_masses.size(); ++idx )
+	{
+		if( nodeCollided[idx] < 0 )
+		{
+			vc.segment<3>( 3 * idx ).setZero();
+		}
+		else
+		{
+			Vector3f x = nodePosition( idx );
+			const CollisionObject* obj = collisionObjects.object( nodeCollided[idx] );
+			
+			Vector3f vObj;
+			obj->velocity( x, vObj );
+			// express collision velocity relative to moving frame:
+			vc.segment<3>( 3 * idx ) = vObj - m_frameVelocity;
+		}
 	}
 
 }
@@ -741,6 +1752,7 @@ Grid::ImplicitUpdateMatrix::ImplicitUpdateMatrix(const MaterialPointData& d,
 , m_collisionObjects( collisionObjects )
 , m_fields( fields )
 , m_timeStep( timeStep )
+, m_multiplies( 0 )
 {
 }
 
@@ -749,6 +1761,7 @@ void Grid::ImplicitUpdateMatrix::multVector( const Eigen::VectorXf& vNPlusOne, E
 	// This method computes the forward momenta in this frame in terms of the velocities
 	// in the next frame:
 	// m * v^(n+1) - m_timeStep * dF(v^(n+1) * m_timeStep)
+	++m_multiplies;
 
 	// apply collisions to input:
 	result = vNPlusOne;
@@ -768,6 +1781,11 @@ void Grid::ImplicitUpdateMatrix::multVector( const Eigen::VectorXf& vNPlusOne, E
 	subspaceProject( result );
 }
 
+int Grid::ImplicitUpdateMatrix::multiplies() const
+{
+	return m_multiplies;
+}
+
 void Grid::ImplicitUpdateMatrix::multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
 {
 	// not implemented
@@ -775,43 +1793,14 @@ void Grid::ImplicitUpdateMatrix::multInverseVector( const Eigen::VectorXf& x, Ei
 
 void Grid::ImplicitUpdateMatrix::subspaceProject( Eigen::VectorXf& toProject ) const
 {
-	for( int i=0; i < m_g.m_n[0]; ++i )
+	for( int idx=0; idx < m_g.m_masses.size(); ++idx )
 	{
-		for( int j=0; j < m_g.m_n[1]; ++j )
+		if( m_g.m_nodeCollided[idx] == -1 )
 		{
-			for( int k=0; k < m_g.m_n[2]; ++k )
-			{
-				int idx = m_g.coordsToIndex( i, j, k );
-				int objIdx = m_g.m_nodeCollided[idx];
-				if( objIdx == -1 )
-				{
-					// no collision
-					continue;
-				}
-				else if( objIdx == -2 )
-				{
-					// more than one collision: set to zero
-					toProject.segment<3>( 3 * idx ).setZero();
-				}
-				else
-				{
-					const CollisionObject* obj = m_collisionObjects.object( objIdx );
-					Vector3f v = toProject.segment<3>( 3 * idx );
-
-					// find object normal:
-					Vector3f x( m_g.m_gridSize * i + m_g.m_min[0], m_g.m_gridSize * j + m_g.m_min[1], m_g.m_gridSize * k + m_g.m_min[2] );
-					Vector3f n;
-					obj->grad( x, n );
-					n.normalize();
-					float nDotP = n.dot( v );
-
-					// project out component perpendicular to the object
-					v -= nDotP * n;
-					toProject.segment<3>( 3 * idx ) = v;
-				}
-
-			}
+			// no collision
+			continue;
 		}
+		toProject.segment<3>( 3 * idx ) = m_g.collisionProjection( idx, m_collisionObjects ) * toProject.segment<3>( 3 * idx );
 	}
 }
 
@@ -822,7 +1811,14 @@ Grid::DiagonalPreconditioner::DiagonalPreconditioner(const Grid& g,
 												     const ConstitutiveModel& constitutiveModel,
 													 float timeStep)
 	{
-		g.dForceidXi( m_implicitUpdateDiagonal, constitutiveModel );
+		// the diagonals of the blocks cost less to work out than dForceidXi() does:
+		VectorXf blocks;
+		g.dForceidXiBlocks( blocks, constitutiveModel );
+		m_implicitUpdateDiagonal.resize( g.m_velocities.size() );
+		for( int i=0; i < m_implicitUpdateDiagonal.size(); ++i )
+		{
+			m_implicitUpdateDiagonal[i] = blocks[ 9 * ( i / 3 ) + 4 * ( i % 3 ) ];
+		}
 		m_implicitUpdateDiagonal *= - timeStep * timeStep;
 		for( int i=0; i < g.m_masses.size(); ++i )
 		{
@@ -890,173 +1886,701 @@ void Grid::updateGridVelocities(
 	Eigen::Vector3f collidedMomentum = Eigen::Vector3f::Zero();
 	for( int idx=0; idx<m_masses.size(); ++idx )
 	{
-		totalMass += m_masses[idx];
-		totalMomentum += explicitMomenta.segment<3>( 3*idx );
-		if( m_nodeCollided[idx] >= 0 )
+		totalMass += m_masses[idx];
+		totalMomentum += explicitMomenta.segment<3>( 3*idx );
+		if( m_nodeCollided[idx] >= 0 )
+		{
+			collidedMass += m_masses[idx];
+			collidedMomentum += m_masses[idx] * vc.segment<3>( 3*idx );
+		}
+	}
+	Eigen::Vector3f initialGuessVelocity;
+	if( totalMass == 0 )
+	{
+		initialGuessVelocity.setZero();
+	}
+	else if( collidedMass == 0 )
+	{
+		// use centre of mass velocity as an initial guess:
+		initialGuessVelocity = totalMomentum / totalMass;
+	}
+	else
+	{
+		// use velocity of collision objects as an initial guess:
+		initialGuessVelocity = collidedMomentum / collidedMass;
+	}
+	
+	std::cerr <<  "initial guess velocity: " << initialGuessVelocity << std::endl;
+	for( int idx=0; idx<m_masses.size(); ++idx )
+	{
+		m_velocities.segment<3>( 3*idx ) = initialGuessVelocity;
+	}
+	
+	// start from the previous solves if we've got them, keeping the uniform guess so we can fall back
+	// on it if they're no good:
+	VectorXf uniformGuess;
+	if( m_initialGuess != Sim::CentreOfMassGuess && !m_solvedVelocities[0].empty() )
+	{
+		uniformGuess = m_velocities;
+		if( !warmStartVelocities( vc, timeStep ) )
+		{
+			uniformGuess.resize( 0 );
+		}
+	}
+	
+	// looks like this works pretty well for when things are in freefall actually, although
+	// it still kind of sucks for resting contact. Maybe the solver's termination criterion
+	// is wrong? Perhaps I can make a little class to make that configurable?
+	// It'd probably help to include angular velocity too innit.
+
+	// My understanding of why it works is that the low frequency modes are the ones the
+	// solver finds most difficult to resolve, and this gets the lowest frequency mode
+	// right first time
+
+	// the constitutive model's not going to change during the solve, so if stiffness caching's on we
+	// can work out how each particle responds to deformation up front:
+	if( m_stiffnessCaching )
+	{
+		cacheStiffness( constitutiveModel );
+	}
+	
+	ImplicitUpdateMatrix implicitMatrix( m_d, *this, constitutiveModel, collisionObjects, fields, timeStep );
+	
+	// what's the forward update gonna look like?
+	// v^(n) = collide ( v^(n+1) - M^-1 f^(n+1) dt - vc ) + vc
+	// vr^(n) = collide ( vr^(n+1) - M^-1 f^(n+1) dt )
+	// vr^(n) = collide ( vr^(n+1) - M^-1 F( x^n+1 ) dt )
+	// vr^(n) = collide ( vr^(n+1) - M^-1 F( x^n + v^(n+1) dt ) dt )
+	// vr^(n) = collide ( vr^(n+1) - M^-1 * F( x^n ) dt - M^-1 * DF * v^(n+1) * dt * dt )
+	
+	// We gotta solve this for vr^(n+1), then add of vc to get v^(n+1).
+	// collide( v ) isn't linear though. What we'll do, (and I should really work out if this
+	// is actually justified shouldn't I...) is just brainlessly take shit over the other side:
+
+	// collide ( vr^(n) + M^-1 * F( x^n ) dt ) = P * ( vr^(n+1) - M^-1 * DF * v^(n+1) * dt * dt )
+	// collide ( vr^(n) + M^-1 * F( x^n ) dt ) = P * ( vr^(n+1) - M^-1 * DF * ( vr^(n+1) + vc ) * dt * dt )
+	// M * collide ( vr^(n) + M^-1 * F( x^n ) dt ) = P * ( M * vr^(n+1) - DF * ( vr^(n+1) + vc ) * dt * dt )
+	// ... = P * ( M * vr^(n+1) - DF * vr^(n+1) * dt * dt - DF * vc * dt * dt )
+	// ... = P * ( M * vr^(n+1) - DF * vr^(n+1) * dt * dt ) - P * DF * vc * dt * dt
+
+	// P * ( M - DF * dt * dt ) * vr^(n+1) = M * collide ( vr^(n) + M^-1 * F( x^n ) dt ) + P * DF * vc * dt * dt
+	// implicitMatrix * vr^(n+1) = explicitMomenta + P * DF * vc * dt * dt
+	
+	// todo: I guess we need to get the semi implicit stuff working too
+
+	// work out the P * DF * vc * dt * dt term and add it onto explicitMomenta:
+	VectorXf df( m_velocities.size() );
+	calculateForceDifferentials( df, vc, constitutiveModel, fields );
+	implicitMatrix.subspaceProject( df );
+
+	// so subtract the extra term onto the explicit momenta:
+	for( int idx=0; idx<m_masses.size(); ++idx )
+	{
+		explicitMomenta.segment<3>( 3 * idx ) += timeStep * timeStep * df.segment<3>( 3 * idx );
+		float prod = explicitMomenta[ 3 * idx ] * explicitMomenta[ 3 * idx + 1 ] * explicitMomenta[ 3 * idx + 2 ];
+		#ifdef WIN32
+		if( !_finite(prod) )
+		#else
+		if( isinff(prod) || isnanf(prod) )
+		#endif
+		{
+			std::cerr << "df: " << df.segment<3>( 3 * idx ).transpose() << std::endl;
+			std::cerr << "explicitMomentum: " << explicitMomenta.segment<3>( 3 * idx ).transpose() << std::endl;
+			throw std::runtime_error( "nan in explicit momenta!" );
+		}
+	}
+	
+	// Use whichever initial guess has the smaller residual. The previous velocities are usually much
+	// closer, but they can be way off if the body's just hit something, or been split up or joined
+	// with another one:
+	if( uniformGuess.size() )
+	{
+		VectorXf residual;
+		implicitMatrix.multVector( m_velocities, residual );
+		float warmStartResidual = ( explicitMomenta - residual ).squaredNorm();
+		implicitMatrix.multVector( uniformGuess, residual );
+		float uniformResidual = ( explicitMomenta - residual ).squaredNorm();
+		if( uniformResidual < warmStartResidual )
+		{
+			m_velocities.swap( uniformGuess );
+		}
+	}
+	int guessMultiplies = implicitMatrix.multiplies();
+	
+	// solve the linear system for the velocities relative to the collision objects:
+	std::unique_ptr<BlockDiagonalPreconditioner> blockDiagonal;
+	std::unique_ptr<ProceduralMatrix> innerPreconditioner;
+	std::unique_ptr<ProceduralMatrix> preconditioner;
+	VectorXf freshPreconditionerBlocks;
+	if( m_multigridLevels > 1 )
+	{
+		updateCoarseGrids();
+		for( size_t i=0; i < m_coarseGrids.size(); ++i )
+		{
+			Grid& coarse = *m_coarseGrids[i];
+			coarse.collideNodes( collisionObjects );
+			if( m_stiffnessCaching )
+			{
+				coarse.cacheStiffness( constitutiveModel );
+			}
+		}
+		preconditioner.reset( new MultigridPreconditioner( *this, implicitMatrix, constitutiveModel, collisionObjects, fields, timeStep ) );
+	}
+	else
+	{
+		// the stiffness blocks are the expensive part, so use the ones we're hanging on to if we've got them:
+		if( m_reusedPreconditionerBlocks.size() != 9 * m_masses.size() )
+		{
+			m_reusedPreconditionerBlocks.resize( 0 );
+			dForceidXiBlocks( freshPreconditionerBlocks, constitutiveModel );
+		}
+		blockDiagonal.reset(
+			new BlockDiagonalPreconditioner(
+				*this,
+				freshPreconditionerBlocks.size() ? freshPreconditionerBlocks : m_reusedPreconditionerBlocks,
+				collisionObjects,
+				timeStep
+			)
+		);
+		if( m_schwarzSubdomainSize > 0 )
+		{
+			// the subdomain solves use the blocks for their jacobi iterations:
+			innerPreconditioner.reset( new SchwarzPreconditioner( *this, *blockDiagonal, constitutiveModel, collisionObjects, timeStep, m_schwarzSubdomainSize ) );
+		}
+		else
+		{
+			innerPreconditioner.reset( blockDiagonal.release() );
+		}
+		
+		if( m_chebyshevDegree > 1 )
+		{
+			preconditioner.reset( new ChebyshevPreconditioner( implicitMatrix, *innerPreconditioner, m_chebyshevDegree ) );
+		}
+		else
+		{
+			preconditioner = std::move( innerPreconditioner );
+		}
+	}
+	std::unique_ptr<LinearSolver> implicitSolver;
+	if( m_pipelinedSolve )
+	{
+		implicitSolver.reset( new PipelinedConjugateResiduals( termination, preconditioner.get() ) );
+	}
+	else if( m_recycleSize > 0 )
+	{
+		remapRecycleSpace();
+		implicitSolver.reset( new RecycledConjugateResiduals( termination, m_recycleSpace, m_recycleSize, preconditioner.get() ) );
+	}
+	else
+	{
+		implicitSolver.reset( new ConjugateResiduals( termination, preconditioner.get() ) );
+	}
+	(*implicitSolver)(
+		implicitMatrix,
+		explicitMomenta,
+		m_velocities,
+		d );
+	m_lastSolveMultiplies = implicitMatrix.multiplies() - guessMultiplies;
+	if( m_recycleSize > 0 && !m_pipelinedSolve )
+	{
+		m_recycleLayout.store( *this );
+	}
+	
+	// hang on to new preconditioner blocks if we're reusing them, using this solve as the benchmark
+	// for when they've got too stale. Otherwise, see if the ones we've got have had it:
+	if( m_preconditionerReuse > 0 && freshPreconditionerBlocks.size() )
+	{
+		m_reusedPreconditionerBlocks.swap( freshPreconditionerBlocks );
+		m_reusedPreconditionerMultiplies = m_lastSolveMultiplies;
+	}
+	else if( m_lastSolveMultiplies > ( 1 + m_preconditionerReuse ) * m_reusedPreconditionerMultiplies )
+	{
+		m_reusedPreconditionerBlocks.resize( 0 );
+	}
+	
+	// the particles are about to get updated, so the stiffness matrices will be out of date:
+	m_stiffnessCached = false;
+	for( size_t i=0; i < m_coarseGrids.size(); ++i )
+	{
+		m_coarseGrids[i]->m_stiffnessCached = false;
+	}
+	
+	// work out velocities relative to the grid:
+	m_velocities += vc;
+	
+	// hang on to them for the next solve's initial guess:
+	if( m_initialGuess != Sim::CentreOfMassGuess && !termination.cancelled() )
+	{
+		m_solvedVelocities[1].swap( m_solvedVelocities[0] );
+		m_solvedVelocities[0].store( *this, timeStep );
+	}
+	
+}
+
+class Grid::DeformationGradientGatherer
+{
+public:
+	
+	DeformationGradientGatherer( const Grid& g, float timeStep )
+		:
+		m_g( g ),
+		m_timeStep( timeStep ),
+		m_particleF( g.m_particleF )
+	{
+	}
+	
+	template< class ShapeFunctionIteratorT >
+	void operator()( ShapeFunctionIteratorT& shIt )
+	{
+		Vector3f weightGrad;
+		Matrix3f delV;
+		
+		Sim::ConstIndexIterator it = m_g.m_particleInds.begin();
+		Sim::ConstIndexIterator end = m_g.m_particleInds.end();
+		for( ; it != end; ++it )
+		{
+			int p = *it;
+			delV.setZero();
+			shIt.initialize( it, true );
+			do
+			{
+				shIt.dw( weightGrad );
+				int idx = shIt.index();
+				delV += m_g.m_velocities.segment<3>( 3 * idx ) * weightGrad.transpose();
+			} while( shIt.next() );
+			
+			Matrix3f newParticleF = ( Matrix3f::Identity() + m_timeStep * delV ) * m_particleF.get( p );
+			m_particleF.set( p, newParticleF );
+		}
+	}
+	
+	// same again using the grid's SIMD kernels:
+	void gatherVectorised( const StencilKernels& kernels )
+	{
+		Sim::ConstIndexIterator it = m_g.m_particleInds.begin();
+		Sim::ConstIndexIterator end = m_g.m_particleInds.end();
+		for( ; it != end; ++it )
+		{
+			int p = *it;
+			Matrix3f delV = kernels.gatherGradient( m_g.stencil( it ), m_g.m_velocities.data() );
+			Matrix3f newParticleF = ( Matrix3f::Identity() + m_timeStep * delV ) * m_particleF.get( p );
+			m_particleF.set( p, newParticleF );
+		}
+	}
+	
+private:
+	
+	const Grid& m_g;
+	float m_timeStep;
+	const MaterialPointData::Handle<Eigen::Matrix3f>& m_particleF;
+	
+};
+
+void Grid::updateDeformationGradients( float timeStep )
+{
+	DeformationGradientGatherer g( *this, timeStep );
+	if( m_kernels )
+	{
+		g.gatherVectorised( *m_kernels );
+	}
+	else
+	{
+		dispatchStencil( g );
+	}
+}
+
+class Grid::ParticleVelocityGatherer
+{
+public:
+	
+	ParticleVelocityGatherer( const Grid& g )
+		:
+		m_g( g ),
+		m_particleV( *g.m_particleV )
+	{
+	}
+	
+	template< class ShapeFunctionIteratorT >
+	void operator()( ShapeFunctionIteratorT& shIt )
+	{
+		const float alpha = 0.95f;
+
+		// blend FLIP and PIC, as pure FLIP allows spurious particle motion
+		// inside the cells:
+		Sim::ConstIndexIterator it = m_g.m_particleInds.begin();
+		Sim::ConstIndexIterator end = m_g.m_particleInds.end();
+		for( ; it != end; ++it )
+		{
+			int p = *it;
+
+			Vector3f vFlip = m_particleV[p];
+			Vector3f vPic = Vector3f::Zero();
+			shIt.initialize( it );
+			do
+			{
+				// soo... should I be interpolating momentum here instead? Need to experiment...
+				int idx = shIt.index();
+				float w = shIt.w();
+				vFlip += w * ( m_g.m_velocities.segment<3>( 3 * idx ) - m_g.m_prevVelocities.segment<3>( 3 * idx ) );
+				vPic += w * ( m_g.m_velocities.segment<3>( 3 * idx ) + m_g.m_frameVelocity );
+			} while( shIt.next() );
+			m_particleV[p] = alpha * vFlip + ( 1.0f - alpha ) * vPic;
+		}
+	}
+	
+	// same again using the grid's SIMD kernels:
+	void gatherVectorised( const StencilKernels& kernels )
+	{
+		const float alpha = 0.95f;
+		
+		Sim::ConstIndexIterator it = m_g.m_particleInds.begin();
+		Sim::ConstIndexIterator end = m_g.m_particleInds.end();
+		for( ; it != end; ++it )
+		{
+			int p = *it;
+			StencilKernels::Stencil s = m_g.stencil( it );
+			Vector3f v = kernels.gatherValue( s, m_g.m_velocities.data() );
+			Vector3f vPrev = kernels.gatherValue( s, m_g.m_prevVelocities.data() );
+			
+			// the stencil weights are separable, so they sum to the product of the sums along each axis:
+			float wSum[3] = { 0, 0, 0 };
+			for( int i=0; i < 4; ++i )
+			{
+				wSum[0] += s.weights[i];
+				wSum[1] += s.weights[4 + i];
+			}
+			for( int k=0; k < s.numSlices; ++k )
+			{
+				wSum[2] += s.weights[8 + k];
+			}
+			
+			Vector3f vFlip = m_particleV[p] + v - vPrev;
+			Vector3f vPic = v + ( wSum[0] * wSum[1] * wSum[2] ) * m_g.m_frameVelocity;
+			m_particleV[p] = alpha * vFlip + ( 1.0f - alpha ) * vPic;
+		}
+	}
+	
+private:
+	
+	const Grid& m_g;
+	std::vector<Eigen::Vector3f>& m_particleV;
+	
+};
+
+void Grid::updateParticleVelocities()
+{
+	ParticleVelocityGatherer g( *this );
+	if( m_kernels )
+	{
+		g.gatherVectorised( *m_kernels );
+	}
+	else
+	{
+		dispatchStencil( g );
+	}
+}
+
+int Grid::coordsToIndex( int i, int j, int k ) const
+{
+	if( !m_sparse )
+	{
+		return i + m_n[0] * ( j + m_n[1] * k );
+	}
+	
+	int slot = blockSlot( blockKey( i >> m_blockShift[0], j >> m_blockShift[1], k >> m_blockShift[2] ) );
+	if( slot < 0 )
+	{
+		return -1;
+	}
+	
+	int li = i & ( ( 1 << m_blockShift[0] ) - 1 );
+	int lj = j & ( ( 1 << m_blockShift[1] ) - 1 );
+	int lk = k & ( ( 1 << m_blockShift[2] ) - 1 );
+	return slot * m_blockNodes + li + ( ( lj + ( lk << m_blockShift[1] ) ) << m_blockShift[0] );
+}
+
+void Grid::indexToCoords( int idx, Eigen::Vector3i& coords ) const
+{
+	if( !m_sparse )
+	{
+		coords[0] = idx % m_n[0];
+		idx /= m_n[0];
+		coords[1] = idx % m_n[1];
+		coords[2] = idx / m_n[1];
+		return;
+	}
+	
+	BlockKey key = m_blockKeys[ idx / m_blockNodes ];
+	int local = idx % m_blockNodes;
+	const BlockKey mask = ( 1 << 21 ) - 1;
+	coords[0] = ( int( key & mask ) << m_blockShift[0] ) + ( local & ( ( 1 << m_blockShift[0] ) - 1 ) );
+	local >>= m_blockShift[0];
+	coords[1] = ( int( ( key >> 21 ) & mask ) << m_blockShift[1] ) + ( local & ( ( 1 << m_blockShift[1] ) - 1 ) );
+	local >>= m_blockShift[1];
+	coords[2] = ( int( ( key >> 42 ) & mask ) << m_blockShift[2] ) + local;
+}
+
+Eigen::Vector3f Grid::nodePosition( int idx ) const
+{
+	Vector3i coords;
+	indexToCoords( idx, coords );
+	return coords.cast<float>() * m_gridSize + m_min;
+}
+
+const Eigen::VectorXf& Grid::masses() const
+{
+	return m_masses;
+}
+
+bool Grid::nodeCollided( int idx ) const
+{
+	return m_nodeCollided[idx] != -1;
+}
+
+void Grid::nodeWeights( const Eigen::Vector3f& p, std::vector<int>& nodes, std::vector<float>& weights ) const
+{
+	ShapeFunctionIterator& shIt = shapeFunctionIterator();
+	shIt.initialize( p );
+	do
+	{
+		// nodes in blocks a sparse grid hasn't allocated come out with negative indices:
+		float w = shIt.w();
+		int idx = shIt.index();
+		if( w != 0 && idx >= 0 )
 		{
-			collidedMass += m_masses[idx];
-			collidedMomentum += m_masses[idx] * vc.segment<3>( 3*idx );
+			nodes.push_back( idx );
+			weights.push_back( w );
 		}
-	}
-	Eigen::Vector3f initialGuessVelocity;
-	if( totalMass == 0 )
+	} while( shIt.next() );
+}
+
+const MaterialPointData& Grid::particleData() const
+{
+	return m_d;
+}
+
+size_t Grid::numCoarseGrids() const
+{
+	return m_coarseGrids.size();
+}
+
+const Grid& Grid::coarseGrid( size_t i ) const
+{
+	return *m_coarseGrids[i];
+}
+
+Eigen::Vector3i Grid::gridOrigin() const
+{
+	// m_min is always a whole number of cells from the origin:
+	Vector3i origin;
+	for( int j=0; j < 3; ++j )
 	{
-		initialGuessVelocity.setZero();
+		origin[j] = int( floor( m_min[j] / m_gridSize + 0.5f ) );
 	}
-	else if( collidedMass == 0 )
+	return origin;
+}
+
+Grid::NodeLayout::NodeLayout() :
+	m_origin( Vector3i::Zero() ),
+	m_n( Vector3i::Zero() )
+{
+}
+
+void Grid::NodeLayout::store( const Grid& g )
+{
+	m_origin = g.gridOrigin();
+	m_n = g.m_n;
+	m_blockKeys = g.m_blockKeys;
+}
+
+void Grid::NodeLayout::clear()
+{
+	m_origin.setZero();
+	m_n.setZero();
+	m_blockKeys.clear();
+}
+
+bool Grid::NodeLayout::matches( const Grid& g ) const
+{
+	return m_origin == g.gridOrigin() && m_n == g.m_n && m_blockKeys == g.m_blockKeys;
+}
+
+int Grid::NodeLayout::index( const Grid& g, const Eigen::Vector3i& coords ) const
+{
+	Vector3i local = coords - m_origin;
+	for( int j=0; j < 3; ++j )
 	{
-		// use centre of mass velocity as an initial guess:
-		initialGuessVelocity = totalMomentum / totalMass;
+		if( local[j] < 0 || local[j] >= m_n[j] )
+		{
+			return -1;
+		}
 	}
-	else
+	
+	// same as Grid::coordsToIndex(), but with our layout:
+	if( !g.m_sparse )
 	{
-		// use velocity of collision objects as an initial guess:
-		initialGuessVelocity = collidedMomentum / collidedMass;
+		return local[0] + m_n[0] * ( local[1] + m_n[1] * local[2] );
 	}
 	
-	std::cerr <<  "initial guess velocity: " << initialGuessVelocity << std::endl;
-	for( int idx=0; idx<m_masses.size(); ++idx )
+	BlockKey key = g.blockKey( local[0] >> g.m_blockShift[0], local[1] >> g.m_blockShift[1], local[2] >> g.m_blockShift[2] );
+	std::vector<BlockKey>::const_iterator it = std::lower_bound( m_blockKeys.begin(), m_blockKeys.end(), key );
+	if( it == m_blockKeys.end() || *it != key )
 	{
-		m_velocities.segment<3>( 3*idx ) = initialGuessVelocity;
+		return -1;
 	}
-	
-	// looks like this works pretty well for when things are in freefall actually, although
-	// it still kind of sucks for resting contact. Maybe the solver's termination criterion
-	// is wrong? Perhaps I can make a little class to make that configurable?
-	// It'd probably help to include angular velocity too innit.
+	int li = local[0] & ( ( 1 << g.m_blockShift[0] ) - 1 );
+	int lj = local[1] & ( ( 1 << g.m_blockShift[1] ) - 1 );
+	int lk = local[2] & ( ( 1 << g.m_blockShift[2] ) - 1 );
+	return int( it - m_blockKeys.begin() ) * g.m_blockNodes + li + ( ( lj + ( lk << g.m_blockShift[1] ) ) << g.m_blockShift[0] );
+}
 
-	// My understanding of why it works is that the low frequency modes are the ones the
-	// solver finds most difficult to resolve, and this gets the lowest frequency mode
-	// right first time
+void Grid::NodeLayout::swap( NodeLayout& other )
+{
+	std::swap( m_origin, other.m_origin );
+	std::swap( m_n, other.m_n );
+	m_blockKeys.swap( other.m_blockKeys );
+}
 
-	ImplicitUpdateMatrix implicitMatrix( m_d, *this, constitutiveModel, collisionObjects, fields, timeStep );
-	
-	// what's the forward update gonna look like?
-	// v^(n) = collide ( v^(n+1) - M^-1 f^(n+1) dt - vc ) + vc
-	// vr^(n) = collide ( vr^(n+1) - M^-1 f^(n+1) dt )
-	// vr^(n) = collide ( vr^(n+1) - M^-1 F( x^n+1 ) dt )
-	// vr^(n) = collide ( vr^(n+1) - M^-1 F( x^n + v^(n+1) dt ) dt )
-	// vr^(n) = collide ( vr^(n+1) - M^-1 * F( x^n ) dt - M^-1 * DF * v^(n+1) * dt * dt )
-	
-	// We gotta solve this for vr^(n+1), then add of vc to get v^(n+1).
-	// collide( v ) isn't linear though. What we'll do, (and I should really work out if this
-	// is actually justified shouldn't I...) is just brainlessly take shit over the other side:
+Grid::SolvedVelocities::SolvedVelocities() :
+	m_frameVelocity( Vector3f::Zero() ),
+	m_timeStep( 0 )
+{
+}
 
-	// collide ( vr^(n) + M^-1 * F( x^n ) dt ) = P * ( vr^(n+1) - M^-1 * DF * v^(n+1) * dt * dt )
-	// collide ( vr^(n) + M^-1 * F( x^n ) dt ) = P * ( vr^(n+1) - M^-1 * DF * ( vr^(n+1) + vc ) * dt * dt )
-	// M * collide ( vr^(n) + M^-1 * F( x^n ) dt ) = P * ( M * vr^(n+1) - DF * ( vr^(n+1) + vc ) * dt * dt )
-	// ... = P * ( M * vr^(n+1) - DF * vr^(n+1) * dt * dt - DF * vc * dt * dt )
-	// ... = P * ( M * vr^(n+1) - DF * vr^(n+1) * dt * dt ) - P * DF * vc * dt * dt
+void Grid::SolvedVelocities::store( const Grid& g, float timeStep )
+{
+	m_velocities = g.m_velocities;
+	m_occupied.resize( g.m_masses.size() );
+	for( int idx=0; idx < g.m_masses.size(); ++idx )
+	{
+		m_occupied[idx] = g.m_masses[idx] > 0;
+	}
+	m_frameVelocity = g.m_frameVelocity;
+	m_timeStep = timeStep;
+	m_layout.store( g );
+}
 
-	// P * ( M - DF * dt * dt ) * vr^(n+1) = M * collide ( vr^(n) + M^-1 * F( x^n ) dt ) + P * DF * vc * dt * dt
-	// implicitMatrix * vr^(n+1) = explicitMomenta + P * DF * vc * dt * dt
-	
-	// todo: I guess we need to get the semi implicit stuff working too
+void Grid::SolvedVelocities::clear()
+{
+	m_velocities.resize( 0 );
+	m_occupied.clear();
+	m_layout.clear();
+	m_timeStep = 0;
+}
 
-	// work out the P * DF * vc * dt * dt term and add it onto explicitMomenta:
-	VectorXf df( m_velocities.size() );
-	calculateForceDifferentials( df, vc, constitutiveModel, fields );
-	implicitMatrix.subspaceProject( df );
+bool Grid::SolvedVelocities::empty() const
+{
+	return m_occupied.empty();
+}
 
-	// so subtract the extra term onto the explicit momenta:
-	for( int idx=0; idx<m_masses.size(); ++idx )
+float Grid::SolvedVelocities::timeStep() const
+{
+	return m_timeStep;
+}
+
+bool Grid::SolvedVelocities::velocity( const Grid& g, const Eigen::Vector3i& coords, Eigen::Vector3f& v ) const
+{
+	if( m_occupied.empty() )
 	{
-		explicitMomenta.segment<3>( 3 * idx ) += timeStep * timeStep * df.segment<3>( 3 * idx );
-		float prod = explicitMomenta[ 3 * idx ] * explicitMomenta[ 3 * idx + 1 ] * explicitMomenta[ 3 * idx + 2 ];
-		#ifdef WIN32
-		if( !_finite(prod) )
-		#else
-		if( isinff(prod) || isnanf(prod) )
-		#endif
-		{
-			std::cerr << "df: " << df.segment<3>( 3 * idx ).transpose() << std::endl;
-			std::cerr << "explicitMomentum: " << explicitMomenta.segment<3>( 3 * idx ).transpose() << std::endl;
-			throw std::runtime_error( "nan in explicit momenta!" );
-		}
+		return false;
 	}
 	
-	// solve the linear system for the velocities relative to the collision objects:
-	DiagonalPreconditioner preconditioner( *this, constitutiveModel, timeStep );
-	ConjugateResiduals implicitSolver( termination, &preconditioner );
-	implicitSolver(
-		implicitMatrix,
-		explicitMomenta,
-		m_velocities,
-		d );
-	
-	// work out velocities relative to the grid:
-	m_velocities += vc;
-	
+	int idx = m_layout.index( g, coords );
+	if( idx < 0 || !m_occupied[idx] )
+	{
+		return false;
+	}
+	v = m_velocities.segment<3>( 3 * idx ) + m_frameVelocity;
+	return true;
 }
 
-void Grid::updateDeformationGradients( float timeStep )
+void Grid::SolvedVelocities::swap( SolvedVelocities& other )
 {
-	
-	const std::vector<Eigen::Vector3f>& particleX = m_d.variable<Vector3f>("p");
-	std::vector<Eigen::Matrix3f>& particleF = m_d.variable<Matrix3f>("F");
+	m_velocities.swap( other.m_velocities );
+	m_occupied.swap( other.m_occupied );
+	std::swap( m_frameVelocity, other.m_frameVelocity );
+	std::swap( m_timeStep, other.m_timeStep );
+	m_layout.swap( other.m_layout );
+}
 
-	ShapeFunctionIterator& shIt = shapeFunctionIterator();
-	Vector3f weightGrad;
-	Vector3i particleCell;
-	Matrix3f delV;
+bool Grid::warmStartVelocities( const Eigen::VectorXf& vc, float timeStep )
+{
+	const SolvedVelocities& previous = m_solvedVelocities[0];
+	const SolvedVelocities& beforeThat = m_solvedVelocities[1];
+	bool extrapolate = m_initialGuess == Sim::ExtrapolatedVelocityGuess && !beforeThat.empty() && previous.timeStep() > 0;
 	
-	Sim::ConstIndexIterator it = m_particleInds.begin();
-	Sim::ConstIndexIterator end = m_particleInds.end();
-	for( ; it != end; ++it )
+	Vector3i origin = gridOrigin();
+	bool covered = false;
+	for( int idx=0; idx < m_masses.size(); ++idx )
 	{
-		int p = *it;
-		delV.setZero();
-		shIt.initialize( particleX[p], true );
-		do
-		{
-			shIt.gridPos( particleCell );
-			shIt.dw( weightGrad );
-			int idx = coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-			delV += m_velocities.segment<3>( 3 * idx ) * weightGrad.transpose();
-		} while( shIt.next() );
+		if( m_masses[idx] <= 0 )
+		{
+			continue;
+		}
+		Vector3i coords;
+		indexToCoords( idx, coords );
+		coords += origin;
+		
+		Vector3f v;
+		if( !previous.velocity( *this, coords, v ) )
+		{
+			continue;
+		}
+		Vector3f vBefore;
+		if( extrapolate && beforeThat.velocity( *this, coords, vBefore ) )
+		{
+			v += ( timeStep / previous.timeStep() ) * ( v - vBefore );
+		}
 		
-		Matrix3f newParticleF = ( Matrix3f::Identity() + timeStep * delV ) * particleF[p];
-		particleF[p] = newParticleF;
+		// the solver works with velocities relative to the grid and the collision objects:
+		m_velocities.segment<3>( 3 * idx ) = v - m_frameVelocity - vc.segment<3>( 3 * idx );
+		covered = true;
 	}
+	return covered;
 }
 
-void Grid::updateParticleVelocities()
+void Grid::remapRecycleSpace()
 {
-	const std::vector<Eigen::Vector3f>& particleX = m_d.variable<Vector3f>("p");
-	std::vector<Eigen::Vector3f>& particleV = m_d.variable<Vector3f>("v");
+	if( m_recycleSpace.empty() || m_recycleLayout.matches( *this ) )
+	{
+		return;
+	}
 	
-	Grid::ShapeFunctionIterator& shIt = shapeFunctionIterator();
-	Vector3i particleCell;
+	// find where each node with mass was before:
+	Vector3i origin = gridOrigin();
+	std::vector<int> oldIndices( m_masses.size(), -1 );
+	bool covered = false;
+	for( int idx=0; idx < m_masses.size(); ++idx )
+	{
+		if( m_masses[idx] <= 0 )
+		{
+			continue;
+		}
+		Vector3i coords;
+		indexToCoords( idx, coords );
+		oldIndices[idx] = m_recycleLayout.index( *this, coords + origin );
+		covered |= oldIndices[idx] >= 0;
+	}
 	
-	const float alpha = 0.95f;
-
-	// blend FLIP and PIC, as pure FLIP allows spurious particle motion
-	// inside the cells:
-	Sim::ConstIndexIterator it = m_particleInds.begin();
-	Sim::ConstIndexIterator end = m_particleInds.end();
-	for( ; it != end; ++it )
+	if( !covered )
 	{
-		int p = *it;
-
-		Vector3f vFlip = particleV[p];
-		Vector3f vPic = Vector3f::Zero();
-		shIt.initialize( particleX[p] );
-		do
+		m_recycleSpace.clear();
+		return;
+	}
+	
+	for( size_t i=0; i < m_recycleSpace.size(); ++i )
+	{
+		VectorXf remapped = VectorXf::Zero( m_velocities.size() );
+		for( int idx=0; idx < m_masses.size(); ++idx )
 		{
-			// soo... should I be interpolating momentum here instead? Need to experiment...
-			shIt.gridPos( particleCell );
-			int idx = coordsToIndex( particleCell[0], particleCell[1], particleCell[2] );
-			float w = shIt.w();
-			vFlip += w * ( m_velocities.segment<3>( 3 * idx ) - m_prevVelocities.segment<3>( 3 * idx ) );
-			vPic += w * ( m_velocities.segment<3>( 3 * idx ) + m_frameVelocity );
-		} while( shIt.next() );
-		particleV[p] = alpha * vFlip + ( 1.0f - alpha ) * vPic;
+			if( oldIndices[idx] >= 0 )
+			{
+				remapped.segment<3>( 3 * idx ) = m_recycleSpace[i].segment<3>( 3 * oldIndices[idx] );
+			}
+		}
+		m_recycleSpace[i].swap( remapped );
 	}
-}
-
-int Grid::coordsToIndex( int i, int j, int k ) const
-{
-	return i + m_n[0] * ( j + m_n[1] * k );
+	m_recycleLayout.store( *this );
 }
 
 
@@ -1065,51 +2589,169 @@ int Grid::coordsToIndex( int i, int j, int k ) const
 
 
 
-Grid::ShapeFunctionIterator::ShapeFunctionIterator( const Grid& g )
-: m_grid( g )
-, m_diameter( 2 * g.m_shapeFunction.supportRadius() )
-, m_gradients(false)
-{
-	for( int dim=0; dim < 3; ++dim )
-	{
-		m_w[dim].resize( m_diameter, 1 );
-		m_dw[dim].resize( m_diameter, 0 );
-	}
-}
-
-void Grid::ShapeFunctionIterator::initialize( const Vector3f& p, bool computeDerivatives )
+void Grid::evaluateShapeFunctions(
+	const Eigen::Vector3f& p,
+	bool computeDerivatives,
+	Eigen::Vector3i& base,
+	float* weights,
+	int* blockSlots ) const
 {
-	m_gradients = computeDerivatives;
-	int r = (int)m_w[0].size() / 2;
-	m_pos.setZero();
-	m_base.setZero();
+	int r = m_shapeFunction.supportRadius();
+	int diameter = 2 * r;
+	base.setZero();
 
-	for( int dim=0; dim < m_grid.m_dimension; ++dim )
+	for( int dim=0; dim < 3; ++dim )
 	{
-		float fracDimPos = ( p[dim] - m_grid.m_min[dim] ) / m_grid.m_gridSize;
+		float* w = weights + dim * diameter;
+		float* dw = weights + ( 3 + dim ) * diameter;
+		if( dim >= m_dimension )
+		{
+			// only one node along axes we're not simulating:
+			std::fill( w, w + diameter, 1.0f );
+			std::fill( dw, dw + diameter, 0.0f );
+			continue;
+		}
+		
+		float fracDimPos = ( p[dim] - m_min[dim] ) / m_gridSize;
 		int dimPos = (int)floor( fracDimPos );
 		fracDimPos -= dimPos;
 		int j;
 		
-		m_base[ dim ] = dimPos + 1 - r;
+		base[ dim ] = dimPos + 1 - r;
+		
+		if( m_cubicBspline )
+		{
+			CubicBsplineShapeFunction::stencilWeights( fracDimPos, w, dw );
+			for( int i = 0; i < diameter; ++i )
+			{
+				dw[i] /= m_gridSize;
+			}
+			continue;
+		}
 		
 		j = 1-r;
-		for( int i = 0; i < m_diameter; ++i, ++j )
+		for( int i = 0; i < diameter; ++i, ++j )
 		{
-			m_w[dim][i] = m_grid.m_shapeFunction.w( j - fracDimPos );
+			w[i] = m_shapeFunction.w( j - fracDimPos );
 		}
 
 		if( computeDerivatives )
 		{
 			j = 1-r;
-			for( int i = 0; i < m_diameter; ++i, ++j )
+			for( int i = 0; i < diameter; ++i, ++j )
+			{
+				dw[i] = m_shapeFunction.dw( j - fracDimPos ) / m_gridSize;
+			}
+		}
+	}
+	
+	if( m_sparse )
+	{
+		// look up the blocks the stencil overlaps:
+		Vector3i blockBase, blockCount;
+		stencilBlocks( base, blockBase, blockCount );
+		int b = 0;
+		for( int k=0; k < blockCount[2]; ++k )
+		{
+			for( int j=0; j < blockCount[1]; ++j )
 			{
-				m_dw[dim][i] = m_grid.m_shapeFunction.dw( j - fracDimPos ) / m_grid.m_gridSize;
+				for( int i=0; i < blockCount[0]; ++i, ++b )
+				{
+					blockSlots[b] = blockSlot( blockKey( blockBase[0] + i, blockBase[1] + j, blockBase[2] + k ) );
+				}
 			}
 		}
 	}
 }
 
+class Grid::ShapeFunctionCacher
+{
+public:
+	
+	ShapeFunctionCacher( Grid& g ) : m_g( g ), m_particleX( *g.m_particleX )
+	{
+	}
+	
+	void operator()( const tbb::blocked_range<int>& r ) const
+	{
+		int numWeights = 6 * 2 * m_g.m_shapeFunction.supportRadius();
+		for( int i = r.begin(); i != r.end(); ++i )
+		{
+			m_g.evaluateShapeFunctions(
+				m_particleX[ m_g.m_particleInds[i] ],
+				true,
+				m_g.m_stencilBases[i],
+				&m_g.m_stencilWeights[ i * numWeights ],
+				m_g.m_sparse ? &m_g.m_stencilBlockSlots[ i * m_g.m_maxStencilBlocks ] : 0
+			);
+		}
+	}
+	
+private:
+	
+	Grid& m_g;
+	const std::vector<Eigen::Vector3f>& m_particleX;
+	
+};
+
+void Grid::cacheShapeFunctions()
+{
+	int n = (int)m_particleInds.size();
+	m_stencilBases.resize( n );
+	m_stencilWeights.resize( n * 6 * 2 * m_shapeFunction.supportRadius() );
+	m_stencilBlockSlots.resize( n * m_maxStencilBlocks );
+	
+	ShapeFunctionCacher c( *this );
+	tbb::parallel_for( tbb::blocked_range<int>( 0, n ), c );
+}
+
+Grid::ShapeFunctionIterator::ShapeFunctionIterator( const Grid& g )
+: m_grid( g )
+, m_diameter( 2 * g.m_shapeFunction.supportRadius() )
+, m_weights( 6 * m_diameter, 0.0f )
+, m_blockSlotStorage( g.m_maxStencilBlocks )
+, m_gradients(false)
+{
+	m_base.setZero();
+	setStencil( &m_weights[0], 0 );
+}
+
+void Grid::ShapeFunctionIterator::initialize( const Vector3f& p, bool computeDerivatives )
+{
+	m_gradients = computeDerivatives;
+	int* blockSlots = m_blockSlotStorage.empty() ? 0 : &m_blockSlotStorage[0];
+	m_grid.evaluateShapeFunctions( p, computeDerivatives, m_base, &m_weights[0], blockSlots );
+	setStencil( &m_weights[0], blockSlots );
+}
+
+void Grid::ShapeFunctionIterator::initialize( Sim::ConstIndexIterator particle, bool computeDerivatives )
+{
+	// the cache always has derivatives in it, but we keep track of whether they were asked for
+	// so dw() behaves the same either way:
+	m_gradients = computeDerivatives;
+	int slot = int( particle - m_grid.m_particleInds.begin() );
+	m_base = m_grid.m_stencilBases[slot];
+	setStencil(
+		&m_grid.m_stencilWeights[ slot * 6 * m_diameter ],
+		m_grid.m_sparse ? &m_grid.m_stencilBlockSlots[ slot * m_grid.m_maxStencilBlocks ] : 0
+	);
+}
+
+void Grid::ShapeFunctionIterator::setStencil( const float* weights, const int* blockSlots )
+{
+	m_pos.setZero();
+	for( int dim=0; dim < 3; ++dim )
+	{
+		m_w[dim] = weights + dim * m_diameter;
+		m_dw[dim] = weights + ( 3 + dim ) * m_diameter;
+	}
+	m_blockSlots = blockSlots;
+	if( m_grid.m_sparse )
+	{
+		m_grid.stencilBlocks( m_base, m_blockBase, m_blockCount );
+	}
+}
+
 bool Grid::ShapeFunctionIterator::next()
 {
 
@@ -1151,6 +2793,18 @@ void Grid::ShapeFunctionIterator::gridPos( Eigen::Vector3i& pos ) const
 	pos[2] = m_pos[2] + m_base[2];
 }
 
+int Grid::ShapeFunctionIterator::index() const
+{
+	int i = m_pos[0] + m_base[0];
+	int j = m_pos[1] + m_base[1];
+	int k = m_pos[2] + m_base[2];
+	if( !m_grid.m_sparse )
+	{
+		return i + m_grid.m_n[0] * ( j + m_grid.m_n[1] * k );
+	}
+	return m_grid.sparseIndex( m_blockBase, m_blockCount, m_blockSlots, i, j, k );
+}
+
 void Grid::ShapeFunctionIterator::dw( Eigen::Vector3f& g ) const
 {
 	if( !m_gradients )
@@ -1177,5 +2831,18 @@ Grid::ShapeFunctionIterator& Grid::shapeFunctionIterator() const
 	return *pIt.get();
 }
 
+StencilKernels::Stencil Grid::stencil( Sim::ConstIndexIterator particle ) const
+{
+	int slot = int( particle - m_particleInds.begin() );
+	const Eigen::Vector3i& base = m_stencilBases[slot];
+	StencilKernels::Stencil s;
+	s.weights = &m_stencilWeights[ slot * 24 ];
+	s.rowStride = m_n[0];
+	s.sliceStride = m_n[0] * m_n[1];
+	s.base = base[0] + s.rowStride * base[1] + s.sliceStride * base[2];
+	s.numSlices = m_stencilType == Stencil4x4x4 ? 4 : 1;
+	return s;
+}
+
 
 
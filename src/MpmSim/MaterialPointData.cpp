@@ -5,7 +5,7 @@
 using namespace MpmSim;
 using namespace Eigen;
 
-MaterialPointData::MaterialPointData()
+MaterialPointData::MaterialPointData() : m_generation( 0 )
 {
 	// create default variables:
 	createVariable<Vector3f>("p");
@@ -23,11 +23,31 @@ MaterialPointData::~MaterialPointData()
 	}
 }
 
+bool MaterialPointData::hasVariable( const std::string& name ) const
+{
+	return m_variables.find( name ) != m_variables.end();
+}
+
 size_t MaterialPointData::numVariables() const
 {
 	return m_variables.size();
 }
 
+MaterialPointData::Layout MaterialPointData::layout( const std::string& name ) const
+{
+	return findVariable( name )->layout();
+}
+
+MaterialPointData::MaterialPointVariableBase* MaterialPointData::findVariable( const std::string& name ) const
+{
+	VariableMap::const_iterator it = m_variables.find( name );
+	if( it == m_variables.end() )
+	{
+		throw std::runtime_error( "Material point data has no variable named '" + name + "'" );
+	}
+	return it->second;
+}
+
 std::vector<std::string> MaterialPointData::variableNames() const
 {
 	std::vector<std::string> names;
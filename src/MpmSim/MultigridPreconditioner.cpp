@@ -0,0 +1,313 @@
+#include "tbb/parallel_for.h"
+
+#include "MpmSim/MultigridPreconditioner.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace Eigen;
+using namespace MpmSim;
+
+class MultigridPreconditioner::Transfer
+{
+public:
+	
+	// Builds the prolongation from coarse onto fine, by evaluating the coarse shape functions at the
+	// fine nodes, or its transpose, which is the restriction from fine onto coarse. Fine nodes without
+	// mass don't take part in the solve, so they're left out.
+	//
+	// Coarse nodes round the edges can also end up with next to no mass of their own, even though
+	// they overlap fine nodes with plenty. The coarse matrix is practically zero there, so jacobi
+	// would blow any residual we restricted onto them up to infinity. We leave those out too, by
+	// comparing each coarse node's mass with the fine mass that'd get restricted onto it:
+	Transfer( const Grid& fine, const Grid& coarse, bool restriction )
+	{
+		const float minMassFraction = 0.1f;
+		
+		const VectorXf& fineMasses = fine.masses();
+		const VectorXf& coarseMasses = coarse.masses();
+		
+		std::vector<int> fineNodes;
+		std::vector<int> coarseNodes;
+		std::vector<float> weights;
+		std::vector<float> restrictedMasses( coarseMasses.size(), 0.0f );
+		for( int i=0; i < fineMasses.size(); ++i )
+		{
+			if( fineMasses[i] <= 0 )
+			{
+				continue;
+			}
+			size_t firstEntry = coarseNodes.size();
+			coarse.nodeWeights( fine.nodePosition( i ), coarseNodes, weights );
+			fineNodes.resize( coarseNodes.size(), i );
+			for( size_t e = firstEntry; e < coarseNodes.size(); ++e )
+			{
+				restrictedMasses[ coarseNodes[e] ] += weights[e] * fineMasses[i];
+			}
+		}
+		
+		size_t numEntries = 0;
+		for( size_t e=0; e < weights.size(); ++e )
+		{
+			int c = coarseNodes[e];
+			if( coarseMasses[c] < minMassFraction * restrictedMasses[c] )
+			{
+				continue;
+			}
+			fineNodes[numEntries] = fineNodes[e];
+			coarseNodes[numEntries] = c;
+			weights[numEntries] = weights[e];
+			++numEntries;
+		}
+		fineNodes.resize( numEntries );
+		coarseNodes.resize( numEntries );
+		weights.resize( numEntries );
+		
+		const std::vector<int>& rows = restriction ? coarseNodes : fineNodes;
+		const std::vector<int>& columns = restriction ? fineNodes : coarseNodes;
+		int numRows = restriction ? (int)coarseMasses.size() : (int)fineMasses.size();
+		
+		// bucket the entries by row:
+		m_rowStarts.assign( numRows + 1, 0 );
+		for( size_t e=0; e < rows.size(); ++e )
+		{
+			++m_rowStarts[ rows[e] + 1 ];
+		}
+		for( int i=0; i < numRows; ++i )
+		{
+			m_rowStarts[i+1] += m_rowStarts[i];
+		}
+		m_columns.resize( rows.size() );
+		m_weights.resize( rows.size() );
+		std::vector<int> next( m_rowStarts.begin(), m_rowStarts.end() - 1 );
+		for( size_t e=0; e < rows.size(); ++e )
+		{
+			int slot = next[ rows[e] ]++;
+			m_columns[slot] = columns[e];
+			m_weights[slot] = weights[e];
+		}
+	}
+	
+	void apply( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const;
+	
+	std::vector<int> m_rowStarts;
+	std::vector<int> m_columns;
+	std::vector<float> m_weights;
+	
+};
+
+class MultigridPreconditioner::TransferMultiplier
+{
+public:
+	
+	TransferMultiplier( const Transfer& t, const Eigen::VectorXf& x, Eigen::VectorXf& result )
+		: m_t( t ), m_x( x ), m_result( result )
+	{
+	}
+	
+	void operator()( const tbb::blocked_range<int>& r ) const
+	{
+		for( int i = r.begin(); i != r.end(); ++i )
+		{
+			Vector3f sum = Vector3f::Zero();
+			for( int e = m_t.m_rowStarts[i]; e < m_t.m_rowStarts[i+1]; ++e )
+			{
+				sum += m_t.m_weights[e] * m_x.segment<3>( 3 * m_t.m_columns[e] );
+			}
+			m_result.segment<3>( 3 * i ) = sum;
+		}
+	}
+	
+private:
+	
+	const Transfer& m_t;
+	const Eigen::VectorXf& m_x;
+	Eigen::VectorXf& m_result;
+	
+};
+
+void MultigridPreconditioner::Transfer::apply( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	int numRows = (int)m_rowStarts.size() - 1;
+	result.resize( 3 * numRows );
+	tbb::parallel_for( tbb::blocked_range<int>( 0, numRows ), TransferMultiplier( *this, x, result ) );
+}
+
+class MultigridPreconditioner::Level
+{
+public:
+	
+	Level( const Grid& g, const Grid::ImplicitUpdateMatrix* matrix, const ConstitutiveModel& constitutiveModel, float timeStep )
+		: m_grid( g ), m_matrix( matrix ), m_diagonal( g, constitutiveModel, timeStep ), m_damping( 1 )
+	{
+	}
+	
+	const Grid& m_grid;
+	
+	// implicit update matrix for this level, and the diagonal we use for smoothing:
+	const Grid::ImplicitUpdateMatrix* m_matrix;
+	Grid::DiagonalPreconditioner m_diagonal;
+	
+	// damping factor for the jacobi iterations:
+	float m_damping;
+	
+	// the coarse levels own their matrices:
+	std::unique_ptr<Grid::ImplicitUpdateMatrix> m_ownedMatrix;
+	
+	// transfer operators between this level and the next coarsest one:
+	std::unique_ptr<Transfer> m_restriction;
+	std::unique_ptr<Transfer> m_prolongation;
+	
+};
+
+MultigridPreconditioner::MultigridPreconditioner(const Grid& g,
+												 const Grid::ImplicitUpdateMatrix& implicitMatrix,
+												 const ConstitutiveModel& constitutiveModel,
+												 const CollisionObject::CollisionObjectSet& collisionObjects,
+												 const ForceField::ForceFieldSet& fields,
+												 float timeStep)
+{
+	m_levels.push_back( std::unique_ptr<Level>( new Level( g, &implicitMatrix, constitutiveModel, timeStep ) ) );
+	for( size_t i=0; i < g.numCoarseGrids(); ++i )
+	{
+		const Grid& coarse = g.coarseGrid( i );
+		Grid::ImplicitUpdateMatrix* coarseMatrix = new Grid::ImplicitUpdateMatrix( coarse.particleData(), coarse, constitutiveModel, collisionObjects, fields, timeStep );
+		
+		Level& fineLevel = *m_levels.back();
+		fineLevel.m_restriction.reset( new Transfer( fineLevel.m_grid, coarse, true ) );
+		fineLevel.m_prolongation.reset( new Transfer( fineLevel.m_grid, coarse, false ) );
+		
+		Level* level = new Level( coarse, coarseMatrix, constitutiveModel, timeStep );
+		level->m_ownedMatrix.reset( coarseMatrix );
+		m_levels.push_back( std::unique_ptr<Level>( level ) );
+	}
+	
+	// The stiffness terms couple each node to loads of others, so the diagonal isn't very dominant and
+	// the usual 2/3 damping makes jacobi blow up. Instead we damp the smoothing by 4 / ( 3 * lambda ),
+	// where lambda is the largest eigenvalue of D^-1 * A. This damps the highest frequencies by a
+	// factor of 3, and the estimate's padded out a bit as the power iteration approaches it from below:
+	for( size_t i=0; i < m_levels.size(); ++i )
+	{
+		m_levels[i]->m_damping = 4.0f / ( 3.0f * 1.1f * maxEigenvalue( *m_levels[i] ) );
+	}
+}
+
+MultigridPreconditioner::~MultigridPreconditioner()
+{
+}
+
+void MultigridPreconditioner::multVector( const Eigen::VectorXf&, Eigen::VectorXf& ) const
+{
+	// the solvers only ever need multInverseVector():
+	throw std::runtime_error( "MultigridPreconditioner::multVector() isn't supported" );
+}
+
+void MultigridPreconditioner::multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	VectorXf b = x;
+	m_levels[0]->m_matrix->subspaceProject( b );
+	vCycle( 0, b, result );
+}
+
+void MultigridPreconditioner::subspaceProject( Eigen::VectorXf& x ) const
+{
+	m_levels[0]->m_matrix->subspaceProject( x );
+}
+
+void MultigridPreconditioner::vCycle( size_t l, const Eigen::VectorXf& b, Eigen::VectorXf& x ) const
+{
+	enum
+	{
+		CoarsestIterations = 4
+	};
+	
+	const Level& level = *m_levels[l];
+	x.resize( b.size() );
+	x.setZero();
+	
+	// there's nowhere further to go on the coarsest level, so just do a few more iterations:
+	if( l + 1 == m_levels.size() )
+	{
+		for( int i=0; i < CoarsestIterations; ++i )
+		{
+			smooth( level, b, x, i == 0 );
+		}
+		return;
+	}
+	
+	smooth( level, b, x, true );
+	
+	// restrict the residual onto the next level down and solve for the correction there:
+	VectorXf r;
+	level.m_matrix->multVector( x, r );
+	r = b - r;
+	
+	const Level& coarseLevel = *m_levels[l+1];
+	VectorXf coarseB;
+	level.m_restriction->apply( r, coarseB );
+	coarseLevel.m_matrix->subspaceProject( coarseB );
+	
+	VectorXf coarseX;
+	vCycle( l + 1, coarseB, coarseX );
+	
+	VectorXf correction;
+	level.m_prolongation->apply( coarseX, correction );
+	level.m_matrix->subspaceProject( correction );
+	x += correction;
+	
+	smooth( level, b, x, false );
+}
+
+float MultigridPreconditioner::maxEigenvalue( const Level& level ) const
+{
+	enum
+	{
+		PowerIterations = 10
+	};
+	
+	// start off with a jumble that's got a bit of every frequency in it:
+	const VectorXf& masses = level.m_grid.masses();
+	VectorXf x( 3 * masses.size() );
+	for( int i=0; i < x.size(); ++i )
+	{
+		x[i] = masses[i/3] > 0 ? sin( 1.7f * i ) + 0.3f : 0;
+	}
+	level.m_matrix->subspaceProject( x );
+	
+	float lambda = 1;
+	VectorXf ax, dax;
+	for( int i=0; i < PowerIterations; ++i )
+	{
+		float norm = x.norm();
+		if( norm == 0 )
+		{
+			break;
+		}
+		level.m_matrix->multVector( x, ax );
+		level.m_diagonal.multInverseVector( ax, dax );
+		level.m_matrix->subspaceProject( dax );
+		lambda = dax.norm() / norm;
+		x = dax / dax.norm();
+	}
+	return std::max( lambda, 1.0f );
+}
+
+void MultigridPreconditioner::smooth( const Level& level, const Eigen::VectorXf& b, Eigen::VectorXf& x, bool zeroGuess ) const
+{
+	VectorXf r;
+	if( zeroGuess )
+	{
+		// saves a multiplication when we're starting from scratch:
+		r = b;
+	}
+	else
+	{
+		level.m_matrix->multVector( x, r );
+		r = b - r;
+	}
+	
+	VectorXf dx;
+	level.m_diagonal.multInverseVector( r, dx );
+	x += level.m_damping * dx;
+	level.m_matrix->subspaceProject( x );
+}
@@ -0,0 +1,298 @@
+#include "tbb/parallel_invoke.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/blocked_range.h"
+
+#include "MpmSim/PipelinedConjugateResiduals.h"
+
+#include <iostream>
+
+using namespace Eigen;
+using namespace MpmSim;
+
+// works out <u,w>, <w,m>, <w,q> and <r,r> in a single parallel pass over the vectors:
+class PipelinedConjugateResiduals::Reductions
+{
+public:
+
+	Reductions(
+		const VectorXf& u,
+		const VectorXf& w,
+		const VectorXf& m,
+		const VectorXf& q,
+		const VectorXf& r
+	) :
+		m_uw( 0 ), m_wm( 0 ), m_wq( 0 ), m_rr( 0 ),
+		m_u( u ), m_w( w ), m_m( m ), m_q( q ), m_r( r )
+	{
+	}
+
+	Reductions( Reductions& other, tbb::split ) :
+		m_uw( 0 ), m_wm( 0 ), m_wq( 0 ), m_rr( 0 ),
+		m_u( other.m_u ), m_w( other.m_w ), m_m( other.m_m ), m_q( other.m_q ), m_r( other.m_r )
+	{
+	}
+
+	void operator()( const tbb::blocked_range<int>& range )
+	{
+		// accumulate in double precision, as we're adding up in long sequences rather than in
+		// blocks like Eigen does:
+		double uw = m_uw;
+		double wm = m_wm;
+		double wq = m_wq;
+		double rr = m_rr;
+		const float* r = m_r.data();
+		const float* u = m_u.data();
+		const float* w = m_w.data();
+		const float* m = m_m.data();
+		const float* q = m_q.data();
+		for( int i=range.begin(); i != range.end(); ++i )
+		{
+			uw += u[i] * w[i];
+			wm += w[i] * m[i];
+			wq += w[i] * q[i];
+			rr += r[i] * r[i];
+		}
+		m_uw = uw;
+		m_wm = wm;
+		m_wq = wq;
+		m_rr = rr;
+	}
+
+	void join( const Reductions& other )
+	{
+		m_uw += other.m_uw;
+		m_wm += other.m_wm;
+		m_wq += other.m_wq;
+		m_rr += other.m_rr;
+	}
+
+	double m_uw;
+	double m_wm;
+	double m_wq;
+	double m_rr;
+
+private:
+
+	const VectorXf& m_u;
+	const VectorXf& m_w;
+	const VectorXf& m_m;
+	const VectorXf& m_q;
+	const VectorXf& m_r;
+
+};
+
+// runs the reductions for tbb::parallel_invoke. We use the deterministic reduce so the
+// sums get added up in the same order every time, and the solve gives the same answer
+// from one run to the next:
+class PipelinedConjugateResiduals::Reducer
+{
+public:
+
+	Reducer( Reductions& reductions, int size ) : m_reductions( reductions ), m_size( size )
+	{
+	}
+
+	void operator()() const
+	{
+		tbb::parallel_deterministic_reduce( tbb::blocked_range<int>( 0, m_size, 4096 ), m_reductions );
+	}
+
+private:
+
+	Reductions& m_reductions;
+	int m_size;
+
+};
+
+class PipelinedConjugateResiduals::Multiplier
+{
+public:
+
+	Multiplier( const ProceduralMatrix& mat, const VectorXf& x, VectorXf& result )
+		: m_mat( mat ), m_x( x ), m_result( result )
+	{
+	}
+
+	void operator()() const
+	{
+		m_mat.multVector( m_x, m_result );
+	}
+
+private:
+
+	const ProceduralMatrix& m_mat;
+	const VectorXf& m_x;
+	VectorXf& m_result;
+
+};
+
+PipelinedConjugateResiduals::PipelinedConjugateResiduals(
+	TerminationCriterion& terminationCriterion,
+	const ProceduralMatrix* preconditioner
+) :
+	m_terminationCriterion( terminationCriterion ),
+	m_preconditioner( preconditioner )
+{
+}
+
+void PipelinedConjugateResiduals::operator()
+(
+		const ProceduralMatrix& A,
+		const Eigen::VectorXf& b,
+		Eigen::VectorXf& x,
+		Debug* d
+) const
+{
+	// Using the same names as Ghysels and Vanroose, r is the residual, u = M^-1 r the preconditioned
+	// residual, w = A u, m = M^-1 w and n = A m. The search direction p comes with s = A p,
+	// q = M^-1 s and z = A q. Everything but m and n gets updated with recurrences, and the step
+	// length's denominator <s,q> gets updated from <w,m> and <w,q>, so all the dot products can be
+	// done in one go alongside A m.
+	float bNorm2 = b.squaredNorm();
+	std::cerr << "pipelined conjugate residuals... rhs squared norm: " << bNorm2 << std::endl;
+	if(bNorm2 == 0)
+	{
+		x.setZero();
+		return;
+	}
+	m_terminationCriterion.init( A, b );
+
+	VectorXf r, u, w, m, n;
+	VectorXf p, s, q, z;
+	float uw, wm, wq, rr, gamma, eta;
+
+	// The recurrences for r, u and w drift away from the vectors they're meant to be a lot more
+	// than they do in the plain solver, which stops it converging to tight tolerances in single
+	// precision. We fix that up by working them out properly from x every time the residual's
+	// dropped by a factor of a hundred, and whenever the recurrences think we're done:
+	const float ReplacementFactor = 1.e-4f;
+	float replacementNorm2 = 0;
+	bool replace = false;
+
+	// start off with p = u:
+	bool restart = true;
+	A.multVector( x, r );
+	r = b - r;
+	for( int i=0; ; ++i )
+	{
+		if( restart )
+		{
+			precondition( r, u );
+			A.multVector( u, w );
+			precondition( w, m );
+			q.setZero( b.size() );
+			Reductions reductions( u, w, m, q, r );
+			tbb::parallel_invoke(
+				Reducer( reductions, (int)b.size() ),
+				Multiplier( A, m, n )
+			);
+			p = u;
+			s = w;
+			q = m;
+			z = n;
+			gamma = (float)reductions.m_uw;
+			eta = (float)reductions.m_wm;
+			replacementNorm2 = (float)reductions.m_rr;
+		}
+
+		if( eta <= 0 || gamma == 0 )
+		{
+			if( restart )
+			{
+				std::cerr << "terminating solve due to potential divide by zero" << std::endl;
+				return;
+			}
+			// eta's been updated with a recurrence, so this could just be rounding error catching
+			// up with us. Try again from the true residual:
+			A.multVector( x, r );
+			r = b - r;
+			restart = true;
+			continue;
+		}
+		restart = false;
+		float alpha = gamma / eta;
+
+		x += alpha * p;
+		A.subspaceProject( x );
+
+		// debug output:
+		if( d )
+		{
+			(*d)( x );
+		}
+
+		// r is only the true residual on the iterations where we've just recomputed it:
+		bool trueResidual = replace;
+		if( replace )
+		{
+			A.multVector( x, r );
+			r = b - r;
+			precondition( r, u );
+			A.multVector( u, w );
+			A.multVector( p, s );
+			precondition( s, q );
+			A.multVector( q, z );
+			replace = false;
+		}
+		else
+		{
+			r -= alpha * s;
+			u -= alpha * q;
+			w -= alpha * z;
+		}
+		precondition( w, m );
+
+		// this is the only place we wait for everything to catch up:
+		Reductions reductions( u, w, m, q, r );
+		tbb::parallel_invoke(
+			Reducer( reductions, (int)b.size() ),
+			Multiplier( A, m, n )
+		);
+		uw = (float)reductions.m_uw;
+		wm = (float)reductions.m_wm;
+		wq = (float)reductions.m_wq;
+		rr = (float)reductions.m_rr;
+
+		// Ask the termination criterion about r once per iteration, on this thread. If it says
+		// we're done when r came from the recurrences, we don't trust it: we do one more
+		// iteration with the residual recomputed from x, and stop if the criterion's still
+		// happy with that:
+		if( m_terminationCriterion( r, i ) )
+		{
+			if( trueResidual )
+			{
+				return;
+			}
+			replace = true;
+		}
+		else if( rr < ReplacementFactor * replacementNorm2 )
+		{
+			replace = true;
+		}
+		if( replace )
+		{
+			replacementNorm2 = rr;
+		}
+
+		float beta = uw / gamma;
+		gamma = uw;
+		eta = wm + 2 * beta * wq + beta * beta * eta;
+
+		z = n + beta * z;
+		q = m + beta * q;
+		s = w + beta * s;
+		p = u + beta * p;
+	}
+}
+
+void PipelinedConjugateResiduals::precondition( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	if( m_preconditioner )
+	{
+		m_preconditioner->multInverseVector( x, result );
+	}
+	else
+	{
+		result = x;
+	}
+}
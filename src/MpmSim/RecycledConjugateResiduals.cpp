@@ -0,0 +1,273 @@
+#include "MpmSim/RecycledConjugateResiduals.h"
+
+#include <Eigen/Eigenvalues>
+
+#include <algorithm>
+#include <iostream>
+
+using namespace Eigen;
+using namespace MpmSim;
+
+class RecycledConjugateResiduals::Space
+{
+public:
+
+	void add( const VectorXf& w, const VectorXf& aw, const VectorXf& paw )
+	{
+		m_w.push_back( w );
+		m_aw.push_back( aw );
+		m_paw.push_back( paw );
+	}
+
+	size_t size() const
+	{
+		return m_w.size();
+	}
+
+	// makes v orthogonal to A times the vectors in the space, in the P^-1 inner product, and applies
+	// the same combination of the vectors themselves to x. Assumes A times the vectors are orthonormal
+	// in that inner product:
+	void project( VectorXf& v, VectorXf& x ) const
+	{
+		for( size_t j=0; j < m_w.size(); ++j )
+		{
+			float c = m_paw[j].dot( v );
+			v -= c * m_aw[j];
+			x -= c * m_w[j];
+		}
+	}
+
+	std::vector<VectorXf> m_w;
+	std::vector<VectorXf> m_aw;
+	std::vector<VectorXf> m_paw;
+
+};
+
+RecycledConjugateResiduals::RecycledConjugateResiduals(
+	TerminationCriterion& terminationCriterion,
+	std::vector<Eigen::VectorXf>& recycleSpace,
+	int recycleSize,
+	const ProceduralMatrix* preconditioner
+) :
+	m_terminationCriterion( terminationCriterion ),
+	m_recycleSpace( recycleSpace ),
+	m_recycleSize( recycleSize ),
+	m_preconditioner( preconditioner )
+{
+}
+
+void RecycledConjugateResiduals::precondition( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	if( m_preconditioner )
+	{
+		m_preconditioner->multInverseVector( x, result );
+	}
+	else
+	{
+		result = x;
+	}
+}
+
+void RecycledConjugateResiduals::compress( Space& space ) const
+{
+	const int n = (int)space.size();
+	const int k = std::min( m_recycleSize, n );
+	if( k <= 0 )
+	{
+		space = Space();
+		return;
+	}
+
+	// Harmonic Ritz vectors for P^-1 A on the space are W y, where (AW)^T P^-1 AW y = theta (AW)^T W y.
+	// Both of those are symmetric, and the first's positive definite, so we solve for 1/theta instead,
+	// and keep the vectors with the biggest:
+	MatrixXd G( n, n );
+	MatrixXd F( n, n );
+	for( int i=0; i < n; ++i )
+	{
+		for( int j=0; j <= i; ++j )
+		{
+			G( i, j ) = G( j, i ) = 0.5 * ( space.m_aw[i].dot( space.m_paw[j] ) + space.m_aw[j].dot( space.m_paw[i] ) );
+			F( i, j ) = F( j, i ) = 0.5 * ( space.m_w[i].dot( space.m_aw[j] ) + space.m_w[j].dot( space.m_aw[i] ) );
+		}
+	}
+
+	// the vectors are close to orthonormal in G, but they lose it a bit in single precision, so stop
+	// that making the decomposition fall over:
+	G += ( 1.e-6 * G.trace() / n ) * MatrixXd::Identity( n, n );
+
+	// if that still doesn't work, we just start again from scratch next time:
+	GeneralizedSelfAdjointEigenSolver<MatrixXd> eigenSolver( F, G );
+	if( eigenSolver.info() != Success )
+	{
+		space = Space();
+		return;
+	}
+
+	// the eigenvalues come out in increasing order, and the eigenvectors are orthonormal in G, so the
+	// new AW is orthonormal in the P^-1 inner product:
+	MatrixXf y = eigenSolver.eigenvectors().rightCols( k ).cast<float>();
+	Space compressed;
+	for( int j=0; j < k; ++j )
+	{
+		VectorXf w = VectorXf::Zero( space.m_w[0].size() );
+		VectorXf aw = VectorXf::Zero( w.size() );
+		VectorXf paw = VectorXf::Zero( w.size() );
+		for( int i=0; i < n; ++i )
+		{
+			w += y( i, j ) * space.m_w[i];
+			aw += y( i, j ) * space.m_aw[i];
+			paw += y( i, j ) * space.m_paw[i];
+		}
+		compressed.add( w, aw, paw );
+	}
+	std::swap( space, compressed );
+}
+
+void RecycledConjugateResiduals::operator()
+(
+		const ProceduralMatrix& A,
+		const Eigen::VectorXf& b,
+		Eigen::VectorXf& x,
+		Debug* d
+) const
+{
+	const size_t N = b.size();
+
+	float bNorm2 = b.squaredNorm();
+	std::cerr << "recycled conjugate residuals... rhs squared norm: " << bNorm2 << std::endl;
+	if(bNorm2 == 0)
+	{
+		x.setZero();
+		return;
+	}
+	m_terminationCriterion.init( A, b );
+
+	// Work out A times the recycled vectors, and orthonormalize them in the P^-1 inner product with
+	// modified Gram Schmidt, dropping any that have become dependent on the others:
+	Space deflation;
+	VectorXf w, aw, paw;
+	for( size_t i=0; i < m_recycleSpace.size(); ++i )
+	{
+		if( (size_t)m_recycleSpace[i].size() != N )
+		{
+			continue;
+		}
+		w = m_recycleSpace[i];
+		A.subspaceProject( w );
+		A.multVector( w, aw );
+		precondition( aw, paw );
+		float norm2 = aw.dot( paw );
+		for( size_t j=0; j < deflation.size(); ++j )
+		{
+			float c = deflation.m_paw[j].dot( aw );
+			w -= c * deflation.m_w[j];
+			aw -= c * deflation.m_aw[j];
+			paw -= c * deflation.m_paw[j];
+		}
+		float projectedNorm2 = aw.dot( paw );
+		if( !( projectedNorm2 > 1.e-6f * norm2 ) )
+		{
+			continue;
+		}
+		float scale = 1.0f / sqrt( projectedNorm2 );
+		deflation.add( scale * w, scale * aw, scale * paw );
+	}
+
+	// solve for the part of the answer in the recycled space up front, leaving the residual orthogonal
+	// to it:
+	VectorXf Ax( N );
+	A.multVector( x, Ax );
+	VectorXf r = b - Ax;
+	VectorXf dx = VectorXf::Zero( N );
+	deflation.project( r, dx );
+	x -= dx;
+	A.subspaceProject( x );
+
+	VectorXf r_precond( N );
+	precondition( r, r_precond );
+
+	// first search direction, orthogonal to the recycled space like all the others:
+	VectorXf Ar( N );
+	A.multVector( r_precond, Ar );
+	VectorXf p = r_precond;
+	VectorXf Ap = Ar;
+	deflation.project( Ap, p );
+
+	// the search directions are the rest of the space we pick the next recycled vectors from:
+	Space harvest;
+	if( m_recycleSize > 0 )
+	{
+		harvest = deflation;
+	}
+
+	VectorXf precond_Ap( N );
+	VectorXf z( N );
+	for( int i=0; ; ++i )
+	{
+		precondition( Ap, precond_Ap );
+
+		float ApdPAp = Ap.dot( precond_Ap );
+		if( ApdPAp <= 0 )
+		{
+			std::cerr << "terminating solve due to potential divide by zero" << std::endl;
+			break;
+		}
+
+		// the deflation breaks the identities the plain solver uses to get alpha and beta from
+		// <r_precond, Ar>, so work them out directly:
+		float alpha = r_precond.dot( Ap ) / ApdPAp;
+
+		if( m_recycleSize > 0 )
+		{
+			float scale = 1.0f / sqrt( ApdPAp );
+			harvest.add( scale * p, scale * Ap, scale * precond_Ap );
+			if( (int)harvest.size() >= 3 * m_recycleSize )
+			{
+				compress( harvest );
+			}
+		}
+
+		// x <- x + alpha * p
+		x += alpha * p;
+		A.subspaceProject( x );
+
+		// debug output:
+		if( d )
+		{
+			(*d)( x );
+		}
+
+		r_precond -= alpha * precond_Ap;
+		r -= alpha * Ap;
+
+		if( m_terminationCriterion( r, i ) )
+		{
+			break;
+		}
+
+		// new search direction, orthogonal to the recycled space, with A times it orthogonal to A times
+		// the previous one:
+		A.multVector( r_precond, Ar );
+		z = r_precond;
+		deflation.project( Ar, z );
+		float beta = -Ar.dot( precond_Ap ) / ApdPAp;
+
+		// p <- z + beta * p
+		p = z + beta * p;
+
+		// Ap <- Ar + beta * Ap
+		Ap = Ar + beta * Ap;
+	}
+
+	// hand the slowest modes on to the next solve:
+	if( m_recycleSize > 0 )
+	{
+		compress( harvest );
+		m_recycleSpace = harvest.m_w;
+	}
+	else
+	{
+		m_recycleSpace.clear();
+	}
+}
@@ -0,0 +1,305 @@
+#include "tbb/parallel_for.h"
+
+#include "MpmSim/SchwarzPreconditioner.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+using namespace Eigen;
+using namespace MpmSim;
+
+class SchwarzPreconditioner::Subdomain
+{
+public:
+	
+	Subdomain() : m_damping( 1 )
+	{
+	}
+	
+	// the subdomain's own particles, a voxel at a time:
+	Grid::ParticlesInVoxelList m_voxels;
+	
+	// sorted indices of the grid nodes their stencils touch:
+	std::vector<int> m_nodes;
+	
+	// damping factor for the jacobi iterations:
+	float m_damping;
+	
+	// weights for the nodes' contributions, which are there to stop the overlaps being counted twice:
+	std::vector<float> m_weights;
+	
+	// solution from the last local solve, with three entries per node:
+	Eigen::VectorXf m_x;
+	
+};
+
+class SchwarzPreconditioner::SubdomainInitialiser
+{
+public:
+	
+	SubdomainInitialiser( const SchwarzPreconditioner& p ) : m_p( p )
+	{
+	}
+	
+	void operator()( const tbb::blocked_range<size_t>& r ) const
+	{
+		for( size_t i = r.begin(); i != r.end(); ++i )
+		{
+			Subdomain& s = *m_p.m_subdomains[i];
+			for( Grid::ParticlesInVoxelList::const_iterator v = s.m_voxels.begin(); v != s.m_voxels.end(); ++v )
+			{
+				for( Sim::ConstIndexIterator it = v->first; it != v->second; ++it )
+				{
+					m_p.m_g.particleNodes( it, s.m_nodes );
+				}
+			}
+			std::sort( s.m_nodes.begin(), s.m_nodes.end() );
+			s.m_nodes.erase( std::unique( s.m_nodes.begin(), s.m_nodes.end() ), s.m_nodes.end() );
+			s.m_x.setZero( 3 * s.m_nodes.size() );
+			
+			// the jacobi iterations get damped by 1 / lambda, where lambda is the largest eigenvalue of
+			// D^-1 * A, padded out a bit as the power iteration approaches it from below. That knocks out
+			// the highest frequencies straight away, which is what the subdomains are for, as the outer
+			// solve's got to deal with the low ones anyway:
+			s.m_damping = 1.0f / ( 1.1f * m_p.maxEigenvalue( s ) );
+		}
+	}
+	
+private:
+	
+	const SchwarzPreconditioner& m_p;
+	
+};
+
+class SchwarzPreconditioner::SubdomainSolver
+{
+public:
+	
+	SubdomainSolver( const SchwarzPreconditioner& p, const Eigen::VectorXf& b ) : m_p( p ), m_b( b )
+	{
+	}
+	
+	void operator()( const tbb::blocked_range<size_t>& r ) const
+	{
+		for( size_t i = r.begin(); i != r.end(); ++i )
+		{
+			m_p.localSolve( *m_p.m_subdomains[i], m_b );
+		}
+	}
+	
+private:
+	
+	const SchwarzPreconditioner& m_p;
+	const Eigen::VectorXf& m_b;
+	
+};
+
+SchwarzPreconditioner::SchwarzPreconditioner(const Grid& g,
+											 const BlockDiagonalPreconditioner& blockDiagonal,
+											 const ConstitutiveModel& constitutiveModel,
+											 const CollisionObject::CollisionObjectSet& collisionObjects,
+											 float timeStep,
+											 int subdomainSize)
+	: m_g( g ), m_blockDiagonal( blockDiagonal ), m_constitutiveModel( constitutiveModel ), m_timeStep( timeStep )
+{
+	int numNodes = (int)g.masses().size();
+	m_projections.resize( numNodes );
+	for( int idx=0; idx < numNodes; ++idx )
+	{
+		if( !g.nodeCollided( idx ) )
+		{
+			m_projections[idx].setIdentity();
+		}
+		else
+		{
+			m_projections[idx] = g.collisionProjection( idx, collisionObjects );
+		}
+	}
+	
+	// hand the processing voxels out to the subdomains containing them:
+	typedef std::map< std::pair< int, std::pair<int, int> >, Subdomain* > SubdomainMap;
+	SubdomainMap subdomains;
+	for( int i=0; i < 8; ++i )
+	{
+		const Grid::ParticlesInVoxelList& partition = g.processingPartition( i&1, (i&2) / 2, (i&4) / 4 );
+		for( Grid::ParticlesInVoxelList::const_iterator v = partition.begin(); v != partition.end(); ++v )
+		{
+			Eigen::Vector3i voxel = g.processingVoxel( *v->first );
+			int cube[3];
+			for( int j=0; j < 3; ++j )
+			{
+				cube[j] = (int)floor( float( voxel[j] ) / subdomainSize );
+			}
+			Subdomain*& s = subdomains[ std::make_pair( cube[0], std::make_pair( cube[1], cube[2] ) ) ];
+			if( !s )
+			{
+				s = new Subdomain;
+				m_subdomains.push_back( std::unique_ptr<Subdomain>( s ) );
+			}
+			s->m_voxels.push_back( *v );
+		}
+	}
+	
+	tbb::parallel_for( tbb::blocked_range<size_t>( 0, m_subdomains.size() ), SubdomainInitialiser( *this ) );
+	
+	// Nodes in the overlaps get solved for by several subdomains, so we weight each subdomain's
+	// restriction and its solution by one over the square root of the number of subdomains sharing
+	// the node. The squares of the weights add up to one, so the overlaps don't get counted more than
+	// once, and using the same weights on the way in and out keeps the preconditioner symmetric:
+	std::vector<int> coverage( numNodes, 0 );
+	for( size_t i=0; i < m_subdomains.size(); ++i )
+	{
+		const std::vector<int>& nodes = m_subdomains[i]->m_nodes;
+		for( size_t j=0; j < nodes.size(); ++j )
+		{
+			++coverage[ nodes[j] ];
+		}
+	}
+	for( size_t i=0; i < m_subdomains.size(); ++i )
+	{
+		Subdomain& s = *m_subdomains[i];
+		s.m_weights.resize( s.m_nodes.size() );
+		for( size_t j=0; j < s.m_nodes.size(); ++j )
+		{
+			s.m_weights[j] = 1.0f / sqrt( float( coverage[ s.m_nodes[j] ] ) );
+		}
+	}
+}
+
+SchwarzPreconditioner::~SchwarzPreconditioner()
+{
+}
+
+void SchwarzPreconditioner::multVector( const Eigen::VectorXf&, Eigen::VectorXf& ) const
+{
+	// the subdomain solves only give us the inverse:
+	throw std::runtime_error( "SchwarzPreconditioner::multVector() isn't supported" );
+}
+
+void SchwarzPreconditioner::multInverseVector( const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	tbb::parallel_for( tbb::blocked_range<size_t>( 0, m_subdomains.size() ), SubdomainSolver( *this, x ) );
+	
+	// the subdomains overlap, so add them up afterwards rather than having them fight over the result:
+	result.setZero( x.size() );
+	for( size_t i=0; i < m_subdomains.size(); ++i )
+	{
+		const Subdomain& s = *m_subdomains[i];
+		for( size_t j=0; j < s.m_nodes.size(); ++j )
+		{
+			result.segment<3>( 3 * s.m_nodes[j] ) += s.m_weights[j] * s.m_x.segment<3>( 3 * j );
+		}
+	}
+}
+
+void SchwarzPreconditioner::subspaceProject( Eigen::VectorXf& x ) const
+{
+	for( int idx=0; idx < m_g.masses().size(); ++idx )
+	{
+		if( m_g.nodeCollided( idx ) )
+		{
+			x.segment<3>( 3 * idx ) = m_projections[idx] * x.segment<3>( 3 * idx );
+		}
+	}
+}
+
+void SchwarzPreconditioner::localMultiply( const Subdomain& s, const Eigen::VectorXf& x, Eigen::VectorXf& result ) const
+{
+	// The grid's force differentials work on grid sized vectors, so we copy x into some scratch space
+	// for them. The particles' stencils only touch the subdomain's nodes, so we only need to fill those in
+	// and clear them out afterwards, and can leave the rest of the scratch space alone:
+	const VectorXf& masses = m_g.masses();
+	Workspace& w = m_workspaces.local();
+	if( w.first.size() != 3 * masses.size() )
+	{
+		w.first.setZero( 3 * masses.size() );
+		w.second.setZero( 3 * masses.size() );
+	}
+	
+	for( size_t i=0; i < s.m_nodes.size(); ++i )
+	{
+		int idx = s.m_nodes[i];
+		w.first.segment<3>( 3 * idx ) = m_projections[idx] * x.segment<3>( 3 * i );
+		w.second.segment<3>( 3 * idx ).setZero();
+	}
+	
+	m_g.addForceDifferentials( w.second, w.first, m_constitutiveModel, s.m_voxels );
+	
+	// same as ImplicitUpdateMatrix::multVector():
+	result.resize( x.size() );
+	for( size_t i=0; i < s.m_nodes.size(); ++i )
+	{
+		int idx = s.m_nodes[i];
+		result.segment<3>( 3 * i ) = m_projections[idx] * (
+			masses[idx] * w.first.segment<3>( 3 * idx ) - m_timeStep * m_timeStep * w.second.segment<3>( 3 * idx )
+		);
+	}
+}
+
+void SchwarzPreconditioner::localSolve( Subdomain& s, const Eigen::VectorXf& b ) const
+{
+	enum
+	{
+		LocalIterations = 4
+	};
+	
+	VectorXf localB( 3 * s.m_nodes.size() );
+	for( size_t i=0; i < s.m_nodes.size(); ++i )
+	{
+		localB.segment<3>( 3 * i ) = s.m_weights[i] * b.segment<3>( 3 * s.m_nodes[i] );
+	}
+	
+	// starting from zero saves a multiplication:
+	VectorXf dx;
+	localJacobi( s, localB, dx );
+	s.m_x = s.m_damping * dx;
+	
+	VectorXf ax;
+	for( int i=1; i < LocalIterations; ++i )
+	{
+		localMultiply( s, s.m_x, ax );
+		localJacobi( s, localB - ax, dx );
+		s.m_x += s.m_damping * dx;
+	}
+}
+
+void SchwarzPreconditioner::localJacobi( const Subdomain& s, const Eigen::VectorXf& r, Eigen::VectorXf& result ) const
+{
+	result.resize( r.size() );
+	for( size_t i=0; i < s.m_nodes.size(); ++i )
+	{
+		result.segment<3>( 3 * i ) = m_blockDiagonal.inverseBlock( s.m_nodes[i] ) * r.segment<3>( 3 * i );
+	}
+}
+
+float SchwarzPreconditioner::maxEigenvalue( const Subdomain& s ) const
+{
+	enum
+	{
+		PowerIterations = 6
+	};
+	
+	// start off with a jumble that's got a bit of every frequency in it:
+	VectorXf x( 3 * s.m_nodes.size() );
+	for( int i=0; i < x.size(); ++i )
+	{
+		x[i] = sin( 1.7f * i ) + 0.3f;
+	}
+	
+	float lambda = 1;
+	VectorXf ax, dax;
+	for( int i=0; i < PowerIterations; ++i )
+	{
+		float norm = x.norm();
+		if( norm == 0 )
+		{
+			break;
+		}
+		localMultiply( s, x, ax );
+		localJacobi( s, ax, dax );
+		lambda = dax.norm() / norm;
+		x = dax / dax.norm();
+	}
+	return std::max( lambda, 1.0f );
+}
@@ -6,7 +6,11 @@
 #include "MpmSim/ConjugateResiduals.h"
 #include "MpmSim/KdTree.h"
 
+#include "tbb/parallel_for_each.h"
+
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <queue>
 #include <stdexcept>
 
@@ -22,30 +26,93 @@ Sim::Sim(
 	ConstitutiveModel& model,
 	const CollisionObject::CollisionObjectSet& collisionObjects,
 	const ForceField::ForceFieldSet& forceFields,
-	int dimension
+	int dimension,
+	bool sparseGrids
+) :
+	m_gridSize( gridSize ),
+	m_shapeFunction( shapeFunction ),
+	m_constitutiveModel( model ),
+	m_collisionObjects( collisionObjects ),
+	m_forceFields( forceFields ),
+	m_dimension( dimension ),
+	m_sparseGrids( sparseGrids ),
+	m_stiffnessCaching( false ),
+	m_multigridLevels( 1 ),
+	m_preconditionerReuse( 0 ),
+	m_schwarzSubdomainSize( 0 ),
+	m_chebyshevDegree( 0 ),
+	m_pipelinedSolve( false ),
+	m_initialGuess( CentreOfMassGuess ),
+	m_recycleSize( 0 )
+{
+	initialize( x, masses );
+}
+
+Sim::Sim(
+	const std::vector<Vector3f>& x,
+	const std::vector<float>& masses,
+	const std::vector<int>& materials,
+	float gridSize,
+	const ShapeFunction& shapeFunction,
+	ConstitutiveModel& model,
+	const CollisionObject::CollisionObjectSet& collisionObjects,
+	const ForceField::ForceFieldSet& forceFields,
+	int dimension,
+	bool sparseGrids
 ) :
 	m_gridSize( gridSize ),
 	m_shapeFunction( shapeFunction ),
 	m_constitutiveModel( model ),
 	m_collisionObjects( collisionObjects ),
 	m_forceFields( forceFields ),
-	m_dimension( dimension )
-{	
-	m_particleData.variable<Vector3f>("p") = x;
-	m_particleData.variable<Vector3f>("v").resize( x.size(), Vector3f::Zero() );
+	m_dimension( dimension ),
+	m_sparseGrids( sparseGrids ),
+	m_stiffnessCaching( false ),
+	m_multigridLevels( 1 ),
+	m_preconditionerReuse( 0 ),
+	m_schwarzSubdomainSize( 0 ),
+	m_chebyshevDegree( 0 ),
+	m_pipelinedSolve( false ),
+	m_initialGuess( CentreOfMassGuess ),
+	m_recycleSize( 0 )
+{
+	if( materials.size() != x.size() )
+	{
+		throw std::runtime_error( "Sim::Sim(): need a material id for every particle" );
+	}
+	m_particleData.createVariable<int>( "material" );
+	m_particleData.variable<int>( "material" ) = materials;
+	initialize( x, masses );
+}
+
+void Sim::initialize( const std::vector<Vector3f>& x, const std::vector<float>& masses )
+{
+	m_particleX = m_particleData.handle<Vector3f>( "p" );
+	m_particleV = m_particleData.handle<Vector3f>( "v" );
+	m_particleM = m_particleData.handle<float>( "m" );
+	
+	*m_particleX = x;
+	m_particleV->resize( x.size(), Vector3f::Zero() );
 	m_particleData.variable<Matrix3f>("F").resize( x.size(), Matrix3f::Identity() );
-	m_particleData.variable<float>("m") = masses;
+	*m_particleM = masses;
 	m_particleData.variable<float>("volume").resize( x.size(), 0.0f );
 	
 	m_constitutiveModel.setParticles( m_particleData );
 	
 	calculateBodies();
 	
-	for( std::vector< IndexList >::iterator it = m_bodies.begin(); it != m_bodies.end(); ++it )
+	for( size_t b=0; b < m_bodies.size(); ++b )
 	{
-		IndexList& b = *it;
-		Grid g( m_particleData, b, gridSize, shapeFunction, Eigen::Vector3f::Zero(),m_dimension );
-		g.computeParticleVolumes();
+		m_grids[b] = new Grid( m_particleData, m_bodies[b], m_gridSize, m_shapeFunction, Eigen::Vector3f::Zero(), m_dimension, m_sparseGrids );
+		m_grids[b]->computeParticleVolumes();
+	}
+}
+
+Sim::~Sim()
+{
+	for( size_t b=0; b < m_grids.size(); ++b )
+	{
+		delete m_grids[b];
 	}
 }
 
@@ -54,11 +121,139 @@ MaterialPointData& Sim::particleData()
 	return m_particleData;
 }
 
+void Sim::setStiffnessCaching( bool cache )
+{
+	m_stiffnessCaching = cache;
+}
+
+bool Sim::getStiffnessCaching() const
+{
+	return m_stiffnessCaching;
+}
+
+void Sim::setMultigridLevels( int levels )
+{
+	m_multigridLevels = levels;
+}
+
+int Sim::getMultigridLevels() const
+{
+	return m_multigridLevels;
+}
+
+void Sim::setPreconditionerReuse( float maxIterationGrowth )
+{
+	m_preconditionerReuse = maxIterationGrowth;
+}
+
+float Sim::getPreconditionerReuse() const
+{
+	return m_preconditionerReuse;
+}
+
+void Sim::setSchwarzSubdomainSize( int voxels )
+{
+	m_schwarzSubdomainSize = voxels;
+}
+
+int Sim::getSchwarzSubdomainSize() const
+{
+	return m_schwarzSubdomainSize;
+}
+
+void Sim::setChebyshevDegree( int degree )
+{
+	m_chebyshevDegree = degree;
+}
+
+int Sim::getChebyshevDegree() const
+{
+	return m_chebyshevDegree;
+}
+
+void Sim::setPipelinedSolve( bool pipelined )
+{
+	m_pipelinedSolve = pipelined;
+}
+
+bool Sim::getPipelinedSolve() const
+{
+	return m_pipelinedSolve;
+}
+
+void Sim::setInitialGuess( InitialGuess guess )
+{
+	m_initialGuess = guess;
+}
+
+Sim::InitialGuess Sim::getInitialGuess() const
+{
+	return m_initialGuess;
+}
+
+void Sim::setRecycleSize( int size )
+{
+	m_recycleSize = size;
+}
+
+int Sim::getRecycleSize() const
+{
+	return m_recycleSize;
+}
+
+class Sim::BodySizeComparator
+{
+public:
+	
+	BodySizeComparator( const BodyList& bodies ) : m_bodies( bodies )
+	{
+	}
+	
+	bool operator()( int a, int b ) const
+	{
+		return m_bodies[a].size() > m_bodies[b].size();
+	}
+	
+private:
+	
+	const BodyList& m_bodies;
+	
+};
+
+class Sim::BodyAdvancer
+{
+public:
+	
+	BodyAdvancer( Sim& sim, float timeStep, const TerminationCriterion& termination, std::vector<char>& completed )
+		: m_sim( sim ), m_timeStep( timeStep ), m_termination( termination ), m_completed( completed )
+	{
+	}
+	
+	void operator()( int b ) const
+	{
+		// termination criteria keep track of the solve they're working on, so each body needs its own:
+		std::unique_ptr<TerminationCriterion> termination( m_termination.clone() );
+		m_completed[b] = m_sim.advanceBody( b, m_timeStep, *termination, 0 );
+	}
+	
+private:
+	
+	Sim& m_sim;
+	float m_timeStep;
+	const TerminationCriterion& m_termination;
+	std::vector<char>& m_completed;
+	
+};
+
 void Sim::advance( float timeStep, TerminationCriterion& termination, LinearSolver::Debug* d )
 {
-	std::vector<Eigen::Vector3f>& particleX = m_particleData.variable<Vector3f>( "p" );
-	std::vector<Eigen::Vector3f>& particleV = m_particleData.variable<Vector3f>( "v" );
-	std::vector<float>& particleMasses = m_particleData.variable<float>( "m" );
+	m_particleX.refresh();
+	m_particleV.refresh();
+	m_particleM.refresh();
+	
+	std::vector<Eigen::Vector3f>& particleX = *m_particleX;
+	std::vector<Eigen::Vector3f>& particleV = *m_particleV;
+	std::vector<float>& particleMasses = *m_particleM;
 	
 	// advance ballistic particle velocities:
 	std::cerr << m_ballisticParticles.size() << " ballistic" << std::endl;
@@ -73,50 +268,43 @@ void Sim::advance( float timeStep, TerminationCriterion& termination, LinearSolv
 	}
 	// \todo: apply collisions. Or can I just apply them all at once at the end?
 	
-	// update velocities on particles in material point bodies:
-	BodyIterator bodyEnd = m_bodies.end();
+	// update velocities on particles in material point bodies. The bodies don't interact, so we
+	// process them concurrently, nested with the parallelism inside each body. Starting with the
+	// biggest ones lets the small ones fill in around them, so the step takes about as long as the
+	// biggest body. The debug callback expects one solve at a time though, and so do termination
+	// criteria that can't be cloned, so if we've got either of those we do them in order:
 	std::cerr << m_bodies.size() << " bodies" << std::endl;
-	for( BodyIterator bIt = m_bodies.begin(); bIt != bodyEnd; ++bIt )
+	std::vector<int> bodyOrder( m_bodies.size() );
+	for( size_t b=0; b < m_bodies.size(); ++b )
 	{
-		// find centre of mass velocity, so we can make a comoving grid:
-		// \todo: angular velocity sounds worthwhile (possibly more so than linear)
-		// although more fiddly
-		Eigen::Vector3f centreOfMassVelocity = Eigen::Vector3f::Zero();
-		
-		float mass = 0;
-		std::cerr << "Body " << ( bIt - m_bodies.begin() ) << ": " << bIt->size() << " particles" << std::endl;
-		for( IndexIterator it = bIt->begin(); it != bIt->end(); ++it )
-		{
-			centreOfMassVelocity += particleV[*it] * particleMasses[*it];
-			mass += particleMasses[*it];
-		}
-		centreOfMassVelocity /= mass;
-		
-		// construct comoving background grid for this body:
-		Grid g( m_particleData, *bIt, m_gridSize, m_shapeFunction, centreOfMassVelocity, m_dimension );
-		
-		// update grid velocities using internal stresses...
-		g.updateGridVelocities(
-			timeStep,
-			m_constitutiveModel,
-			m_collisionObjects,
-			m_forceFields,
-			termination,
-			d
-		);
-		if( termination.cancelled() )
+		bodyOrder[b] = int( b );
+	}
+	std::stable_sort( bodyOrder.begin(), bodyOrder.end(), BodySizeComparator( m_bodies ) );
+	
+	// the bodies all share the constitutive model, so it has to pick up any reallocated particle
+	// variables here rather than when they're done:
+	m_constitutiveModel.prepareParticleData();
+	
+	bool cancelled = false;
+	std::unique_ptr<TerminationCriterion> clonedTermination( termination.clone() );
+	if( d || !clonedTermination.get() )
+	{
+		for( size_t i=0; i < bodyOrder.size() && !cancelled; ++i )
 		{
-			calculateBodies();
-			return;
+			cancelled = !advanceBody( bodyOrder[i], timeStep, termination, d );
 		}
-
-		// transfer the grid velocities back onto the particles:
-		g.updateParticleVelocities();
-		
-		// update particle deformation gradients:
-		g.updateDeformationGradients( timeStep );
-		m_constitutiveModel.updateParticleData();
-		
+	}
+	else
+	{
+		std::vector<char> completed( m_bodies.size(), 0 );
+		tbb::parallel_for_each( bodyOrder.begin(), bodyOrder.end(), BodyAdvancer( *this, timeStep, termination, completed ) );
+		cancelled = std::find( completed.begin(), completed.end(), 0 ) != completed.end();
+	}
+	
+	if( cancelled )
+	{
+		calculateBodies();
+		return;
 	}
 	
 	// advance particle positions:
@@ -133,11 +321,80 @@ void Sim::advance( float timeStep, TerminationCriterion& termination, LinearSolv
 	calculateBodies();
 }
 
+bool Sim::advanceBody( size_t b, float timeStep, TerminationCriterion& termination, LinearSolver::Debug* d )
+{
+	const IndexList& body = m_bodies[b];
+	const std::vector<Eigen::Vector3f>& particleV = *m_particleV;
+	const std::vector<float>& particleMasses = *m_particleM;
+	
+	// find centre of mass velocity, so we can make a comoving grid:
+	// \todo: angular velocity sounds worthwhile (possibly more so than linear)
+	// although more fiddly
+	Eigen::Vector3f centreOfMassVelocity = Eigen::Vector3f::Zero();
+	
+	float mass = 0;
+	for( ConstIndexIterator it = body.begin(); it != body.end(); ++it )
+	{
+		centreOfMassVelocity += particleV[*it] * particleMasses[*it];
+		mass += particleMasses[*it];
+	}
+	centreOfMassVelocity /= mass;
+	
+	// update the comoving background grid for this body, or make one if it hasn't got one:
+	Grid*& grid = m_grids[b];
+	if( grid )
+	{
+		grid->update( centreOfMassVelocity );
+	}
+	else
+	{
+		grid = new Grid( m_particleData, body, m_gridSize, m_shapeFunction, centreOfMassVelocity, m_dimension, m_sparseGrids );
+	}
+	Grid& g = *grid;
+	g.setStiffnessCaching( m_stiffnessCaching );
+	g.setMultigridLevels( m_multigridLevels );
+	g.setPreconditionerReuse( m_preconditionerReuse );
+	g.setSchwarzSubdomainSize( m_schwarzSubdomainSize );
+	g.setChebyshevDegree( m_chebyshevDegree );
+	g.setPipelinedSolve( m_pipelinedSolve );
+	g.setInitialGuess( m_initialGuess );
+	g.setRecycleSize( m_recycleSize );
+	
+	// update grid velocities using internal stresses...
+	g.updateGridVelocities(
+		timeStep,
+		m_constitutiveModel,
+		m_collisionObjects,
+		m_forceFields,
+		termination,
+		d
+	);
+	if( termination.cancelled() )
+	{
+		return false;
+	}
+
+	// transfer the grid velocities back onto the particles:
+	g.updateParticleVelocities();
+	
+	// update particle deformation gradients, and let the constitutive model know about them. The
+	// other bodies' particles are off limits, as they might be getting updated at the same time:
+	g.updateDeformationGradients( timeStep );
+	m_constitutiveModel.updateParticleData( body );
+	return true;
+}
+
 void Sim::calculateBodies()
 {
 
-	const std::vector<Eigen::Vector3f>& particleV = m_particleData.variable<Vector3f>("v");
-	std::vector<Eigen::Vector3f>& particleX = m_particleData.variable<Vector3f>("p");
+	const std::vector<Eigen::Vector3f>& particleV = *m_particleV;
+	std::vector<Eigen::Vector3f>& particleX = *m_particleX;
+	
+	std::vector<size_t> oldBodySizes( m_bodies.size() );
+	for( size_t b=0; b < m_bodies.size(); ++b )
+	{
+		oldBodySizes[b] = m_bodies[b].size();
+	}
 	
 	m_bodies.clear();
 	m_ballisticParticles.clear();
@@ -199,5 +456,81 @@ void Sim::calculateBodies()
 				flood.push( (int)(nearNeighbours[j] - particleX.begin()));
 			}
 		}
+		
+		// keep the body's particles in index order, so the per body updates walk through the particle
+		// data in order, and the constitutive model gets whole blocks of any packed variables:
+		std::sort( b.begin(), b.end() );
+	}
+	
+	assignGrids( oldBodySizes );
+}
+
+void Sim::assignGrids( const std::vector<size_t>& oldBodySizes )
+{
+	std::vector< Grid* > oldGrids;
+	oldGrids.swap( m_grids );
+	m_grids.resize( m_bodies.size(), 0 );
+	
+	// if all the particles in a body were in the same body last time, and that body had the
+	// same number of particles, then it's the same body and it can keep its grid:
+	for( size_t b=0; b < m_bodies.size(); ++b )
+	{
+		const IndexList& body = m_bodies[b];
+		int oldBody = m_particleBodies.empty() ? -1 : m_particleBodies[ body[0] ];
+		if( oldBody < 0 || oldBody >= (int)oldGrids.size() || !oldGrids[oldBody] || oldBodySizes[oldBody] != body.size() )
+		{
+			continue;
+		}
+		
+		ConstIndexIterator it = body.begin();
+		for( ; it != body.end(); ++it )
+		{
+			if( m_particleBodies[*it] != oldBody )
+			{
+				break;
+			}
+		}
+		if( it == body.end() )
+		{
+			m_grids[b] = oldGrids[oldBody];
+			oldGrids[oldBody] = 0;
+		}
+	}
+	
+	// give any grids we've got left over to the new bodies, so they can at least reuse the storage:
+	std::vector< Grid* >::iterator oldIt = oldGrids.begin();
+	for( size_t b=0; b < m_bodies.size(); ++b )
+	{
+		if( m_grids[b] )
+		{
+			continue;
+		}
+		while( oldIt != oldGrids.end() && !*oldIt )
+		{
+			++oldIt;
+		}
+		if( oldIt == oldGrids.end() )
+		{
+			break;
+		}
+		m_grids[b] = *oldIt;
+		m_grids[b]->setParticles( m_bodies[b] );
+		*oldIt = 0;
+	}
+	
+	// ...and get rid of the rest:
+	for( oldIt = oldGrids.begin(); oldIt != oldGrids.end(); ++oldIt )
+	{
+		delete *oldIt;
+	}
+	
+	// remember which body each particle's in for next time:
+	m_particleBodies.assign( m_particleX->size(), -1 );
+	for( size_t b=0; b < m_bodies.size(); ++b )
+	{
+		for( ConstIndexIterator it = m_bodies[b].begin(); it != m_bodies[b].end(); ++it )
+		{
+			m_particleBodies[*it] = (int)b;
+		}
 	}
 }
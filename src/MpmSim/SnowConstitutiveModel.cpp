@@ -1,5 +1,10 @@
 #include "MpmSim/SnowConstitutiveModel.h"
+#include "MpmSim/SvdKernels.h"
 
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 
@@ -17,133 +22,389 @@ SnowConstitutiveModel::SnowConstitutiveModel(
 	m_poissonRatio( poissonRatio ),
 	m_hardening( hardening ),
 	m_compressiveStrength( compressiveStrength ),
-	m_tensileStrength( tensileStrength )
+	m_tensileStrength( tensileStrength ),
+	m_warmStartPolar( false )
 {
 	// calculate Lame parameters:
 	m_mu = ( youngsModulus / ( 2 * ( 1 + poissonRatio ) ) );
 	m_lambda = ( youngsModulus * poissonRatio / ( ( 1 + poissonRatio ) * ( 1 - 2 * poissonRatio ) ) );
 }
 
-void SnowConstitutiveModel::updateParticleData()
+class SnowConstitutiveModel::ParticleUpdater
 {
-	std::vector<Eigen::Matrix3f>& particleF = m_p->variable<Matrix3f>( "F" );
-	std::vector<Eigen::Matrix3f>& particleFplastic = m_p->variable<Matrix3f>( "Fp" );
-	std::vector<Eigen::Matrix3f>& particleFinvTrans = m_p->variable<Matrix3f>( "FinvTrans" );
-	std::vector<Eigen::Matrix3f>& particleR = m_p->variable<Matrix3f>( "R" );
-	std::vector<Eigen::Matrix3f>& particleGinv = m_p->variable<Matrix3f>( "Ginv" );
+public:
 	
-	std::vector<float>& particleJ = m_p->variable<float>( "J" );
-	std::vector<float>& particleMu = m_p->variable<float>( "mu" );
-	std::vector<float>& particleLambda = m_p->variable<float>( "lambda" );
+	ParticleUpdater( SnowConstitutiveModel& model, size_t numParticles )
+		: m_model( model ), m_numParticles( numParticles )
+	{
+	}
 	
-	for( size_t p=0; p < particleF.size(); ++p )
+	// r is a range of blocks of SvdKernels::BlockSize particles, which line up with the blocks
+	// of a packed variable:
+	void operator()( const tbb::blocked_range<size_t>& r ) const
 	{
-		JacobiSVD<Matrix3f> svd(particleF[p], ComputeFullU | ComputeFullV );
-
-		Vector3f singularValues = svd.singularValues();
-
-		// apply plastic yeild:
-		Matrix3f diagonalMat = Matrix3f::Zero();
-		Matrix3f diagonalMatInv = Matrix3f::Zero();
-		bool modifiedSVD = false;
-		for( int i=0; i < 3; ++i )
+		size_t particles[ SvdKernels::BlockSize ];
+		for( size_t b = r.begin(); b != r.end(); ++b )
 		{
-			// stretching:
-			if( singularValues[i] > 1 + m_tensileStrength )
+			size_t begin = b * SvdKernels::BlockSize;
+			int n = int( std::min( m_numParticles - begin, size_t( SvdKernels::BlockSize ) ) );
+			for( int i=0; i < n; ++i )
 			{
-				modifiedSVD = true;
-				singularValues[i] = 1 + m_tensileStrength;
+				particles[i] = begin + i;
 			}
+			m_model.updateParticleBlock( particles, n );
+		}
+	}
+	
+private:
+	
+	SnowConstitutiveModel& m_model;
+	size_t m_numParticles;
+	
+};
 
-			// compression:
-			if( singularValues[i] < 1 - m_compressiveStrength )
+class SnowConstitutiveModel::IndexedParticleUpdater
+{
+public:
+	
+	IndexedParticleUpdater( SnowConstitutiveModel& model, const std::vector<int>& particleInds )
+		: m_model( model ), m_particleInds( particleInds )
+	{
+	}
+	
+	// r is a range of blocks of SvdKernels::BlockSize entries in the index list:
+	void operator()( const tbb::blocked_range<size_t>& r ) const
+	{
+		size_t particles[ SvdKernels::BlockSize ];
+		for( size_t b = r.begin(); b != r.end(); ++b )
+		{
+			size_t begin = b * SvdKernels::BlockSize;
+			int n = int( std::min( m_particleInds.size() - begin, size_t( SvdKernels::BlockSize ) ) );
+			for( int i=0; i < n; ++i )
 			{
-				modifiedSVD = true;
-				singularValues[i] = 1 - m_compressiveStrength;
+				particles[i] = m_particleInds[ begin + i ];
 			}
-			diagonalMat(i,i) = singularValues[i];
-			diagonalMatInv(i,i) = 1.0f / singularValues[i];
+			m_model.updateParticleBlock( particles, n );
 		}
-		
-		if( modifiedSVD )
+	}
+	
+private:
+	
+	SnowConstitutiveModel& m_model;
+	const std::vector<int>& m_particleInds;
+	
+};
+
+static size_t numBlocks( size_t n )
+{
+	return ( n + SvdKernels::BlockSize - 1 ) / SvdKernels::BlockSize;
+}
+
+// true if the particles are exactly the ones in one of a packed variable's blocks:
+static bool wholeBlock( const size_t* particles, int n )
+{
+	if( n != SvdKernels::BlockSize || particles[0] % SvdKernels::BlockSize != 0 )
+	{
+		return false;
+	}
+	for( int i=1; i < n; ++i )
+	{
+		if( particles[i] != particles[0] + i )
 		{
-			Matrix3f FNplusOne = particleF[p] * particleFplastic[p];
-			particleFplastic[p] = svd.matrixV() * diagonalMatInv * svd.matrixU().transpose() * FNplusOne;
-			particleF[p] = svd.matrixU() * diagonalMat * svd.matrixV().transpose();
+			return false;
 		}
+	}
+	return true;
+}
 
-		particleFinvTrans[p] = svd.matrixU() * diagonalMatInv * svd.matrixV().transpose();
-		particleR[p] = svd.matrixU() * svd.matrixV().transpose();
-		
-		Matrix3f S = svd.matrixV() * diagonalMat * svd.matrixV().transpose();
-		Matrix3f G;
-		G(0,0) = S(0,0) + S(1,1);
-		G(1,1) = S(0,0) + S(2,2);
-		G(2,2) = S(1,1) + S(2,2);
-		
-		G(0,1) = G(1,0) = S(1,2);
-		G(0,2) = G(2,0) = -S(0,2);
-		G(1,2) = G(2,1) = S(0,1);
-		particleGinv[p] = G.inverse();
+void SnowConstitutiveModel::updateParticleData()
+{
+	refreshHandles();
+	size_t numParticles = m_particleF.size();
+	tbb::parallel_for( tbb::blocked_range<size_t>( 0, numBlocks( numParticles ) ), ParticleUpdater( *this, numParticles ) );
+}
 
-		particleJ[p] = diagonalMat(0,0) * diagonalMat(1,1) * diagonalMat(2,2);
-		
-		
-		// apply hardening:
-		float hardeningFactor = m_hardening * ( 1 - particleFplastic[p].determinant() );
-		if( hardeningFactor > 2 )
+void SnowConstitutiveModel::updateParticleData( const std::vector<int>& particleInds )
+{
+	tbb::parallel_for( tbb::blocked_range<size_t>( 0, numBlocks( particleInds.size() ) ), IndexedParticleUpdater( *this, particleInds ) );
+}
+
+void SnowConstitutiveModel::updateParticleBlock( const size_t* particles, int n )
+{
+	// only the particles the warm start fails on need the SVD:
+	size_t remaining[ SvdKernels::BlockSize ];
+	if( m_warmStartPolar )
+	{
+		int numRemaining = 0;
+		for( int i=0; i < n; ++i )
+		{
+			if( !updateParticleWarmStart( particles[i] ) )
+			{
+				remaining[ numRemaining++ ] = particles[i];
+			}
+		}
+		if( numRemaining == 0 )
+		{
+			return;
+		}
+		particles = remaining;
+		n = numRemaining;
+	}
+	
+	// The kernels take their matrices laid out like a block of a packed variable, so if F's packed
+	// and we've got a whole block of it we can decompose it where it is. Otherwise we pack the
+	// deformation gradients into SIMD lanes, padding out the block with identity matrices:
+	const int blockSize = SvdKernels::BlockSize;
+	float packed[ 9 * blockSize ];
+	const float* a = packed;
+	const PackedArray<Matrix3f>* packedF = m_particleF.packed();
+	if( packedF && int( PackedArray<Matrix3f>::BlockSize ) == blockSize && wholeBlock( particles, n ) )
+	{
+		a = packedF->component( particles[0] / blockSize, 0 );
+	}
+	else
+	{
+		Matrix3f identity = Matrix3f::Identity();
+		for( int l=0; l < blockSize; ++l )
+		{
+			Matrix3f F = l < n ? m_particleF.get( particles[l] ) : identity;
+			for( int c=0; c < 9; ++c )
+			{
+				packed[ c * blockSize + l ] = F.data()[c];
+			}
+		}
+	}
+	
+	float u[ 9 * blockSize ];
+	float sigma[ 3 * blockSize ];
+	float v[ 9 * blockSize ];
+	SvdKernels::best().decompose( a, u, sigma, v );
+	
+	for( int l=0; l < n; ++l )
+	{
+		Matrix3f U, V;
+		Vector3f singularValues;
+		for( int c=0; c < 9; ++c )
 		{
-			// don't let it harden by more than a factor of about 7.4
-			hardeningFactor = 2;
+			U.data()[c] = u[ c * blockSize + l ];
+			V.data()[c] = v[ c * blockSize + l ];
 		}
-		hardeningFactor = exp( hardeningFactor );
-		#ifdef WIN32
-		if( !_finite(hardeningFactor) )
-		#else
-		if( isinff(hardeningFactor) || isnanf(hardeningFactor) )
-		#endif
+		for( int i=0; i < 3; ++i )
 		{
-			std::cerr << "plastic deformation: " << std::endl << particleFplastic[p] << std::endl;
-			std::cerr << "det: " << std::endl << particleFplastic[p].determinant() << std::endl;
-			std::cerr << "my log is hardening: " << m_hardening * ( 1 - particleFplastic[p].determinant() ) << std::endl;
-			throw std::runtime_error( "infinite hardness!!!" );
+			singularValues[i] = sigma[ i * blockSize + l ];
 		}
+		updateParticle( particles[l], U, singularValues, V );
+	}
+}
 
-		
-		particleMu[p] = m_mu * hardeningFactor;
-		particleLambda[p] = m_lambda * hardeningFactor;
-		
-		if( particleJ[p] <= 0 )
+void SnowConstitutiveModel::updateParticle( size_t p, const Eigen::Matrix3f& U, Eigen::Vector3f singularValues, const Eigen::Matrix3f& V )
+{
+	std::vector<Eigen::Matrix3f>& particleFplastic = *m_particleFplastic;
+	std::vector<Eigen::Matrix3f>& particleFinvTrans = *m_particleFinvTrans;
+	
+	// U and V are proper rotations, with a negative singular value if the particle's inverted,
+	// so U * V^T is the rotation part of F.
+	
+	// apply plastic yeild:
+	Matrix3f diagonalMat = Matrix3f::Zero();
+	Matrix3f diagonalMatInv = Matrix3f::Zero();
+	bool modifiedSVD = false;
+	for( int i=0; i < 3; ++i )
+	{
+		// stretching:
+		if( singularValues[i] > 1 + m_tensileStrength )
 		{
-			std::cerr << "warning: inverted deformation gradient!" << std::endl;
+			modifiedSVD = true;
+			singularValues[i] = 1 + m_tensileStrength;
 		}
+
+		// compression:
+		if( singularValues[i] < 1 - m_compressiveStrength )
+		{
+			modifiedSVD = true;
+			singularValues[i] = 1 - m_compressiveStrength;
+		}
+		diagonalMat(i,i) = singularValues[i];
+		diagonalMatInv(i,i) = 1.0f / singularValues[i];
+	}
+	
+	if( modifiedSVD )
+	{
+		Matrix3f FNplusOne = m_particleF.get( p ) * particleFplastic[p];
+		particleFplastic[p] = V * diagonalMatInv * U.transpose() * FNplusOne;
+		m_particleF.set( p, U * diagonalMat * V.transpose() );
 	}
+
+	particleFinvTrans[p] = U * diagonalMatInv * V.transpose();
+	setPolarDecomposition(
+		p,
+		U * V.transpose(),
+		V * diagonalMat * V.transpose(),
+		diagonalMat(0,0) * diagonalMat(1,1) * diagonalMat(2,2)
+	);
 }
 
-void SnowConstitutiveModel::setParticles( MaterialPointData& p )
+// returns true if the symmetric matrix m is positive definite, by checking its leading principal minors:
+static bool positiveDefinite( const Matrix3f& m )
 {
-	m_p = &p;
+	return
+		m(0,0) > 0 &&
+		m(0,0) * m(1,1) - m(0,1) * m(1,0) > 0 &&
+		m.determinant() > 0;
+}
+
+bool SnowConstitutiveModel::updateParticleWarmStart( size_t p )
+{
+	const Matrix3f F = m_particleF.get( p );
+	
+	// Newton iteration for the rotation R in the polar decomposition F = R * S, starting from the stored
+	// rotation. If we rotate R by a small angle theta (in R's frame), R^T F's antisymmetric part changes
+	// by ( trace( S ) * I - S ) * theta, which gives us the update. Rotations hardly change over a time
+	// step, so this usually converges in one or two iterations. R is kept as a quaternion to stop it
+	// drifting away from being a rotation:
+	const int maxIterations = 4;
+	Quaternionf q( (*m_particleR)[p] );
+	q.normalize();
+	Matrix3f R = q.toRotationMatrix();
+	Matrix3f S;
+	bool converged = false;
+	for( int i=0; i <= maxIterations; ++i )
+	{
+		Matrix3f M = R.transpose() * F;
+		S = 0.5f * ( M + M.transpose() );
+		Vector3f antisymmetric( M(2,1) - M(1,2), M(0,2) - M(2,0), M(1,0) - M(0,1) );
+		Matrix3f G = S.trace() * Matrix3f::Identity() - S;
+		Vector3f theta = G.inverse() * antisymmetric;
+		if( theta.squaredNorm() < 1.e-10f )
+		{
+			converged = true;
+			break;
+		}
+		if( i == maxIterations )
+		{
+			break;
+		}
+		q = q * Quaternionf( 1.0f, 0.5f * theta[0], 0.5f * theta[1], 0.5f * theta[2] );
+		q.normalize();
+		R = q.toRotationMatrix();
+	}
+	
+	if( !converged )
+	{
+		return false;
+	}
+	
+	// S's eigenvalues are F's singular values, so leave it to the SVD if any of them are outside the yield
+	// limits (or negative):
+	float lowerLimit = std::max( 1 - m_compressiveStrength, 0.0f );
+	float upperLimit = 1 + m_tensileStrength;
+	if(
+		!positiveDefinite( S - lowerLimit * Matrix3f::Identity() ) ||
+		!positiveDefinite( upperLimit * Matrix3f::Identity() - S )
+	)
+	{
+		return false;
+	}
+	
+	Matrix3f Sinv = S.inverse();
+	(*m_particleFinvTrans)[p] = R * Sinv;
+	setPolarDecomposition( p, R, S, S.determinant() );
+	return true;
+}
+
+void SnowConstitutiveModel::setPolarDecomposition( size_t p, const Eigen::Matrix3f& R, const Eigen::Matrix3f& S, float J )
+{
+	std::vector<Eigen::Matrix3f>& particleFplastic = *m_particleFplastic;
+	std::vector<Eigen::Matrix3f>& particleR = *m_particleR;
+	std::vector<Eigen::Matrix3f>& particleGinv = *m_particleGinv;
+	
+	std::vector<float>& particleJ = *m_particleJ;
+	std::vector<float>& particleMu = *m_particleMu;
+	std::vector<float>& particleLambda = *m_particleLambda;
 	
+	particleR[p] = R;
 	
-	// create variables:
-	// plastic deformation:
-	m_p->createVariable<Matrix3f>("Fp");
+	Matrix3f G;
+	G(0,0) = S(0,0) + S(1,1);
+	G(1,1) = S(0,0) + S(2,2);
+	G(2,2) = S(1,1) + S(2,2);
+	
+	G(0,1) = G(1,0) = S(1,2);
+	G(0,2) = G(2,0) = -S(0,2);
+	G(1,2) = G(2,1) = S(0,1);
+	particleGinv[p] = G.inverse();
 
-	// inverse transpose of the deformation gradient:
-	m_p->createVariable<Matrix3f>("FinvTrans");
+	particleJ[p] = J;
+	
 	
-	// jacobian of the deformation gradient:
-	m_p->createVariable<float>("J");
+	// apply hardening:
+	float hardeningFactor = m_hardening * ( 1 - particleFplastic[p].determinant() );
+	if( hardeningFactor > 2 )
+	{
+		// don't let it harden by more than a factor of about 7.4
+		hardeningFactor = 2;
+	}
+	hardeningFactor = exp( hardeningFactor );
+	#ifdef WIN32
+	if( !_finite(hardeningFactor) )
+	#else
+	if( isinff(hardeningFactor) || isnanf(hardeningFactor) )
+	#endif
+	{
+		std::cerr << "plastic deformation: " << std::endl << particleFplastic[p] << std::endl;
+		std::cerr << "det: " << std::endl << particleFplastic[p].determinant() << std::endl;
+		std::cerr << "my log is hardening: " << m_hardening * ( 1 - particleFplastic[p].determinant() ) << std::endl;
+		throw std::runtime_error( "infinite hardness!!!" );
+	}
 
-	// rotational component of the deformation gradient
-	m_p->createVariable<Matrix3f>("R");
+	
+	particleMu[p] = m_mu * hardeningFactor;
+	particleLambda[p] = m_lambda * hardeningFactor;
+	
+	if( particleJ[p] <= 0 )
+	{
+		std::cerr << "warning: inverted deformation gradient!" << std::endl;
+	}
+}
+
+void SnowConstitutiveModel::setWarmStartPolarDecomposition( bool warmStart )
+{
+	m_warmStartPolar = warmStart;
+}
 
-	// matrix used to calculate the differential of R when you change F by a small amount
-	m_p->createVariable<Matrix3f>("Ginv");
+bool SnowConstitutiveModel::getWarmStartPolarDecomposition() const
+{
+	return m_warmStartPolar;
+}
+
+void SnowConstitutiveModel::setParticles( MaterialPointData& p )
+{
+	m_p = &p;
 	
-	// lame parameters
-	m_p->createVariable<float>("mu");
-	m_p->createVariable<float>("lambda");
+	
+	// create variables. Several snow models can share the same particles in a ConstitutiveModelSet,
+	// in which case the first one creates these and the rest just use them:
+	if( !m_p->hasVariable( "Fp" ) )
+	{
+		// plastic deformation:
+		m_p->createVariable<Matrix3f>("Fp");
+
+		// inverse transpose of the deformation gradient:
+		m_p->createVariable<Matrix3f>("FinvTrans");
+		
+		// jacobian of the deformation gradient:
+		m_p->createVariable<float>("J");
+
+		// rotational component of the deformation gradient
+		m_p->createVariable<Matrix3f>("R");
+
+		// matrix used to calculate the differential of R when you change F by a small amount
+		m_p->createVariable<Matrix3f>("Ginv");
+		
+		// lame parameters
+		m_p->createVariable<float>("mu");
+		m_p->createVariable<float>("lambda");
+	}
 	
 	// initialize variables:
 	size_t nParticles = m_p->variable<float>("m").size();
@@ -157,36 +418,61 @@ void SnowConstitutiveModel::setParticles( MaterialPointData& p )
 	m_p->variable<float>("lambda").resize( nParticles, m_lambda );
 	
 	
-	// keep some pointers around for convenience/performance reasons:
-	m_particleF = &p.variable<Matrix3f>( "F" );
-	m_particleFinvTrans = &p.variable<Matrix3f>( "FinvTrans" );
-	m_particleR = &p.variable<Matrix3f>( "R" );
-	m_particleGinv = &p.variable<Matrix3f>( "Ginv" );
+	// keep some handles around for convenience/performance reasons:
+	m_particleF = p.handle<Matrix3f>( "F" );
+	m_particleFplastic = p.handle<Matrix3f>( "Fp" );
+	m_particleFinvTrans = p.handle<Matrix3f>( "FinvTrans" );
+	m_particleR = p.handle<Matrix3f>( "R" );
+	m_particleGinv = p.handle<Matrix3f>( "Ginv" );
 	
-	m_particleJ = &p.variable<float>( "J" );
-	m_particleMu = &p.variable<float>( "mu" );
-	m_particleLambda = &p.variable<float>( "lambda" );
+	m_particleJ = p.handle<float>( "J" );
+	m_particleMu = p.handle<float>( "mu" );
+	m_particleLambda = p.handle<float>( "lambda" );
+}
+
+void SnowConstitutiveModel::refreshHandles()
+{
+	m_particleF.refresh();
+	m_particleFplastic.refresh();
+	m_particleFinvTrans.refresh();
+	m_particleR.refresh();
+	m_particleGinv.refresh();
+	
+	m_particleJ.refresh();
+	m_particleMu.refresh();
+	m_particleLambda.refresh();
 }
 
 float SnowConstitutiveModel::energyDensity( size_t p ) const
 {
-	const std::vector<Eigen::Matrix3f>& particleF = *m_particleF;
 	const std::vector<Eigen::Matrix3f>& particleR = *m_particleR;
 	
 	const std::vector<float>& particleJ = *m_particleJ;
 	const std::vector<float>& particleMu = *m_particleMu;
 	const std::vector<float>& particleLambda = *m_particleLambda;
 	
-	Matrix3f rigidDeviation = particleF[p] - particleR[p];
+	Matrix3f rigidDeviation = m_particleF.get( p ) - particleR[p];
 	float JminusOne = particleJ[p] - 1;
 	float doubledot = matrixDoubleDot( rigidDeviation, rigidDeviation );
 	float ret = ( particleMu[p] * doubledot + 0.5f * particleLambda[p] * JminusOne * JminusOne );
 	return ret;
 }
 
+inline Eigen::Matrix3f SnowConstitutiveModel::stress( size_t p ) const
+{
+	const std::vector<Eigen::Matrix3f>& particleFinvTrans = *m_particleFinvTrans;
+	const std::vector<Eigen::Matrix3f>& particleR = *m_particleR;
+	
+	const std::vector<float>& particleJ = *m_particleJ;
+	const std::vector<float>& particleMu = *m_particleMu;
+	const std::vector<float>& particleLambda = *m_particleLambda;
+
+	Matrix3f rigidDeviation = m_particleF.get( p ) - particleR[p];
+	return 2 * particleMu[p] * (rigidDeviation ) + particleLambda[p] * ( particleJ[p] - 1 ) * particleJ[p] * particleFinvTrans[p];
+}
+
 Eigen::Matrix3f SnowConstitutiveModel::dEnergyDensitydF( size_t p ) const
 {
-	const std::vector<Eigen::Matrix3f>& particleF = *m_particleF;
 	const std::vector<Eigen::Matrix3f>& particleFinvTrans = *m_particleFinvTrans;
 	const std::vector<Eigen::Matrix3f>& particleR = *m_particleR;
 	
@@ -194,8 +480,7 @@ Eigen::Matrix3f SnowConstitutiveModel::dEnergyDensitydF( size_t p ) const
 	const std::vector<float>& particleMu = *m_particleMu;
 	const std::vector<float>& particleLambda = *m_particleLambda;
 
-	Matrix3f rigidDeviation = particleF[p] - particleR[p];
-	Matrix3f ret = 2 * particleMu[p] * (rigidDeviation ) + particleLambda[p] * ( particleJ[p] - 1 ) * particleJ[p] * particleFinvTrans[p];
+	Matrix3f ret = stress( p );
 	
 	float n = ret.norm();
 	#ifdef WIN32
@@ -204,9 +489,9 @@ Eigen::Matrix3f SnowConstitutiveModel::dEnergyDensitydF( size_t p ) const
 	if( isinff(n) || isnanf(n) )
 	#endif
 	{
-		std::cerr << "particle def grad: " << std::endl << particleF[p] << std::endl;
+		std::cerr << "particle def grad: " << std::endl << m_particleF.get( p ) << std::endl;
 		std::cerr << "inverse transpose: " << std::endl << particleFinvTrans[p] << std::endl;
-		std::cerr << "rigidDeviation: " << std::endl << rigidDeviation << std::endl;
+		std::cerr << "rigidDeviation: " << std::endl << m_particleF.get( p ) - particleR[p] << std::endl;
 		std::cerr << "determinant: " << particleJ[p] << std::endl;
 		std::cerr << "lame parameters: " << particleMu[p] << " " << particleLambda[p] << std::endl;
 		throw std::runtime_error( "nans in dEnergyDensitydF matrix!" );
@@ -255,6 +540,42 @@ Eigen::Matrix3f SnowConstitutiveModel::dEdFDifferential( const Eigen::Matrix3f&
 
 }
 
+void SnowConstitutiveModel::dEnergyDensitydF( std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const
+{
+	// rather than checking every matrix for nans, add them all up and check the total, as
+	// nans and infinities propagate through the sum:
+	float total = 0;
+	Matrix3f* r = result;
+	for( std::vector<int>::const_iterator it = begin; it != end; ++it, ++r )
+	{
+		*r = stress( *it );
+		total += r->sum();
+	}
+	
+	#ifdef WIN32
+	if( !_finite(total) )
+	#else
+	if( isinff(total) || isnanf(total) )
+	#endif
+	{
+		// something's gone wrong, so go through them again with the single particle version, which
+		// prints out the details of the first bad particle and throws:
+		for( std::vector<int>::const_iterator it = begin; it != end; ++it )
+		{
+			SnowConstitutiveModel::dEnergyDensitydF( *it );
+		}
+	}
+}
+
+void SnowConstitutiveModel::dEdFDifferential( const Eigen::Matrix3f* dFp, std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end, Eigen::Matrix3f* result ) const
+{
+	// qualified calls, so these don't go through the vtable:
+	for( std::vector<int>::const_iterator it = begin; it != end; ++it, ++dFp, ++result )
+	{
+		*result = SnowConstitutiveModel::dEdFDifferential( *dFp, *it );
+	}
+}
+
 float SnowConstitutiveModel::matrixDoubleDot( const Matrix3f& a, const Matrix3f& b )
 {
 	return
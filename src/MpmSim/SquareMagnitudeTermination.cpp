@@ -10,6 +10,11 @@ SquareMagnitudeTermination::SquareMagnitudeTermination( int maxIters, float tolE
 {
 }
 
+TerminationCriterion* SquareMagnitudeTermination::clone() const
+{
+	return new SquareMagnitudeTermination( *this );
+}
+
 void SquareMagnitudeTermination::init( const ProceduralMatrix& A, const Eigen::VectorXf& b )
 {
 	float bNorm2 = b.squaredNorm();
@@ -0,0 +1,636 @@
+#include "MpmSim/StencilKernels.h"
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || ( defined( __i386__ ) && defined( __SSE2__ ) ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define MPMSIM_STENCILKERNELS_X86
+#endif
+
+#ifdef MPMSIM_STENCILKERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// The AVX2 code lives in the same file as everything else, so with gcc and clang we need to tell the
+// compiler it's allowed to use AVX2 and FMA instructions in those functions. MSVC lets you use
+// intrinsics for any instruction set without this:
+#if defined( __GNUC__ )
+#define MPMSIM_TARGET_AVX2 __attribute__(( target( "avx2,fma" ) ))
+#else
+#define MPMSIM_TARGET_AVX2
+#endif
+
+using namespace Eigen;
+using namespace MpmSim;
+
+namespace
+{
+
+// Plain scalar kernels, for cpus we haven't got anything better for:
+class ScalarStencilKernels : public StencilKernels
+{
+public:
+
+	virtual void splatMassMomentum( const Stencil& s, float mass, const Eigen::Vector3f& momentum, float* masses, float* momenta ) const
+	{
+		const float* wx = s.weights;
+		const float* wy = s.weights + 4;
+		const float* wz = s.weights + 8;
+		for( int k=0; k < s.numSlices; ++k )
+		{
+			for( int j=0; j < 4; ++j )
+			{
+				int row = s.base + j * s.rowStride + k * s.sliceStride;
+				for( int i=0; i < 4; ++i )
+				{
+					float w = wx[i] * wy[j] * wz[k];
+					masses[ row + i ] += mass * w;
+					float* v = momenta + 3 * ( row + i );
+					v[0] += w * momentum[0];
+					v[1] += w * momentum[1];
+					v[2] += w * momentum[2];
+				}
+			}
+		}
+	}
+
+	virtual void splatForce( const Stencil& s, const Eigen::Matrix3f& forceMatrix, float* forces ) const
+	{
+		const float* wx = s.weights;
+		const float* wy = s.weights + 4;
+		const float* wz = s.weights + 8;
+		const float* dwx = s.weights + 12;
+		const float* dwy = s.weights + 16;
+		const float* dwz = s.weights + 20;
+		for( int k=0; k < s.numSlices; ++k )
+		{
+			for( int j=0; j < 4; ++j )
+			{
+				int row = s.base + j * s.rowStride + k * s.sliceStride;
+				for( int i=0; i < 4; ++i )
+				{
+					// this is minus the weight gradient:
+					Vector3f h( dwx[i] * wy[j] * wz[k], wx[i] * dwy[j] * wz[k], wx[i] * wy[j] * dwz[k] );
+					Map<Vector3f> f( forces + 3 * ( row + i ) );
+					f += forceMatrix * h;
+				}
+			}
+		}
+	}
+
+	virtual Eigen::Matrix3f gatherGradient( const Stencil& s, const float* x ) const
+	{
+		const float* wx = s.weights;
+		const float* wy = s.weights + 4;
+		const float* wz = s.weights + 8;
+		const float* dwx = s.weights + 12;
+		const float* dwy = s.weights + 16;
+		const float* dwz = s.weights + 20;
+		Matrix3f result = Matrix3f::Zero();
+		for( int k=0; k < s.numSlices; ++k )
+		{
+			for( int j=0; j < 4; ++j )
+			{
+				int row = s.base + j * s.rowStride + k * s.sliceStride;
+				for( int i=0; i < 4; ++i )
+				{
+					Vector3f h( dwx[i] * wy[j] * wz[k], wx[i] * dwy[j] * wz[k], wx[i] * wy[j] * dwz[k] );
+					result -= Map<const Vector3f>( x + 3 * ( row + i ) ) * h.transpose();
+				}
+			}
+		}
+		return result;
+	}
+
+	virtual Eigen::Vector3f gatherValue( const Stencil& s, const float* x ) const
+	{
+		const float* wx = s.weights;
+		const float* wy = s.weights + 4;
+		const float* wz = s.weights + 8;
+		Vector3f result = Vector3f::Zero();
+		for( int k=0; k < s.numSlices; ++k )
+		{
+			for( int j=0; j < 4; ++j )
+			{
+				int row = s.base + j * s.rowStride + k * s.sliceStride;
+				for( int i=0; i < 4; ++i )
+				{
+					result += ( wx[i] * wy[j] * wz[k] ) * Map<const Vector3f>( x + 3 * ( row + i ) );
+				}
+			}
+		}
+		return result;
+	}
+
+};
+
+#ifdef MPMSIM_STENCILKERNELS_X86
+
+// A row of 4 nodes has 12 floats of vector data, with the components interleaved. We deal with this in
+// three chunks of 4 floats, holding components (x,y,z,x), (y,z,x,y) and (z,x,y,z) of nodes (0,0,0,1),
+// (1,1,2,2) and (2,3,3,3). These functions spread a vector of per node values out over the chunks:
+inline __m128 nodeChunk0( __m128 v )
+{
+	return _mm_shuffle_ps( v, v, _MM_SHUFFLE( 1, 0, 0, 0 ) );
+}
+
+inline __m128 nodeChunk1( __m128 v )
+{
+	return _mm_shuffle_ps( v, v, _MM_SHUFFLE( 2, 2, 1, 1 ) );
+}
+
+inline __m128 nodeChunk2( __m128 v )
+{
+	return _mm_shuffle_ps( v, v, _MM_SHUFFLE( 3, 3, 3, 2 ) );
+}
+
+// ...and these ones lay the components of a 3 vector out to match the chunks:
+inline void componentChunks( const float* c, __m128& c0, __m128& c1, __m128& c2 )
+{
+	c0 = _mm_setr_ps( c[0], c[1], c[2], c[0] );
+	c1 = _mm_setr_ps( c[1], c[2], c[0], c[1] );
+	c2 = _mm_setr_ps( c[2], c[0], c[1], c[2] );
+}
+
+// adds up the components in a set of chunks to give a 3 vector:
+inline void sumChunks( __m128 c0, __m128 c1, __m128 c2, float* result )
+{
+	float t0[4], t1[4], t2[4];
+	_mm_storeu_ps( t0, c0 );
+	_mm_storeu_ps( t1, c1 );
+	_mm_storeu_ps( t2, c2 );
+	result[0] = t0[0] + t0[3] + t1[2] + t2[1];
+	result[1] = t0[1] + t1[0] + t1[3] + t2[2];
+	result[2] = t0[2] + t1[1] + t2[0] + t2[3];
+}
+
+// SSE kernels, which process one row of the stencil at a time:
+
+void sseSplatMassMomentum( const StencilKernels::Stencil& s, float mass, const float* momentum, float* masses, float* momenta )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	__m128 wx = _mm_loadu_ps( s.weights );
+	__m128 m = _mm_set1_ps( mass );
+	__m128 p0, p1, p2;
+	componentChunks( momentum, p0, p1, p2 );
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; ++j )
+		{
+			int row = s.base + j * s.rowStride + k * s.sliceStride;
+			__m128 w = _mm_mul_ps( _mm_mul_ps( wx, _mm_set1_ps( wy[j] ) ), _mm_set1_ps( wz[k] ) );
+
+			float* rowMasses = masses + row;
+			_mm_storeu_ps( rowMasses, _mm_add_ps( _mm_loadu_ps( rowMasses ), _mm_mul_ps( m, w ) ) );
+
+			float* v = momenta + 3 * row;
+			_mm_storeu_ps( v, _mm_add_ps( _mm_loadu_ps( v ), _mm_mul_ps( nodeChunk0( w ), p0 ) ) );
+			_mm_storeu_ps( v + 4, _mm_add_ps( _mm_loadu_ps( v + 4 ), _mm_mul_ps( nodeChunk1( w ), p1 ) ) );
+			_mm_storeu_ps( v + 8, _mm_add_ps( _mm_loadu_ps( v + 8 ), _mm_mul_ps( nodeChunk2( w ), p2 ) ) );
+		}
+	}
+}
+
+// f is a column major 3x3 matrix:
+void sseSplatForce( const StencilKernels::Stencil& s, const float* f, float* forces )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	const float* dwy = s.weights + 16;
+	const float* dwz = s.weights + 20;
+	__m128 wx = _mm_loadu_ps( s.weights );
+	__m128 dwx = _mm_loadu_ps( s.weights + 12 );
+
+	// columns of the force matrix laid out to match the chunks:
+	__m128 fx0, fx1, fx2, fy0, fy1, fy2, fz0, fz1, fz2;
+	componentChunks( f, fx0, fx1, fx2 );
+	componentChunks( f + 3, fy0, fy1, fy2 );
+	componentChunks( f + 6, fz0, fz1, fz2 );
+
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; ++j )
+		{
+			int row = s.base + j * s.rowStride + k * s.sliceStride;
+
+			// minus the weight gradients for the nodes in this row. We multiply the weights together
+			// in the same order as the shape function iterators, so we get exactly the same values:
+			__m128 wzk = _mm_set1_ps( wz[k] );
+			__m128 hx = _mm_mul_ps( _mm_mul_ps( dwx, _mm_set1_ps( wy[j] ) ), wzk );
+			__m128 hy = _mm_mul_ps( _mm_mul_ps( wx, _mm_set1_ps( dwy[j] ) ), wzk );
+			__m128 hz = _mm_mul_ps( _mm_mul_ps( wx, _mm_set1_ps( wy[j] ) ), _mm_set1_ps( dwz[k] ) );
+
+			// matrix times gradient for each node, with the terms added up in the same order as Eigen does it:
+			float* v = forces + 3 * row;
+			__m128 c0 = _mm_add_ps( _mm_mul_ps( fx0, nodeChunk0( hx ) ), _mm_add_ps( _mm_mul_ps( fy0, nodeChunk0( hy ) ), _mm_mul_ps( fz0, nodeChunk0( hz ) ) ) );
+			__m128 c1 = _mm_add_ps( _mm_mul_ps( fx1, nodeChunk1( hx ) ), _mm_add_ps( _mm_mul_ps( fy1, nodeChunk1( hy ) ), _mm_mul_ps( fz1, nodeChunk1( hz ) ) ) );
+			__m128 c2 = _mm_add_ps( _mm_mul_ps( fx2, nodeChunk2( hx ) ), _mm_add_ps( _mm_mul_ps( fy2, nodeChunk2( hy ) ), _mm_mul_ps( fz2, nodeChunk2( hz ) ) ) );
+			_mm_storeu_ps( v, _mm_add_ps( _mm_loadu_ps( v ), c0 ) );
+			_mm_storeu_ps( v + 4, _mm_add_ps( _mm_loadu_ps( v + 4 ), c1 ) );
+			_mm_storeu_ps( v + 8, _mm_add_ps( _mm_loadu_ps( v + 8 ), c2 ) );
+		}
+	}
+}
+
+// result is a column major 3x3 matrix:
+void sseGatherGradient( const StencilKernels::Stencil& s, const float* x, float* result )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	const float* dwy = s.weights + 16;
+	const float* dwz = s.weights + 20;
+	__m128 wx = _mm_loadu_ps( s.weights );
+	__m128 dwx = _mm_loadu_ps( s.weights + 12 );
+
+	// one set of chunks for each column of the result:
+	__m128 ax0 = _mm_setzero_ps(), ax1 = _mm_setzero_ps(), ax2 = _mm_setzero_ps();
+	__m128 ay0 = _mm_setzero_ps(), ay1 = _mm_setzero_ps(), ay2 = _mm_setzero_ps();
+	__m128 az0 = _mm_setzero_ps(), az1 = _mm_setzero_ps(), az2 = _mm_setzero_ps();
+
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; ++j )
+		{
+			int row = s.base + j * s.rowStride + k * s.sliceStride;
+			__m128 wzk = _mm_set1_ps( wz[k] );
+			__m128 hx = _mm_mul_ps( _mm_mul_ps( dwx, _mm_set1_ps( wy[j] ) ), wzk );
+			__m128 hy = _mm_mul_ps( _mm_mul_ps( wx, _mm_set1_ps( dwy[j] ) ), wzk );
+			__m128 hz = _mm_mul_ps( _mm_mul_ps( wx, _mm_set1_ps( wy[j] ) ), _mm_set1_ps( dwz[k] ) );
+
+			const float* v = x + 3 * row;
+			__m128 x0 = _mm_loadu_ps( v );
+			__m128 x1 = _mm_loadu_ps( v + 4 );
+			__m128 x2 = _mm_loadu_ps( v + 8 );
+
+			ax0 = _mm_add_ps( ax0, _mm_mul_ps( x0, nodeChunk0( hx ) ) );
+			ax1 = _mm_add_ps( ax1, _mm_mul_ps( x1, nodeChunk1( hx ) ) );
+			ax2 = _mm_add_ps( ax2, _mm_mul_ps( x2, nodeChunk2( hx ) ) );
+			ay0 = _mm_add_ps( ay0, _mm_mul_ps( x0, nodeChunk0( hy ) ) );
+			ay1 = _mm_add_ps( ay1, _mm_mul_ps( x1, nodeChunk1( hy ) ) );
+			ay2 = _mm_add_ps( ay2, _mm_mul_ps( x2, nodeChunk2( hy ) ) );
+			az0 = _mm_add_ps( az0, _mm_mul_ps( x0, nodeChunk0( hz ) ) );
+			az1 = _mm_add_ps( az1, _mm_mul_ps( x1, nodeChunk1( hz ) ) );
+			az2 = _mm_add_ps( az2, _mm_mul_ps( x2, nodeChunk2( hz ) ) );
+		}
+	}
+
+	sumChunks( ax0, ax1, ax2, result );
+	sumChunks( ay0, ay1, ay2, result + 3 );
+	sumChunks( az0, az1, az2, result + 6 );
+}
+
+void sseGatherValue( const StencilKernels::Stencil& s, const float* x, float* result )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	__m128 wx = _mm_loadu_ps( s.weights );
+	__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps();
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; ++j )
+		{
+			int row = s.base + j * s.rowStride + k * s.sliceStride;
+			__m128 w = _mm_mul_ps( _mm_mul_ps( wx, _mm_set1_ps( wy[j] ) ), _mm_set1_ps( wz[k] ) );
+			const float* v = x + 3 * row;
+			a0 = _mm_add_ps( a0, _mm_mul_ps( _mm_loadu_ps( v ), nodeChunk0( w ) ) );
+			a1 = _mm_add_ps( a1, _mm_mul_ps( _mm_loadu_ps( v + 4 ), nodeChunk1( w ) ) );
+			a2 = _mm_add_ps( a2, _mm_mul_ps( _mm_loadu_ps( v + 8 ), nodeChunk2( w ) ) );
+		}
+	}
+	sumChunks( a0, a1, a2, result );
+}
+
+// AVX2 kernels. These do two rows of the stencil at a time, with the first row in the low 128 bits of
+// each register and the second row in the high 128 bits. The shuffles we use for the chunks work
+// independently on each half, so the chunk layout is the same as for SSE:
+
+MPMSIM_TARGET_AVX2 inline __m256 avxNodeChunk0( __m256 v )
+{
+	return _mm256_shuffle_ps( v, v, _MM_SHUFFLE( 1, 0, 0, 0 ) );
+}
+
+MPMSIM_TARGET_AVX2 inline __m256 avxNodeChunk1( __m256 v )
+{
+	return _mm256_shuffle_ps( v, v, _MM_SHUFFLE( 2, 2, 1, 1 ) );
+}
+
+MPMSIM_TARGET_AVX2 inline __m256 avxNodeChunk2( __m256 v )
+{
+	return _mm256_shuffle_ps( v, v, _MM_SHUFFLE( 3, 3, 3, 2 ) );
+}
+
+// puts a in the low half of a register and b in the high half:
+MPMSIM_TARGET_AVX2 inline __m256 avxPair( __m128 a, __m128 b )
+{
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( a ), b, 1 );
+}
+
+MPMSIM_TARGET_AVX2 inline __m256 avxLoadRows( const float* a, const float* b )
+{
+	return avxPair( _mm_loadu_ps( a ), _mm_loadu_ps( b ) );
+}
+
+MPMSIM_TARGET_AVX2 inline void avxStoreRows( float* a, float* b, __m256 v )
+{
+	_mm_storeu_ps( a, _mm256_castps256_ps128( v ) );
+	_mm_storeu_ps( b, _mm256_extractf128_ps( v, 1 ) );
+}
+
+// adds on v to the data at a and b:
+MPMSIM_TARGET_AVX2 inline void avxAccumulateRows( float* a, float* b, __m256 v )
+{
+	avxStoreRows( a, b, _mm256_add_ps( avxLoadRows( a, b ), v ) );
+}
+
+MPMSIM_TARGET_AVX2 inline void avxComponentChunks( const float* c, __m256& c0, __m256& c1, __m256& c2 )
+{
+	__m128 s0, s1, s2;
+	componentChunks( c, s0, s1, s2 );
+	c0 = avxPair( s0, s0 );
+	c1 = avxPair( s1, s1 );
+	c2 = avxPair( s2, s2 );
+}
+
+// adds the two halves of a register together:
+MPMSIM_TARGET_AVX2 inline __m128 avxFold( __m256 v )
+{
+	return _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) );
+}
+
+MPMSIM_TARGET_AVX2 void avxSplatMassMomentum( const StencilKernels::Stencil& s, float mass, const float* momentum, float* masses, float* momenta )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	__m128 wx4 = _mm_loadu_ps( s.weights );
+	__m256 wx = avxPair( wx4, wx4 );
+	__m256 m = _mm256_set1_ps( mass );
+	__m256 p0, p1, p2;
+	avxComponentChunks( momentum, p0, p1, p2 );
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; j += 2 )
+		{
+			int rowA = s.base + j * s.rowStride + k * s.sliceStride;
+			int rowB = rowA + s.rowStride;
+			__m256 w = _mm256_mul_ps( _mm256_mul_ps( wx, avxPair( _mm_set1_ps( wy[j] ), _mm_set1_ps( wy[j+1] ) ) ), _mm256_set1_ps( wz[k] ) );
+
+			avxAccumulateRows( masses + rowA, masses + rowB, _mm256_mul_ps( m, w ) );
+
+			float* a = momenta + 3 * rowA;
+			float* b = momenta + 3 * rowB;
+			avxAccumulateRows( a, b, _mm256_mul_ps( avxNodeChunk0( w ), p0 ) );
+			avxAccumulateRows( a + 4, b + 4, _mm256_mul_ps( avxNodeChunk1( w ), p1 ) );
+			avxAccumulateRows( a + 8, b + 8, _mm256_mul_ps( avxNodeChunk2( w ), p2 ) );
+		}
+	}
+}
+
+MPMSIM_TARGET_AVX2 void avxSplatForce( const StencilKernels::Stencil& s, const float* f, float* forces )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	const float* dwy = s.weights + 16;
+	const float* dwz = s.weights + 20;
+	__m128 wx4 = _mm_loadu_ps( s.weights );
+	__m128 dwx4 = _mm_loadu_ps( s.weights + 12 );
+	__m256 wx = avxPair( wx4, wx4 );
+	__m256 dwx = avxPair( dwx4, dwx4 );
+
+	__m256 fx0, fx1, fx2, fy0, fy1, fy2, fz0, fz1, fz2;
+	avxComponentChunks( f, fx0, fx1, fx2 );
+	avxComponentChunks( f + 3, fy0, fy1, fy2 );
+	avxComponentChunks( f + 6, fz0, fz1, fz2 );
+
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; j += 2 )
+		{
+			int rowA = s.base + j * s.rowStride + k * s.sliceStride;
+			int rowB = rowA + s.rowStride;
+
+			__m256 wy2 = avxPair( _mm_set1_ps( wy[j] ), _mm_set1_ps( wy[j+1] ) );
+			__m256 wzk = _mm256_set1_ps( wz[k] );
+			__m256 hx = _mm256_mul_ps( _mm256_mul_ps( dwx, wy2 ), wzk );
+			__m256 hy = _mm256_mul_ps( _mm256_mul_ps( wx, avxPair( _mm_set1_ps( dwy[j] ), _mm_set1_ps( dwy[j+1] ) ) ), wzk );
+			__m256 hz = _mm256_mul_ps( _mm256_mul_ps( wx, wy2 ), _mm256_set1_ps( dwz[k] ) );
+
+			__m256 c0 = _mm256_add_ps( _mm256_mul_ps( fx0, avxNodeChunk0( hx ) ), _mm256_add_ps( _mm256_mul_ps( fy0, avxNodeChunk0( hy ) ), _mm256_mul_ps( fz0, avxNodeChunk0( hz ) ) ) );
+			__m256 c1 = _mm256_add_ps( _mm256_mul_ps( fx1, avxNodeChunk1( hx ) ), _mm256_add_ps( _mm256_mul_ps( fy1, avxNodeChunk1( hy ) ), _mm256_mul_ps( fz1, avxNodeChunk1( hz ) ) ) );
+			__m256 c2 = _mm256_add_ps( _mm256_mul_ps( fx2, avxNodeChunk2( hx ) ), _mm256_add_ps( _mm256_mul_ps( fy2, avxNodeChunk2( hy ) ), _mm256_mul_ps( fz2, avxNodeChunk2( hz ) ) ) );
+
+			// no fused multiply adds here, so the forces round the same way as the scalar code:
+			float* a = forces + 3 * rowA;
+			float* b = forces + 3 * rowB;
+			avxAccumulateRows( a, b, c0 );
+			avxAccumulateRows( a + 4, b + 4, c1 );
+			avxAccumulateRows( a + 8, b + 8, c2 );
+		}
+	}
+}
+
+MPMSIM_TARGET_AVX2 void avxGatherGradient( const StencilKernels::Stencil& s, const float* x, float* result )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	const float* dwy = s.weights + 16;
+	const float* dwz = s.weights + 20;
+	__m128 wx4 = _mm_loadu_ps( s.weights );
+	__m128 dwx4 = _mm_loadu_ps( s.weights + 12 );
+	__m256 wx = avxPair( wx4, wx4 );
+	__m256 dwx = avxPair( dwx4, dwx4 );
+
+	__m256 ax0 = _mm256_setzero_ps(), ax1 = _mm256_setzero_ps(), ax2 = _mm256_setzero_ps();
+	__m256 ay0 = _mm256_setzero_ps(), ay1 = _mm256_setzero_ps(), ay2 = _mm256_setzero_ps();
+	__m256 az0 = _mm256_setzero_ps(), az1 = _mm256_setzero_ps(), az2 = _mm256_setzero_ps();
+
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; j += 2 )
+		{
+			int rowA = s.base + j * s.rowStride + k * s.sliceStride;
+			int rowB = rowA + s.rowStride;
+
+			__m256 wy2 = avxPair( _mm_set1_ps( wy[j] ), _mm_set1_ps( wy[j+1] ) );
+			__m256 wzk = _mm256_set1_ps( wz[k] );
+			__m256 hx = _mm256_mul_ps( _mm256_mul_ps( dwx, wy2 ), wzk );
+			__m256 hy = _mm256_mul_ps( _mm256_mul_ps( wx, avxPair( _mm_set1_ps( dwy[j] ), _mm_set1_ps( dwy[j+1] ) ) ), wzk );
+			__m256 hz = _mm256_mul_ps( _mm256_mul_ps( wx, wy2 ), _mm256_set1_ps( dwz[k] ) );
+
+			const float* a = x + 3 * rowA;
+			const float* b = x + 3 * rowB;
+			__m256 x0 = avxLoadRows( a, b );
+			__m256 x1 = avxLoadRows( a + 4, b + 4 );
+			__m256 x2 = avxLoadRows( a + 8, b + 8 );
+
+			ax0 = _mm256_fmadd_ps( x0, avxNodeChunk0( hx ), ax0 );
+			ax1 = _mm256_fmadd_ps( x1, avxNodeChunk1( hx ), ax1 );
+			ax2 = _mm256_fmadd_ps( x2, avxNodeChunk2( hx ), ax2 );
+			ay0 = _mm256_fmadd_ps( x0, avxNodeChunk0( hy ), ay0 );
+			ay1 = _mm256_fmadd_ps( x1, avxNodeChunk1( hy ), ay1 );
+			ay2 = _mm256_fmadd_ps( x2, avxNodeChunk2( hy ), ay2 );
+			az0 = _mm256_fmadd_ps( x0, avxNodeChunk0( hz ), az0 );
+			az1 = _mm256_fmadd_ps( x1, avxNodeChunk1( hz ), az1 );
+			az2 = _mm256_fmadd_ps( x2, avxNodeChunk2( hz ), az2 );
+		}
+	}
+
+	sumChunks( avxFold( ax0 ), avxFold( ax1 ), avxFold( ax2 ), result );
+	sumChunks( avxFold( ay0 ), avxFold( ay1 ), avxFold( ay2 ), result + 3 );
+	sumChunks( avxFold( az0 ), avxFold( az1 ), avxFold( az2 ), result + 6 );
+}
+
+MPMSIM_TARGET_AVX2 void avxGatherValue( const StencilKernels::Stencil& s, const float* x, float* result )
+{
+	const float* wy = s.weights + 4;
+	const float* wz = s.weights + 8;
+	__m128 wx4 = _mm_loadu_ps( s.weights );
+	__m256 wx = avxPair( wx4, wx4 );
+	__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps();
+	for( int k=0; k < s.numSlices; ++k )
+	{
+		for( int j=0; j < 4; j += 2 )
+		{
+			int rowA = s.base + j * s.rowStride + k * s.sliceStride;
+			int rowB = rowA + s.rowStride;
+			__m256 w = _mm256_mul_ps( _mm256_mul_ps( wx, avxPair( _mm_set1_ps( wy[j] ), _mm_set1_ps( wy[j+1] ) ) ), _mm256_set1_ps( wz[k] ) );
+			const float* a = x + 3 * rowA;
+			const float* b = x + 3 * rowB;
+			a0 = _mm256_fmadd_ps( avxLoadRows( a, b ), avxNodeChunk0( w ), a0 );
+			a1 = _mm256_fmadd_ps( avxLoadRows( a + 4, b + 4 ), avxNodeChunk1( w ), a1 );
+			a2 = _mm256_fmadd_ps( avxLoadRows( a + 8, b + 8 ), avxNodeChunk2( w ), a2 );
+		}
+	}
+	sumChunks( avxFold( a0 ), avxFold( a1 ), avxFold( a2 ), result );
+}
+
+class SseStencilKernels : public StencilKernels
+{
+public:
+
+	virtual void splatMassMomentum( const Stencil& s, float mass, const Eigen::Vector3f& momentum, float* masses, float* momenta ) const
+	{
+		sseSplatMassMomentum( s, mass, momentum.data(), masses, momenta );
+	}
+
+	virtual void splatForce( const Stencil& s, const Eigen::Matrix3f& forceMatrix, float* forces ) const
+	{
+		sseSplatForce( s, forceMatrix.data(), forces );
+	}
+
+	virtual Eigen::Matrix3f gatherGradient( const Stencil& s, const float* x ) const
+	{
+		Matrix3f result;
+		sseGatherGradient( s, x, result.data() );
+		return -result;
+	}
+
+	virtual Eigen::Vector3f gatherValue( const Stencil& s, const float* x ) const
+	{
+		Vector3f result;
+		sseGatherValue( s, x, result.data() );
+		return result;
+	}
+
+};
+
+class Avx2StencilKernels : public StencilKernels
+{
+public:
+
+	virtual void splatMassMomentum( const Stencil& s, float mass, const Eigen::Vector3f& momentum, float* masses, float* momenta ) const
+	{
+		avxSplatMassMomentum( s, mass, momentum.data(), masses, momenta );
+	}
+
+	virtual void splatForce( const Stencil& s, const Eigen::Matrix3f& forceMatrix, float* forces ) const
+	{
+		avxSplatForce( s, forceMatrix.data(), forces );
+	}
+
+	virtual Eigen::Matrix3f gatherGradient( const Stencil& s, const float* x ) const
+	{
+		Matrix3f result;
+		avxGatherGradient( s, x, result.data() );
+		return -result;
+	}
+
+	virtual Eigen::Vector3f gatherValue( const Stencil& s, const float* x ) const
+	{
+		Vector3f result;
+		avxGatherValue( s, x, result.data() );
+		return result;
+	}
+
+};
+
+// checks the cpu and the operating system both support AVX2 and FMA:
+bool cpuSupportsAvx2()
+{
+#if defined( _MSC_VER )
+	int info[4];
+	__cpuid( info, 0 );
+	if( info[0] < 7 )
+	{
+		return false;
+	}
+	__cpuid( info, 1 );
+	bool fma = ( info[2] & ( 1 << 12 ) ) != 0;
+	bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+	bool avx = ( info[2] & ( 1 << 28 ) ) != 0;
+	if( !( fma && osxsave && avx ) )
+	{
+		return false;
+	}
+	// the os has to be saving the ymm registers on context switches:
+	if( ( _xgetbv( 0 ) & 6 ) != 6 )
+	{
+		return false;
+	}
+	__cpuidex( info, 7, 0 );
+	return ( info[1] & ( 1 << 5 ) ) != 0;
+#elif defined( __GNUC__ )
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+#else
+	return false;
+#endif
+}
+
+#endif // MPMSIM_STENCILKERNELS_X86
+
+ScalarStencilKernels g_scalarKernels;
+
+#ifdef MPMSIM_STENCILKERNELS_X86
+SseStencilKernels g_sseKernels;
+Avx2StencilKernels g_avx2Kernels;
+#endif
+
+} // namespace
+
+const StencilKernels* StencilKernels::kernels( Type type )
+{
+	switch( type )
+	{
+		case Scalar:
+			return &g_scalarKernels;
+#ifdef MPMSIM_STENCILKERNELS_X86
+		case SSE:
+			// every x86 cpu we build for has SSE2:
+			return &g_sseKernels;
+		case AVX2:
+		{
+			static bool avx2 = cpuSupportsAvx2();
+			return avx2 ? &g_avx2Kernels : 0;
+		}
+#endif
+		default:
+			return 0;
+	}
+}
+
+const StencilKernels& StencilKernels::best()
+{
+	static const StencilKernels* best = kernels( AVX2 ) ? kernels( AVX2 ) : kernels( SSE ) ? kernels( SSE ) : kernels( Scalar );
+	return *best;
+}
@@ -0,0 +1,28 @@
+#include "MpmSim/Svd3.h"
+
+using namespace Eigen;
+using namespace MpmSim;
+
+void MpmSim::svd3( const Matrix3f& a, Matrix3f& u, Vector3f& sigma, Matrix3f& v )
+{
+	SvdFloat aIn[9], uOut[9], sigmaOut[3], vOut[9];
+	for( int i=0; i < 3; ++i )
+	{
+		for( int j=0; j < 3; ++j )
+		{
+			aIn[3 * i + j] = a(i,j);
+		}
+	}
+	
+	Svd3<SvdFloat>::decompose( aIn, uOut, sigmaOut, vOut );
+	
+	for( int i=0; i < 3; ++i )
+	{
+		for( int j=0; j < 3; ++j )
+		{
+			u(i,j) = uOut[3 * i + j].v;
+			v(i,j) = vOut[3 * i + j].v;
+		}
+		sigma[i] = sigmaOut[i].v;
+	}
+}
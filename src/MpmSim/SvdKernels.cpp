@@ -0,0 +1,147 @@
+#include "MpmSim/SvdKernels.h"
+#include "MpmSim/StencilKernels.h"
+#include "MpmSim/Svd3.h"
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || ( defined( __i386__ ) && defined( __SSE2__ ) ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define MPMSIM_SVDKERNELS_X86
+#endif
+
+#ifdef MPMSIM_SVDKERNELS_X86
+#include <emmintrin.h>
+#endif
+
+using namespace MpmSim;
+
+namespace
+{
+
+// Plain scalar kernels, which just loop over the lanes:
+class ScalarSvdKernels : public SvdKernels
+{
+public:
+
+	virtual void decompose( const float* a, float* u, float* sigma, float* v ) const
+	{
+		for( int l=0; l < BlockSize; ++l )
+		{
+			SvdFloat aLane[9], uLane[9], sigmaLane[3], vLane[9];
+			for( int i=0; i < 3; ++i )
+			{
+				for( int j=0; j < 3; ++j )
+				{
+					aLane[ 3 * i + j ] = a[ ( i + 3 * j ) * BlockSize + l ];
+				}
+			}
+			Svd3<SvdFloat>::decompose( aLane, uLane, sigmaLane, vLane );
+			for( int i=0; i < 3; ++i )
+			{
+				for( int j=0; j < 3; ++j )
+				{
+					u[ ( i + 3 * j ) * BlockSize + l ] = uLane[ 3 * i + j ].v;
+					v[ ( i + 3 * j ) * BlockSize + l ] = vLane[ 3 * i + j ].v;
+				}
+				sigma[ i * BlockSize + l ] = sigmaLane[i].v;
+			}
+		}
+	}
+
+};
+
+#ifdef MPMSIM_SVDKERNELS_X86
+
+// Four lanes of SSE2 floats for Svd3. Masks are all ones or all zeros in each lane. svdRsqrt()
+// does a real square root and division rather than using _mm_rsqrt_ps(), so the results match the
+// scalar version:
+struct SvdFloat4
+{
+	typedef SvdFloat4 Mask;
+	SvdFloat4() {}
+	SvdFloat4( float x ) : v( _mm_set1_ps( x ) ) {}
+	SvdFloat4( __m128 x ) : v( x ) {}
+	__m128 v;
+};
+
+inline SvdFloat4 operator+( const SvdFloat4& a, const SvdFloat4& b ) { return _mm_add_ps( a.v, b.v ); }
+inline SvdFloat4 operator-( const SvdFloat4& a, const SvdFloat4& b ) { return _mm_sub_ps( a.v, b.v ); }
+inline SvdFloat4 operator*( const SvdFloat4& a, const SvdFloat4& b ) { return _mm_mul_ps( a.v, b.v ); }
+inline SvdFloat4 operator-( const SvdFloat4& a ) { return _mm_xor_ps( a.v, _mm_set1_ps( -0.0f ) ); }
+inline SvdFloat4 operator<( const SvdFloat4& a, const SvdFloat4& b ) { return _mm_cmplt_ps( a.v, b.v ); }
+inline SvdFloat4 operator>( const SvdFloat4& a, const SvdFloat4& b ) { return _mm_cmpgt_ps( a.v, b.v ); }
+inline SvdFloat4 svdSelect( const SvdFloat4& c, const SvdFloat4& a, const SvdFloat4& b ) { return _mm_or_ps( _mm_and_ps( c.v, a.v ), _mm_andnot_ps( c.v, b.v ) ); }
+inline SvdFloat4 svdRsqrt( const SvdFloat4& x ) { return _mm_div_ps( _mm_set1_ps( 1.0f ), _mm_sqrt_ps( x.v ) ); }
+inline SvdFloat4 svdSqrt( const SvdFloat4& x ) { return _mm_sqrt_ps( x.v ); }
+inline SvdFloat4 svdAbs( const SvdFloat4& x ) { return _mm_andnot_ps( _mm_set1_ps( -0.0f ), x.v ); }
+// _mm_max_ps() returns its second argument when they're equal, so swap them round to match svdMax( SvdFloat ):
+inline SvdFloat4 svdMax( const SvdFloat4& a, const SvdFloat4& b ) { return _mm_max_ps( b.v, a.v ); }
+
+// SSE kernels, which do the block in two halves of four:
+class SseSvdKernels : public SvdKernels
+{
+public:
+
+	virtual void decompose( const float* a, float* u, float* sigma, float* v ) const
+	{
+		for( int half=0; half < BlockSize; half += 4 )
+		{
+			SvdFloat4 aHalf[9], uHalf[9], sigmaHalf[3], vHalf[9];
+			for( int i=0; i < 3; ++i )
+			{
+				for( int j=0; j < 3; ++j )
+				{
+					aHalf[ 3 * i + j ] = _mm_loadu_ps( a + ( i + 3 * j ) * BlockSize + half );
+				}
+			}
+
+			Svd3<SvdFloat4>::decompose( aHalf, uHalf, sigmaHalf, vHalf );
+
+			for( int i=0; i < 3; ++i )
+			{
+				for( int j=0; j < 3; ++j )
+				{
+					_mm_storeu_ps( u + ( i + 3 * j ) * BlockSize + half, uHalf[ 3 * i + j ].v );
+					_mm_storeu_ps( v + ( i + 3 * j ) * BlockSize + half, vHalf[ 3 * i + j ].v );
+				}
+				_mm_storeu_ps( sigma + i * BlockSize + half, sigmaHalf[i].v );
+			}
+		}
+	}
+
+};
+
+#endif // MPMSIM_SVDKERNELS_X86
+
+ScalarSvdKernels g_scalarKernels;
+
+#ifdef MPMSIM_SVDKERNELS_X86
+SseSvdKernels g_sseKernels;
+#endif
+
+} // namespace
+
+const SvdKernels* SvdKernels::kernels( Type type )
+{
+	switch( type )
+	{
+		case Scalar:
+			return &g_scalarKernels;
+#ifdef MPMSIM_SVDKERNELS_X86
+		case SSE:
+			// every x86 cpu we build for has SSE2:
+			return &g_sseKernels;
+		case AVX2:
+		{
+			// the AVX2 stencil kernels are only available if the cpu and os support AVX2:
+			static bool avx2 = StencilKernels::kernels( StencilKernels::AVX2 ) != 0;
+			return avx2 ? avx2Kernels() : 0;
+		}
+#endif
+		default:
+			return 0;
+	}
+}
+
+const SvdKernels& SvdKernels::best()
+{
+	static const SvdKernels* best = kernels( AVX2 ) ? kernels( AVX2 ) : kernels( SSE ) ? kernels( SSE ) : kernels( Scalar );
+	return *best;
+}
@@ -0,0 +1,111 @@
+#include "MpmSim/SvdKernels.h"
+
+// get these in before we switch to AVX2 below, so the rest of the library doesn't end up sharing
+// code compiled from them here:
+#include <Eigen/Dense>
+#include <cmath>
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || ( defined( __i386__ ) && defined( __SSE2__ ) ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define MPMSIM_SVDKERNELS_X86
+#endif
+
+// Svd3's functions are templates, and gcc and clang take their instruction set from where the
+// template's defined rather than from where it's instantiated, so we can't just put a target attribute
+// on the kernel like StencilKernels does. Instead, everything from here on in this file gets compiled
+// for AVX2, including Svd3. SvdKernels::kernels() only hands these kernels out if the cpu supports them.
+// MSVC lets you use intrinsics for any instruction set anyway:
+#ifdef MPMSIM_SVDKERNELS_X86
+#if defined( __clang__ )
+#pragma clang attribute push( __attribute__(( target( "avx2" ) )), apply_to = function )
+#elif defined( __GNUC__ )
+#pragma GCC push_options
+#pragma GCC target( "avx2" )
+#endif
+#include <immintrin.h>
+#endif
+
+#include "MpmSim/Svd3.h"
+
+using namespace MpmSim;
+
+#ifdef MPMSIM_SVDKERNELS_X86
+
+namespace
+{
+
+// Eight lanes of AVX floats for Svd3. As with the SSE version, svdRsqrt() doesn't use the
+// approximate _mm256_rsqrt_ps(), so the results match the scalar version:
+struct SvdFloat8
+{
+	typedef SvdFloat8 Mask;
+	SvdFloat8() {}
+	SvdFloat8( float x ) : v( _mm256_set1_ps( x ) ) {}
+	SvdFloat8( __m256 x ) : v( x ) {}
+	__m256 v;
+};
+
+inline SvdFloat8 operator+( const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_add_ps( a.v, b.v ); }
+inline SvdFloat8 operator-( const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_sub_ps( a.v, b.v ); }
+inline SvdFloat8 operator*( const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_mul_ps( a.v, b.v ); }
+inline SvdFloat8 operator-( const SvdFloat8& a ) { return _mm256_xor_ps( a.v, _mm256_set1_ps( -0.0f ) ); }
+inline SvdFloat8 operator<( const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_cmp_ps( a.v, b.v, _CMP_LT_OQ ); }
+inline SvdFloat8 operator>( const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_cmp_ps( a.v, b.v, _CMP_GT_OQ ); }
+inline SvdFloat8 svdSelect( const SvdFloat8& c, const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_blendv_ps( b.v, a.v, c.v ); }
+inline SvdFloat8 svdRsqrt( const SvdFloat8& x ) { return _mm256_div_ps( _mm256_set1_ps( 1.0f ), _mm256_sqrt_ps( x.v ) ); }
+inline SvdFloat8 svdSqrt( const SvdFloat8& x ) { return _mm256_sqrt_ps( x.v ); }
+inline SvdFloat8 svdAbs( const SvdFloat8& x ) { return _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), x.v ); }
+inline SvdFloat8 svdMax( const SvdFloat8& a, const SvdFloat8& b ) { return _mm256_max_ps( b.v, a.v ); }
+
+class Avx2SvdKernels : public SvdKernels
+{
+public:
+
+	virtual void decompose( const float* a, float* u, float* sigma, float* v ) const
+	{
+		SvdFloat8 aBlock[9], uBlock[9], sigmaBlock[3], vBlock[9];
+		for( int i=0; i < 3; ++i )
+		{
+			for( int j=0; j < 3; ++j )
+			{
+				aBlock[ 3 * i + j ] = _mm256_loadu_ps( a + ( i + 3 * j ) * BlockSize );
+			}
+		}
+
+		Svd3<SvdFloat8>::decompose( aBlock, uBlock, sigmaBlock, vBlock );
+
+		for( int i=0; i < 3; ++i )
+		{
+			for( int j=0; j < 3; ++j )
+			{
+				_mm256_storeu_ps( u + ( i + 3 * j ) * BlockSize, uBlock[ 3 * i + j ].v );
+				_mm256_storeu_ps( v + ( i + 3 * j ) * BlockSize, vBlock[ 3 * i + j ].v );
+			}
+			_mm256_storeu_ps( sigma + i * BlockSize, sigmaBlock[i].v );
+		}
+	}
+
+};
+
+} // namespace
+
+const SvdKernels* SvdKernels::avx2Kernels()
+{
+	// a local static, so it doesn't get constructed unless we're running on an AVX2 cpu:
+	static Avx2SvdKernels kernels;
+	return &kernels;
+}
+
+#if defined( __clang__ )
+#pragma clang attribute pop
+#elif defined( __GNUC__ )
+#pragma GCC pop_options
+#endif
+
+#else
+
+const SvdKernels* SvdKernels::avx2Kernels()
+{
+	return 0;
+}
+
+#endif // MPMSIM_SVDKERNELS_X86
@@ -10,6 +10,11 @@ HoudiniSolveTermination::HoudiniSolveTermination( int maxIters, float tolError,
 {
 }
 
+TerminationCriterion* HoudiniSolveTermination::clone() const
+{
+	return new HoudiniSolveTermination( *this );
+}
+
 bool HoudiniSolveTermination::cancelled() const
 {
 	return m_utInterrupt->opInterrupt();
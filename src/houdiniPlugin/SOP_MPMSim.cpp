@@ -45,8 +45,27 @@ static PRM_Name        names[] = {
     PRM_Name("hardening",		"Hardening"),
     PRM_Name("compressiveStrength",	"Compressive Strength"),
     PRM_Name("tensileStrength",		"Tensile Strength"),
+    PRM_Name("sparseGrid",		"Sparse Grid"),
+    PRM_Name("warmStartPolar",		"Warm Start Polar Decomposition"),
+    PRM_Name("cacheStiffness",		"Cache Stiffness"),
+    PRM_Name("multigridLevels",		"Multigrid Levels"),
+    PRM_Name("preconditionerReuse",	"Preconditioner Reuse"),
+    PRM_Name("schwarzSubdomainSize",	"Schwarz Subdomain Size"),
+    PRM_Name("chebyshevDegree",		"Chebyshev Degree"),
+    PRM_Name("pipelinedSolve",		"Pipelined Solve"),
+    PRM_Name("initialGuess",		"Initial Guess"),
+    PRM_Name("recycleSize",		"Recycle Size"),
 };
 
+// in the same order as MpmSim::Sim::InitialGuess:
+static PRM_Name        initialGuessNames[] = {
+    PRM_Name("centreOfMass",		"Centre Of Mass"),
+    PRM_Name("previousVelocity",	"Previous Velocity"),
+    PRM_Name("extrapolatedVelocity",	"Extrapolated Velocity"),
+    PRM_Name(0),
+};
+static PRM_ChoiceList  initialGuessMenu( PRM_CHOICELIST_SINGLE, initialGuessNames );
+
 static PRM_Default      toleranceDefault(1.e-4);         // Default to 5 divisions
 static PRM_Default      iterationsDefault(60);         // Default to 5 divisions
 
@@ -68,6 +87,16 @@ SOP_MPMSim::myTemplateList[] = {
     PRM_Template(PRM_FLT_J,	1, &names[7], &hardeningDefault),
     PRM_Template(PRM_FLT_J,	1, &names[8], &compressiveStrengthDefault),
     PRM_Template(PRM_FLT_J,	1, &names[9], &tensileStrengthDefault),
+    PRM_Template(PRM_TOGGLE,	1, &names[10], PRMzeroDefaults),
+    PRM_Template(PRM_TOGGLE,	1, &names[11], PRMzeroDefaults),
+    PRM_Template(PRM_TOGGLE,	1, &names[12], PRMzeroDefaults),
+    PRM_Template(PRM_INT,	1, &names[13], PRMoneDefaults),
+    PRM_Template(PRM_FLT_J,	1, &names[14], PRMzeroDefaults),
+    PRM_Template(PRM_INT,	1, &names[15], PRMzeroDefaults),
+    PRM_Template(PRM_INT,	1, &names[16], PRMzeroDefaults),
+    PRM_Template(PRM_TOGGLE,	1, &names[17], PRMzeroDefaults),
+    PRM_Template(PRM_ORD,	1, &names[18], PRMzeroDefaults, &initialGuessMenu),
+    PRM_Template(PRM_INT,	1, &names[19], PRMzeroDefaults),
     PRM_Template(),
 };
 
@@ -161,6 +190,7 @@ SOP_MPMSim::initSim(OP_Context &context)
 				compressiveStrength( startTime ),
 				tensileStrength( startTime )
 		) );
+		m_snowModel->setWarmStartPolarDecomposition( warmStartPolar( startTime ) );
 
 		m_forceFields = MpmSim::ForceField::ForceFieldSet();
 		m_forceFields.add( new MpmSim::GravityField( Eigen::Vector3f( 0,-9.8f,0 ) ) );
@@ -196,9 +226,18 @@ SOP_MPMSim::initSim(OP_Context &context)
 		
 		m_sim.reset(
 			new MpmSim::Sim(
-				x, m, gridSize( context.getTime() ), m_shapeFunction, *m_snowModel, m_collisionObjects, m_forceFields
+				x, m, gridSize( context.getTime() ), m_shapeFunction, *m_snowModel, m_collisionObjects, m_forceFields,
+				3, sparseGrid( startTime )
 			)
 		);
+		m_sim->setStiffnessCaching( cacheStiffness( startTime ) );
+		m_sim->setMultigridLevels( multigridLevels( startTime ) );
+		m_sim->setPreconditionerReuse( preconditionerReuse( startTime ) );
+		m_sim->setSchwarzSubdomainSize( schwarzSubdomainSize( startTime ) );
+		m_sim->setChebyshevDegree( chebyshevDegree( startTime ) );
+		m_sim->setPipelinedSolve( pipelinedSolve( startTime ) );
+		m_sim->setInitialGuess( MpmSim::Sim::InitialGuess( initialGuess( startTime ) ) );
+		m_sim->setRecycleSize( recycleSize( startTime ) );
 		
 		if( vVdb )
 		{
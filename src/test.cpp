@@ -3,6 +3,7 @@
 #include "tests/TestSnowConstitutiveModel.h"
 #include "tests/TestGrid.h"
 #include "tests/TestSimClass.h"
+#include "tests/TestMaterialPointData.h"
 
 #include "MpmSim/CubicBsplineShapeFunction.h"
 
@@ -11,6 +12,7 @@ using namespace MpmSimTest;
 
 int main(int argc, char** argv)
 {
+	TestMaterialPointData::test();
 	TestShapeFunction::test( CubicBsplineShapeFunction() );
 	TestConjugateResiduals::test();
 	TestSnowConstitutiveModel::test();
@@ -1,6 +1,9 @@
 #include "tests/TestConjugateResiduals.h"
 
+#include "MpmSim/ChebyshevPreconditioner.h"
 #include "MpmSim/ConjugateResiduals.h"
+#include "MpmSim/PipelinedConjugateResiduals.h"
+#include "MpmSim/RecycledConjugateResiduals.h"
 #include "MpmSim/SquareMagnitudeTermination.h"
 
 #include <iostream>
@@ -37,6 +40,22 @@ private:
 
 };
 
+// counts the solver iterations:
+class IterationCounter : public LinearSolver::Debug
+{
+public:
+	IterationCounter() : iterations( 0 )
+	{
+	}
+	
+	virtual void operator()( Eigen::VectorXf& x )
+	{
+		++iterations;
+	}
+	
+	int iterations;
+};
+
 namespace MpmSimTest
 {
 
@@ -108,12 +127,172 @@ void TestConjugateResiduals::testPreconditioner()
 	assert( iKnowWhatImDoing );
 }
 
+void TestConjugateResiduals::testChebyshevPreconditioner()
+{
+	std::cerr << "testChebyshevPreconditioner()" << std::endl;
+	const int matrixSize = 40;
+	
+	// symmetric positive definite matrix with a wide range of scales on the diagonal, and the
+	// jacobi preconditioner that evens them out:
+	MatrixXf B = MatrixXf::Random( matrixSize, matrixSize );
+	MatrixXf scales = MatrixXf::Zero( matrixSize, matrixSize );
+	for( int i=0; i < matrixSize; ++i )
+	{
+		scales( i, i ) = exp( 0.1f * i );
+	}
+	MatrixXf A = scales * ( B * B.transpose() + 0.1f * MatrixXf::Identity( matrixSize, matrixSize ) ) * scales;
+	MatrixXf diagonal = A.diagonal().asDiagonal();
+	DenseMatrix matrix( A );
+	DenseMatrix jacobi( diagonal );
+	
+	// eigenvalues of the jacobi preconditioned matrix:
+	MatrixXf invSqrtDiagonal = A.diagonal().cwiseSqrt().cwiseInverse().asDiagonal();
+	SelfAdjointEigenSolver<MatrixXf> eigenSolver( invSqrtDiagonal * A * invSqrtDiagonal );
+	float minEigenvalue = eigenSolver.eigenvalues()[0];
+	float maxEigenvalue = eigenSolver.eigenvalues()[matrixSize-1];
+	
+	// the first application estimates the bounds, which should contain the top of the spectrum:
+	ChebyshevPreconditioner chebyshev( matrix, jacobi, 6, 20 );
+	VectorXf x = VectorXf::Random( matrixSize );
+	VectorXf y = VectorXf::Random( matrixSize );
+	VectorXf mx, my;
+	chebyshev.multInverseVector( x, mx );
+	chebyshev.multInverseVector( y, my );
+	std::cerr << "bounds: " << chebyshev.minEigenvalue() << " " << chebyshev.maxEigenvalue() << " actual: " << minEigenvalue << " " << maxEigenvalue << std::endl;
+	assert( chebyshev.maxEigenvalue() >= maxEigenvalue );
+	assert( chebyshev.maxEigenvalue() < 1.2f * maxEigenvalue );
+	assert( chebyshev.minEigenvalue() > 0 );
+	assert( chebyshev.minEigenvalue() < chebyshev.maxEigenvalue() );
+	
+	// it should be a symmetric positive definite operator:
+	assert( fabs( x.dot( my ) - y.dot( mx ) ) < 1.e-4f * x.norm() * my.norm() );
+	assert( x.dot( mx ) > 0 );
+	assert( y.dot( my ) > 0 );
+	
+	// and a better preconditioner than jacobi on its own:
+	VectorXf b = VectorXf::Random( matrixSize );
+	SquareMagnitudeTermination t( 500, 1.e-4f );
+	IterationCounter jacobiIterations, chebyshevIterations;
+	VectorXf jacobiSolution = VectorXf::Zero( matrixSize );
+	VectorXf chebyshevSolution = VectorXf::Zero( matrixSize );
+	ConjugateResiduals( t, &jacobi )( matrix, b, jacobiSolution, &jacobiIterations );
+	ConjugateResiduals( t, &chebyshev )( matrix, b, chebyshevSolution, &chebyshevIterations );
+	std::cerr << "jacobi iterations: " << jacobiIterations.iterations << " chebyshev iterations: " << chebyshevIterations.iterations << std::endl;
+	assert( chebyshevIterations.iterations < jacobiIterations.iterations );
+	assert( ( A * chebyshevSolution - b ).norm() < 1.e-3f * b.norm() );
+}
+
+void TestConjugateResiduals::testPipelinedSolve()
+{
+	std::cerr << "testPipelinedSolve()" << std::endl;
+	const int matrixSize = 40;
+	
+	MatrixXf B = MatrixXf::Random( matrixSize, matrixSize );
+	MatrixXf scales = MatrixXf::Zero( matrixSize, matrixSize );
+	for( int i=0; i < matrixSize; ++i )
+	{
+		scales( i, i ) = exp( 0.05f * i );
+	}
+	// the pipelined recurrences lose accuracy quicker than the plain ones as the condition number
+	// goes up, so keep this one a bit nicer than the one in testChebyshevPreconditioner():
+	MatrixXf A = scales * ( B * B.transpose() + 10.0f * MatrixXf::Identity( matrixSize, matrixSize ) ) * scales;
+	MatrixXf diagonal = A.diagonal().asDiagonal();
+	DenseMatrix matrix( A );
+	DenseMatrix jacobi( diagonal );
+	VectorXf b = VectorXf::Random( matrixSize );
+	
+	// should do the same iterations as the plain solver in exact arithmetic, with and without a
+	// preconditioner, but it's allowed to take a few more as it drifts a bit more in floating point:
+	const DenseMatrix* preconditioners[] = { 0, &jacobi };
+	for( int i=0; i < 2; ++i )
+	{
+		SquareMagnitudeTermination t( 500, 1.e-4f );
+		IterationCounter iterations, pipelinedIterations;
+		VectorXf solution = VectorXf::Zero( matrixSize );
+		VectorXf pipelinedSolution = VectorXf::Zero( matrixSize );
+		ConjugateResiduals( t, preconditioners[i] )( matrix, b, solution, &iterations );
+		PipelinedConjugateResiduals( t, preconditioners[i] )( matrix, b, pipelinedSolution, &pipelinedIterations );
+		std::cerr << "iterations: " << iterations.iterations << " pipelined iterations: " << pipelinedIterations.iterations << std::endl;
+		assert( pipelinedIterations.iterations <= iterations.iterations + 5 );
+		assert( ( A * pipelinedSolution - b ).norm() < 2.e-4f * b.norm() );
+		assert( ( pipelinedSolution - solution ).norm() < 1.e-2f * solution.norm() );
+	}
+}
+
+void TestConjugateResiduals::testRecycledSolve()
+{
+	std::cerr << "testRecycledSolve()" << std::endl;
+	const int matrixSize = 60;
+	
+	// a matrix with a handful of really small eigenvalues, which the plain solver takes ages to resolve:
+	MatrixXf Q = MatrixXf::Random( matrixSize, matrixSize ).householderQr().householderQ();
+	VectorXf eigenvalues( matrixSize );
+	for( int i=0; i < matrixSize; ++i )
+	{
+		eigenvalues[i] = i < 4 ? 1.e-3f * ( i + 1 ) : 1.0f + 0.15f * i;
+	}
+	MatrixXf A = Q * eigenvalues.asDiagonal() * Q.transpose();
+	
+	// and one a bit different from it, like the next time step's:
+	MatrixXf noise = MatrixXf::Random( matrixSize, matrixSize );
+	MatrixXf nextA = A + 1.e-4f * ( noise + noise.transpose() );
+	
+	MatrixXf diagonal = A.diagonal().asDiagonal();
+	MatrixXf nextDiagonal = nextA.diagonal().asDiagonal();
+	DenseMatrix matrix( A );
+	DenseMatrix nextMatrix( nextA );
+	DenseMatrix jacobi( diagonal );
+	DenseMatrix nextJacobi( nextDiagonal );
+	VectorXf b = VectorXf::Random( matrixSize );
+	VectorXf nextB = VectorXf::Random( matrixSize );
+	
+	const DenseMatrix* preconditioners[] = { 0, &jacobi };
+	const DenseMatrix* nextPreconditioners[] = { 0, &nextJacobi };
+	for( int i=0; i < 2; ++i )
+	{
+		SquareMagnitudeTermination t( 500, 1.e-5f );
+		
+		// with nothing to recycle it should do the same as the plain solver:
+		std::vector<VectorXf> recycleSpace;
+		IterationCounter iterations, recycledIterations;
+		VectorXf solution = VectorXf::Zero( matrixSize );
+		VectorXf recycledSolution = VectorXf::Zero( matrixSize );
+		ConjugateResiduals( t, preconditioners[i] )( matrix, b, solution, &iterations );
+		RecycledConjugateResiduals( t, recycleSpace, 4, preconditioners[i] )( matrix, b, recycledSolution, &recycledIterations );
+		std::cerr << "iterations: " << iterations.iterations << " recycled iterations: " << recycledIterations.iterations << std::endl;
+		assert( recycledIterations.iterations <= iterations.iterations + 2 );
+		assert( ( A * recycledSolution - b ).norm() < 1.e-3f * b.norm() );
+		assert( recycleSpace.size() == 4 );
+		
+		// the recycled vectors should be close to the eigenvectors for the small eigenvalues, so the
+		// next solve should find those straight away, and take a lot fewer iterations:
+		IterationCounter nextIterations, nextRecycledIterations;
+		VectorXf nextSolution = VectorXf::Zero( matrixSize );
+		VectorXf nextRecycledSolution = VectorXf::Zero( matrixSize );
+		ConjugateResiduals( t, nextPreconditioners[i] )( nextMatrix, nextB, nextSolution, &nextIterations );
+		RecycledConjugateResiduals( t, recycleSpace, 4, nextPreconditioners[i] )( nextMatrix, nextB, nextRecycledSolution, &nextRecycledIterations );
+		std::cerr << "iterations: " << nextIterations.iterations << " recycled iterations: " << nextRecycledIterations.iterations << std::endl;
+		assert( nextRecycledIterations.iterations < nextIterations.iterations );
+		assert( ( nextA * nextRecycledSolution - nextB ).norm() < 1.e-3f * nextB.norm() );
+		assert( recycleSpace.size() == 4 );
+	}
+	
+	// a recycle size of zero should leave nothing behind:
+	SquareMagnitudeTermination t( 500, 1.e-5f );
+	std::vector<VectorXf> recycleSpace( 2, VectorXf::Random( matrixSize ) );
+	VectorXf solution = VectorXf::Zero( matrixSize );
+	RecycledConjugateResiduals( t, recycleSpace, 0 )( matrix, b, solution );
+	assert( recycleSpace.empty() );
+}
 
 void TestConjugateResiduals::test()
 {
 	std::cerr << "TestConjugateResiduals::test()" << std::endl;
 	testSolve();
 	//testPreconditioner();
+	testChebyshevPreconditioner();
+	testPipelinedSolve();
+	testRecycledSolve();
 }
 
 }
@@ -3,14 +3,21 @@
 #include "tests/TestGrid.h"
 
 #include "MpmSim/Grid.h"
+#include "MpmSim/BlockDiagonalPreconditioner.h"
 #include "MpmSim/CollisionPlane.h"
 #include "MpmSim/ConjugateResiduals.h"
 #include "MpmSim/CubicBsplineShapeFunction.h"
+#include "MpmSim/GravityField.h"
+#include "MpmSim/MultigridPreconditioner.h"
+#include "MpmSim/SchwarzPreconditioner.h"
 #include "MpmSim/SnowConstitutiveModel.h"
 #include "MpmSim/SquareMagnitudeTermination.h"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <memory>
 
 using namespace MpmSim;
 using namespace Eigen;
@@ -344,6 +351,7 @@ void TestGrid::testForces()
 	// now work out the forces on the grid nodes by finite differences!
 	std::vector<float>& volume = particleData.variable<float>("volume");
 	float e0 = constitutiveModel.energyDensity( 0 ) * volume[0];
+	float maxForce = forces.cwiseAbs().maxCoeff();
 	const float dx = 0.01f;
 	for( int i=0; i <g.m_velocities.size(); ++i )
 	{
@@ -381,9 +389,10 @@ void TestGrid::testForces()
 		float eMinus = constitutiveModel.energyDensity( 0 ) * volume[0];
 		g.calculateForces( forcesPerturbedNegative, constitutiveModel, forceFields );
 		
-		// x component of force on this node is -dE/dx, same for y and z. Make fd and analytic values
-		// agree within a percent:
-		assert( fabs( ( forces[i] + ( ePlus - eMinus ) / ( 2 * dx ) ) / forces[i] ) < 0.01f );
+		// x component of force on this node is -dE/dx, same for y and z. The energies are only good to
+		// single precision, which leaves about the same absolute error in every finite difference, so
+		// make fd and analytic values agree to a tenth of a percent of the largest force:
+		assert( fabs( forces[i] + ( ePlus - eMinus ) / ( 2 * dx ) ) < 0.001f * maxForce );
 		
 		// I wish I knew why this stuff converged so badly... looks like I can only get the force
 		// differentials to agree with the finite difference approximation to within 2.5% or something.
@@ -834,6 +843,11 @@ void TestGrid::testDfiDxi()
 	Grid g( particleData, inds, gridSize, shapeFunction );
 	Eigen::VectorXf dfidxi;
 	g.dForceidXi( dfidxi, constitutiveModel );
+	
+	// the force differentials can go through the SIMD kernels, which add things up in a different order,
+	// and the closed form blocks are worked out differently again, so both only match up to float rounding:
+	Eigen::VectorXf blocks;
+	g.dForceidXiBlocks( blocks, constitutiveModel );
 
 	ForceField::ForceFieldSet fields;
 	Eigen::VectorXf dx = Eigen::VectorXf::Constant(dfidxi.size(),0);
@@ -846,11 +860,1125 @@ void TestGrid::testDfiDxi()
 			dx,
 			constitutiveModel,
 			fields );
-		assert( fabs( df[i] - dfidxi[i] ) < 1.e-8 );
+		assert( fabs( df[i] - dfidxi[i] ) <= 1.e-5f * ( 1 + fabs( df[i] ) ) );
+		float blockDiagonal = blocks[ 9 * ( i / 3 ) + 4 * ( i % 3 ) ];
+		assert( fabs( df[i] - blockDiagonal ) <= 1.e-5f * ( 1 + fabs( df[i] ) ) );
 		dx[i] = 0;
 	}
 }
 
+// makes two little clumps of particles a long way apart, so a dense grid is mostly empty:
+static void makeSeparatedClumps( MaterialPointData& particleData, Sim::IndexList& inds, float gridSize )
+{
+	std::vector<Vector3f>& velocities = particleData.variable<Vector3f>( "v" );
+	std::vector<Vector3f>& positions = particleData.variable<Vector3f>( "p" );
+	std::vector<Matrix3f>& F = particleData.variable<Matrix3f>( "F" );
+	std::vector<float>& masses = particleData.variable<float>( "m" );
+	std::vector<float>& volumes = particleData.variable<float>( "volume" );
+	
+	for( int c=0; c < 2; ++c )
+	{
+		Vector3f offset = c * Vector3f( 40, 30, 20 ) * gridSize;
+		for( int i=0; i < 6; ++i )
+		{
+			for( int j=0; j < 6; ++j )
+			{
+				for( int k=0; k < 6; ++k )
+				{
+					inds.push_back( (int)positions.size() );
+					positions.push_back( offset + Vector3f( float( i ), float( j ), float( k ) ) * 0.5f * gridSize );
+					masses.push_back( 1.0f );
+					volumes.push_back( 1.0f );
+					velocities.push_back(
+						Vector3f(
+							0.1f + 0.01f*sin( 2 * positions.back()[0] ),
+							0.1f + 0.01f*sin( 2 * positions.back()[1] ),
+							-0.5f + 0.01f*sin( 2 * positions.back()[2] )
+						)
+					);
+					F.push_back( Matrix3f::Identity() + 0.01f * cos( 3.0f * i + 5.0f * j + 7.0f * k ) * Matrix3f::Ones() );
+				}
+			}
+		}
+	}
+}
+
+// Snow particles with a grid set up on them, which the solver tests below start from:
+class TestGrid::SnowFixture
+{
+public:
+	
+	// makeSeparatedClumps() particles with the usual snow parameters, on a dense or sparse grid:
+	SnowFixture( float gridSize, const ShapeFunction& shapeFunction, bool sparse ) :
+		snowModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f )
+	{
+		makeSeparatedClumps( d, inds, gridSize );
+		initialise( gridSize, shapeFunction, sparse );
+	}
+	
+	// a block of ni x nj x nk snow particles that's been squashed and sheared, falling onto the
+	// plane, on a dense grid. The strengths are big so the deformation stays elastic, rather than
+	// getting yielded away:
+	SnowFixture( float gridSize, const ShapeFunction& shapeFunction, int ni, int nj, int nk ) :
+		snowModel( 1.4e5f, 0.2f, 0, 100000.0f, 100000.0f )
+	{
+		Matrix3f deformed;
+		deformed <<
+			1.3f, 0.4f, 0.0f,
+			0.0f, 0.7f, 0.2f,
+			0.0f, 0.0f, 1.0f;
+		for( int i=0; i < ni; ++i )
+		{
+			for( int j=0; j < nj; ++j )
+			{
+				for( int k=0; k < nk; ++k )
+				{
+					inds.push_back( (int)d.variable<Vector3f>( "p" ).size() );
+					d.variable<Vector3f>( "p" ).push_back( Vector3f( float( i ), float( j ), float( k ) ) * 0.5f * gridSize );
+					d.variable<Vector3f>( "v" ).push_back( Vector3f( 0.1f, -1.0f, 0.0f ) );
+					d.variable<Matrix3f>( "F" ).push_back( deformed + 0.01f * cos( 3.0f * i + 5.0f * j + 7.0f * k ) * Matrix3f::Ones() );
+					d.variable<float>( "m" ).push_back( 1.0f );
+					d.variable<float>( "volume" ).push_back( 1.0f );
+				}
+			}
+		}
+		initialise( gridSize, shapeFunction, false );
+	}
+	
+	SnowConstitutiveModel snowModel;
+	MaterialPointData d;
+	Sim::IndexList inds;
+	std::unique_ptr<Grid> grid;
+	
+private:
+	
+	void initialise( float gridSize, const ShapeFunction& shapeFunction, bool sparse )
+	{
+		snowModel.setParticles( d );
+		snowModel.updateParticleData();
+		grid.reset( new Grid( d, inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse ) );
+		grid->computeParticleVolumes();
+	}
+	
+};
+
+void TestGrid::testSparseGrid()
+{
+	std::cerr << "testSparseGrid()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	CubicBsplineShapeFunction shapeFunction;
+	SnowConstitutiveModel denseModel( 1.4e5f, 0.2f, 0, 100000.0f, 100000.0f );
+	SnowConstitutiveModel sparseModel( 1.4e5f, 0.2f, 0, 100000.0f, 100000.0f );
+	
+	MaterialPointData denseData;
+	Sim::IndexList denseInds;
+	makeSeparatedClumps( denseData, denseInds, gridSize );
+	denseModel.setParticles( denseData );
+	denseModel.updateParticleData();
+	
+	MaterialPointData sparseData;
+	Sim::IndexList sparseInds;
+	makeSeparatedClumps( sparseData, sparseInds, gridSize );
+	sparseModel.setParticles( sparseData );
+	sparseModel.updateParticleData();
+	
+	Grid dense( denseData, denseInds, gridSize, shapeFunction, Vector3f::Zero(), 3, false );
+	Grid sparse( sparseData, sparseInds, gridSize, shapeFunction, Vector3f::Zero(), 3, true );
+	dense.computeParticleVolumes();
+	sparse.computeParticleVolumes();
+	
+	// the sparse grid should be a lot smaller, but cover the same region:
+	assert( sparse.m_masses.size() < dense.m_masses.size() / 10 );
+	assert( sparse.m_min == dense.m_min );
+	assert( sparse.m_n == dense.m_n );
+	
+	// index mapping should round trip. Blocks can hang off the end of the dense grid, but the nodes
+	// out there shouldn't have anything splatted onto them:
+	std::vector<int> denseIndices( sparse.m_masses.size() );
+	for( int idx=0; idx < sparse.m_masses.size(); ++idx )
+	{
+		Vector3i coords;
+		sparse.indexToCoords( idx, coords );
+		assert( sparse.coordsToIndex( coords[0], coords[1], coords[2] ) == idx );
+		if( coords[0] >= dense.m_n[0] || coords[1] >= dense.m_n[1] || coords[2] >= dense.m_n[2] )
+		{
+			assert( sparse.m_masses[idx] == 0 );
+			denseIndices[idx] = -1;
+			continue;
+		}
+		denseIndices[idx] = dense.coordsToIndex( coords[0], coords[1], coords[2] );
+		assert( sparse.nodePosition( idx ) == dense.nodePosition( denseIndices[idx] ) );
+	}
+	
+	// all the mass should have ended up on the same nodes:
+	for( int idx=0; idx < sparse.m_masses.size(); ++idx )
+	{
+		int denseIdx = denseIndices[idx];
+		if( denseIdx < 0 )
+		{
+			continue;
+		}
+		assert( fabs( sparse.m_masses[idx] - dense.m_masses[denseIdx] ) < 1.e-6 );
+		assert( ( sparse.m_velocities.segment<3>( 3 * idx ) - dense.m_velocities.segment<3>( 3 * denseIdx ) ).norm() < 1.e-6 );
+	}
+	assert( fabs( sparse.m_masses.sum() - dense.m_masses.sum() ) < 1.e-3 );
+	
+	// same forces:
+	ForceField::ForceFieldSet fields;
+	fields.add( new GravityField( Vector3f( 0, -9.8f, 0 ) ) );
+	VectorXf denseForces( dense.m_velocities.size() );
+	VectorXf sparseForces( sparse.m_velocities.size() );
+	dense.calculateForces( denseForces, denseModel, fields );
+	sparse.calculateForces( sparseForces, sparseModel, fields );
+	for( int idx=0; idx < sparse.m_masses.size(); ++idx )
+	{
+		int denseIdx = denseIndices[idx];
+		if( denseIdx < 0 )
+		{
+			continue;
+		}
+		assert( ( sparseForces.segment<3>( 3 * idx ) - denseForces.segment<3>( 3 * denseIdx ) ).norm() < 1.e-3 );
+	}
+	
+	// same implicit update, with the bottom clump resting on a collision plane:
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	
+	SquareMagnitudeTermination t( 40, 1.e-6f );
+	const float timeStep = 0.002f;
+	dense.updateGridVelocities( timeStep, denseModel, collisionObjects, fields, t );
+	sparse.updateGridVelocities( timeStep, sparseModel, collisionObjects, fields, t );
+	
+	float maxVelocity = 0;
+	float maxDifference = 0;
+	for( int idx=0; idx < sparse.m_masses.size(); ++idx )
+	{
+		int denseIdx = denseIndices[idx];
+		if( sparse.m_masses[idx] == 0 )
+		{
+			continue;
+		}
+		assert( sparse.m_nodeCollided[idx] == dense.m_nodeCollided[denseIdx] );
+		maxVelocity = std::max( maxVelocity, dense.m_velocities.segment<3>( 3 * denseIdx ).norm() );
+		maxDifference = std::max( maxDifference, ( sparse.m_velocities.segment<3>( 3 * idx ) - dense.m_velocities.segment<3>( 3 * denseIdx ) ).norm() );
+	}
+	assert( maxDifference < 1.e-3f * maxVelocity );
+	
+	// transfer back to the particles, and check they agree:
+	dense.updateParticleVelocities();
+	sparse.updateParticleVelocities();
+	dense.updateDeformationGradients( timeStep );
+	sparse.updateDeformationGradients( timeStep );
+	
+	const std::vector<Vector3f>& denseV = denseData.variable<Vector3f>( "v" );
+	const std::vector<Vector3f>& sparseV = sparseData.variable<Vector3f>( "v" );
+	const std::vector<Matrix3f>& denseF = denseData.variable<Matrix3f>( "F" );
+	const std::vector<Matrix3f>& sparseF = sparseData.variable<Matrix3f>( "F" );
+	for( size_t p=0; p < denseV.size(); ++p )
+	{
+		assert( ( denseV[p] - sparseV[p] ).norm() < 1.e-3f * maxVelocity );
+		assert( ( denseF[p] - sparseF[p] ).norm() < 1.e-5f );
+	}
+}
+
+void TestGrid::checkUpdatedGrid( const Grid& g, MaterialPointData& d, const ShapeFunction& shapeFunction, bool sparse )
+{
+	const std::vector<Vector3f>& positions = d.variable<Vector3f>( "p" );
+	
+	// the particles should be in voxel order, and the processing partitions should account for all of them:
+	size_t numPartitionedParticles = 0;
+	float voxelSize = 2 * shapeFunction.supportRadius() * g.m_gridSize;
+	for( int i=0; i < 8; ++i )
+	{
+		const Grid::ParticlesInVoxelList& partition = g.m_processingPartitions[i&1][(i&2) / 2][(i&4) / 4];
+		for( size_t v=0; v < partition.size(); ++v )
+		{
+			numPartitionedParticles += partition[v].second - partition[v].first;
+			Vector3i voxel;
+			for( Sim::ConstIndexIterator it = partition[v].first; it != partition[v].second; ++it )
+			{
+				Vector3f x = positions[ *it ] / voxelSize;
+				Vector3i particleVoxel( (int)floor( x[0] ), (int)floor( x[1] ), (int)floor( x[2] ) );
+				if( it == partition[v].first )
+				{
+					voxel = particleVoxel;
+				}
+				assert( particleVoxel == voxel );
+				assert( ( voxel[0] & 1 ) == ( i&1 ) );
+				assert( ( voxel[1] & 1 ) == ( (i&2) / 2 ) );
+				assert( ( voxel[2] & 1 ) == ( (i&4) / 4 ) );
+			}
+		}
+	}
+	assert( numPartitionedParticles == g.m_particleInds.size() );
+	
+	// compare against a grid built from scratch:
+	Grid fresh( d, g.m_particleInds, g.m_gridSize, shapeFunction, g.m_frameVelocity, 3, sparse );
+	
+	Sim::IndexList inds( g.m_particleInds );
+	Sim::IndexList freshInds( fresh.m_particleInds );
+	std::sort( inds.begin(), inds.end() );
+	std::sort( freshInds.begin(), freshInds.end() );
+	assert( inds == freshInds );
+	
+	assert( fabs( g.m_masses.sum() - fresh.m_masses.sum() ) < 1.e-4f * fresh.m_masses.sum() );
+	for( int idx=0; idx < fresh.m_masses.size(); ++idx )
+	{
+		Vector3f c = ( fresh.nodePosition( idx ) - g.m_min ) / g.m_gridSize;
+		Vector3i coords( (int)floor( c[0] + 0.5f ), (int)floor( c[1] + 0.5f ), (int)floor( c[2] + 0.5f ) );
+		int updatedIdx = -1;
+		if( coords.minCoeff() >= 0 && coords[0] < g.m_n[0] && coords[1] < g.m_n[1] && coords[2] < g.m_n[2] )
+		{
+			updatedIdx = g.coordsToIndex( coords[0], coords[1], coords[2] );
+		}
+		if( updatedIdx == -1 )
+		{
+			assert( fresh.m_masses[idx] == 0 );
+			continue;
+		}
+		// the grid origins are different, so allow for a bit of rounding error:
+		assert( fabs( g.m_masses[updatedIdx] - fresh.m_masses[idx] ) < 1.e-5f * ( 1 + fresh.m_masses[idx] ) );
+		// compare momenta, as velocities on nodes right at the edge of the shape function support are
+		// pretty much arbitrary:
+		Vector3f momentumDiff =
+			g.m_masses[updatedIdx] * g.m_velocities.segment<3>( 3 * updatedIdx ) -
+			fresh.m_masses[idx] * fresh.m_velocities.segment<3>( 3 * idx );
+		assert( momentumDiff.norm() < 1.e-4f * ( 1 + fresh.m_masses[idx] ) );
+	}
+}
+
+void TestGrid::testGridUpdate()
+{
+	std::cerr << "testGridUpdate()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	CubicBsplineShapeFunction shapeFunction;
+	
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		
+		MaterialPointData d;
+		Sim::IndexList inds;
+		makeSeparatedClumps( d, inds, gridSize );
+		std::vector<Vector3f>& positions = d.variable<Vector3f>( "p" );
+		
+		Grid g( d, inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		
+		// nudge the particles, which should push them outside the grid so it has to grow:
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] += Vector3f( 0.3f, 0.2f, -0.35f ) * gridSize;
+		}
+		g.update( Vector3f( 0, -1, 0 ) );
+		checkUpdatedGrid( g, d, shapeFunction, sparse );
+		
+		// nudge them again. This time the grid should have enough slack to fit them in
+		// without changing size:
+		Vector3i n = g.m_n;
+		Vector3f min = g.m_min;
+		const float* masses = g.m_masses.data();
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] += Vector3f( 0.1f, -0.15f, 0.2f ) * gridSize;
+		}
+		g.update( Vector3f( 0, -1, 0 ) );
+		assert( g.m_n == n );
+		assert( g.m_min == min );
+		if( !sparse )
+		{
+			assert( g.m_masses.data() == masses );
+		}
+		checkUpdatedGrid( g, d, shapeFunction, sparse );
+		
+		// jumble the particles up so the previous ordering is no good:
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] += 6 * gridSize * Vector3f( sin( 7.0f * p ), cos( 11.0f * p ), sin( 13.0f * p ) );
+		}
+		g.update();
+		checkUpdatedGrid( g, d, shapeFunction, sparse );
+		
+		// switch over to just the first clump:
+		Sim::IndexList firstClump( inds.begin(), inds.begin() + inds.size() / 2 );
+		g.setParticles( firstClump );
+		g.update();
+		assert( g.m_particleInds.size() == firstClump.size() );
+		checkUpdatedGrid( g, d, shapeFunction, sparse );
+	}
+}
+
+void TestGrid::testShapeFunctionCache()
+{
+	std::cerr << "testShapeFunctionCache()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	CubicBsplineShapeFunction shapeFunction;
+	
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		MaterialPointData d;
+		Sim::IndexList inds;
+		makeSeparatedClumps( d, inds, gridSize );
+		const std::vector<Vector3f>& positions = d.variable<Vector3f>( "p" );
+		
+		Grid g( d, inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		
+		assert( g.m_stencilType == Grid::Stencil4x4x4 );
+		
+		// cached weights should match the ones we get by evaluating the shape functions directly,
+		// and the fixed size stencil iterator should agree with the generic one:
+		Grid::ShapeFunctionIterator cached( g );
+		Grid::ShapeFunctionIterator direct( g );
+		Grid::FixedShapeFunctionIterator<4, 3> fixed( g );
+		for( Sim::ConstIndexIterator it = g.m_particleInds.begin(); it != g.m_particleInds.end(); ++it )
+		{
+			cached.initialize( it, true );
+			direct.initialize( positions[*it], true );
+			fixed.initialize( it, true );
+			int numNodes = 0;
+			bool more;
+			do
+			{
+				Vector3i cachedPos, directPos, fixedPos;
+				cached.gridPos( cachedPos );
+				direct.gridPos( directPos );
+				fixed.gridPos( fixedPos );
+				assert( cachedPos == directPos );
+				assert( fixedPos == directPos );
+				assert( cached.index() == direct.index() );
+				assert( fixed.index() == direct.index() );
+				assert( cached.w() == direct.w() );
+				assert( fixed.w() == direct.w() );
+				
+				Vector3f cachedGrad, directGrad, fixedGrad;
+				cached.dw( cachedGrad );
+				direct.dw( directGrad );
+				fixed.dw( fixedGrad );
+				assert( cachedGrad == directGrad );
+				assert( fixedGrad == directGrad );
+				
+				// check the closed form b-spline weights against the shape function itself:
+				Vector3f x = directPos.cast<float>() - ( positions[*it] - g.m_min ) / gridSize;
+				float w = shapeFunction.w( x[0] ) * shapeFunction.w( x[1] ) * shapeFunction.w( x[2] );
+				Vector3f grad(
+					shapeFunction.dw( x[0] ) * shapeFunction.w( x[1] ) * shapeFunction.w( x[2] ),
+					shapeFunction.w( x[0] ) * shapeFunction.dw( x[1] ) * shapeFunction.w( x[2] ),
+					shapeFunction.w( x[0] ) * shapeFunction.w( x[1] ) * shapeFunction.dw( x[2] )
+				);
+				assert( fabs( direct.w() - w ) < 1.e-6f );
+				assert( ( directGrad + grad / gridSize ).norm() < 1.e-4f );
+				
+				++numNodes;
+				more = direct.next();
+				assert( cached.next() == more );
+				assert( fixed.next() == more );
+			} while( more );
+			assert( numNodes == 64 );
+		}
+	}
+}
+
+void TestGrid::testStencilKernels()
+{
+	std::cerr << "testStencilKernels()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	CubicBsplineShapeFunction shapeFunction;
+	
+	MaterialPointData d;
+	Sim::IndexList inds;
+	makeSeparatedClumps( d, inds, gridSize );
+	
+	// sparse grids can't use the kernels:
+	Grid sparseGrid( d, inds, gridSize, shapeFunction, Vector3f::Zero(), 3, true );
+	assert( sparseGrid.m_kernels == 0 );
+	
+	Grid g( d, inds, gridSize, shapeFunction, Vector3f::Zero(), 3, false );
+	assert( g.m_kernels == &StencilKernels::best() );
+	
+	// some made up grid data to gather and splat:
+	int numNodes = (int)g.m_masses.size();
+	VectorXf x( 3 * numNodes );
+	for( int i=0; i < x.size(); ++i )
+	{
+		x[i] = sin( 0.37f * i ) + 0.5f * cos( 1.3f * i );
+	}
+	Matrix3f m;
+	m << 1, 2, -3, 0.5f, -1, 4, 2, 0, 1;
+	Vector3f momentum( 0.3f, -1.2f, 0.7f );
+	
+	StencilKernels::Type types[] = { StencilKernels::Scalar, StencilKernels::SSE, StencilKernels::AVX2 };
+	for( int t=0; t < 3; ++t )
+	{
+		const StencilKernels* kernels = StencilKernels::kernels( types[t] );
+		if( !kernels )
+		{
+			continue;
+		}
+		
+		// compare against the shape function iterator one particle at a time:
+		Grid::ShapeFunctionIterator shIt( g );
+		for( Sim::ConstIndexIterator it = g.m_particleInds.begin(); it != g.m_particleInds.end(); ++it )
+		{
+			StencilKernels::Stencil s = g.stencil( it );
+			
+			VectorXf masses = VectorXf::Zero( numNodes );
+			VectorXf momenta = VectorXf::Zero( 3 * numNodes );
+			VectorXf forces = VectorXf::Zero( 3 * numNodes );
+			kernels->splatMassMomentum( s, 2.0f, momentum, masses.data(), momenta.data() );
+			kernels->splatForce( s, m, forces.data() );
+			Matrix3f gradient = kernels->gatherGradient( s, x.data() );
+			Vector3f value = kernels->gatherValue( s, x.data() );
+			
+			VectorXf expectedMasses = VectorXf::Zero( numNodes );
+			VectorXf expectedMomenta = VectorXf::Zero( 3 * numNodes );
+			VectorXf expectedForces = VectorXf::Zero( 3 * numNodes );
+			Matrix3f expectedGradient = Matrix3f::Zero();
+			Vector3f expectedValue = Vector3f::Zero();
+			Vector3f weightGrad;
+			shIt.initialize( it, true );
+			do
+			{
+				int idx = shIt.index();
+				float w = shIt.w();
+				shIt.dw( weightGrad );
+				expectedMasses[idx] += 2.0f * w;
+				expectedMomenta.segment<3>( 3 * idx ) += w * momentum;
+				expectedForces.segment<3>( 3 * idx ) -= m * weightGrad;
+				expectedGradient += x.segment<3>( 3 * idx ) * weightGrad.transpose();
+				expectedValue += w * x.segment<3>( 3 * idx );
+			} while( shIt.next() );
+			
+			assert( ( masses - expectedMasses ).norm() < 1.e-6f );
+			assert( ( momenta - expectedMomenta ).norm() < 1.e-6f );
+			assert( ( forces - expectedForces ).norm() < 1.e-6f * ( 1 + expectedForces.norm() ) );
+			assert( ( gradient - expectedGradient ).norm() < 1.e-6f * ( 1 + expectedGradient.norm() ) );
+			assert( ( value - expectedValue ).norm() < 1.e-6f );
+		}
+	}
+}
+
+void TestGrid::testStiffnessCache()
+{
+	std::cerr << "testStiffnessCache()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	fields.add( new GravityField( Vector3f( 0, -9.8f, 0 ) ) );
+	
+	// dense grids go through the stencil kernels and sparse ones through the shape function iterators:
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		SnowFixture f( gridSize, shapeFunction, sparse );
+		Grid& g = *f.grid;
+		
+		VectorXf dx( g.m_velocities.size() );
+		for( int i=0; i < dx.size(); ++i )
+		{
+			dx[i] = sin( 0.37f * i ) + 0.5f * cos( 1.3f * i );
+		}
+		
+		// force differentials from the cached stiffness matrices should match the ones we get
+		// by going through the constitutive model:
+		VectorXf expected;
+		g.calculateForceDifferentials( expected, dx, f.snowModel, fields );
+		
+		assert( !g.getStiffnessCaching() );
+		g.setStiffnessCaching( true );
+		g.cacheStiffness( f.snowModel );
+		assert( g.m_stiffness.size() == 81 * f.inds.size() );
+		VectorXf df;
+		g.calculateForceDifferentials( df, dx, f.snowModel, fields );
+		assert( ( df - expected ).norm() < 1.e-5f * expected.norm() );
+		
+		// same goes for the whole implicit update:
+		Grid uncachedGrid( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		Grid cachedGrid( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		cachedGrid.setStiffnessCaching( true );
+		CollisionObject::CollisionObjectSet collisionObjects;
+		collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+		SquareMagnitudeTermination t( 40, 1.e-6f );
+		uncachedGrid.updateGridVelocities( 0.002f, f.snowModel, collisionObjects, fields, t );
+		cachedGrid.updateGridVelocities( 0.002f, f.snowModel, collisionObjects, fields, t );
+		assert( !cachedGrid.m_stiffnessCached );
+		assert( ( cachedGrid.m_velocities - uncachedGrid.m_velocities ).norm() < 1.e-4f * uncachedGrid.m_velocities.norm() );
+	}
+}
+
+// counts the solver iterations:
+class IterationCounter : public LinearSolver::Debug
+{
+public:
+	
+	IterationCounter() : iterations( 0 )
+	{
+	}
+	
+	virtual void operator()( Eigen::VectorXf& x )
+	{
+		++iterations;
+	}
+	
+	int iterations;
+};
+
+void TestGrid::testMultigrid()
+{
+	std::cerr << "testMultigrid()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	const float timeStep = 0.01f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	fields.add( new GravityField( Vector3f( 0, -9.8f, 0 ) ) );
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	
+	int multigridSolveIterations[2];
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		SnowFixture f( gridSize, shapeFunction, sparse );
+		Grid& g = *f.grid;
+		
+		VectorXf explicitMomenta;
+		g.calculateExplicitMomenta( explicitMomenta, g.m_nodeCollided, timeStep, f.snowModel, collisionObjects, fields );
+		
+		g.setMultigridLevels( 3 );
+		g.updateCoarseGrids();
+		assert( g.m_coarseGrids.size() == 2 );
+		for( size_t i=0; i < g.m_coarseGrids.size(); ++i )
+		{
+			assert( g.m_coarseGrids[i]->m_gridSize == gridSize * ( 2 << i ) );
+			assert( g.m_coarseGrids[i]->m_sparse == sparse );
+			g.m_coarseGrids[i]->collideNodes( collisionObjects );
+		}
+		
+		// the conjugate residuals solver needs the preconditioner to be symmetric and positive definite
+		// on the subspace the collisions leave us in:
+		Grid::ImplicitUpdateMatrix implicitMatrix( f.d, g, f.snowModel, collisionObjects, fields, timeStep );
+		MultigridPreconditioner preconditioner( g, implicitMatrix, f.snowModel, collisionObjects, fields, timeStep );
+		VectorXf a( g.m_velocities.size() ), b( g.m_velocities.size() );
+		for( int i=0; i < a.size(); ++i )
+		{
+			a[i] = g.m_masses[i/3] > 0 ? sin( 0.37f * i ) + 0.5f * cos( 1.3f * i ) : 0;
+			b[i] = g.m_masses[i/3] > 0 ? cos( 0.71f * i ) : 0;
+		}
+		implicitMatrix.subspaceProject( a );
+		implicitMatrix.subspaceProject( b );
+		VectorXf ma, mb;
+		preconditioner.multInverseVector( a, ma );
+		preconditioner.multInverseVector( b, mb );
+		assert( fabs( a.dot( mb ) - b.dot( ma ) ) < 1.e-4f * a.norm() * mb.norm() );
+		assert( a.dot( ma ) > 0 && b.dot( mb ) > 0 );
+		
+		// it should get the same answer as the diagonal preconditioner in fewer iterations:
+		Grid diagonalGrid( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		Grid multigridGrid( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		multigridGrid.setMultigridLevels( 3 );
+		SquareMagnitudeTermination t( 200, 1.e-5f );
+		IterationCounter diagonalIterations, multigridIterations;
+		diagonalGrid.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &diagonalIterations );
+		multigridGrid.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &multigridIterations );
+		assert( multigridIterations.iterations < diagonalIterations.iterations );
+		assert( ( multigridGrid.m_velocities - diagonalGrid.m_velocities ).norm() < 1.e-3f * diagonalGrid.m_velocities.norm() );
+		multigridSolveIterations[s] = multigridIterations.iterations;
+		
+		// dropping back to one level should get rid of the coarse grids:
+		multigridGrid.setMultigridLevels( 1 );
+		multigridGrid.updateCoarseGrids();
+		assert( multigridGrid.m_coarseGrids.empty() );
+	}
+	
+	// the nodes the sparse coarse grids leave out have no mass, so they should precondition as well
+	// as the dense ones:
+	assert( abs( multigridSolveIterations[1] - multigridSolveIterations[0] ) <= 1 );
+}
+
+void TestGrid::testBlockDiagonalPreconditioner()
+{
+	std::cerr << "testBlockDiagonalPreconditioner()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	const float timeStep = 0.05f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	
+	SnowFixture f( gridSize, shapeFunction, 10, 10, 10 );
+	Grid& g = *f.grid;
+	VectorXf explicitMomenta;
+	g.calculateExplicitMomenta( explicitMomenta, g.m_nodeCollided, timeStep, f.snowModel, collisionObjects, fields );
+	
+	// the blocks should be the force differentials on each node when we move it along each axis:
+	VectorXf blocks;
+	g.dForceidXiBlocks( blocks, f.snowModel );
+	VectorXf dfidxi;
+	g.dForceidXi( dfidxi, f.snowModel );
+	VectorXf dx = VectorXf::Zero( g.m_velocities.size() );
+	VectorXf df( g.m_velocities.size() );
+	for( int idx=0; idx < g.m_masses.size(); idx += 37 )
+	{
+		for( int axis=0; axis < 3; ++axis )
+		{
+			dx[ 3 * idx + axis ] = 1;
+			g.calculateForceDifferentials( df, dx, f.snowModel, fields );
+			dx[ 3 * idx + axis ] = 0;
+			Vector3f column = blocks.segment<3>( 9 * idx + 3 * axis );
+			assert( ( column - df.segment<3>( 3 * idx ) ).norm() <= 1.e-4f * ( 1 + df.segment<3>( 3 * idx ).norm() ) );
+			assert( fabs( column[axis] - dfidxi[ 3 * idx + axis ] ) <= 1.e-4f * ( 1 + fabs( dfidxi[ 3 * idx + axis ] ) ) );
+		}
+	}
+	
+	// applying the inverse should undo multiplying by the blocks on the collision subspace, and
+	// leave us on that subspace:
+	Grid::ImplicitUpdateMatrix implicitMatrix( f.d, g, f.snowModel, collisionObjects, fields, timeStep );
+	BlockDiagonalPreconditioner preconditioner( g, blocks, collisionObjects, timeStep );
+	int numCollided = 0;
+	for( int idx=0; idx < g.m_masses.size(); ++idx )
+	{
+		numCollided += g.m_nodeCollided[idx] != -1;
+	}
+	assert( numCollided > 0 );
+	
+	VectorXf x( g.m_velocities.size() );
+	for( int i=0; i < x.size(); ++i )
+	{
+		x[i] = g.m_masses[i/3] > 0 ? sin( 0.37f * i ) + 0.5f * cos( 1.3f * i ) : 0;
+	}
+	implicitMatrix.subspaceProject( x );
+	VectorXf bx, x2;
+	preconditioner.multVector( x, bx );
+	preconditioner.multInverseVector( bx, x2 );
+	assert( ( x2 - x ).norm() < 1.e-4f * x.norm() );
+	
+	VectorXf projected = x2;
+	preconditioner.subspaceProject( projected );
+	assert( ( projected - x2 ).norm() < 1.e-6f * x2.norm() );
+	implicitMatrix.subspaceProject( projected );
+	assert( ( projected - x2 ).norm() < 1.e-6f * x2.norm() );
+	
+	// it should take fewer iterations than the plain diagonal on this lot:
+	VectorXf rhs;
+	implicitMatrix.multVector( x, rhs );
+	Grid::DiagonalPreconditioner diagonal( g, f.snowModel, timeStep );
+	SquareMagnitudeTermination t( 200, 1.e-5f );
+	IterationCounter diagonalIterations, blockIterations;
+	VectorXf diagonalSolution = VectorXf::Zero( x.size() );
+	VectorXf blockSolution = VectorXf::Zero( x.size() );
+	ConjugateResiduals( t, &diagonal )( implicitMatrix, rhs, diagonalSolution, &diagonalIterations );
+	ConjugateResiduals( t, &preconditioner )( implicitMatrix, rhs, blockSolution, &blockIterations );
+	assert( blockIterations.iterations < diagonalIterations.iterations );
+	VectorXf residual;
+	implicitMatrix.multVector( blockSolution, residual );
+	assert( ( residual - rhs ).norm() < 1.e-4f * rhs.norm() );
+}
+
+void TestGrid::testPreconditionerReuse()
+{
+	std::cerr << "testPreconditionerReuse()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	const float timeStep = 0.01f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	fields.add( new GravityField( Vector3f( 0, -9.8f, 0 ) ) );
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	SquareMagnitudeTermination t( 100, 1.e-5f );
+	
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		SnowFixture f( gridSize, shapeFunction, sparse );
+		Grid& g = *f.grid;
+		
+		// nothing gets kept when reuse is off:
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		assert( g.m_reusedPreconditionerBlocks.size() == 0 );
+		
+		// with it on, the first solve should hang on to the blocks it used:
+		g.setPreconditionerReuse( 0.5f );
+		g.update();
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		VectorXf blocks;
+		g.dForceidXiBlocks( blocks, f.snowModel );
+		assert( g.m_reusedPreconditionerBlocks.size() == blocks.size() );
+		assert( ( g.m_reusedPreconditionerBlocks - blocks ).norm() <= 1.e-5f * blocks.norm() );
+		VectorXf freshVelocities = g.m_velocities;
+		
+		// they should still be there after the next step, as the particles haven't gone anywhere
+		// and the solve won't have got any slower:
+		g.update();
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		assert( g.m_reusedPreconditionerBlocks.size() == blocks.size() );
+		assert( ( g.m_velocities - freshVelocities ).norm() < 1.e-3f * freshVelocities.norm() );
+		
+		// if the solve's taken too long compared to the first one they get dropped:
+		g.m_reusedPreconditionerMultiplies = 1;
+		g.update();
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		assert( g.m_reusedPreconditionerBlocks.size() == 0 );
+		
+		// and they're no good once the grid nodes have moved around:
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		assert( g.m_reusedPreconditionerBlocks.size() == blocks.size() );
+		std::vector<Vector3f>& positions = f.d.variable<Vector3f>( "p" );
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] += Vector3f( 0.5f, 0, 0 );
+		}
+		g.update();
+		assert( g.m_reusedPreconditionerBlocks.size() == 0 );
+		
+		// turning reuse off should get rid of them too:
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		assert( g.m_reusedPreconditionerBlocks.size() != 0 );
+		g.setPreconditionerReuse( 0 );
+		assert( g.m_reusedPreconditionerBlocks.size() == 0 );
+	}
+}
+
+void TestGrid::testSchwarzPreconditioner()
+{
+	std::cerr << "testSchwarzPreconditioner()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	const float timeStep = 0.05f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	
+	// a sheared block of snow falling onto the plane, big enough to span a few processing voxels:
+	SnowFixture f( gridSize, shapeFunction, 16, 10, 16 );
+	Grid& g = *f.grid;
+	VectorXf explicitMomenta;
+	g.calculateExplicitMomenta( explicitMomenta, g.m_nodeCollided, timeStep, f.snowModel, collisionObjects, fields );
+	
+	VectorXf blocks;
+	g.dForceidXiBlocks( blocks, f.snowModel );
+	Grid::ImplicitUpdateMatrix implicitMatrix( f.d, g, f.snowModel, collisionObjects, fields, timeStep );
+	BlockDiagonalPreconditioner blockDiagonal( g, blocks, collisionObjects, timeStep );
+	
+	VectorXf x( g.m_velocities.size() );
+	VectorXf y( g.m_velocities.size() );
+	for( int i=0; i < x.size(); ++i )
+	{
+		x[i] = g.m_masses[i/3] > 0 ? sin( 0.37f * i ) + 0.5f * cos( 1.3f * i ) : 0;
+		y[i] = g.m_masses[i/3] > 0 ? cos( 0.71f * i ) - 0.3f * sin( 2.9f * i ) : 0;
+	}
+	implicitMatrix.subspaceProject( x );
+	implicitMatrix.subspaceProject( y );
+	VectorXf ax;
+	implicitMatrix.multVector( x, ax );
+	
+	SquareMagnitudeTermination t( 200, 1.e-5f );
+	IterationCounter blockIterations;
+	VectorXf blockSolution = VectorXf::Zero( x.size() );
+	ConjugateResiduals( t, &blockDiagonal )( implicitMatrix, ax, blockSolution, &blockIterations );
+	
+	// try one subdomain covering the whole grid, and lots of little overlapping ones:
+	int subdomainSizes[] = { 100, 1 };
+	for( int s=0; s < 2; ++s )
+	{
+		SchwarzPreconditioner schwarz( g, blockDiagonal, f.snowModel, collisionObjects, timeStep, subdomainSizes[s] );
+		
+		// it has to be symmetric and positive definite for the solver, and leave vectors on the collision subspace:
+		VectorXf mx, my;
+		schwarz.multInverseVector( x, mx );
+		schwarz.multInverseVector( y, my );
+		assert( fabs( y.dot( mx ) - x.dot( my ) ) < 1.e-4f * mx.norm() * y.norm() );
+		assert( x.dot( mx ) > 0 && y.dot( my ) > 0 );
+		VectorXf projected = mx;
+		implicitMatrix.subspaceProject( projected );
+		assert( ( projected - mx ).norm() < 1.e-6f * mx.norm() );
+		
+		// every node with mass has to be in a subdomain, or the preconditioner would be singular there:
+		VectorXf e = VectorXf::Zero( x.size() );
+		VectorXf me;
+		for( int idx=0; idx < g.m_masses.size(); idx += 37 )
+		{
+			if( g.m_masses[idx] == 0 || g.m_nodeCollided[idx] != -1 )
+			{
+				continue;
+			}
+			e.segment<3>( 3 * idx ) = Vector3f( 1, -0.5f, 0.25f );
+			schwarz.multInverseVector( e, me );
+			assert( e.dot( me ) > 0 );
+			e.segment<3>( 3 * idx ).setZero();
+		}
+		
+		// it should take fewer iterations than the block diagonal, and get to the same answer:
+		IterationCounter schwarzIterations;
+		VectorXf schwarzSolution = VectorXf::Zero( x.size() );
+		ConjugateResiduals( t, &schwarz )( implicitMatrix, ax, schwarzSolution, &schwarzIterations );
+		std::cerr << "block diagonal iterations: " << blockIterations.iterations << " schwarz iterations: " << schwarzIterations.iterations << std::endl;
+		assert( schwarzIterations.iterations < blockIterations.iterations );
+		VectorXf residual;
+		implicitMatrix.multVector( schwarzSolution, residual );
+		assert( ( residual - ax ).norm() < 1.e-4f * ax.norm() );
+	}
+}
+
+void TestGrid::testInitialGuess()
+{
+	std::cerr << "testInitialGuess()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	const float timeStep = 0.01f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	fields.add( new GravityField( Vector3f( 0, -9.8f, 0 ) ) );
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	SquareMagnitudeTermination t( 200, 1.e-5f );
+	
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		SnowFixture f( gridSize, shapeFunction, sparse );
+		Grid& reference = *f.grid;
+		IterationCounter referenceIterations;
+		reference.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &referenceIterations );
+		
+		// nothing's kept with the default guess:
+		assert( reference.getInitialGuess() == Sim::CentreOfMassGuess );
+		assert( reference.m_solvedVelocities[0].empty() );
+		
+		// the first solve has nothing to warm start from, so it should go the same as the reference:
+		Grid g( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		g.computeParticleVolumes();
+		g.setInitialGuess( Sim::PreviousVelocityGuess );
+		IterationCounter firstIterations;
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &firstIterations );
+		assert( firstIterations.iterations == referenceIterations.iterations );
+		assert( !g.m_solvedVelocities[0].empty() );
+		
+		// solving the same system again should start off more or less at the answer:
+		g.update();
+		IterationCounter secondIterations;
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &secondIterations );
+		assert( secondIterations.iterations < referenceIterations.iterations );
+		assert( ( g.m_velocities - reference.m_velocities ).norm() < 1.e-3f * reference.m_velocities.norm() );
+		
+		// extrapolating from two identical solves should do the same:
+		g.setInitialGuess( Sim::ExtrapolatedVelocityGuess );
+		g.update();
+		IterationCounter extrapolatedIterations;
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &extrapolatedIterations );
+		assert( extrapolatedIterations.iterations < referenceIterations.iterations );
+		assert( ( g.m_velocities - reference.m_velocities ).norm() < 1.e-3f * reference.m_velocities.norm() );
+		
+		// the old velocities should still get picked up by position after the particles have moved a
+		// bit and the grid extents have changed. The move is off the grid lines, as particles sitting
+		// right on them can leave nodes with vanishingly small masses when the extents change:
+		std::map< std::pair< int, std::pair<int, int> >, Vector3f > solved;
+		Vector3i oldOrigin = g.gridOrigin();
+		for( int idx=0; idx < g.m_masses.size(); ++idx )
+		{
+			if( g.m_masses[idx] > 0 )
+			{
+				Vector3i coords;
+				g.indexToCoords( idx, coords );
+				coords += oldOrigin;
+				solved[ std::make_pair( coords[0], std::make_pair( coords[1], coords[2] ) ) ] = g.m_velocities.segment<3>( 3 * idx );
+			}
+		}
+		
+		std::vector<Vector3f>& positions = f.d.variable<Vector3f>( "p" );
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] += Vector3f( 0.063f, 0.013f, 0.013f );
+		}
+		Vector3i oldN = g.m_n;
+		g.update();
+		assert( g.gridOrigin() != oldOrigin || g.m_n != oldN );
+		
+		g.setInitialGuess( Sim::PreviousVelocityGuess );
+		VectorXf vc = VectorXf::Zero( g.m_velocities.size() );
+		assert( g.warmStartVelocities( vc, timeStep ) );
+		int matched = 0;
+		for( int idx=0; idx < g.m_masses.size(); ++idx )
+		{
+			Vector3i coords;
+			g.indexToCoords( idx, coords );
+			coords += g.gridOrigin();
+			std::map< std::pair< int, std::pair<int, int> >, Vector3f >::const_iterator it = solved.find( std::make_pair( coords[0], std::make_pair( coords[1], coords[2] ) ) );
+			if( g.m_masses[idx] > 0 && it != solved.end() )
+			{
+				assert( ( g.m_velocities.segment<3>( 3 * idx ) - it->second ).norm() < 1.e-6f );
+				++matched;
+			}
+		}
+		assert( matched > 0 );
+		
+		// it should get to the same answer as a grid built from scratch, in no more iterations. The
+		// warm start's overwritten the splatted velocities, so redo those first:
+		g.update();
+		Grid moved( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		IterationCounter movedReferenceIterations;
+		moved.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &movedReferenceIterations );
+		
+		IterationCounter movedIterations;
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &movedIterations );
+		assert( movedIterations.iterations <= movedReferenceIterations.iterations );
+		float energy = 0;
+		float movedEnergy = 0;
+		for( int idx=0; idx < g.m_masses.size(); ++idx )
+		{
+			energy += g.m_masses[idx] * g.m_velocities.segment<3>( 3 * idx ).squaredNorm();
+		}
+		for( int idx=0; idx < moved.m_masses.size(); ++idx )
+		{
+			movedEnergy += moved.m_masses[idx] * moved.m_velocities.segment<3>( 3 * idx ).squaredNorm();
+		}
+		assert( fabs( energy - movedEnergy ) < 1.e-3f * movedEnergy );
+		
+		// if the old velocities are way off, it should fall back on the centre of mass guess:
+		for( int i=0; i < 2; ++i )
+		{
+			g.m_solvedVelocities[i].m_velocities.setConstant( 1000.0f );
+		}
+		g.update();
+		IterationCounter fallbackIterations;
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &fallbackIterations );
+		assert( fallbackIterations.iterations == movedReferenceIterations.iterations );
+		
+		// going back to the default should drop the old velocities:
+		g.setInitialGuess( Sim::CentreOfMassGuess );
+		assert( g.m_solvedVelocities[0].empty() && g.m_solvedVelocities[1].empty() );
+		
+		// put the particles back for the next pass:
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] -= Vector3f( 0.063f, 0.013f, 0.013f );
+		}
+	}
+}
+
+void TestGrid::testRecycleSpace()
+{
+	std::cerr << "testRecycleSpace()" << std::endl;
+	
+	const float gridSize = 0.1f;
+	const float timeStep = 0.01f;
+	CubicBsplineShapeFunction shapeFunction;
+	ForceField::ForceFieldSet fields;
+	fields.add( new GravityField( Vector3f( 0, -9.8f, 0 ) ) );
+	CollisionObject::CollisionObjectSet collisionObjects;
+	collisionObjects.add( new CollisionPlane( Eigen::Vector4f( 0, 1, 0, 0.05f ) ) );
+	SquareMagnitudeTermination t( 200, 1.e-5f );
+	
+	for( int s=0; s < 2; ++s )
+	{
+		bool sparse = s == 1;
+		SnowFixture f( gridSize, shapeFunction, sparse );
+		Grid& reference = *f.grid;
+		IterationCounter referenceIterations;
+		reference.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &referenceIterations );
+		assert( reference.m_recycleSpace.empty() );
+		
+		// the first solve should leave some vectors behind for the next one:
+		Grid g( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		g.setRecycleSize( 4 );
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		assert( g.m_recycleSpace.size() == 4 );
+		for( size_t i=0; i < g.m_recycleSpace.size(); ++i )
+		{
+			assert( g.m_recycleSpace[i].size() == g.m_velocities.size() );
+		}
+		assert( ( g.m_velocities - reference.m_velocities ).norm() < 1.e-3f * reference.m_velocities.norm() );
+		
+		// deflating with them should get the same answer, in no more iterations:
+		g.update();
+		IterationCounter recycledIterations;
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t, &recycledIterations );
+		assert( recycledIterations.iterations <= referenceIterations.iterations );
+		assert( ( g.m_velocities - reference.m_velocities ).norm() < 1.e-3f * reference.m_velocities.norm() );
+		
+		// the vectors should follow the nodes by position when the grid extents change. The move is off
+		// the grid lines, for the same reason as in testInitialGuess():
+		std::map< std::pair< int, std::pair<int, int> >, Vector3f > recycled;
+		Vector3i oldOrigin = g.gridOrigin();
+		for( int idx=0; idx < g.m_masses.size(); ++idx )
+		{
+			Vector3i coords;
+			g.indexToCoords( idx, coords );
+			coords += oldOrigin;
+			recycled[ std::make_pair( coords[0], std::make_pair( coords[1], coords[2] ) ) ] = g.m_recycleSpace[0].segment<3>( 3 * idx );
+		}
+		
+		std::vector<Vector3f>& positions = f.d.variable<Vector3f>( "p" );
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] += Vector3f( 0.063f, 0.013f, 0.013f );
+		}
+		Vector3i oldN = g.m_n;
+		g.update();
+		assert( g.gridOrigin() != oldOrigin || g.m_n != oldN );
+		assert( !g.m_recycleLayout.matches( g ) );
+		
+		g.remapRecycleSpace();
+		assert( g.m_recycleLayout.matches( g ) );
+		assert( g.m_recycleSpace.size() == 4 );
+		int matched = 0;
+		for( int idx=0; idx < g.m_masses.size(); ++idx )
+		{
+			assert( g.m_recycleSpace[0].size() == g.m_velocities.size() );
+			if( g.m_masses[idx] <= 0 )
+			{
+				continue;
+			}
+			Vector3i coords;
+			g.indexToCoords( idx, coords );
+			coords += g.gridOrigin();
+			std::map< std::pair< int, std::pair<int, int> >, Vector3f >::const_iterator it = recycled.find( std::make_pair( coords[0], std::make_pair( coords[1], coords[2] ) ) );
+			if( it != recycled.end() )
+			{
+				assert( g.m_recycleSpace[0].segment<3>( 3 * idx ) == it->second );
+				++matched;
+			}
+			else
+			{
+				assert( g.m_recycleSpace[0].segment<3>( 3 * idx ).isZero() );
+			}
+		}
+		assert( matched > 0 );
+		
+		// and the solve should still match one from scratch:
+		Grid moved( f.d, f.inds, gridSize, shapeFunction, Vector3f::Zero(), 3, sparse );
+		moved.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		g.updateGridVelocities( timeStep, f.snowModel, collisionObjects, fields, t );
+		float energy = 0;
+		float movedEnergy = 0;
+		for( int idx=0; idx < g.m_masses.size(); ++idx )
+		{
+			energy += g.m_masses[idx] * g.m_velocities.segment<3>( 3 * idx ).squaredNorm();
+		}
+		for( int idx=0; idx < moved.m_masses.size(); ++idx )
+		{
+			movedEnergy += moved.m_masses[idx] * moved.m_velocities.segment<3>( 3 * idx ).squaredNorm();
+		}
+		assert( fabs( energy - movedEnergy ) < 1.e-3f * movedEnergy );
+		
+		// turning it off should drop the vectors:
+		g.setRecycleSize( 0 );
+		assert( g.m_recycleSpace.empty() );
+		
+		for( size_t p=0; p < positions.size(); ++p )
+		{
+			positions[p] -= Vector3f( 0.063f, 0.013f, 0.013f );
+		}
+	}
+}
+
 void TestGrid::test()
 {
 	std::cerr << "testGrid()" << std::endl;
@@ -861,6 +1989,17 @@ void TestGrid::test()
 	testImplicitUpdate();
 	testMovingGrid();
 	testDfiDxi();
+	testSparseGrid();
+	testGridUpdate();
+	testShapeFunctionCache();
+	testStencilKernels();
+	testStiffnessCache();
+	testMultigrid();
+	testBlockDiagonalPreconditioner();
+	testPreconditionerReuse();
+	testSchwarzPreconditioner();
+	testInitialGuess();
+	testRecycleSpace();
 }
 
 }
@@ -0,0 +1,181 @@
+#include "tests/TestMaterialPointData.h"
+
+#include "MpmSim/MaterialPointData.h"
+
+#include <iostream>
+#include <stdexcept>
+
+using namespace MpmSim;
+using namespace Eigen;
+
+namespace MpmSimTest
+{
+
+void TestMaterialPointData::testPackedVariables()
+{
+	std::cerr << "testPackedVariables()" << std::endl;
+	
+	MaterialPointData d;
+	d.createVariable<Matrix3f>( "packedF", MaterialPointData::AoSoA );
+	assert( d.layout( "packedF" ) == MaterialPointData::AoSoA );
+	assert( d.layout( "F" ) == MaterialPointData::AoS );
+	
+	// AoS accessors shouldn't hand out packed variables and vice versa:
+	bool threw = false;
+	try
+	{
+		d.variable<Matrix3f>( "packedF" );
+	}
+	catch( const std::runtime_error& )
+	{
+		threw = true;
+	}
+	assert( threw );
+	
+	threw = false;
+	try
+	{
+		d.packedVariable<Matrix3f>( "F" );
+	}
+	catch( const std::runtime_error& )
+	{
+		threw = true;
+	}
+	assert( threw );
+	
+	// fill in some matrices, with a partial block at the end:
+	const int n = 19;
+	std::vector<Matrix3f>& F = d.variable<Matrix3f>( "F" );
+	PackedArray<Matrix3f>& packedF = d.packedVariable<Matrix3f>( "packedF" );
+	for( int i=0; i < n; ++i )
+	{
+		Matrix3f m;
+		for( int c=0; c < 9; ++c )
+		{
+			m.data()[c] = float( 100 * i + c );
+		}
+		F.push_back( m );
+		packedF.push_back( m );
+	}
+	assert( packedF.size() == n );
+	assert( packedF.numBlocks() == 3 );
+	
+	// components should be in aligned blocks, with zero padding after the last element:
+	for( size_t b=0; b < packedF.numBlocks(); ++b )
+	{
+		for( int c=0; c < 9; ++c )
+		{
+			const float* component = packedF.component( b, c );
+			assert( reinterpret_cast<size_t>( component ) % PackedArray<Matrix3f>::Alignment == 0 );
+			for( int l=0; l < PackedArray<Matrix3f>::BlockSize; ++l )
+			{
+				size_t i = b * PackedArray<Matrix3f>::BlockSize + l;
+				assert( component[l] == ( i < n ? F[i].data()[c] : 0.0f ) );
+			}
+		}
+	}
+	
+	for( int i=0; i < n; ++i )
+	{
+		assert( packedF.get( i ) == F[i] );
+	}
+	
+	// copies have to line themselves up again:
+	PackedArray<Matrix3f> copy( packedF );
+	assert( reinterpret_cast<size_t>( copy.component( 0, 0 ) ) % PackedArray<Matrix3f>::Alignment == 0 );
+	for( int i=0; i < n; ++i )
+	{
+		assert( copy.get( i ) == F[i] );
+	}
+	
+	// switching layouts should keep the data:
+	d.setLayout<Matrix3f>( "F", MaterialPointData::AoSoA );
+	assert( d.layout( "F" ) == MaterialPointData::AoSoA );
+	for( int i=0; i < n; ++i )
+	{
+		assert( d.packedVariable<Matrix3f>( "F" ).get( i ) == packedF.get( i ) );
+	}
+	d.setLayout<Matrix3f>( "F", MaterialPointData::AoS );
+	for( int i=0; i < n; ++i )
+	{
+		assert( d.variable<Matrix3f>( "F" )[i] == packedF.get( i ) );
+	}
+	
+	// pack up a subset of the particles and write it back:
+	std::vector<int> inds;
+	inds.push_back( 17 );
+	inds.push_back( 3 );
+	inds.push_back( 8 );
+	PackedArray<Matrix3f> subset;
+	subset.gather( d.variable<Matrix3f>( "F" ), inds.begin(), inds.end() );
+	assert( subset.size() == 3 );
+	assert( subset.numBlocks() == 1 );
+	assert( subset.get( 0 ) == packedF.get( 17 ) );
+	assert( subset.get( 1 ) == packedF.get( 3 ) );
+	assert( subset.get( 2 ) == packedF.get( 8 ) );
+	
+	subset.set( 1, Matrix3f::Identity() );
+	subset.scatter( d.variable<Matrix3f>( "F" ), inds.begin(), inds.end() );
+	assert( d.variable<Matrix3f>( "F" )[3] == Matrix3f::Identity() );
+	assert( d.variable<Matrix3f>( "F" )[17] == packedF.get( 17 ) );
+}
+
+void TestMaterialPointData::testHandles()
+{
+	std::cerr << "testHandles()" << std::endl;
+	
+	MaterialPointData d;
+	MaterialPointData::Handle<float> invalid;
+	assert( !invalid.valid() );
+	assert( !invalid.stale() );
+	
+	MaterialPointData::Handle<float> m = d.handle<float>( "m" );
+	MaterialPointData::Handle<Matrix3f> F = d.handle<Matrix3f>( "F" );
+	assert( m.valid() );
+	assert( &*m == &d.variable<float>( "m" ) );
+	
+	// handles should see the variables grow:
+	for( int i=0; i < 100; ++i )
+	{
+		d.variable<float>( "m" ).push_back( float( i ) );
+		F->push_back( float( i ) * Matrix3f::Identity() );
+	}
+	assert( m->size() == 100 );
+	assert( m[42] == 42.0f );
+	m[42] = 3.0f;
+	assert( d.variable<float>( "m" )[42] == 3.0f );
+	assert( !m.stale() && !F.stale() );
+	
+	// reallocating a variable makes all the handles stale until they're refreshed:
+	d.setLayout<Matrix3f>( "F", MaterialPointData::AoSoA );
+	d.setLayout<Matrix3f>( "F", MaterialPointData::AoS );
+	assert( m.stale() && F.stale() );
+	F.refresh();
+	m.refresh();
+	assert( !m.stale() && !F.stale() );
+	assert( &*F == &d.variable<Matrix3f>( "F" ) );
+	assert( F->size() == 100 );
+	assert( F[7] == 7.0f * Matrix3f::Identity() );
+	
+	// handles to packed variables can only get at the elements one at a time:
+	d.setLayout<Matrix3f>( "F", MaterialPointData::AoSoA );
+	assert( F.stale() );
+	F.refresh();
+	assert( F.valid() && !F.stale() );
+	assert( F.packed() == &d.packedVariable<Matrix3f>( "F" ) );
+	assert( F.size() == 100 );
+	assert( F.get( 7 ) == 7.0f * Matrix3f::Identity() );
+	F.set( 7, Matrix3f::Ones() );
+	assert( d.packedVariable<Matrix3f>( "F" ).get( 7 ) == Matrix3f::Ones() );
+	assert( !m.packed() );
+	assert( m.get( 42 ) == 3.0f );
+}
+
+void TestMaterialPointData::test()
+{
+	std::cerr << "testMaterialPointData()" << std::endl;
+	testPackedVariables();
+	testHandles();
+}
+
+}
@@ -4,11 +4,13 @@
 #include "MpmSim/GravityField.h"
 #include "MpmSim/CubicBsplineShapeFunction.h"
 #include "MpmSim/ConstitutiveModel.h"
+#include "MpmSim/ConstitutiveModelSet.h"
 #include "MpmSim/SnowConstitutiveModel.h"
 #include "MpmSim/ConjugateResiduals.h"
 #include "MpmSim/SquareMagnitudeTermination.h"
 
 #include <iostream>
+#include <stdexcept>
 
 using namespace MpmSim;
 using namespace Eigen;
@@ -29,6 +31,9 @@ public:
 	
 	virtual void updateParticleData()
 	{}
+	
+	virtual void updateParticleData( const std::vector<int>& particleInds )
+	{}
 
 	virtual float energyDensity( size_t p ) const
 	{ return 0; }
@@ -169,11 +174,18 @@ void TestSimClass::testTimestepAdvance()
 	forceFields.add( new GravityField( Eigen::Vector3f( 0, 1.f, 0 ) ) );
 	Sim sim( positions, masses, gridSize, shapeFunction, constitutiveModel, collisionObjects, forceFields );
 	
+	assert( sim.m_grids.size() == 2 );
+	std::vector<Grid*> grids = sim.m_grids;
+	
 	SquareMagnitudeTermination t( 10, 0.0f );
 	sim.advance( 0.01f, t );
 	sim.advance( 0.01f, t );
 	sim.advance( 0.01f, t );
 	
+	// the bodies haven't changed, so they should have kept their grids:
+	assert( sim.m_bodies.size() == 2 );
+	assert( sim.m_grids == grids );
+	
 	// average velocity should be about 0.03 now, innit
 	const std::vector<Eigen::Vector3f>& velocities = sim.particleData().variable<Eigen::Vector3f>( "v" );
 	Eigen::Vector3f v = Eigen::Vector3f::Zero();
@@ -189,11 +201,278 @@ void TestSimClass::testTimestepAdvance()
 
 }
 
+// debug callback that doesn't do anything, for making Sim::advance() do one body at a time:
+class NullDebug : public LinearSolver::Debug
+{
+public:
+	virtual void operator()( Eigen::VectorXf& x )
+	{
+	}
+};
+
+// termination criterion that can't be cloned, which should make Sim::advance() do one body at a time:
+class UncloneableTermination : public SquareMagnitudeTermination
+{
+public:
+	UncloneableTermination( int maxIters, float tolError ) : SquareMagnitudeTermination( maxIters, tolError )
+	{
+	}
+	
+	virtual TerminationCriterion* clone() const
+	{
+		return 0;
+	}
+};
+
+void TestSimClass::testConcurrentBodies()
+{
+	std::cerr << "testConcurrentBodies()" << std::endl;
+	
+	std::vector<Vector3f> positions;
+	std::vector<float> masses;
+	const float gridSize = 0.1f;
+	
+	// make some separate clumps of different sizes, moving in different directions:
+	std::vector<Vector3f> velocities;
+	for( int c=0; c < 4; ++c )
+	{
+		int n = 2 + c;
+		for( int i=0; i < n; ++i )
+		{
+			for( int j=0; j < n; ++j )
+			{
+				for( int k=0; k < n; ++k )
+				{
+					positions.push_back( Vector3f( 0.5f * gridSize * (i+0.5f) + 3 * c, 0.5f * gridSize * (j+0.5f), 0.5f * gridSize * (k+0.5f) ) );
+					masses.push_back( 1.0f );
+					velocities.push_back( Vector3f( 0.1f * c, 0.02f * i, -0.03f * k ) );
+				}
+			}
+		}
+	}
+	
+	CubicBsplineShapeFunction shapeFunction;
+	CollisionObject::CollisionObjectSet collisionObjects;
+	ForceField::ForceFieldSet forceFields;
+	forceFields.add( new GravityField( Eigen::Vector3f( 0, -9.8f, 0 ) ) );
+	
+	// advance one sim with the bodies done concurrently and one with them done in order. The
+	// bodies are independent, so we should get exactly the same answer:
+	SnowConstitutiveModel concurrentModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel serialModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel uncloneableModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	Sim concurrentSim( positions, masses, gridSize, shapeFunction, concurrentModel, collisionObjects, forceFields );
+	Sim serialSim( positions, masses, gridSize, shapeFunction, serialModel, collisionObjects, forceFields );
+	Sim uncloneableSim( positions, masses, gridSize, shapeFunction, uncloneableModel, collisionObjects, forceFields );
+	assert( concurrentSim.m_bodies.size() == 4 );
+	concurrentSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	serialSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	uncloneableSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	
+	// the last one's termination criterion can't be cloned, so it should get done in order too:
+	SquareMagnitudeTermination t( 10, 0.0f );
+	UncloneableTermination uncloneable( 10, 0.0f );
+	NullDebug debug;
+	for( int i=0; i < 2; ++i )
+	{
+		concurrentSim.advance( 0.01f, t );
+		serialSim.advance( 0.01f, t, &debug );
+		uncloneableSim.advance( 0.01f, uncloneable );
+	}
+	
+	const std::vector<Vector3f>& concurrentX = concurrentSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Vector3f>& serialX = serialSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Matrix3f>& concurrentF = concurrentSim.particleData().variable<Matrix3f>( "F" );
+	const std::vector<Matrix3f>& serialF = serialSim.particleData().variable<Matrix3f>( "F" );
+	const std::vector<Vector3f>& uncloneableX = uncloneableSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Matrix3f>& uncloneableF = uncloneableSim.particleData().variable<Matrix3f>( "F" );
+	for( size_t p=0; p < positions.size(); ++p )
+	{
+		assert( concurrentX[p] == serialX[p] );
+		assert( concurrentF[p] == serialF[p] );
+		assert( uncloneableX[p] == serialX[p] );
+		assert( uncloneableF[p] == serialF[p] );
+	}
+}
+
+void TestSimClass::testMultipleMaterials()
+{
+	std::cerr << "testMultipleMaterials()" << std::endl;
+	
+	// three clumps: one soft, one stiff, and one with the two materials interleaved:
+	std::vector<Vector3f> positions;
+	std::vector<float> masses;
+	std::vector<int> materials;
+	std::vector<Vector3f> velocities;
+	const float gridSize = 0.1f;
+	for( int c=0; c < 3; ++c )
+	{
+		for( int i=0; i < 5; ++i )
+		{
+			for( int j=0; j < 5; ++j )
+			{
+				for( int k=0; k < 5; ++k )
+				{
+					positions.push_back( Vector3f( 0.5f * gridSize * (i+0.5f) + 3 * c, 0.5f * gridSize * (j+0.5f), 0.5f * gridSize * (k+0.5f) ) );
+					masses.push_back( 1.0f );
+					materials.push_back( c < 2 ? c : ( i + j + k ) % 2 );
+					velocities.push_back( Vector3f( 0.1f * c, 0.02f * i, -0.03f * k ) );
+				}
+			}
+		}
+	}
+	
+	CubicBsplineShapeFunction shapeFunction;
+	CollisionObject::CollisionObjectSet collisionObjects;
+	ForceField::ForceFieldSet forceFields;
+	forceFields.add( new GravityField( Eigen::Vector3f( 0, -9.8f, 0 ) ) );
+	
+	ConstitutiveModelSet mixedModels;
+	assert( mixedModels.add( new SnowConstitutiveModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f ) ) == 0 );
+	assert( mixedModels.add( new SnowConstitutiveModel( 1.4e6f, 0.3f, 5, 0.025f, 0.0075f ) ) == 1 );
+	Sim mixedSim( positions, masses, materials, gridSize, shapeFunction, mixedModels, collisionObjects, forceFields );
+	
+	// sims where everything's soft and everything's stiff. The model set updates its particles when
+	// it's set up, so do the same for these:
+	SnowConstitutiveModel softModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel stiffModel( 1.4e6f, 0.3f, 5, 0.025f, 0.0075f );
+	Sim softSim( positions, masses, gridSize, shapeFunction, softModel, collisionObjects, forceFields );
+	Sim stiffSim( positions, masses, gridSize, shapeFunction, stiffModel, collisionObjects, forceFields );
+	softModel.updateParticleData();
+	stiffModel.updateParticleData();
+	
+	// the particles should have picked up their own material's parameters:
+	const std::vector<float>& mixedMu = mixedSim.particleData().variable<float>( "mu" );
+	const std::vector<float>& softMu = softSim.particleData().variable<float>( "mu" );
+	const std::vector<float>& stiffMu = stiffSim.particleData().variable<float>( "mu" );
+	assert( softMu[0] != stiffMu[0] );
+	for( size_t p=0; p < positions.size(); ++p )
+	{
+		assert( mixedMu[p] == ( materials[p] ? stiffMu[p] : softMu[p] ) );
+	}
+	
+	mixedSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	softSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	stiffSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	
+	SquareMagnitudeTermination t( 10, 0.0f );
+	for( int i=0; i < 2; ++i )
+	{
+		mixedSim.advance( 0.01f, t );
+		softSim.advance( 0.01f, t );
+		stiffSim.advance( 0.01f, t );
+	}
+	
+	// the clumps are separate bodies, so the soft and stiff ones should match the single material sims,
+	// and the mixed one should be somewhere in between. The bodies' particle orders depend on where
+	// all the particles are, so the sums over them can round differently and we can't expect an exact
+	// match:
+	const std::vector<Vector3f>& mixedX = mixedSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Vector3f>& softX = softSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Vector3f>& stiffX = stiffSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Matrix3f>& mixedF = mixedSim.particleData().variable<Matrix3f>( "F" );
+	const std::vector<Matrix3f>& softF = softSim.particleData().variable<Matrix3f>( "F" );
+	const std::vector<Matrix3f>& stiffF = stiffSim.particleData().variable<Matrix3f>( "F" );
+	size_t clumpSize = positions.size() / 3;
+	for( size_t p=0; p < 2 * clumpSize; ++p )
+	{
+		assert( ( mixedX[p] - ( materials[p] ? stiffX[p] : softX[p] ) ).norm() < 1.e-5f );
+		assert( ( mixedF[p] - ( materials[p] ? stiffF[p] : softF[p] ) ).norm() < 1.e-5f );
+	}
+	
+	float mixedStrain = 0, softStrain = 0, stiffStrain = 0;
+	for( size_t p=2 * clumpSize; p < positions.size(); ++p )
+	{
+		mixedStrain += ( mixedF[p] - Matrix3f::Identity() ).norm();
+		softStrain += ( softF[p] - Matrix3f::Identity() ).norm();
+		stiffStrain += ( stiffF[p] - Matrix3f::Identity() ).norm();
+	}
+	assert( stiffStrain < mixedStrain && mixedStrain < softStrain );
+	
+	// material ids that don't index a model should get caught, even when there's only one model:
+	ConstitutiveModelSet singleModel;
+	singleModel.add( new SnowConstitutiveModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f ) );
+	bool threw = false;
+	try
+	{
+		Sim badSim( positions, masses, materials, gridSize, shapeFunction, singleModel, collisionObjects, forceFields );
+	}
+	catch( const std::runtime_error& )
+	{
+		threw = true;
+	}
+	assert( threw );
+}
+
+void TestSimClass::testPackedDeformationGradients()
+{
+	std::cerr << "testPackedDeformationGradients()" << std::endl;
+	
+	std::vector<Vector3f> positions;
+	std::vector<float> masses;
+	std::vector<Vector3f> velocities;
+	const float gridSize = 0.1f;
+	for( int i=0; i < 6; ++i )
+	{
+		for( int j=0; j < 6; ++j )
+		{
+			for( int k=0; k < 6; ++k )
+			{
+				positions.push_back( Vector3f( 0.5f * gridSize * (i+0.5f), 0.5f * gridSize * (j+0.5f), 0.5f * gridSize * (k+0.5f) ) );
+				masses.push_back( 1.0f );
+				velocities.push_back( Vector3f( 0.02f * i, 0.03f * j * k, -0.03f * k ) );
+			}
+		}
+	}
+	
+	CubicBsplineShapeFunction shapeFunction;
+	CollisionObject::CollisionObjectSet collisionObjects;
+	ForceField::ForceFieldSet forceFields;
+	forceFields.add( new GravityField( Eigen::Vector3f( 0, -9.8f, 0 ) ) );
+	
+	// the grid and the constitutive model should both be happy with F packed, and give exactly the same
+	// answers as they do with it unpacked:
+	SnowConstitutiveModel aosModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel packedModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	Sim aosSim( positions, masses, gridSize, shapeFunction, aosModel, collisionObjects, forceFields );
+	Sim packedSim( positions, masses, gridSize, shapeFunction, packedModel, collisionObjects, forceFields );
+	// advance() should pick the new layout up on its own, before it updates the bodies concurrently:
+	packedSim.particleData().setLayout<Matrix3f>( "F", MaterialPointData::AoSoA );
+	aosSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	packedSim.particleData().variable<Vector3f>( "v" ) = velocities;
+	
+	SquareMagnitudeTermination t( 10, 0.0f );
+	for( int i=0; i < 2; ++i )
+	{
+		aosSim.advance( 0.01f, t );
+		packedSim.advance( 0.01f, t );
+	}
+	
+	const std::vector<Vector3f>& aosX = aosSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Vector3f>& packedX = packedSim.particleData().variable<Vector3f>( "p" );
+	const std::vector<Matrix3f>& aosF = aosSim.particleData().variable<Matrix3f>( "F" );
+	const PackedArray<Matrix3f>& packedF = packedSim.particleData().packedVariable<Matrix3f>( "F" );
+	const std::vector<Matrix3f>& aosR = aosSim.particleData().variable<Matrix3f>( "R" );
+	const std::vector<Matrix3f>& packedR = packedSim.particleData().variable<Matrix3f>( "R" );
+	for( size_t p=0; p < positions.size(); ++p )
+	{
+		assert( aosX[p] == packedX[p] );
+		assert( aosF[p] == packedF.get( p ) );
+		
+		// the model works R out from F, so this checks it's been reading the packed F:
+		assert( aosR[p] == packedR[p] );
+	}
+	assert( aosF[0] != Matrix3f::Identity() );
+}
+
 void TestSimClass::test()
 {
 	std::cerr << "testSimClass()" << std::endl;
 	testInitialization();
 	testTimestepAdvance();
+	testConcurrentBodies();
+	testMultipleMaterials();
+	testPackedDeformationGradients();
 }
 
 }
@@ -5,8 +5,14 @@
 #include "MpmSim/SnowConstitutiveModel.h"
 #include "MpmSim/CubicBsplineShapeFunction.h"
 #include "MpmSim/Sim.h"
+#include "MpmSim/Svd3.h"
+#include "MpmSim/SvdKernels.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 
 using namespace MpmSim;
 using namespace Eigen;
@@ -14,9 +20,398 @@ using namespace Eigen;
 namespace MpmSimTest
 {
 
+void TestSnowConstitutiveModel::testParticleSubset()
+{
+	std::cerr << "testParticleSubset()" << std::endl;
+	
+	// two copies of the same particles, with deformation gradients that need clamping:
+	const int n = 10;
+	MaterialPointData subsetData;
+	MaterialPointData allData;
+	for( int i=0; i < n; ++i )
+	{
+		Matrix3f F = Matrix3f::Identity();
+		F(0,0) = 1.1f + 0.05f * i;
+		F(1,2) = 0.1f * i;
+		subsetData.variable<float>( "m" ).push_back( 1.0f );
+		subsetData.variable<Matrix3f>( "F" ).push_back( F );
+		allData.variable<float>( "m" ).push_back( 1.0f );
+		allData.variable<Matrix3f>( "F" ).push_back( F );
+	}
+	
+	SnowConstitutiveModel subsetModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel allModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	subsetModel.setParticles( subsetData );
+	allModel.setParticles( allData );
+	
+	std::vector<int> inds;
+	inds.push_back( 7 );
+	inds.push_back( 1 );
+	inds.push_back( 4 );
+	subsetModel.updateParticleData( inds );
+	allModel.updateParticleData();
+	
+	// the particles in the list should match the full update, and the rest should still have
+	// the values setParticles() gave them:
+	const char* matrixVariables[] = { "Fp", "FinvTrans", "R", "Ginv" };
+	const char* floatVariables[] = { "J", "mu", "lambda" };
+	for( int i=0; i < n; ++i )
+	{
+		if( std::find( inds.begin(), inds.end(), i ) != inds.end() )
+		{
+			assert( subsetData.variable<Matrix3f>( "F" )[i] == allData.variable<Matrix3f>( "F" )[i] );
+			for( int v=0; v < 4; ++v )
+			{
+				assert( subsetData.variable<Matrix3f>( matrixVariables[v] )[i] == allData.variable<Matrix3f>( matrixVariables[v] )[i] );
+			}
+			for( int v=0; v < 3; ++v )
+			{
+				assert( subsetData.variable<float>( floatVariables[v] )[i] == allData.variable<float>( floatVariables[v] )[i] );
+			}
+		}
+		else
+		{
+			assert( subsetData.variable<Matrix3f>( "F" )[i](0,0) == 1.1f + 0.05f * i );
+			for( int v=0; v < 4; ++v )
+			{
+				assert( subsetData.variable<Matrix3f>( matrixVariables[v] )[i] == Matrix3f::Identity() );
+			}
+			assert( subsetData.variable<float>( "J" )[i] == 1.0f );
+		}
+	}
+}
+
+void TestSnowConstitutiveModel::testSvd3()
+{
+	std::cerr << "testSvd3()" << std::endl;
+	
+	// random matrices, plus some awkward ones with repeated, zero or negative singular values:
+	std::vector<Matrix3f> matrices;
+	matrices.push_back( Matrix3f::Identity() );
+	matrices.push_back( Vector3f( 1.0f, 1.0f, 0.5f ).asDiagonal() );
+	matrices.push_back( Vector3f( 0.5f, 2.0f, 0.0f ).asDiagonal() );
+	matrices.push_back( Vector3f( 1.0f, -1.0f, 1.0f ).asDiagonal() );
+	matrices.push_back( Matrix3f( AngleAxisf( 0.3f, Vector3f( 1, 2, 3 ).normalized() ) ) * Vector3f( 1.01f, 0.99f, 0.97f ).asDiagonal() );
+	srand( 10 );
+	for( int i=0; i < 1000; ++i )
+	{
+		Matrix3f m = Matrix3f::Random();
+		if( i % 2 )
+		{
+			// near identity, like the deformation gradients we usually see:
+			m = Matrix3f::Identity() + 0.1f * m;
+		}
+		matrices.push_back( m );
+	}
+	
+	for( size_t i=0; i < matrices.size(); ++i )
+	{
+		const Matrix3f& F = matrices[i];
+		Matrix3f U, V;
+		Vector3f sigma;
+		svd3( F, U, sigma, V );
+		
+		// U and V should be rotations:
+		assert( ( U * U.transpose() - Matrix3f::Identity() ).norm() < 1.e-5f );
+		assert( ( V * V.transpose() - Matrix3f::Identity() ).norm() < 1.e-5f );
+		assert( fabs( U.determinant() - 1 ) < 1.e-5f );
+		assert( fabs( V.determinant() - 1 ) < 1.e-5f );
+		
+		// it should reconstruct F:
+		float scale = std::max( 1.0f, F.norm() );
+		assert( ( U * sigma.asDiagonal() * V.transpose() - F ).norm() < 1.e-5f * scale );
+		
+		// singular values should match JacobiSVD's up to sign, with the sign of the last one giving
+		// the sign of the determinant:
+		JacobiSVD<Matrix3f> svd( F, ComputeFullU | ComputeFullV );
+		for( int j=0; j < 3; ++j )
+		{
+			assert( fabs( fabs( sigma[j] ) - svd.singularValues()[j] ) < 1.e-5f * scale );
+		}
+		assert( sigma[0] >= 0 && sigma[1] >= 0 );
+		float det = F.determinant();
+		if( fabs( det ) > 1.e-4f )
+		{
+			assert( ( sigma[2] < 0 ) == ( det < 0 ) );
+		}
+		
+		// where JacobiSVD gives proper rotations and the singular values are well separated,
+		// the rotation from the polar decomposition and the stretch should match:
+		Matrix3f Ujacobi = svd.matrixU();
+		Matrix3f Vjacobi = svd.matrixV();
+		if( det > 1.e-2f )
+		{
+			assert( ( U * V.transpose() - Ujacobi * Vjacobi.transpose() ).norm() < 1.e-4f );
+			Matrix3f S = V * sigma.asDiagonal() * V.transpose();
+			Matrix3f Sjacobi = Vjacobi * svd.singularValues().asDiagonal() * Vjacobi.transpose();
+			assert( ( S - Sjacobi ).norm() < 1.e-4f * scale );
+		}
+	}
+}
+
+void TestSnowConstitutiveModel::testSvdKernels()
+{
+	std::cerr << "testSvdKernels()" << std::endl;
+	
+	const int blockSize = SvdKernels::BlockSize;
+	srand( 20 );
+	for( int t=0; t < 3; ++t )
+	{
+		const SvdKernels* kernels = SvdKernels::kernels( SvdKernels::Type( t ) );
+		if( !kernels )
+		{
+			// this cpu can't run them:
+			continue;
+		}
+		
+		for( int block=0; block < 100; ++block )
+		{
+			// pack a block of random matrices, with the odd inverted or diagonal one:
+			Matrix3f matrices[ blockSize ];
+			float a[ 9 * blockSize ];
+			for( int l=0; l < blockSize; ++l )
+			{
+				matrices[l] = Matrix3f::Identity() + 0.5f * Matrix3f::Random();
+				if( ( block + l ) % 5 == 0 )
+				{
+					matrices[l] = Vector3f( 1.1f, 0.9f, 1.0f ).asDiagonal();
+				}
+				for( int c=0; c < 9; ++c )
+				{
+					a[ c * blockSize + l ] = matrices[l].data()[c];
+				}
+			}
+			
+			float u[ 9 * blockSize ];
+			float sigma[ 3 * blockSize ];
+			float v[ 9 * blockSize ];
+			kernels->decompose( a, u, sigma, v );
+			
+			// every lane should match svd3():
+			for( int l=0; l < blockSize; ++l )
+			{
+				Matrix3f U, V;
+				Vector3f singularValues;
+				svd3( matrices[l], U, singularValues, V );
+				for( int c=0; c < 9; ++c )
+				{
+					assert( fabs( u[ c * blockSize + l ] - U.data()[c] ) < 1.e-6f );
+					assert( fabs( v[ c * blockSize + l ] - V.data()[c] ) < 1.e-6f );
+				}
+				for( int i=0; i < 3; ++i )
+				{
+					assert( fabs( sigma[ i * blockSize + l ] - singularValues[i] ) < 1.e-6f );
+				}
+			}
+		}
+	}
+}
+
+void TestSnowConstitutiveModel::testWarmStartPolar()
+{
+	std::cerr << "testWarmStartPolar()" << std::endl;
+	
+	// two copies of the same particles, one updated using warm starts and one using the SVD:
+	const int n = 20;
+	MaterialPointData warmData;
+	MaterialPointData svdData;
+	for( int i=0; i < n; ++i )
+	{
+		warmData.variable<float>( "m" ).push_back( 1.0f );
+		warmData.variable<Matrix3f>( "F" ).push_back( Matrix3f::Identity() );
+		svdData.variable<float>( "m" ).push_back( 1.0f );
+		svdData.variable<Matrix3f>( "F" ).push_back( Matrix3f::Identity() );
+	}
+	
+	SnowConstitutiveModel warmModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel svdModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	assert( !warmModel.getWarmStartPolarDecomposition() );
+	warmModel.setWarmStartPolarDecomposition( true );
+	warmModel.setParticles( warmData );
+	svdModel.setParticles( svdData );
+	
+	// spin the particles round a bit more each step, with stretches inside the yield limits for the even
+	// particles and outside for the odd ones:
+	for( int step=0; step < 10; ++step )
+	{
+		for( int i=0; i < n; ++i )
+		{
+			float strain = ( i % 2 ) ? 0.05f : 0.005f;
+			Vector3f stretch( 1 + strain * cos( 0.1f * ( i + step ) ), 1 - strain * sin( 0.2f * i ), 1 );
+			Matrix3f F =
+				AngleAxisf( 0.05f * step * ( i + 1 ), Vector3f( 1, 2, 3 ).normalized() ) *
+				Matrix3f( AngleAxisf( 0.1f * i, Vector3f::UnitZ() ) ) *
+				stretch.asDiagonal() *
+				Matrix3f( AngleAxisf( -0.1f * i, Vector3f::UnitZ() ) );
+			warmData.variable<Matrix3f>( "F" )[i] = F;
+			svdData.variable<Matrix3f>( "F" )[i] = F;
+		}
+		
+		warmModel.updateParticleData();
+		svdModel.updateParticleData();
+		
+		const char* matrixNames[] = { "F", "Fp", "R", "FinvTrans", "Ginv" };
+		for( int v=0; v < 5; ++v )
+		{
+			const std::vector<Matrix3f>& warm = warmData.variable<Matrix3f>( matrixNames[v] );
+			const std::vector<Matrix3f>& svd = svdData.variable<Matrix3f>( matrixNames[v] );
+			for( int i=0; i < n; ++i )
+			{
+				assert( ( warm[i] - svd[i] ).norm() < 1.e-4f );
+			}
+		}
+		const char* floatNames[] = { "J", "mu", "lambda" };
+		for( int v=0; v < 3; ++v )
+		{
+			const std::vector<float>& warm = warmData.variable<float>( floatNames[v] );
+			const std::vector<float>& svd = svdData.variable<float>( floatNames[v] );
+			for( int i=0; i < n; ++i )
+			{
+				assert( fabs( warm[i] - svd[i] ) < 1.e-4f * fabs( svd[i] ) );
+			}
+		}
+	}
+}
+
+void TestSnowConstitutiveModel::testBatchEvaluation()
+{
+	std::cerr << "testBatchEvaluation()" << std::endl;
+	
+	const int n = 30;
+	MaterialPointData d;
+	for( int i=0; i < n; ++i )
+	{
+		Matrix3f F =
+			Matrix3f( AngleAxisf( 0.2f * i, Vector3f( 1, 2, 3 ).normalized() ) ) *
+			Vector3f( 1 + 0.01f * cos( 0.3f * i ), 1 - 0.01f * sin( 0.7f * i ), 1 + 0.005f * i ).asDiagonal();
+		d.variable<float>( "m" ).push_back( 1.0f );
+		d.variable<Matrix3f>( "F" ).push_back( F );
+	}
+	SnowConstitutiveModel model( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	model.setParticles( d );
+	model.updateParticleData();
+	
+	// evaluate every third particle backwards, so the indices aren't contiguous:
+	std::vector<int> inds;
+	std::vector<Matrix3f> dF;
+	for( int i=n-1; i >= 0; i -= 3 )
+	{
+		inds.push_back( i );
+		dF.push_back( Matrix3f( AngleAxisf( 0.1f * i, Vector3f::UnitY() ) ) * 0.01f );
+	}
+	
+	// the batch versions should agree with the single particle versions:
+	const ConstitutiveModel& cm = model;
+	std::vector<Matrix3f> stresses( inds.size() );
+	std::vector<Matrix3f> differentials( inds.size() );
+	cm.dEnergyDensitydF( inds.begin(), inds.end(), &stresses[0] );
+	cm.dEdFDifferential( &dF[0], inds.begin(), inds.end(), &differentials[0] );
+	for( size_t i=0; i < inds.size(); ++i )
+	{
+		Matrix3f stress = cm.dEnergyDensitydF( inds[i] );
+		Matrix3f differential = cm.dEdFDifferential( dF[i], inds[i] );
+		assert( ( stresses[i] - stress ).norm() <= 1.e-6f * stress.norm() );
+		assert( ( differentials[i] - differential ).norm() <= 1.e-6f * differential.norm() );
+	}
+	
+	// the batch version should still throw if there are nans in there:
+	d.variable<float>( "mu" )[ inds[1] ] = std::numeric_limits<float>::quiet_NaN();
+	bool thrown = false;
+	try
+	{
+		cm.dEnergyDensitydF( inds.begin(), inds.end(), &stresses[0] );
+	}
+	catch( const std::runtime_error& )
+	{
+		thrown = true;
+	}
+	assert( thrown );
+}
+
+void TestSnowConstitutiveModel::testPackedDeformationGradients()
+{
+	std::cerr << "testPackedDeformationGradients()" << std::endl;
+	
+	// two copies of the same particles, one with F packed. There are a couple of whole blocks and a
+	// partial one, and some of the deformation gradients need clamping:
+	const int n = 21;
+	MaterialPointData aosData;
+	MaterialPointData packedData;
+	srand( 5 );
+	for( int i=0; i < n; ++i )
+	{
+		Matrix3f F = Matrix3f::Identity() + ( i % 3 ? 0.001f : 0.1f ) * Matrix3f::Random();
+		aosData.variable<float>( "m" ).push_back( 1.0f );
+		aosData.variable<Matrix3f>( "F" ).push_back( F );
+		packedData.variable<float>( "m" ).push_back( 1.0f );
+		packedData.variable<Matrix3f>( "F" ).push_back( F );
+	}
+	packedData.setLayout<Matrix3f>( "F", MaterialPointData::AoSoA );
+	
+	SnowConstitutiveModel aosModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	SnowConstitutiveModel packedModel( 1.4e5f, 0.2f, 10, 0.025f, 0.0075f );
+	aosModel.setParticles( aosData );
+	packedModel.setParticles( packedData );
+	
+	// update everything, then a list with a whole block at the start and a couple of stragglers:
+	std::vector<int> inds;
+	for( int i=8; i < 16; ++i )
+	{
+		inds.push_back( i );
+	}
+	inds.push_back( 3 );
+	inds.push_back( 20 );
+	
+	const char* matrixVariables[] = { "Fp", "FinvTrans", "R", "Ginv" };
+	const char* floatVariables[] = { "J", "mu", "lambda" };
+	for( int pass=0; pass < 2; ++pass )
+	{
+		if( pass == 0 )
+		{
+			aosModel.updateParticleData();
+			packedModel.updateParticleData();
+		}
+		else
+		{
+			std::vector<Matrix3f>& aosF = aosData.variable<Matrix3f>( "F" );
+			PackedArray<Matrix3f>& packedF = packedData.packedVariable<Matrix3f>( "F" );
+			for( int i=0; i < n; ++i )
+			{
+				Matrix3f F = ( Matrix3f::Identity() + 0.02f * Matrix3f::Random() ) * aosF[i];
+				aosF[i] = F;
+				packedF.set( i, F );
+			}
+			aosModel.updateParticleData( inds );
+			packedModel.updateParticleData( inds );
+		}
+		
+		// the SIMD kernels give the same answers however the matrices get to them, so everything
+		// should match exactly:
+		for( int i=0; i < n; ++i )
+		{
+			assert( packedData.packedVariable<Matrix3f>( "F" ).get( i ) == aosData.variable<Matrix3f>( "F" )[i] );
+			for( int v=0; v < 4; ++v )
+			{
+				assert( packedData.variable<Matrix3f>( matrixVariables[v] )[i] == aosData.variable<Matrix3f>( matrixVariables[v] )[i] );
+			}
+			for( int v=0; v < 3; ++v )
+			{
+				assert( packedData.variable<float>( floatVariables[v] )[i] == aosData.variable<float>( floatVariables[v] )[i] );
+			}
+			assert( packedModel.dEnergyDensitydF( i ) == aosModel.dEnergyDensitydF( i ) );
+		}
+	}
+}
+
 void TestSnowConstitutiveModel::test()
 {
 	std::cerr << "testSnowConstitutiveModel()" << std::endl;
+	testSvd3();
+	testSvdKernels();
+	testParticleSubset();
+	testPackedDeformationGradients();
+	testWarmStartPolar();
+	testBatchEvaluation();
 	
 	std::vector<Vector3f> positions;
 	std::vector<float> masses;